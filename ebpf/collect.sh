@@ -5,7 +5,11 @@ USAGE=$"Usage: ${PROG} -out 'Path to directory to save trace in' \
 [-trace_lines 'Number of trace lines to record.  Trace duration is only loosely
 correlated with recorded lines, and will vary based on system topology and
 workload.  Default 1000000'] \
-[-script 'Path to trace script']\n
+[-script 'Path to trace script'] \
+[-collector 'Path to the schedbpf binary.  If set, schedbpf records binary
+events instead of running the bpftrace script'] \
+[-bpf_object 'Path to sched.bpf.o, for -collector.  Default sched.bpf.o next to
+the collector']\n
 Must run as root."
 
 if [[ "$EUID" -ne 0 ]]
@@ -17,6 +21,8 @@ while [[ "$#" -gt 0 ]]; do case $1 in
   -o|-out) OUT="$2"; shift;;
   -l|-trace_lines) TRACELINES="$2"; shift;;
   -s|-script) LOCAL_PATH_TO_SCRIPT="$2"; shift;;
+  -c|-collector) COLLECTOR="$2"; shift;;
+  -b|-bpf_object) BPF_OBJECT="$2"; shift;;
   -h|-help) echo "$USAGE"; exit 0;;
   *) echo "Unknown parameter passed: $1"; echo "$USAGE"; exit 1;;
 esac; shift; done
@@ -36,6 +42,10 @@ if [[ -z "${LOCAL_PATH_TO_SCRIPT}" ]]; then
   LOCAL_PATH_TO_SCRIPT=`dirname "${PROG}"`/sched.bt
 fi
 
+if [[ -n "${COLLECTOR}" && -z "${BPF_OBJECT}" ]]; then
+  BPF_OBJECT=`dirname "${COLLECTOR}"`/sched.bpf.o
+fi
+
 TMP="${OUT}/tmp"
 
 kill_trap() {
@@ -60,11 +70,16 @@ mv sys/devices/system/node/* "${TMP}/topology"
 rm -rf sys/
 
 echo "Starting tracing..."
-bpftrace ${LOCAL_PATH_TO_SCRIPT} |
-  head -${TRACELINES} |
-  awk -F: '{val="0x" $2; print strtonum(val),$0 ;}' /dev/stdin |
-  sort -n |
-  sed 's/^[^ ]* //' > "${TMP}/ebpf_trace"
+if [[ -n "${COLLECTOR}" ]]; then
+  "${COLLECTOR}" --bpf_object="${BPF_OBJECT}" --max_events="${TRACELINES}" \
+    --out="${TMP}/ebpf_trace.bin" || exit 1
+else
+  bpftrace ${LOCAL_PATH_TO_SCRIPT} |
+    head -${TRACELINES} |
+    awk -F: '{val="0x" $2; print strtonum(val),$0 ;}' /dev/stdin |
+    sort -n |
+    sed 's/^[^ ]* //' > "${TMP}/ebpf_trace"
+fi
 
 echo "Creating tar file"
 rm -f "${OUT}/trace.tar.gz"
@@ -0,0 +1,172 @@
+// Records scheduling events as fixed-size binary records in a BPF ring buffer,
+// for schedbpf.cc to write to disk. This is the compiled equivalent of
+// sched.bt, without formatting text in the kernel.
+//
+// Build with:
+//   bpftool btf dump file /sys/kernel/btf/vmlinux format c > vmlinux.h
+//   clang -O2 -g -target bpf -c sched.bpf.c -o sched.bpf.o
+
+#include "vmlinux.h"
+
+#include <bpf/bpf_helpers.h>
+
+#include "sched_record.h"
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
+
+// Once this many bytes are waiting in the ring buffer, userspace is woken up
+// to drain it. Until then, it drains on its own poll timeout, so that a busy
+// system doesn't wake it for every record.
+#define WAKEUP_BYTES (256 * 1024)
+
+struct comm_entry {
+  __s32 prio;
+  char comm[SCHED_COMM_LEN];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_RINGBUF);
+  // Resized by schedbpf.cc's --buffer_size before loading.
+  __uint(max_entries, 16 * 1024 * 1024);
+} records SEC(".maps");
+
+// The command and priority last recorded for each thread, so that COMM
+// records are only emitted for new threads and changes. Least recently seen
+// threads are evicted, and recorded again when next seen.
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, 65536);
+  __type(key, __u32);
+  __type(value, struct comm_entry);
+} comms SEC(".maps");
+
+// Records dropped because the ring buffer was full.
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, __u64);
+} lost SEC(".maps");
+
+static __always_inline void *reserve(__u64 size) {
+  void *record = bpf_ringbuf_reserve(&records, size, 0);
+  if (!record) {
+    __u32 key = 0;
+    __u64 *count = bpf_map_lookup_elem(&lost, &key);
+    if (count) {
+      (*count)++;
+    }
+  }
+  return record;
+}
+
+static __always_inline void submit(void *record) {
+  __u64 flags = bpf_ringbuf_query(&records, BPF_RB_AVAIL_DATA) >= WAKEUP_BYTES
+                    ? BPF_RB_FORCE_WAKEUP
+                    : BPF_RB_NO_WAKEUP;
+  bpf_ringbuf_submit(record, flags);
+}
+
+static __always_inline void fill_header(struct sched_record_header *header,
+                                        __u64 timestamp, __u16 type,
+                                        __u32 pid) {
+  header->timestamp = timestamp;
+  header->type = type;
+  header->cpu = bpf_get_smp_processor_id();
+  header->pid = pid;
+}
+
+static __always_inline int same_comm(const char *a, const char *b) {
+  __u64 a_words[2], b_words[2];
+  __builtin_memcpy(a_words, a, sizeof(a_words));
+  __builtin_memcpy(b_words, b, sizeof(b_words));
+  return a_words[0] == b_words[0] && a_words[1] == b_words[1];
+}
+
+// Emits a COMM record for pid if it hasn't been recorded yet, its command or
+// priority changed, or force is set.
+static __always_inline void record_comm(__u64 timestamp, __u32 pid, int prio,
+                                        const char *comm, int force) {
+  struct comm_entry entry = {};
+  entry.prio = prio;
+  __builtin_memcpy(entry.comm, comm, SCHED_COMM_LEN);
+  struct comm_entry *cached = bpf_map_lookup_elem(&comms, &pid);
+  if (!force && cached && cached->prio == entry.prio &&
+      same_comm(cached->comm, entry.comm)) {
+    return;
+  }
+
+  struct sched_comm_record *record = reserve(sizeof(*record));
+  if (!record) {
+    // Leave the cache alone so that the command is recorded next time.
+    return;
+  }
+  fill_header(&record->header, timestamp, SCHED_RECORD_COMM, pid);
+  record->prio = entry.prio;
+  record->padding = 0;
+  __builtin_memcpy(record->comm, entry.comm, SCHED_COMM_LEN);
+  submit(record);
+  bpf_map_update_elem(&comms, &pid, &entry, BPF_ANY);
+}
+
+SEC("tracepoint/sched/sched_switch")
+int handle_sched_switch(struct trace_event_raw_sched_switch *ctx) {
+  __u64 timestamp = bpf_ktime_get_ns();
+  record_comm(timestamp, ctx->prev_pid, ctx->prev_prio, ctx->prev_comm, 0);
+  record_comm(timestamp, ctx->next_pid, ctx->next_prio, ctx->next_comm, 0);
+
+  struct sched_switch_record *record = reserve(sizeof(*record));
+  if (!record) {
+    return 0;
+  }
+  fill_header(&record->header, timestamp, SCHED_RECORD_SWITCH, ctx->prev_pid);
+  record->prev_state = ctx->prev_state;
+  record->next_pid = ctx->next_pid;
+  submit(record);
+  return 0;
+}
+
+static __always_inline int record_wakeup(
+    struct trace_event_raw_sched_wakeup_template *ctx, int force_comm) {
+  __u64 timestamp = bpf_ktime_get_ns();
+  record_comm(timestamp, ctx->pid, ctx->prio, ctx->comm, force_comm);
+
+  struct sched_wakeup_record *record = reserve(sizeof(*record));
+  if (!record) {
+    return 0;
+  }
+  fill_header(&record->header, timestamp, SCHED_RECORD_WAKEUP, ctx->pid);
+  record->target_cpu = ctx->target_cpu;
+  record->padding = 0;
+  submit(record);
+  return 0;
+}
+
+SEC("tracepoint/sched/sched_wakeup")
+int handle_sched_wakeup(struct trace_event_raw_sched_wakeup_template *ctx) {
+  return record_wakeup(ctx, /*force_comm=*/0);
+}
+
+SEC("tracepoint/sched/sched_wakeup_new")
+int handle_sched_wakeup_new(
+    struct trace_event_raw_sched_wakeup_template *ctx) {
+  // A new thread may reuse the PID of one that exited.
+  return record_wakeup(ctx, /*force_comm=*/1);
+}
+
+SEC("tracepoint/sched/sched_migrate_task")
+int handle_sched_migrate_task(
+    struct trace_event_raw_sched_migrate_task *ctx) {
+  __u64 timestamp = bpf_ktime_get_ns();
+  record_comm(timestamp, ctx->pid, ctx->prio, ctx->comm, 0);
+
+  struct sched_migrate_record *record = reserve(sizeof(*record));
+  if (!record) {
+    return 0;
+  }
+  fill_header(&record->header, timestamp, SCHED_RECORD_MIGRATE, ctx->pid);
+  record->orig_cpu = ctx->orig_cpu;
+  record->dest_cpu = ctx->dest_cpu;
+  submit(record);
+  return 0;
+}
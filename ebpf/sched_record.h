@@ -0,0 +1,85 @@
+#ifndef SCHEDVIZ_EBPF_SCHED_RECORD_H_
+#define SCHEDVIZ_EBPF_SCHED_RECORD_H_
+
+// Binary records shared by sched.bpf.c, which emits them into a BPF ring
+// buffer, schedbpf.cc, which writes them to ebpf_trace.bin, and schedbpf.go,
+// which reads them back. All fields are in the host's (little-endian) byte
+// order.
+//
+// ebpf_trace.bin starts with a sched_file_header, followed by records. Every
+// record starts with a sched_record_header, whose type determines the fixed
+// size of the rest of the record.
+
+#ifndef __VMLINUX_H__
+#include <linux/types.h>
+#endif
+
+#define SCHED_FILE_MAGIC "SVBPFTR1"
+#define SCHED_FILE_VERSION 1
+
+// Record types.
+enum {
+  // A thread was seen for the first time, or its command or priority changed.
+  SCHED_RECORD_COMM = 1,
+  SCHED_RECORD_SWITCH = 2,
+  SCHED_RECORD_WAKEUP = 3,
+  SCHED_RECORD_MIGRATE = 4,
+  // Records the BPF program could not reserve ring buffer space for. Written
+  // once, at the end of the file.
+  SCHED_RECORD_LOST = 5,
+};
+
+struct sched_file_header {
+  char magic[8];
+  __u32 version;
+  // The size of a COMM record's comm field.
+  __u32 comm_len;
+};
+
+struct sched_record_header {
+  // bpf_ktime_get_ns() when the event was recorded.
+  __u64 timestamp;
+  __u16 type;
+  // The CPU the event was recorded on.
+  __u16 cpu;
+  __u32 pid;
+};
+
+#define SCHED_COMM_LEN 16
+
+// pid is the thread the command belongs to.
+struct sched_comm_record {
+  struct sched_record_header header;
+  __s32 prio;
+  __u32 padding;
+  char comm[SCHED_COMM_LEN];
+};
+
+// pid is the thread switched out.
+struct sched_switch_record {
+  struct sched_record_header header;
+  __s32 prev_state;
+  __u32 next_pid;
+};
+
+// pid is the thread woken up.
+struct sched_wakeup_record {
+  struct sched_record_header header;
+  __u32 target_cpu;
+  __u32 padding;
+};
+
+// pid is the thread migrated.
+struct sched_migrate_record {
+  struct sched_record_header header;
+  __u32 orig_cpu;
+  __u32 dest_cpu;
+};
+
+// pid is unused.
+struct sched_lost_record {
+  struct sched_record_header header;
+  __u64 count;
+};
+
+#endif  // SCHEDVIZ_EBPF_SCHED_RECORD_H_
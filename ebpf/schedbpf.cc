@@ -0,0 +1,242 @@
+// Loads sched.bpf.o, and writes the binary records it emits into its BPF ring
+// buffer to a file, for schedbpf.go to read. See sched_record.h for the file
+// format.
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "ebpf/sched_record.h"
+
+ABSL_FLAG(std::string, bpf_object, "sched.bpf.o",
+          "Path to the compiled sched.bpf.c");
+ABSL_FLAG(std::string, out, "", "Path to the file to write records to");
+ABSL_FLAG(int, capture_seconds, 0,
+          "Number of seconds to record. 0 records until interrupted, or until "
+          "--max_events is reached.");
+ABSL_FLAG(int64_t, max_events, 0,
+          "Stop after this many scheduling events. 0 means no limit.");
+ABSL_FLAG(int, buffer_size, 16384,
+          "Size of the BPF ring buffer in KB. Rounded down to a power of two "
+          "number of pages.");
+
+namespace {
+
+constexpr const char* kUSAGE =
+    "Usage: schedbpf --out 'Path to the file to write records to'\n"
+    "[--bpf_object 'Path to sched.bpf.o'. Default 'sched.bpf.o']\n"
+    "[--capture_seconds 'Number of seconds to record'. Default 0 (until "
+    "interrupted)]\n"
+    "[--max_events 'Number of events to record'. Default 0 (no limit)]\n"
+    "[--buffer_size 'Size of the BPF ring buffer in KB'. Default 16384]\n"
+    "Must run as root.";
+
+std::atomic<bool> interrupted(false);
+
+void OnSignal(int) { interrupted = true; }
+
+/**
+ * Buffers records drained from the ring buffer and writes them to the output
+ * file.
+ */
+class RecordWriter {
+ public:
+  RecordWriter(std::ofstream* out, int64_t max_events)
+      : out_(out), max_events_(max_events) {}
+
+  /**
+   * ring_buffer_sample_fn that appends a record.
+   */
+  static int Append(void* ctx, void* data, size_t size) {
+    auto* writer = static_cast<RecordWriter*>(ctx);
+    if (writer->Full()) {
+      return 0;
+    }
+    const auto* header = static_cast<const sched_record_header*>(data);
+    if (header->type != SCHED_RECORD_COMM) {
+      writer->events_++;
+    }
+    writer->out_->write(static_cast<const char*>(data), size);
+    return 0;
+  }
+
+  /**
+   * @return Whether --max_events have been written.
+   */
+  bool Full() const { return max_events_ > 0 && events_ >= max_events_; }
+
+  int64_t events() const { return events_; }
+
+ private:
+  std::ofstream* out_;
+  const int64_t max_events_;
+  int64_t events_ = 0;
+};
+
+/**
+ * @return The number of records the BPF program dropped, summed over CPUs.
+ */
+uint64_t LostRecords(bpf_object* object) {
+  bpf_map* lost = bpf_object__find_map_by_name(object, "lost");
+  const int cpus = libbpf_num_possible_cpus();
+  if (lost == nullptr || cpus <= 0) {
+    return 0;
+  }
+  std::vector<uint64_t> counts(cpus);
+  uint32_t key = 0;
+  if (bpf_map__lookup_elem(lost, &key, sizeof(key), counts.data(),
+                           counts.size() * sizeof(uint64_t), 0) != 0) {
+    return 0;
+  }
+  uint64_t total = 0;
+  for (const auto& count : counts) {
+    total += count;
+  }
+  return total;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  const auto& out_path = absl::GetFlag(FLAGS_out);
+  const auto& capture_seconds = absl::GetFlag(FLAGS_capture_seconds);
+  const auto& max_events = absl::GetFlag(FLAGS_max_events);
+  const auto& buffer_size = absl::GetFlag(FLAGS_buffer_size);
+  if (out_path.empty()) {
+    std::cerr << kUSAGE << std::endl;
+    std::cerr << "--out is required." << std::endl;
+    return 1;
+  }
+  if (capture_seconds < 0 || max_events < 0 || buffer_size <= 0) {
+    std::cerr << "--capture_seconds and --max_events must not be negative, "
+                 "and --buffer_size must be positive"
+              << std::endl;
+    return 1;
+  }
+  if (geteuid() != 0) {
+    std::cerr << "schedbpf must be run as root in order to load BPF programs"
+              << std::endl;
+    return 1;
+  }
+
+  bpf_object* object =
+      bpf_object__open_file(absl::GetFlag(FLAGS_bpf_object).c_str(), nullptr);
+  if (object == nullptr || libbpf_get_error(object) != 0) {
+    std::cerr << "Unable to open " << absl::GetFlag(FLAGS_bpf_object)
+              << std::endl;
+    return 1;
+  }
+  bpf_map* records = bpf_object__find_map_by_name(object, "records");
+  if (records == nullptr) {
+    std::cerr << "The BPF object has no records map" << std::endl;
+    bpf_object__close(object);
+    return 1;
+  }
+  // BPF ring buffers must be a power of two number of pages.
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t ring_size = page_size;
+  while (ring_size * 2 <= static_cast<uint64_t>(buffer_size) * 1024) {
+    ring_size *= 2;
+  }
+  if (bpf_map__set_max_entries(records, ring_size) != 0 ||
+      bpf_object__load(object) != 0) {
+    std::cerr << "Unable to load the BPF object: " << strerror(errno)
+              << std::endl;
+    bpf_object__close(object);
+    return 1;
+  }
+
+  std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+  sched_file_header file_header = {};
+  memcpy(file_header.magic, SCHED_FILE_MAGIC, sizeof(file_header.magic));
+  file_header.version = SCHED_FILE_VERSION;
+  file_header.comm_len = SCHED_COMM_LEN;
+  out.write(reinterpret_cast<const char*>(&file_header), sizeof(file_header));
+  if (!out) {
+    std::cerr << "Unable to write to " << out_path << std::endl;
+    bpf_object__close(object);
+    return 1;
+  }
+
+  RecordWriter writer(&out, max_events);
+  ring_buffer* ring = ring_buffer__new(bpf_map__fd(records),
+                                       &RecordWriter::Append, &writer, nullptr);
+  if (ring == nullptr) {
+    std::cerr << "Unable to open the BPF ring buffer" << std::endl;
+    bpf_object__close(object);
+    return 1;
+  }
+
+  std::vector<bpf_link*> links;
+  bpf_program* program;
+  bpf_object__for_each_program(program, object) {
+    bpf_link* link = bpf_program__attach(program);
+    if (link == nullptr || libbpf_get_error(link) != 0) {
+      std::cerr << "Unable to attach " << bpf_program__name(program)
+                << std::endl;
+      for (auto* attached : links) {
+        bpf_link__destroy(attached);
+      }
+      ring_buffer__free(ring);
+      bpf_object__close(object);
+      return 1;
+    }
+    links.push_back(link);
+  }
+
+  signal(SIGINT, OnSignal);
+  signal(SIGTERM, OnSignal);
+  std::cout << "Recording scheduling events" << std::endl;
+  const auto& end_time = capture_seconds > 0
+                             ? absl::Now() + absl::Seconds(capture_seconds)
+                             : absl::InfiniteFuture();
+  // The BPF program only wakes us once a good chunk of the ring buffer has
+  // filled, so also drain on a timeout.
+  constexpr int kPollTimeoutMs = 100;
+  while (!interrupted && !writer.Full() && absl::Now() < end_time) {
+    const int err = ring_buffer__poll(ring, kPollTimeoutMs);
+    if (err < 0 && err != -EINTR) {
+      std::cerr << "Error polling the BPF ring buffer: " << strerror(-err)
+                << std::endl;
+      break;
+    }
+  }
+  for (auto* link : links) {
+    bpf_link__destroy(link);
+  }
+  // Whatever was recorded before detaching.
+  (void)ring_buffer__consume(ring);
+
+  sched_lost_record lost = {};
+  lost.header.type = SCHED_RECORD_LOST;
+  lost.count = LostRecords(object);
+  out.write(reinterpret_cast<const char*>(&lost), sizeof(lost));
+  out.close();
+  ring_buffer__free(ring);
+  bpf_object__close(object);
+  if (!out) {
+    std::cerr << "Unable to write to " << out_path << std::endl;
+    return 1;
+  }
+  std::cout << "Recorded " << writer.events() << " events";
+  if (lost.count > 0) {
+    std::cout << ", dropped " << lost.count;
+  }
+  std::cout << std::endl;
+  return 0;
+}
@@ -0,0 +1,149 @@
+//
+// Copyright 2019 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS-IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//
+package schedbt
+
+import (
+	"bytes"
+	"encoding/binary"
+	"io"
+
+	log "github.com/golang/glog"
+	"google.golang.org/grpc/codes"
+	"google.golang.org/grpc/status"
+)
+
+// BinaryTraceFile is the name of the file schedbpf writes its records to in
+// eBPF trace archives. Archives recorded with sched.bt have an ebpf_trace text
+// file instead.
+const BinaryTraceFile = "ebpf_trace.bin"
+
+// The binary format written by schedbpf. Keep in sync with sched_record.h.
+const (
+	binaryMagic   = "SVBPFTR1"
+	binaryVersion = 1
+
+	fileHeaderSize   = 16
+	recordHeaderSize = 16
+
+	recordComm    = 1
+	recordSwitch  = 2
+	recordWakeup  = 3
+	recordMigrate = 4
+	recordLost    = 5
+)
+
+// recordBodySizes holds the size of each record type after its header.
+var recordBodySizes = map[uint16]int{
+	recordComm:    8 + 16,
+	recordSwitch:  8,
+	recordWakeup:  8,
+	recordMigrate: 8,
+	recordLost:    8,
+}
+
+// ParseBinary parses a sched trace recorded by schedbpf, whose records hold
+// the same information as sched.bt's rows:
+// File header: <8 byte magic> <u32 version> <u32 comm length>
+// Each record: <u64 timestamp> <u16 type> <u16 cpu> <u32 pid> <body>, with
+// bodies:
+//   COMM:    <s32 prio> <u32 padding> <comm, NUL-padded>
+//   SWITCH:  <s32 prev state> <u32 next pid>    (pid is the prev pid)
+//   WAKEUP:  <u32 target cpu> <u32 padding>
+//   MIGRATE: <u32 orig cpu> <u32 dest cpu>
+//   LOST:    <u64 records dropped in the kernel>
+// All integers are little-endian, and timestamps are absolute.
+func (p *Parser) ParseBinary(r io.Reader) error {
+	le := binary.LittleEndian
+	header := make([]byte, fileHeaderSize)
+	if _, err := io.ReadFull(r, header); err != nil {
+		return status.Errorf(codes.InvalidArgument, "failed to read file header: %s", err)
+	}
+	if string(header[:8]) != binaryMagic {
+		return status.Errorf(codes.InvalidArgument, "not a schedbpf trace")
+	}
+	if version := le.Uint32(header[8:]); version != binaryVersion {
+		return status.Errorf(codes.InvalidArgument, "unsupported schedbpf trace version %d", version)
+	}
+	commLen := int(le.Uint32(header[12:]))
+	bodySizes := make(map[uint16]int, len(recordBodySizes))
+	for recordType, size := range recordBodySizes {
+		bodySizes[recordType] = size
+	}
+	bodySizes[recordComm] = 8 + commLen
+
+	record := make([]byte, recordHeaderSize+8+commLen)
+	for offset := int64(fileHeaderSize); ; {
+		if _, err := io.ReadFull(r, record[:recordHeaderSize]); err != nil {
+			if err == io.EOF {
+				return nil
+			}
+			return status.Errorf(codes.InvalidArgument, "at offset %d, truncated record: %s", offset, err)
+		}
+		ts := int64(le.Uint64(record))
+		recordType := le.Uint16(record[8:])
+		cpu := int64(le.Uint16(record[10:]))
+		pid := int64(le.Uint32(record[12:]))
+		bodySize, ok := bodySizes[recordType]
+		if !ok {
+			return status.Errorf(codes.InvalidArgument, "at offset %d, unknown record type %d", offset, recordType)
+		}
+		body := record[recordHeaderSize : recordHeaderSize+bodySize]
+		if _, err := io.ReadFull(r, body); err != nil {
+			return status.Errorf(codes.InvalidArgument, "at offset %d, truncated record: %s", offset, err)
+		}
+		offset += int64(recordHeaderSize + bodySize)
+
+		switch recordType {
+		case recordComm:
+			comm := body[8:]
+			if end := bytes.IndexByte(comm, 0); end >= 0 {
+				comm = comm[:end]
+			}
+			p.prioAndCommByPid[pid] = &prioAndComm{
+				prio: int64(int32(le.Uint32(body))),
+				comm: string(comm),
+			}
+		case recordSwitch:
+			nextPID := int64(le.Uint32(body[4:]))
+			prevPac := p.lookupPrioAndComm(pid)
+			nextPac := p.lookupPrioAndComm(nextPID)
+			p.esb.WithEvent(sswitch, cpu, ts, false,
+				pid, prevPac.comm, prevPac.prio, int64(int32(le.Uint32(body))),
+				nextPID, nextPac.comm, nextPac.prio)
+		case recordWakeup:
+			pac := p.lookupPrioAndComm(pid)
+			p.esb.WithEvent(swakeup, cpu, ts, false,
+				pid, pac.comm, pac.prio, int64(le.Uint32(body)))
+		case recordMigrate:
+			pac := p.lookupPrioAndComm(pid)
+			p.esb.WithEvent(smigrate, cpu, ts, false,
+				pid, pac.comm, pac.prio,
+				int64(le.Uint32(body)), int64(le.Uint32(body[4:])))
+		case recordLost:
+			if lost := le.Uint64(body); lost > 0 {
+				log.Warningf("schedbpf dropped %d records in the kernel", lost)
+			}
+		}
+	}
+}
+
+func (p *Parser) lookupPrioAndComm(pid int64) *prioAndComm {
+	if pac, ok := p.prioAndCommByPid[pid]; ok {
+		return pac
+	}
+	return unknownPrioAndComm
+}
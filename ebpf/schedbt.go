@@ -15,7 +15,7 @@
 //
 //
 // Package schedbt provides a type to convert an eBPF sched trace gathered by
-// sched.bt into an EventSet suitable for visualization in SchedViz.
+// sched.bt or schedbpf into an EventSet suitable for visualization in SchedViz.
 package schedbt
 
 import (
@@ -18,6 +18,8 @@ package schedbt
 
 import (
 	"bufio"
+	"bytes"
+	"encoding/binary"
 	"strings"
 	"testing"
 
@@ -79,3 +81,87 @@ M:a:0:0:1:64`,
 		})
 	}
 }
+
+// binaryTrace assembles a schedbpf trace from records, each a list of
+// fixed-size integers and byte arrays.
+func binaryTrace(t *testing.T, records ...[]interface{}) []byte {
+	t.Helper()
+	var buf bytes.Buffer
+	write := func(v interface{}) {
+		if err := binary.Write(&buf, binary.LittleEndian, v); err != nil {
+			t.Fatalf("binary.Write(%v) failed: %s", v, err)
+		}
+	}
+	buf.WriteString(binaryMagic)
+	write(uint32(binaryVersion))
+	write(uint32(16))
+	for _, record := range records {
+		for _, field := range record {
+			write(field)
+		}
+	}
+	return buf.Bytes()
+}
+
+func comm(s string) [16]byte {
+	var c [16]byte
+	copy(c[:], s)
+	return c
+}
+
+func TestParsingBinary(t *testing.T) {
+	trace := binaryTrace(t,
+		[]interface{}{uint64(0xbeef), uint16(recordComm), uint16(0), uint32(100), int32(112), uint32(0), comm("Thread:1")},
+		[]interface{}{uint64(0xbeef), uint16(recordComm), uint16(0), uint32(200), int32(112), uint32(0), comm("Thread 2")},
+		[]interface{}{uint64(0xbeef + 10), uint16(recordSwitch), uint16(0), uint32(100), int32(0), uint32(200)},
+		[]interface{}{uint64(0xbeef + 20), uint16(recordMigrate), uint16(0), uint32(100), uint32(0), uint32(1)},
+		[]interface{}{uint64(0xbeef + 30), uint16(recordWakeup), uint16(0), uint32(100), uint32(1), uint32(0)},
+		[]interface{}{uint64(0xbeef + 40), uint16(recordWakeup), uint16(1), uint32(300), uint32(1), uint32(0)},
+		[]interface{}{uint64(0), uint16(recordLost), uint16(0), uint32(0), uint64(0)},
+	)
+	want := testeventsetbuilder.TestProtobuf(t, emptyEventSet().
+		WithEvent("sched_switch", 0, 0xbeef+10, false,
+			100, "Thread:1", 112, 0,
+			200, "Thread 2", 112).
+		WithEvent("sched_migrate_task", 0, 0xbeef+20, false,
+			100, "Thread:1", 112,
+			0, 1).
+		WithEvent("sched_wakeup", 0, 0xbeef+30, false,
+			100, "Thread:1", 112, 1).
+		WithEvent("sched_wakeup", 1, 0xbeef+40, false,
+			300, "<unknown>", 0, 1))
+
+	p := NewParser()
+	if err := p.ParseBinary(bytes.NewReader(trace)); err != nil {
+		t.Fatalf("ParseBinary() yielded unexpected error %v", err)
+	}
+	got, err := p.EventSet()
+	if err != nil {
+		t.Fatalf("EventSet() yielded unexpected error %v", err)
+	}
+	if d := cmp.Diff(want, got, cmp.Comparer(proto.Equal)); d != "" {
+		t.Errorf("Parser produced %s, diff(want->got) %s", proto.MarshalTextString(got), d)
+	}
+}
+
+func TestParsingBinaryErrors(t *testing.T) {
+	valid := binaryTrace(t,
+		[]interface{}{uint64(10), uint16(recordWakeup), uint16(0), uint32(100), uint32(1), uint32(0)})
+	tests := []struct {
+		description string
+		input       []byte
+	}{
+		{"Missing header", valid[:4]},
+		{"Bad magic", append([]byte("SVBPFTR0"), valid[8:]...)},
+		{"Truncated record", valid[:len(valid)-1]},
+		{"Unknown record type", binaryTrace(t,
+			[]interface{}{uint64(10), uint16(42), uint16(0), uint32(100), uint64(0)})},
+	}
+	for _, test := range tests {
+		t.Run(test.description, func(t *testing.T) {
+			if err := NewParser().ParseBinary(bytes.NewReader(test.input)); err == nil {
+				t.Errorf("ParseBinary() yielded no error")
+			}
+		})
+	}
+}
@@ -108,6 +108,11 @@ func (fs *FsStorage) GetCollection(ctx context.Context, collectionName string) (
 	if err != nil {
 		return nil, err
 	}
+	if isHistOnly(collectionProto) {
+		// Set err, so that the cached entry records the failure.
+		err = fmt.Errorf("collection %s only holds aggregated hist tables; use GetHistTables", collectionName)
+		return nil, err
+	}
 	collection, err := createCollection(collectionProto.EventSet)
 	if err != nil {
 		return nil, err
@@ -118,6 +123,16 @@ func (fs *FsStorage) GetCollection(ctx context.Context, collectionName string) (
 	return cachedCollection, nil
 }
 
+// GetHistTables returns the tables of a collection recorded in aggregate mode.
+// Collections of events have no tables.
+func (fs *FsStorage) GetHistTables(ctx context.Context, collectionName string) ([]*eventpb.HistTable, error) {
+	collectionProto, err := fs.getCollectionFromDisk(collectionName)
+	if err != nil {
+		return nil, err
+	}
+	return collectionProto.GetHistTable(), nil
+}
+
 // GetCollectionMetadata gets the metadata for the collection with the given name.
 func (fs *FsStorage) GetCollectionMetadata(ctx context.Context, collectionUniqueName string) (models.Metadata, error) {
 	collectionProto, err := fs.getCollectionFromDisk(collectionUniqueName)
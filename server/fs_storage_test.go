@@ -214,6 +214,52 @@ func TestFsStorage_UploadFile(t *testing.T) {
 	}
 }
 
+func TestFsStorage_UploadHistFile(t *testing.T) {
+	tmpDir, err := createCollectionDir()
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer cleanup(t, tmpDir)
+	fsStorage := createFSStorage(t, tmpDir, 1)
+
+	collectionName, err := fsStorage.UploadFile(ctx, colRequest, getTestTarFile(t, "hist_trace.tar.gz"))
+	if err != nil {
+		t.Fatalf("unexpected error thrown by FsStorage::UploadFile: %s", err)
+	}
+
+	tables, err := fsStorage.GetHistTables(ctx, collectionName)
+	if err != nil {
+		t.Fatalf("unexpected error thrown by FsStorage::GetHistTables: %s", err)
+	}
+	type tableSummary struct {
+		Name             string
+		SnapshotOffsetNs int64
+		Entries          int
+		Hits             int64
+	}
+	var got []tableSummary
+	for _, table := range tables {
+		got = append(got, tableSummary{table.Name, table.SnapshotOffsetNs, len(table.Entry), table.Hits})
+	}
+	// Two snapshots, each with one run_time and wait_time table, and two
+	// wakeup_latency tables: one per thread, and one across all threads.
+	var want []tableSummary
+	for _, offset := range []int64{1000000000, 2000000000} {
+		want = append(want,
+			tableSummary{"run_time", offset, 3, 8},
+			tableSummary{"wait_time", offset, 3, 8},
+			tableSummary{"wakeup_latency", offset, 3, 8},
+			tableSummary{"wakeup_latency", offset, 3, 8})
+	}
+	if diff := cmp.Diff(want, got); diff != "" {
+		t.Errorf("wrong hist tables returned; Diff -want +got %v", diff)
+	}
+
+	if _, err := fsStorage.GetCollection(ctx, collectionName); err == nil {
+		t.Errorf("FsStorage::GetCollection returned no error for a collection without events")
+	}
+}
+
 func TestFsStorage_DeleteCollection(t *testing.T) {
 	collectionName := "coll_to_delete"
 	tmpDir, err := createCollectionDir()
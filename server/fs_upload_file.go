@@ -61,14 +61,14 @@ const (
 
 // UploadFile creates a new collection from the uploaded file and saves it to disk
 func (fs *FsStorage) UploadFile(ctx context.Context, req *models.CreateCollectionRequest, file io.Reader) (string, error) {
-	eventSet, topology, err := readTar(file, fs.failOnUnknownEventFormat)
+	eventSet, topology, histTables, err := readTar(file, fs.failOnUnknownEventFormat)
 	if err != nil {
 		return "", err
 	}
 
 	metadata := makeMetadata(req)
 
-	if err := fs.saveCollection(ctx, metadata, eventSet, topology); err != nil {
+	if err := fs.saveCollection(ctx, metadata, eventSet, topology, histTables); err != nil {
 		return "", err
 	}
 
@@ -106,7 +106,7 @@ func makeMetadata(req *models.CreateCollectionRequest) *models.Metadata {
 	return metadata
 }
 
-func (fs *FsStorage) saveCollection(ctx context.Context, metadata *models.Metadata, eventSet *eventpb.EventSet, topology *models.SystemTopology) error {
+func (fs *FsStorage) saveCollection(ctx context.Context, metadata *models.Metadata, eventSet *eventpb.EventSet, topology *models.SystemTopology, histTables []*eventpb.HistTable) error {
 	sort.Slice(eventSet.Event, func(i, j int) bool {
 		return eventSet.Event[i].TimestampNs < eventSet.Event[j].TimestampNs
 	})
@@ -123,9 +123,10 @@ func (fs *FsStorage) saveCollection(ctx context.Context, metadata *models.Metada
 	}
 
 	outProto := &eventpb.Collection{
-		Metadata: metadataProto,
-		EventSet: eventSet,
-		Topology: convertTopologyStructToProto(topology),
+		Metadata:  metadataProto,
+		EventSet:  eventSet,
+		Topology:  convertTopologyStructToProto(topology),
+		HistTable: histTables,
 	}
 
 	protoBytes, err := proto.Marshal(outProto)
@@ -138,6 +139,10 @@ func (fs *FsStorage) saveCollection(ctx context.Context, metadata *models.Metada
 		return err
 	}
 
+	if isHistOnly(outProto) {
+		// There are no events to check by loading the collection.
+		return nil
+	}
 	_, err = fs.GetCollection(ctx, metadata.CollectionUniqueName)
 	return err
 }
@@ -148,10 +153,11 @@ func (fs *FsStorage) saveCollection(ctx context.Context, metadata *models.Metada
 // Old tars created before the metadata was added will not contain the
 // metadata.textproto file; tars lacking the file will be treated as containing
 // FTrace traces.
-func readTar(inputTar io.Reader, failOnUnknownEventFormat bool) (*eventpb.EventSet, *models.SystemTopology, error) {
+// Only FTRACE_HIST tars return hist tables; their event set is empty.
+func readTar(inputTar io.Reader, failOnUnknownEventFormat bool) (*eventpb.EventSet, *models.SystemTopology, []*eventpb.HistTable, error) {
 	tmpDir, err := ioutil.TempDir("", "temptar")
 	if err != nil {
-		return nil, nil, fmt.Errorf("failed to create temp directory: %s", err)
+		return nil, nil, nil, fmt.Errorf("failed to create temp directory: %s", err)
 	}
 	defer func() {
 		// Clean up temp directory after parsing or on error.
@@ -161,21 +167,26 @@ func readTar(inputTar io.Reader, failOnUnknownEventFormat bool) (*eventpb.EventS
 	}()
 
 	if err := untar(inputTar, tmpDir); err != nil {
-		return nil, nil, err
+		return nil, nil, nil, err
 	}
 
 	config, err := readMetadataFile(tmpDir)
 	if err != nil {
-		return nil, nil, err
+		return nil, nil, nil, err
 	}
 
 	switch config.TraceType {
 	case eventpb.ArchiveMetadataConfig_FTRACE:
-		return parseFTraceTar(tmpDir, failOnUnknownEventFormat)
+		eventSet, topology, err := parseFTraceTar(tmpDir, failOnUnknownEventFormat)
+		return eventSet, topology, nil, err
 	case eventpb.ArchiveMetadataConfig_EBPF:
-		return parseEBPFTar(tmpDir)
+		eventSet, topology, err := parseEBPFTar(tmpDir)
+		return eventSet, topology, nil, err
+	case eventpb.ArchiveMetadataConfig_FTRACE_HIST:
+		topology, histTables, err := parseHistTar(tmpDir)
+		return &eventpb.EventSet{}, topology, histTables, err
 	default:
-		return nil, nil, status.Errorf(codes.Internal, "unknown trace type %s", config.TraceType)
+		return nil, nil, nil, status.Errorf(codes.Internal, "unknown trace type %s", config.TraceType)
 	}
 }
 
@@ -504,13 +515,25 @@ func findOverflowedCPUs(traceDir string) (map[int64]struct{}, error) {
 func parseEBPFTar(dir string) (*eventpb.EventSet, *models.SystemTopology, error) {
 	traceParser := schedbt.NewParser()
 
-	filePath := path.Join(dir, "ebpf_trace")
+	// Traces recorded by schedbpf are binary, those recorded by sched.bt text.
+	filePath := path.Join(dir, schedbt.BinaryTraceFile)
+	isBinary := true
+	if _, err := os.Stat(filePath); os.IsNotExist(err) {
+		filePath = path.Join(dir, "ebpf_trace")
+		isBinary = false
+	}
 	file, err := os.Open(filePath)
 	if err != nil {
 		return nil, nil, fmt.Errorf("error opening %s for reading: %s", filePath, err)
 	}
+	defer file.Close()
 
-	if err := traceParser.Parse(bufio.NewReader(file)); err != nil {
+	if isBinary {
+		err = traceParser.ParseBinary(bufio.NewReaderSize(file, 1<<20))
+	} else {
+		err = traceParser.Parse(bufio.NewReader(file))
+	}
+	if err != nil {
 		return nil, nil, fmt.Errorf("error parsing ebpf trace: %s", err)
 	}
 	eventSet, err := traceParser.EventSet()
@@ -530,6 +553,88 @@ func parseEBPFTar(dir string) (*eventpb.EventSet, *models.SystemTopology, error)
 	return eventSet, topology, nil
 }
 
+/*
+parseHistTar parses a tar that holds only tables aggregated in the kernel by
+FTrace hist triggers. The format of the tar is:
+
+metadata.textproto
+formats
+  - (as for FTrace tars)
+topology
+  - (as for FTrace tars)
+hist
+  - milliseconds since the start of the capture at which a snapshot was read
+    - table name (e.g. wakeup_latency)
+    - second table name
+      ...
+  - second snapshot
+    ...
+stats [optional]
+  - (as for FTrace tars)
+
+*/
+func parseHistTar(dir string) (*models.SystemTopology, []*eventpb.HistTable, error) {
+	histDir := path.Join(dir, "hist")
+	snapshots, err := ioutil.ReadDir(histDir)
+	if err != nil {
+		return nil, nil, fmt.Errorf("error reading hist tables: %s", err)
+	}
+	var snapshotOffsets []int64
+	for _, snapshot := range snapshots {
+		offsetMs, err := strconv.ParseInt(snapshot.Name(), 10, 64)
+		if err != nil || !snapshot.IsDir() {
+			return nil, nil, fmt.Errorf("unknown file in hist directory: %s", snapshot.Name())
+		}
+		snapshotOffsets = append(snapshotOffsets, offsetMs)
+	}
+	sort.Slice(snapshotOffsets, func(i, j int) bool {
+		return snapshotOffsets[i] < snapshotOffsets[j]
+	})
+
+	histTables := []*eventpb.HistTable{}
+	for _, offsetMs := range snapshotOffsets {
+		snapshotDir := path.Join(histDir, strconv.FormatInt(offsetMs, 10))
+		tableFiles, err := ioutil.ReadDir(snapshotDir)
+		if err != nil {
+			return nil, nil, fmt.Errorf("error reading hist tables: %s", err)
+		}
+		for _, tableFile := range tableFiles {
+			bytes, err := ioutil.ReadFile(path.Join(snapshotDir, tableFile.Name()))
+			if err != nil {
+				return nil, nil, fmt.Errorf("error reading hist table %s: %s", tableFile.Name(), err)
+			}
+			tables, err := traceparser.ParseHistFile(tableFile.Name(), string(bytes))
+			if err != nil {
+				return nil, nil, err
+			}
+			for _, table := range tables {
+				table.SnapshotOffsetNs = offsetMs * int64(time.Millisecond)
+			}
+			histTables = append(histTables, tables...)
+		}
+	}
+	if len(histTables) == 0 {
+		return nil, nil, errors.New("no hist tables found. Must have at least one hist table")
+	}
+
+	// Read topology
+	topology, err := readTopology(path.Join(dir, "topology"))
+	if err != nil {
+		log.Warningf("error reading topology. Using empty topology. error: %s", err)
+		topology = &models.SystemTopology{
+			LogicalCores: []*models.LogicalCore{},
+		}
+	}
+
+	return topology, histTables, nil
+}
+
+// isHistOnly returns whether a collection holds only hist tables, and so
+// cannot be analyzed as a collection of events.
+func isHistOnly(collection *eventpb.Collection) bool {
+	return len(collection.GetHistTable()) > 0 && len(collection.GetEventSet().GetEvent()) == 0
+}
+
 func readString(r io.Reader) (string, error) {
 	buf, err := ioutil.ReadAll(r)
 	if err != nil {
@@ -290,6 +290,21 @@ func (s *storageServiceHTTPHandler) handleGetFtraceEvents(w http.ResponseWriter,
 	sendStructHTTPResponse(req, res, w)
 }
 
+func (s *storageServiceHTTPHandler) handleGetHistTables(w http.ResponseWriter, req *http.Request) {
+	ctx := req.Context()
+	if err := req.ParseForm(); err != nil {
+		httpErrorInternal(w, req, fmt.Sprintf("Failed to parse form: %s", err))
+		return
+	}
+	cn := req.Form.Get(requestTag)
+	res, err := s.GetHistTables(ctx, cn)
+	if err != nil {
+		httpErrorInternal(w, req, fmt.Sprintf("Failed to get hist tables: %s", err))
+		return
+	}
+	sendStructHTTPResponse(req, res, w)
+}
+
 func registerStorageService(r *mux.Router, s storageservice.StorageService) {
 	sh := &storageServiceHTTPHandler{s}
 	handle(r, "/get_collection_metadata", sh.handleGetCollectionMetadata)
@@ -299,6 +314,7 @@ func registerStorageService(r *mux.Router, s storageservice.StorageService) {
 	handle(r, "/get_collection_parameters", sh.handleGetCollectionParameters)
 	handle(r, "/list_collection_metadata", sh.handleListCollectionMetadata)
 	handle(r, "/get_ftrace_events", sh.handleGetFtraceEvents)
+	handle(r, "/get_hist_tables", sh.handleGetHistTables)
 }
 
 type apiServiceHTTPHandler struct{ *apiservice.APIService }
@@ -213,6 +213,10 @@ type StorageService interface {
 	ListCollectionMetadata(ctx context.Context, user string, collectionName string) ([]models.Metadata, error)
 	GetCollectionParameters(ctx context.Context, collectionName string) (models.CollectionParametersResponse, error)
 	GetFtraceEvents(ctx context.Context, req *models.FtraceEventsRequest) (models.FtraceEventsResponse, error)
+	// GetHistTables returns the tables aggregated in the kernel of a collection
+	// recorded in aggregate mode. Such collections have no events, so
+	// GetCollection fails for them.
+	GetHistTables(ctx context.Context, collectionName string) ([]*eventpb.HistTable, error)
 	// Helper
 	SetFailOnUnknownEventFormat(option bool)
 }
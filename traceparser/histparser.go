@@ -0,0 +1,122 @@
+//
+// Copyright 2019 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS-IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//
+package traceparser
+
+// histparser contains a parser for the hist files of FTrace hist triggers
+
+import (
+	"bufio"
+	"fmt"
+	"regexp"
+	"strconv"
+	"strings"
+
+	pb "github.com/google/schedviz/tracedata/schedviz_events_go_proto"
+)
+
+var (
+	histTriggerRe = regexp.MustCompile(`^# trigger info:\s*(.*?)\s*(?:\[\w+\])?$`)
+	histEntryRe   = regexp.MustCompile(`^\{(.*)\}(.*)$`)
+	histValueRe   = regexp.MustCompile(`(\w+):\s*(-?\d+)`)
+	histTotalRe   = regexp.MustCompile(`^(Hits|Entries|Dropped):\s*(\d+)$`)
+)
+
+// ParseHistFile parses the contents of an FTrace hist file into HistTables.
+// An event with several hist triggers has one table per trigger in its hist
+// file, so one HistTable is returned per trigger, each named name.
+// hist files look like this:
+/**
+# event histogram
+#
+# trigger info: hist:keys=pid,lat.log2:vals=hitcount:sort=pid,lat.log2:size=2048 [active]
+#
+
+{ pid:       1234, lat: ~ 2^3       } hitcount:          5
+... (more entries)
+
+Totals:
+    Hits: 5
+    Entries: 1
+    Dropped: 0
+*/
+func ParseHistFile(name string, contents string) ([]*pb.HistTable, error) {
+	var tables []*pb.HistTable
+	var table *pb.HistTable
+	scanner := bufio.NewScanner(strings.NewReader(contents))
+	for scanner.Scan() {
+		line := strings.TrimSpace(scanner.Text())
+		if line == "" {
+			continue
+		}
+		if m := histTriggerRe.FindStringSubmatch(line); m != nil {
+			table = &pb.HistTable{
+				Name:    name,
+				Trigger: m[1],
+			}
+			tables = append(tables, table)
+			continue
+		}
+		if strings.HasPrefix(line, "#") || line == "Totals:" {
+			continue
+		}
+		if table == nil {
+			return nil, fmt.Errorf("hist table %s has data before its trigger info: %q", name, line)
+		}
+		if m := histTotalRe.FindStringSubmatch(line); m != nil {
+			total, err := strconv.ParseInt(m[2], 10, 64)
+			if err != nil {
+				return nil, err
+			}
+			switch m[1] {
+			case "Hits":
+				table.Hits = total
+			case "Entries":
+				table.Entries = total
+			case "Dropped":
+				table.Dropped = total
+			}
+			continue
+		}
+		m := histEntryRe.FindStringSubmatch(line)
+		if m == nil {
+			return nil, fmt.Errorf("malformed entry in hist table %s: %q", name, line)
+		}
+		entry := &pb.HistTable_Entry{
+			Key:   map[string]string{},
+			Value: map[string]int64{},
+		}
+		for _, key := range strings.Split(m[1], ",") {
+			parts := strings.SplitN(key, ":", 2)
+			if len(parts) != 2 {
+				return nil, fmt.Errorf("malformed key in hist table %s: %q", name, key)
+			}
+			entry.Key[strings.TrimSpace(parts[0])] = strings.TrimSpace(parts[1])
+		}
+		for _, value := range histValueRe.FindAllStringSubmatch(m[2], -1) {
+			v, err := strconv.ParseInt(value[2], 10, 64)
+			if err != nil {
+				return nil, err
+			}
+			entry.Value[value[1]] = v
+		}
+		table.Entry = append(table.Entry, entry)
+	}
+	if err := scanner.Err(); err != nil {
+		return nil, err
+	}
+	return tables, nil
+}
@@ -0,0 +1,122 @@
+//
+// Copyright 2019 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS-IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//
+package traceparser
+
+import (
+	"testing"
+
+	"github.com/golang/protobuf/proto"
+	"github.com/google/go-cmp/cmp"
+	pb "github.com/google/schedviz/tracedata/schedviz_events_go_proto"
+)
+
+func TestParseHistFile(t *testing.T) {
+	hist := `# event histogram
+#
+# trigger info: hist:keys=pid,lat.log2:vals=hitcount:sort=pid,lat.log2:size=16384 [active]
+#
+
+{ pid:         12, lat: ~ 2^3       } hitcount:          5
+{ pid:         12, lat: ~ 2^7       } hitcount:          1
+{ pid:       1234, lat: ~ 2^4       } hitcount:          2
+
+Totals:
+    Hits: 8
+    Entries: 3
+    Dropped: 0
+
+# event histogram
+#
+# trigger info: hist:keys=lat.log2:vals=hitcount:sort=lat.log2:size=2048 [active]
+#
+
+{ lat: ~ 2^3       } hitcount:          5
+
+Totals:
+    Hits: 5
+    Entries: 1
+    Dropped: 2
+`
+	entry := func(pid, lat string, hitcount int64) *pb.HistTable_Entry {
+		key := map[string]string{"lat": lat}
+		if pid != "" {
+			key["pid"] = pid
+		}
+		return &pb.HistTable_Entry{
+			Key:   key,
+			Value: map[string]int64{"hitcount": hitcount},
+		}
+	}
+	want := []*pb.HistTable{
+		{
+			Name:    "wakeup_latency",
+			Trigger: "hist:keys=pid,lat.log2:vals=hitcount:sort=pid,lat.log2:size=16384",
+			Entry: []*pb.HistTable_Entry{
+				entry("12", "~ 2^3", 5),
+				entry("12", "~ 2^7", 1),
+				entry("1234", "~ 2^4", 2),
+			},
+			Hits:    8,
+			Entries: 3,
+		},
+		{
+			Name:    "wakeup_latency",
+			Trigger: "hist:keys=lat.log2:vals=hitcount:sort=lat.log2:size=2048",
+			Entry: []*pb.HistTable_Entry{
+				entry("", "~ 2^3", 5),
+			},
+			Hits:    5,
+			Entries: 1,
+			Dropped: 2,
+		},
+	}
+
+	got, err := ParseHistFile("wakeup_latency", hist)
+	if err != nil {
+		t.Fatalf("ParseHistFile returned unexpected error: %s", err)
+	}
+	if diff := cmp.Diff(want, got, cmp.Comparer(proto.Equal)); diff != "" {
+		t.Errorf("ParseHistFile returned unexpected tables. Diff (-want +got):\n%s", diff)
+	}
+}
+
+func TestParseHistFileErrors(t *testing.T) {
+	tests := []struct {
+		description string
+		hist        string
+	}{
+		{
+			description: "entry before trigger info",
+			hist:        "{ pid: 12 } hitcount: 1\n",
+		},
+		{
+			description: "malformed entry",
+			hist:        "# trigger info: hist:keys=pid [active]\npid: 12 hitcount: 1\n",
+		},
+		{
+			description: "malformed key",
+			hist:        "# trigger info: hist:keys=pid [active]\n{ 12 } hitcount: 1\n",
+		},
+	}
+	for _, test := range tests {
+		t.Run(test.description, func(t *testing.T) {
+			if _, err := ParseHistFile("table", test.hist); err == nil {
+				t.Errorf("ParseHistFile(%q) returned no error", test.hist)
+			}
+		})
+	}
+}
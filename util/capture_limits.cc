@@ -0,0 +1,38 @@
+#include "util/capture_limits.h"
+
+#include "absl/strings/str_cat.h"
+
+CaptureLimitCounter::CaptureLimitCounter(const CaptureLimits& limits,
+                                         int cpu_count)
+    : limits_(limits), cpu_events_(cpu_count, 0), cpu_bytes_(cpu_count, 0) {}
+
+bool CaptureLimitCounter::Count(int cpu, int64_t events, int64_t bytes) {
+  if (reached()) {
+    return true;
+  }
+  events_ += events;
+  bytes_ += bytes;
+  cpu_events_[cpu] += events;
+  cpu_bytes_[cpu] += bytes;
+  if (limits_.max_events > 0 && events_ >= limits_.max_events) {
+    stop_reason_ = StopReason::kEventLimit;
+    stop_detail_ = absl::StrCat("captured ", events_, " events, limit was ",
+                                limits_.max_events);
+  } else if (limits_.max_bytes > 0 && bytes_ >= limits_.max_bytes) {
+    stop_reason_ = StopReason::kByteLimit;
+    stop_detail_ = absl::StrCat("captured ", bytes_, " bytes, limit was ",
+                                limits_.max_bytes);
+  } else if (limits_.max_cpu_events > 0 &&
+             cpu_events_[cpu] >= limits_.max_cpu_events) {
+    stop_reason_ = StopReason::kCPUEventLimit;
+    stop_detail_ =
+        absl::StrCat("cpu", cpu, " captured ", cpu_events_[cpu],
+                     " events, limit was ", limits_.max_cpu_events);
+  } else if (limits_.max_cpu_bytes > 0 &&
+             cpu_bytes_[cpu] >= limits_.max_cpu_bytes) {
+    stop_reason_ = StopReason::kCPUByteLimit;
+    stop_detail_ = absl::StrCat("cpu", cpu, " captured ", cpu_bytes_[cpu],
+                                " bytes, limit was ", limits_.max_cpu_bytes);
+  }
+  return reached();
+}
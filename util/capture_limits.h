@@ -0,0 +1,100 @@
+#ifndef SCHEDVIZ_UTIL_CAPTURE_LIMITS_H_
+#define SCHEDVIZ_UTIL_CAPTURE_LIMITS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Optional budgets that end a capture before its duration elapses.
+ * A value of zero disables the corresponding limit.
+ */
+struct CaptureLimits {
+  // Maximum number of events to capture across all CPUs.
+  int64_t max_events = 0;
+  // Maximum number of bytes to capture across all CPUs.
+  int64_t max_bytes = 0;
+  // Maximum number of events to capture from any single CPU.
+  int64_t max_cpu_events = 0;
+  // Maximum number of bytes to capture from any single CPU.
+  int64_t max_cpu_bytes = 0;
+};
+
+/**
+ * Why a capture stopped. Mirrors ArchiveMetadataConfig.StopReason.
+ */
+enum class StopReason {
+  kUnspecified,
+  kCaptureDuration,
+  kEventLimit,
+  kByteLimit,
+  kCPUEventLimit,
+  kCPUByteLimit,
+  kTrigger,
+  kCommandExited,
+  kDiskBudget,
+  kMemoryBudget,
+  kSnapshot,
+};
+
+/**
+ * Counts the events and bytes kept for a capture against its limits.
+ *
+ * Pages are counted one at a time as they are kept, so that the capture can
+ * end with the page that reaches a limit.
+ */
+class CaptureLimitCounter {
+ public:
+  CaptureLimitCounter() = default;
+
+  /**
+   * @param limits The limits to count against.
+   * @param cpu_count The number of CPUs, for the per-CPU limits.
+   */
+  CaptureLimitCounter(const CaptureLimits& limits, int cpu_count);
+
+  /**
+   * @return Whether any limit is set.
+   */
+  bool enabled() const {
+    return limits_.max_events > 0 || limits_.max_bytes > 0 ||
+           limits_.max_cpu_events > 0 || limits_.max_cpu_bytes > 0;
+  }
+
+  /**
+   * Counts a page kept for the capture.
+   * @param cpu The CPU whose buffer the page is from.
+   * @param events The number of events on the page.
+   * @param bytes The size of the page.
+   * @return Whether a limit has been reached, by this page or an earlier
+   *         one.
+   */
+  bool Count(int cpu, int64_t events, int64_t bytes);
+
+  /**
+   * @return Whether a limit has been reached.
+   */
+  bool reached() const { return stop_reason_ != StopReason::kUnspecified; }
+
+  /**
+   * @return The limit that was reached first, or kUnspecified.
+   */
+  StopReason stop_reason() const { return stop_reason_; }
+
+  /**
+   * @return A description of the limit that was reached first.
+   */
+  const std::string& stop_detail() const { return stop_detail_; }
+
+ private:
+  CaptureLimits limits_;
+  // Counts so far. Indexed by CPU ID.
+  std::vector<int64_t> cpu_events_;
+  std::vector<int64_t> cpu_bytes_;
+  int64_t events_ = 0;
+  int64_t bytes_ = 0;
+  StopReason stop_reason_ = StopReason::kUnspecified;
+  std::string stop_detail_;
+};
+
+#endif  // SCHEDVIZ_UTIL_CAPTURE_LIMITS_H_
@@ -0,0 +1,85 @@
+#include "util/capture_limits.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+TEST(CaptureLimitCounterTest, IsDisabledWithoutLimits) {
+  CaptureLimitCounter counter(CaptureLimits(), 2);
+  EXPECT_FALSE(counter.enabled());
+  EXPECT_FALSE(counter.Count(0, 1 << 20, int64_t{1} << 40));
+  EXPECT_EQ(counter.stop_reason(), StopReason::kUnspecified);
+  EXPECT_EQ(counter.stop_detail(), "");
+}
+
+TEST(CaptureLimitCounterTest, StopsAtTheEventLimit) {
+  CaptureLimits limits;
+  limits.max_events = 100;
+  CaptureLimitCounter counter(limits, 2);
+  EXPECT_TRUE(counter.enabled());
+  EXPECT_FALSE(counter.Count(0, 60, 4096));
+  EXPECT_FALSE(counter.Count(1, 39, 4096));
+  EXPECT_TRUE(counter.Count(0, 30, 4096));
+  EXPECT_EQ(counter.stop_reason(), StopReason::kEventLimit);
+  EXPECT_EQ(counter.stop_detail(), "captured 129 events, limit was 100");
+}
+
+TEST(CaptureLimitCounterTest, StopsAtTheByteLimit) {
+  CaptureLimits limits;
+  limits.max_bytes = 3 * 4096;
+  CaptureLimitCounter counter(limits, 2);
+  EXPECT_FALSE(counter.Count(0, 10, 4096));
+  EXPECT_FALSE(counter.Count(1, 10, 4096));
+  EXPECT_TRUE(counter.Count(1, 10, 4096));
+  EXPECT_EQ(counter.stop_reason(), StopReason::kByteLimit);
+  EXPECT_EQ(counter.stop_detail(), "captured 12288 bytes, limit was 12288");
+}
+
+TEST(CaptureLimitCounterTest, StopsAtTheCPUEventLimit) {
+  CaptureLimits limits;
+  limits.max_cpu_events = 50;
+  CaptureLimitCounter counter(limits, 4);
+  // Other CPUs' events don't count toward a CPU's limit.
+  EXPECT_FALSE(counter.Count(0, 40, 4096));
+  EXPECT_FALSE(counter.Count(1, 40, 4096));
+  EXPECT_FALSE(counter.Count(2, 49, 4096));
+  EXPECT_TRUE(counter.Count(2, 1, 4096));
+  EXPECT_EQ(counter.stop_reason(), StopReason::kCPUEventLimit);
+  EXPECT_EQ(counter.stop_detail(), "cpu2 captured 50 events, limit was 50");
+}
+
+TEST(CaptureLimitCounterTest, StopsAtTheCPUByteLimit) {
+  CaptureLimits limits;
+  limits.max_cpu_bytes = 2 * 4096;
+  CaptureLimitCounter counter(limits, 4);
+  EXPECT_FALSE(counter.Count(3, 10, 4096));
+  EXPECT_FALSE(counter.Count(1, 10, 4096));
+  EXPECT_TRUE(counter.Count(3, 10, 4096));
+  EXPECT_EQ(counter.stop_reason(), StopReason::kCPUByteLimit);
+  EXPECT_EQ(counter.stop_detail(), "cpu3 captured 8192 bytes, limit was 8192");
+}
+
+TEST(CaptureLimitCounterTest, KeepsTheFirstLimitReached) {
+  CaptureLimits limits;
+  limits.max_events = 100;
+  limits.max_bytes = 2 * 4096;
+  limits.max_cpu_events = 10;
+  CaptureLimitCounter counter(limits, 2);
+  EXPECT_TRUE(counter.Count(0, 20, 4096));
+  EXPECT_EQ(counter.stop_reason(), StopReason::kCPUEventLimit);
+  // Later pages reach other limits, but the first one stays.
+  EXPECT_TRUE(counter.Count(1, 200, 4096));
+  EXPECT_EQ(counter.stop_reason(), StopReason::kCPUEventLimit);
+  EXPECT_EQ(counter.stop_detail(), "cpu0 captured 20 events, limit was 10");
+}
+
+TEST(CaptureLimitCounterTest, PrefersGlobalLimitsOnTheSamePage) {
+  CaptureLimits limits;
+  limits.max_bytes = 4096;
+  limits.max_cpu_bytes = 4096;
+  CaptureLimitCounter counter(limits, 1);
+  EXPECT_TRUE(counter.Count(0, 1, 4096));
+  EXPECT_EQ(counter.stop_reason(), StopReason::kByteLimit);
+}
+
+}  // namespace
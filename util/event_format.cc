@@ -0,0 +1,108 @@
+#include "util/event_format.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "re2/re2.h"
+
+namespace {
+
+/**
+ * Regex for matching a field in a header_page or format file.
+ */
+constexpr const LazyRE2 kFieldRegex = {
+    "field:\\s*[^;]*?(\\w+)\\s*(?:\\[\\d*\\])?;\\s*offset:\\s*(\\d+);\\s*"
+    "size:\\s*(\\d+);(?:\\s*signed:\\s*(\\d+);)?"};
+
+/**
+ * Regexes for matching the name, ID and print format of an event.
+ */
+constexpr const LazyRE2 kNameRegex = {"(?m)^name:\\s*(\\w+)"};
+constexpr const LazyRE2 kIDRegex = {"(?m)^ID:\\s*(\\d+)"};
+constexpr const LazyRE2 kPrintFmtRegex = {"(?m)^print fmt:\\s*(.*)$"};
+
+}  // namespace
+
+std::vector<FormatField> ParseFormatFields(const std::string& format) {
+  std::vector<FormatField> fields;
+  re2::StringPiece input(format);
+  FormatField field;
+  // Not every file has the signed attribute, so capture it as text.
+  std::string is_signed;
+  while (RE2::FindAndConsume(&input, *kFieldRegex, &field.name, &field.offset,
+                             &field.size, &is_signed)) {
+    field.is_signed = is_signed == "1";
+    fields.push_back(field);
+  }
+  return fields;
+}
+
+Status EventFormat::Parse(const std::string& format,
+                          EventFormat* event_format) {
+  EventFormat parsed;
+  int id;
+  if (!RE2::PartialMatch(format, *kNameRegex, &parsed.name)) {
+    return Status::InternalError("Format file is missing the event name");
+  }
+  if (!RE2::PartialMatch(format, *kIDRegex, &id)) {
+    return Status::InternalError(
+        absl::StrCat("Format file for ", parsed.name, " is missing its ID"));
+  }
+  parsed.id = static_cast<uint16_t>(id);
+  RE2::PartialMatch(format, *kPrintFmtRegex, &parsed.print_fmt);
+  parsed.fields = ParseFormatFields(format);
+  *event_format = std::move(parsed);
+  return Status::OkStatus();
+}
+
+const FormatField* EventFormat::FindField(absl::string_view name) const {
+  for (const auto& field : fields) {
+    if (field.name == name) {
+      return &field;
+    }
+  }
+  return nullptr;
+}
+
+int64_t ReadNumberField(const FormatField& field, const char* data,
+                        size_t length) {
+  if (field.offset + field.size > length) {
+    return 0;
+  }
+  const char* p = data + field.offset;
+  switch (field.size) {
+    case 1: {
+      uint8_t v;
+      memcpy(&v, p, sizeof(v));
+      return field.is_signed ? static_cast<int8_t>(v) : v;
+    }
+    case 2: {
+      uint16_t v;
+      memcpy(&v, p, sizeof(v));
+      return field.is_signed ? static_cast<int16_t>(v) : v;
+    }
+    case 4: {
+      uint32_t v;
+      memcpy(&v, p, sizeof(v));
+      return field.is_signed ? static_cast<int32_t>(v) : v;
+    }
+    case 8: {
+      int64_t v;
+      memcpy(&v, p, sizeof(v));
+      return v;
+    }
+    default:
+      return 0;
+  }
+}
+
+absl::string_view ReadStringField(const FormatField& field, const char* data,
+                                  size_t length) {
+  if (field.offset + field.size > length) {
+    return absl::string_view();
+  }
+  const char* p = data + field.offset;
+  return absl::string_view(p, strnlen(p, field.size));
+}
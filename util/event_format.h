@@ -0,0 +1,80 @@
+#ifndef SCHEDVIZ_UTIL_EVENT_FORMAT_H_
+#define SCHEDVIZ_UTIL_EVENT_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "util/status.h"
+
+/**
+ * A single field of an FTrace format file.
+ */
+struct FormatField {
+  std::string name;
+  size_t offset = 0;
+  size_t size = 0;
+  bool is_signed = false;
+};
+
+/**
+ * The parsed contents of an events/<system>/<event>/format file.
+ */
+struct EventFormat {
+  // Name of the event, e.g. "sched_switch".
+  std::string name;
+  // ID of the event, stored in the common_type field of each record.
+  uint16_t id = 0;
+  // All fields of the event, including the common fields.
+  std::vector<FormatField> fields;
+  // The "print fmt" line of the format file.
+  std::string print_fmt;
+
+  /**
+   * Parses the contents of a format file.
+   * @param format The contents of the format file.
+   * @param event_format The parsed format. Only written to on success.
+   * @return Status if successful or not.
+   */
+  static Status Parse(const std::string& format, EventFormat* event_format);
+
+  /**
+   * Finds a field by name.
+   * @param name The name of the field.
+   * @return The field, or nullptr if this event has no such field.
+   */
+  const FormatField* FindField(absl::string_view name) const;
+};
+
+/**
+ * Parses all "field:" lines in a format or header_page file.
+ * @param format The contents of the file.
+ * @return The fields in the order they appear.
+ */
+std::vector<FormatField> ParseFormatFields(const std::string& format);
+
+/**
+ * Reads an integer field from a record's payload.
+ * @param field The field to read.
+ * @param data The record's payload.
+ * @param length The length of the payload.
+ * @return The value of the field, sign extended if the field is signed, or 0
+ *         if the field does not fit in the payload.
+ */
+int64_t ReadNumberField(const FormatField& field, const char* data,
+                        size_t length);
+
+/**
+ * Reads a fixed length character array field (e.g. a comm) from a record's
+ * payload.
+ * @param field The field to read.
+ * @param data The record's payload.
+ * @param length The length of the payload.
+ * @return The value of the field, up to the first NUL byte.
+ */
+absl::string_view ReadStringField(const FormatField& field, const char* data,
+                                  size_t length);
+
+#endif  // SCHEDVIZ_UTIL_EVENT_FORMAT_H_
@@ -0,0 +1,94 @@
+#include "util/hist_triggers.h"
+
+#include <cstdint>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+
+namespace {
+
+constexpr absl::string_view kSwitch = "sched:sched_switch";
+constexpr absl::string_view kWakeup = "sched:sched_wakeup";
+
+/**
+ * Number of entries in each per-thread table. Must be a power of two.
+ * Entries that don't fit are counted as dropped in the table's totals.
+ */
+constexpr int kTableSize = 16384;
+
+/**
+ * Returns the trigger that records, per thread, a histogram of a duration
+ * field of a synthetic event.
+ */
+std::string PerThreadHistogram(absl::string_view field) {
+  return absl::StrCat("hist:keys=pid,", field, ".log2:sort=pid,", field,
+                      ":size=", kTableSize);
+}
+
+}  // namespace
+
+SchedAggregation MakeSchedAggregation(int64_t task_report_max) {
+  SchedAggregation aggregation;
+  aggregation.synthetic_events = {
+      "schedviz_wakeup_latency pid_t pid; u64 lat",
+      "schedviz_run_time pid_t pid; u64 run",
+      "schedviz_wait_time pid_t pid; u64 wait",
+  };
+
+  const std::string size = absl::StrCat(":size=", kTableSize);
+  aggregation.triggers = {
+      // Wakeup latency: from sched_wakeup of a thread to its switch-in.
+      {std::string(kWakeup),
+       absl::StrCat("hist:keys=pid:schedviz_wake_ts=common_timestamp.usecs",
+                    size)},
+      {std::string(kSwitch),
+       absl::StrCat("hist:keys=next_pid:schedviz_wake_lat=common_timestamp."
+                    "usecs-$schedviz_wake_ts",
+                    size,
+                    ":onmatch(sched.sched_wakeup).schedviz_wakeup_latency("
+                    "next_pid,$schedviz_wake_lat)")},
+      // Run time: from the switch-in of a thread to its switch-out.
+      {std::string(kSwitch),
+       absl::StrCat("hist:keys=next_pid:schedviz_on_ts=common_timestamp.usecs",
+                    size)},
+      {std::string(kSwitch),
+       absl::StrCat("hist:keys=prev_pid:schedviz_run=common_timestamp.usecs-"
+                    "$schedviz_on_ts",
+                    size,
+                    ":onmatch(sched.sched_switch).schedviz_run_time(prev_pid,"
+                    "$schedviz_run)")},
+      // Wait time: from the preemption of a thread to its next switch-in.
+      {std::string(kSwitch),
+       absl::StrCat("hist:keys=prev_pid:schedviz_off_ts=common_timestamp.usecs",
+                    size, " if prev_state == 0 || prev_state == ",
+                    task_report_max)},
+      {std::string(kSwitch),
+       absl::StrCat("hist:keys=next_pid:schedviz_wait=common_timestamp.usecs-"
+                    "$schedviz_off_ts",
+                    size,
+                    ":onmatch(sched.sched_switch).schedviz_wait_time(next_pid,"
+                    "$schedviz_wait)")},
+      // The tables themselves.
+      {"synthetic:schedviz_wakeup_latency", PerThreadHistogram("lat")},
+      {"synthetic:schedviz_wakeup_latency", "hist:keys=lat.log2:sort=lat"},
+      {"synthetic:schedviz_run_time", PerThreadHistogram("run")},
+      {"synthetic:schedviz_wait_time", PerThreadHistogram("wait")},
+  };
+
+  aggregation.tables = {
+      {"wakeup_latency", "synthetic:schedviz_wakeup_latency"},
+      {"run_time", "synthetic:schedviz_run_time"},
+      {"wait_time", "synthetic:schedviz_wait_time"},
+  };
+  return aggregation;
+}
+
+HistTrigger MakeBlockedStackTrigger(int64_t task_report_max) {
+  return {std::string(kSwitch),
+          absl::StrCat("stacktrace if prev_state != 0 && prev_state != ",
+                       task_report_max)};
+}
+
+std::string SyntheticEventName(const std::string& definition) {
+  return definition.substr(0, definition.find(' '));
+}
@@ -0,0 +1,69 @@
+#ifndef SCHEDVIZ_UTIL_HIST_TRIGGERS_H_
+#define SCHEDVIZ_UTIL_HIST_TRIGGERS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A hist trigger to install on an FTrace event.
+ */
+struct HistTrigger {
+  // FTrace event name, e.g. "sched:sched_switch".
+  std::string event;
+  // The trigger command written to the event's trigger file.
+  std::string command;
+};
+
+/**
+ * An aggregated table to read at the end of, or periodically during, an
+ * aggregate capture.
+ */
+struct HistTableSource {
+  // Name of the table in the archive, e.g. "wakeup_latency".
+  std::string name;
+  // FTrace event whose hist file holds the table.
+  std::string event;
+};
+
+/**
+ * Everything needed to aggregate scheduling behavior in the kernel.
+ */
+struct SchedAggregation {
+  // Synthetic event definitions, in the form accepted by synthetic_events.
+  std::vector<std::string> synthetic_events;
+  // Triggers in installation order. They must be removed in reverse order,
+  // since later triggers reference variables and synthetic events of earlier
+  // ones.
+  std::vector<HistTrigger> triggers;
+  std::vector<HistTableSource> tables;
+};
+
+/**
+ * Builds the synthetic events and hist triggers that aggregate, per thread,
+ * wakeup latency (wakeup to switch-in), run time (switch-in to switch-out)
+ * and wait time (preemption to switch-in). All durations are in
+ * microseconds and bucketed by powers of two.
+ * @param task_report_max The prev_state value that marks a preempted thread
+ *                        in sched_switch.
+ * @return The aggregation.
+ */
+SchedAggregation MakeSchedAggregation(int64_t task_report_max);
+
+/**
+ * Builds the trigger that records the kernel stack of each thread that
+ * blocks, as a kernel_stack record following its sched_switch. Preempted
+ * threads are left out, since they didn't choose to stop running.
+ * @param task_report_max The prev_state value that marks a preempted thread
+ *                        in sched_switch.
+ * @return The trigger.
+ */
+HistTrigger MakeBlockedStackTrigger(int64_t task_report_max);
+
+/**
+ * @param definition A synthetic event definition.
+ * @return The name of the synthetic event it defines.
+ */
+std::string SyntheticEventName(const std::string& definition);
+
+#endif  // SCHEDVIZ_UTIL_HIST_TRIGGERS_H_
@@ -0,0 +1,289 @@
+#include "util/kernel_stacks.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+
+namespace {
+
+constexpr uint32_t kNoStack = ~0u;
+// The table starts with this many slots, and is kept at most half full.
+constexpr size_t kInitialSlots = 1024;
+
+// Marks a kallsyms index cache file, and its version.
+constexpr char kCacheMagic[] = "SVKSYMS1";
+
+uint64_t HashFrames(const uint64_t* frames, size_t depth) {
+  uint64_t hash = depth;
+  for (size_t i = 0; i < depth; i++) {
+    hash = (hash ^ frames[i]) * 0x9e3779b97f4a7c15;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+bool ReadFile(const std::filesystem::path& path, std::string* contents) {
+  // procfs files have no size, so they are read until the end.
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::ostringstream stream;
+  stream << file.rdbuf();
+  *contents = stream.str();
+  return true;
+}
+
+template <typename T>
+void AppendRaw(std::string* out, const T& value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool ReadRaw(const std::string& in, size_t* pos, T* value) {
+  if (in.size() - *pos < sizeof(T)) {
+    return false;
+  }
+  memcpy(value, in.data() + *pos, sizeof(T));
+  *pos += sizeof(T);
+  return true;
+}
+
+/**
+ * @return What identifies the running kernel's symbol addresses: the boot,
+ *         and the name and address of each loaded module.
+ */
+std::string KernelKey(const std::filesystem::path& proc_root) {
+  std::string boot_id;
+  std::string modules;
+  ReadFile(proc_root / "sys" / "kernel" / "random" / "boot_id", &boot_id);
+  ReadFile(proc_root / "modules", &modules);
+  std::string key(absl::StripAsciiWhitespace(boot_id));
+  for (absl::string_view line : absl::StrSplit(modules, '\n')) {
+    // The other columns, like the reference counts, change while loaded.
+    const std::vector<absl::string_view> columns =
+        absl::StrSplit(line, ' ', absl::SkipEmpty());
+    if (columns.size() >= 6) {
+      absl::StrAppend(&key, "\n", columns[0], " ", columns[5]);
+    }
+  }
+  return key;
+}
+
+}  // namespace
+
+uint32_t StackTable::Intern(const uint64_t* frames, size_t depth) {
+  lookups_++;
+  if (2 * (size() + 1) > slots_.size()) {
+    Grow();
+  }
+  const uint64_t hash = HashFrames(frames, depth);
+  const size_t mask = slots_.size() - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    const uint32_t id = slots_[slot];
+    if (id == kNoStack) {
+      const uint32_t new_id = size();
+      frames_.insert(frames_.end(), frames, frames + depth);
+      starts_.push_back(frames_.size());
+      hashes_.push_back(hash);
+      slots_[slot] = new_id;
+      return new_id;
+    }
+    if (hashes_[id] == hash && starts_[id + 1] - starts_[id] == depth &&
+        std::equal(frames, frames + depth, frames_.begin() + starts_[id])) {
+      return id;
+    }
+  }
+}
+
+const uint64_t* StackTable::Frames(uint32_t id, size_t* depth) const {
+  *depth = starts_[id + 1] - starts_[id];
+  return frames_.data() + starts_[id];
+}
+
+void StackTable::Grow() {
+  slots_.assign(std::max(kInitialSlots, 2 * slots_.size()), kNoStack);
+  const size_t mask = slots_.size() - 1;
+  for (uint32_t id = 0; id < size(); id++) {
+    size_t slot = hashes_[id] & mask;
+    while (slots_[slot] != kNoStack) {
+      slot = (slot + 1) & mask;
+    }
+    slots_[slot] = id;
+  }
+}
+
+Status KallsymsIndex::Load(const std::filesystem::path& proc_root,
+                           const std::filesystem::path& cache_path,
+                           std::unique_ptr<KallsymsIndex>* index) {
+  std::unique_ptr<KallsymsIndex> loaded(new KallsymsIndex());
+  const auto& key = KernelKey(proc_root);
+  std::string cache;
+  if (!cache_path.empty() && ReadFile(cache_path, &cache) &&
+      loaded->Deserialize(cache, key)) {
+    loaded->cached_ = true;
+    *index = std::move(loaded);
+    return Status::OkStatus();
+  }
+
+  std::string kallsyms;
+  if (!ReadFile(proc_root / "kallsyms", &kallsyms)) {
+    return Status::InternalError(absl::StrCat(
+        "Unable to read ", (proc_root / "kallsyms").string()));
+  }
+  loaded->Parse(kallsyms);
+  // An index of hidden addresses would be wrong once they're visible.
+  if (!cache_path.empty() && loaded->size() > 0) {
+    // Written aside and renamed, so that a concurrent capture never reads a
+    // partial cache.
+    std::error_code error;
+    std::filesystem::create_directories(cache_path.parent_path(), error);
+    auto temp_path = cache_path;
+    temp_path += absl::StrCat(".", getpid());
+    std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+    file << loaded->Serialize(key);
+    file.close();
+    if (file) {
+      std::filesystem::rename(temp_path, cache_path, error);
+    }
+    if (!file || error) {
+      std::filesystem::remove(temp_path, error);
+    }
+  }
+  *index = std::move(loaded);
+  return Status::OkStatus();
+}
+
+std::string KallsymsIndex::Symbolize(uint64_t address) const {
+  auto it = std::upper_bound(
+      symbols_.begin(), symbols_.end(), address,
+      [](uint64_t address, const Symbol& symbol) {
+        return address < symbol.address;
+      });
+  if (it == symbols_.begin()) {
+    return absl::StrCat("0x", absl::Hex(address));
+  }
+  --it;
+  std::string symbol =
+      absl::StrCat(&names_[it->name], "+0x", absl::Hex(address - it->address));
+  if (names_[it->module] != '\0') {
+    absl::StrAppend(&symbol, " [", &names_[it->module], "]");
+  }
+  return symbol;
+}
+
+void KallsymsIndex::Parse(const std::string& kallsyms) {
+  symbols_.clear();
+  // Offset 0 is the empty module name.
+  names_.assign(1, '\0');
+  std::unordered_map<std::string, uint32_t> modules;
+  for (absl::string_view line : absl::StrSplit(kallsyms, '\n')) {
+    // "<address> <type> <name>[\t[<module>]]"
+    const size_t type_end = line.find(' ', line.find(' ') + 1);
+    if (type_end == absl::string_view::npos || type_end < 2) {
+      continue;
+    }
+    const char type = line[type_end - 1];
+    if (type != 't' && type != 'T' && type != 'w' && type != 'W') {
+      continue;
+    }
+    uint64_t address;
+    if (!absl::SimpleHexAtoi(line.substr(0, type_end - 2), &address) ||
+        address == 0) {
+      continue;
+    }
+    absl::string_view name = line.substr(type_end + 1);
+    absl::string_view module;
+    if (const size_t tab = name.find('\t'); tab != absl::string_view::npos) {
+      module = absl::StripSuffix(absl::StripPrefix(name.substr(tab + 1), "["),
+                                 "]");
+      name = name.substr(0, tab);
+    }
+
+    Symbol symbol;
+    symbol.address = address;
+    symbol.name = names_.size();
+    names_.append(name.data(), name.size());
+    names_.push_back('\0');
+    symbol.module = 0;
+    if (!module.empty()) {
+      auto [it, inserted] =
+          modules.emplace(std::string(module), names_.size());
+      if (inserted) {
+        names_.append(module.data(), module.size());
+        names_.push_back('\0');
+      }
+      symbol.module = it->second;
+    }
+    symbols_.push_back(symbol);
+  }
+  std::stable_sort(symbols_.begin(), symbols_.end(),
+                   [](const Symbol& a, const Symbol& b) {
+                     return a.address < b.address;
+                   });
+}
+
+bool KallsymsIndex::Deserialize(const std::string& cache,
+                                const std::string& key) {
+  const size_t magic_size = sizeof(kCacheMagic) - 1;
+  if (cache.compare(0, magic_size, kCacheMagic) != 0) {
+    return false;
+  }
+  size_t pos = magic_size;
+  uint32_t key_size;
+  if (!ReadRaw(cache, &pos, &key_size) || cache.size() - pos < key_size ||
+      cache.compare(pos, key_size, key) != 0 || key_size != key.size()) {
+    return false;
+  }
+  pos += key_size;
+  uint32_t symbol_count;
+  if (!ReadRaw(cache, &pos, &symbol_count) ||
+      (cache.size() - pos) / sizeof(Symbol) < symbol_count) {
+    return false;
+  }
+  symbols_.resize(symbol_count);
+  memcpy(symbols_.data(), cache.data() + pos, symbol_count * sizeof(Symbol));
+  pos += symbol_count * sizeof(Symbol);
+  uint32_t names_size;
+  if (!ReadRaw(cache, &pos, &names_size) ||
+      cache.size() - pos != names_size || names_size == 0 ||
+      cache.back() != '\0') {
+    symbols_.clear();
+    return false;
+  }
+  names_.assign(cache, pos, names_size);
+  for (const auto& symbol : symbols_) {
+    if (symbol.name >= names_size || symbol.module >= names_size) {
+      symbols_.clear();
+      names_.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string KallsymsIndex::Serialize(const std::string& key) const {
+  std::string cache(kCacheMagic);
+  AppendRaw(&cache, static_cast<uint32_t>(key.size()));
+  cache.append(key);
+  AppendRaw(&cache, static_cast<uint32_t>(symbols_.size()));
+  cache.append(reinterpret_cast<const char*>(symbols_.data()),
+               symbols_.size() * sizeof(Symbol));
+  AppendRaw(&cache, static_cast<uint32_t>(names_.size()));
+  cache.append(names_);
+  return cache;
+}
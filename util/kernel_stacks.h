@@ -0,0 +1,138 @@
+#ifndef SCHEDVIZ_UTIL_KERNEL_STACKS_H_
+#define SCHEDVIZ_UTIL_KERNEL_STACKS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/status.h"
+
+/**
+ * Deduplicates kernel stacks, giving each distinct stack a 32-bit ID. IDs are
+ * handed out densely from 0, in the order stacks are first seen.
+ *
+ * Stacks are found through an open addressing hash table of IDs, so that a
+ * stack already in the table costs a hash and a compare, and no allocation.
+ */
+class StackTable {
+ public:
+  /**
+   * @param frames The return addresses of the stack, innermost first.
+   * @param depth The number of frames.
+   * @return The ID of the stack, which is added to the table if it's new.
+   */
+  uint32_t Intern(const uint64_t* frames, size_t depth);
+
+  /**
+   * @return The number of distinct stacks.
+   */
+  uint32_t size() const { return starts_.size() - 1; }
+
+  /**
+   * @param id The ID of a stack in the table.
+   * @param depth Set to the number of frames.
+   * @return The stack's frames, innermost first.
+   */
+  const uint64_t* Frames(uint32_t id, size_t* depth) const;
+
+  /**
+   * @return The number of stacks interned, including repeats.
+   */
+  uint64_t lookups() const { return lookups_; }
+
+ private:
+  /**
+   * Doubles the number of slots and reinserts every ID.
+   */
+  void Grow();
+
+  // Every stack's frames, back to back, and where each stack starts, with
+  // the end of the last stack at the back.
+  std::vector<uint64_t> frames_;
+  std::vector<size_t> starts_ = {0};
+  std::vector<uint64_t> hashes_;
+  // IDs by hash, probed linearly. kNoStack marks a free slot.
+  std::vector<uint32_t> slots_;
+  uint64_t lookups_ = 0;
+};
+
+/**
+ * The kernel's text symbols from /proc/kallsyms, sorted by address to
+ * symbolize stacks.
+ *
+ * Reading kallsyms is slow, since the kernel formats every one of its
+ * symbols, so the parsed index is cached in a file. The cache is only used
+ * while it matches the running kernel: the same boot, which fixes where
+ * KASLR put the kernel, and the same loaded modules.
+ */
+class KallsymsIndex {
+ public:
+  /**
+   * Loads the index from the cache, or builds it from kallsyms and updates
+   * the cache.
+   * @param proc_root Where procfs is mounted, usually /proc.
+   * @param cache_path The cache file, or empty to not cache the index.
+   * @param index Set to the index on success.
+   * @return Status if successful or not. Failing to write the cache is not
+   *         an error.
+   */
+  static Status Load(const std::filesystem::path& proc_root,
+                     const std::filesystem::path& cache_path,
+                     std::unique_ptr<KallsymsIndex>* index);
+
+  /**
+   * @param address A kernel text address.
+   * @return The address as symbol+0xoffset, with the module in brackets if
+   *         the symbol is in one, or as a hex address if no symbol holds it.
+   */
+  std::string Symbolize(uint64_t address) const;
+
+  /**
+   * @return The number of symbols. Zero if kallsyms hides the addresses,
+   *         e.g. because of kptr_restrict.
+   */
+  size_t size() const { return symbols_.size(); }
+
+  /**
+   * @return Whether the index was loaded from the cache.
+   */
+  bool cached() const { return cached_; }
+
+ private:
+  struct Symbol {
+    uint64_t address;
+    // Offsets into names_ of the NUL terminated symbol and module names. The
+    // module is empty for symbols of the kernel proper.
+    uint32_t name;
+    uint32_t module;
+  };
+
+  KallsymsIndex() = default;
+
+  /**
+   * Parses the contents of kallsyms into the index.
+   */
+  void Parse(const std::string& kallsyms);
+
+  /**
+   * Replaces the index with a serialized one.
+   * @param key The key the cache must have been saved with.
+   * @return Whether the cache is well formed and matches the key.
+   */
+  bool Deserialize(const std::string& cache, const std::string& key);
+
+  /**
+   * @param key Identifies the running kernel.
+   * @return The index in the cache file's format.
+   */
+  std::string Serialize(const std::string& key) const;
+
+  std::vector<Symbol> symbols_;
+  std::string names_;
+  bool cached_ = false;
+};
+
+#endif  // SCHEDVIZ_UTIL_KERNEL_STACKS_H_
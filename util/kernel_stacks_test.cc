@@ -0,0 +1,211 @@
+#include "util/kernel_stacks.h"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+TEST(StackTableTest, InternsEachDistinctStackOnce) {
+  StackTable table;
+  const uint64_t a[] = {1, 2, 3};
+  const uint64_t b[] = {1, 2, 4};
+  EXPECT_EQ(table.Intern(a, 3), 0);
+  EXPECT_EQ(table.Intern(b, 3), 1);
+  // A prefix of a stack is a different stack.
+  EXPECT_EQ(table.Intern(a, 2), 2);
+  EXPECT_EQ(table.Intern(a, 0), 3);
+  EXPECT_EQ(table.Intern(b, 3), 1);
+  EXPECT_EQ(table.Intern(a, 3), 0);
+  EXPECT_EQ(table.Intern(a, 0), 3);
+  EXPECT_EQ(table.size(), 4);
+  EXPECT_EQ(table.lookups(), 7);
+
+  size_t depth;
+  const uint64_t* frames = table.Frames(1, &depth);
+  ASSERT_EQ(depth, 3);
+  EXPECT_EQ(std::vector<uint64_t>(frames, frames + depth),
+            std::vector<uint64_t>(b, b + 3));
+  table.Frames(3, &depth);
+  EXPECT_EQ(depth, 0);
+}
+
+TEST(StackTableTest, KeepsIDsWhileGrowing) {
+  // Enough stacks to grow the table several times.
+  constexpr uint64_t kStacks = 5000;
+  StackTable table;
+  for (uint64_t i = 0; i < kStacks; i++) {
+    const uint64_t frames[] = {0xffffffff81000000 + i, i % 7};
+    ASSERT_EQ(table.Intern(frames, 2), i);
+  }
+  EXPECT_EQ(table.size(), kStacks);
+  for (uint64_t i = 0; i < kStacks; i++) {
+    const uint64_t frames[] = {0xffffffff81000000 + i, i % 7};
+    ASSERT_EQ(table.Intern(frames, 2), i);
+    size_t depth;
+    const uint64_t* interned = table.Frames(i, &depth);
+    ASSERT_EQ(depth, 2);
+    EXPECT_EQ(interned[0], frames[0]);
+    EXPECT_EQ(interned[1], frames[1]);
+  }
+  EXPECT_EQ(table.size(), kStacks);
+}
+
+constexpr char kKallsyms[] =
+    "ffffffff81000000 T _stext\n"
+    "ffffffff81000100 t do_one_initcall\n"
+    "ffffffff81000200 D some_data\n"
+    "ffffffff81000300 W weak_function\n"
+    "ffffffffc0000000 t module_function\t[some_module]\n"
+    "ffffffffc0000100 T other_function\t[some_module]\n";
+
+/**
+ * A fake procfs, with the files KallsymsIndex reads, in the test's
+ * temporary directory.
+ */
+class KallsymsIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    root_ = std::filesystem::path(::testing::TempDir()) /
+            ("kernel_stacks_test." + std::to_string(getpid()));
+    proc_root_ = root_ / "proc";
+    cache_path_ = root_ / "cache" / "kallsyms";
+    std::filesystem::create_directories(proc_root_ / "sys/kernel/random");
+    WriteFile(proc_root_ / "kallsyms", kKallsyms);
+    WriteFile(proc_root_ / "sys/kernel/random/boot_id",
+              "5f2b3b3c-1c4e-4a4e-9d0a-7e6d3b8a9c01\n");
+    WriteFile(proc_root_ / "modules",
+              "some_module 16384 0 - Live 0xffffffffc0000000\n");
+  }
+
+  void TearDown() override { std::filesystem::remove_all(root_); }
+
+  static void WriteFile(const std::filesystem::path& path,
+                        const std::string& contents) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file << contents;
+  }
+
+  static std::string ReadFile(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+  }
+
+  /**
+   * Loads the index, expecting it to have the symbols of kKallsyms.
+   */
+  void ExpectLoads(bool cached) {
+    std::unique_ptr<KallsymsIndex> index;
+    ASSERT_TRUE(KallsymsIndex::Load(proc_root_, cache_path_, &index).ok());
+    EXPECT_EQ(index->cached(), cached);
+    EXPECT_EQ(index->size(), 5);
+    EXPECT_EQ(index->Symbolize(0xffffffff81000310), "weak_function+0x10");
+    EXPECT_EQ(index->Symbolize(0xffffffffc0000004),
+              "module_function+0x4 [some_module]");
+  }
+
+  std::filesystem::path root_;
+  std::filesystem::path proc_root_;
+  std::filesystem::path cache_path_;
+};
+
+TEST_F(KallsymsIndexTest, SymbolizesTextAddresses) {
+  std::unique_ptr<KallsymsIndex> index;
+  ASSERT_TRUE(KallsymsIndex::Load(proc_root_, "", &index).ok());
+  EXPECT_FALSE(index->cached());
+  // some_data isn't text, so do_one_initcall runs on to weak_function.
+  EXPECT_EQ(index->size(), 5);
+  EXPECT_EQ(index->Symbolize(0xffffffff81000000), "_stext+0x0");
+  EXPECT_EQ(index->Symbolize(0xffffffff81000250), "do_one_initcall+0x150");
+  EXPECT_EQ(index->Symbolize(0xffffffffc0000180),
+            "other_function+0x80 [some_module]");
+  EXPECT_EQ(index->Symbolize(0x1000), "0x1000");
+  EXPECT_FALSE(std::filesystem::exists(cache_path_));
+}
+
+TEST_F(KallsymsIndexTest, IsEmptyWhenAddressesAreHidden) {
+  WriteFile(proc_root_ / "kallsyms",
+            "0000000000000000 T _stext\n"
+            "0000000000000000 t do_one_initcall\n");
+  std::unique_ptr<KallsymsIndex> index;
+  ASSERT_TRUE(KallsymsIndex::Load(proc_root_, cache_path_, &index).ok());
+  EXPECT_EQ(index->size(), 0);
+  EXPECT_EQ(index->Symbolize(0xffffffff81000000), "0xffffffff81000000");
+  // The empty index isn't cached.
+  EXPECT_FALSE(std::filesystem::exists(cache_path_));
+}
+
+TEST_F(KallsymsIndexTest, FailsWithoutKallsyms) {
+  std::filesystem::remove(proc_root_ / "kallsyms");
+  std::unique_ptr<KallsymsIndex> index;
+  EXPECT_FALSE(KallsymsIndex::Load(proc_root_, cache_path_, &index).ok());
+}
+
+TEST_F(KallsymsIndexTest, LoadsFromTheCache) {
+  ExpectLoads(/*cached=*/false);
+  ASSERT_TRUE(std::filesystem::exists(cache_path_));
+  ExpectLoads(/*cached=*/true);
+  // The cache is enough on its own.
+  std::filesystem::remove(proc_root_ / "kallsyms");
+  ExpectLoads(/*cached=*/true);
+}
+
+TEST_F(KallsymsIndexTest, IgnoresTheCacheOfAnotherKernel) {
+  ExpectLoads(/*cached=*/false);
+  const auto& cache = ReadFile(cache_path_);
+  // A reboot.
+  WriteFile(proc_root_ / "sys/kernel/random/boot_id",
+            "0c8f0b7e-4a8e-4bfa-8f47-3f2a6b1d5e02\n");
+  ExpectLoads(/*cached=*/false);
+  ExpectLoads(/*cached=*/true);
+  // A module loaded elsewhere.
+  WriteFile(cache_path_, cache);
+  WriteFile(proc_root_ / "modules",
+            "some_module 16384 0 - Live 0xffffffffc0100000\n");
+  ExpectLoads(/*cached=*/false);
+  // A reference count is not part of the key.
+  WriteFile(proc_root_ / "modules",
+            "some_module 16384 3 - Live 0xffffffffc0100000\n");
+  ExpectLoads(/*cached=*/true);
+}
+
+TEST_F(KallsymsIndexTest, RebuildsCorruptCaches) {
+  ExpectLoads(/*cached=*/false);
+  const auto& cache = ReadFile(cache_path_);
+  for (size_t length = 0; length < cache.size(); length++) {
+    SCOPED_TRACE(length);
+    WriteFile(cache_path_, cache.substr(0, length));
+    ExpectLoads(/*cached=*/false);
+    EXPECT_EQ(ReadFile(cache_path_), cache);
+  }
+
+  WriteFile(cache_path_, cache + '\0');
+  ExpectLoads(/*cached=*/false);
+
+  // The cache is the magic, the key and the symbols, each but the magic
+  // after its size, then the names. Point the first symbol's name past them.
+  const std::string key =
+      "5f2b3b3c-1c4e-4a4e-9d0a-7e6d3b8a9c01\n"
+      "some_module 0xffffffffc0000000";
+  const size_t name = 8 + 4 + key.size() + 4 + sizeof(uint64_t);
+  ASSERT_EQ(cache.compare(12, key.size(), key), 0);
+  std::string corrupt = cache;
+  const uint32_t bad_offset = cache.size();
+  memcpy(&corrupt[name], &bad_offset, sizeof(bad_offset));
+  WriteFile(cache_path_, corrupt);
+  ExpectLoads(/*cached=*/false);
+  ExpectLoads(/*cached=*/true);
+}
+
+}  // namespace
@@ -0,0 +1,100 @@
+#include "util/log_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+
+namespace {
+
+/**
+ * @return The position of the most significant set bit of value, which must
+ *         not be 0.
+ */
+int HighestBit(uint64_t value) { return 63 - __builtin_clzll(value); }
+
+}  // namespace
+
+LogHistogram::LogHistogram(int sub_bucket_bits, int max_value_bits)
+    : sub_bucket_bits_(sub_bucket_bits) {
+  // Values below 2^sub_bucket_bits get a bucket each, and every power of two
+  // from there up to 2^max_value_bits gets 2^sub_bucket_bits buckets.
+  const size_t sub_buckets = size_t{1} << sub_bucket_bits;
+  buckets_.resize(sub_buckets * (max_value_bits - sub_bucket_bits + 1), 0);
+}
+
+size_t LogHistogram::BucketIndex(uint64_t value) const {
+  const uint64_t sub_buckets = uint64_t{1} << sub_bucket_bits_;
+  if (value < sub_buckets) {
+    return value;
+  }
+  // value >> shift is in [sub_buckets, 2 * sub_buckets).
+  const int shift = HighestBit(value) - sub_bucket_bits_;
+  const size_t index = shift * sub_buckets + (value >> shift);
+  return std::min(index, buckets_.size() - 1);
+}
+
+int64_t LogHistogram::LowerBound(size_t index) const {
+  const size_t sub_buckets = size_t{1} << sub_bucket_bits_;
+  if (index < sub_buckets) {
+    return index;
+  }
+  const int shift = index / sub_buckets - 1;
+  return static_cast<int64_t>(index % sub_buckets + sub_buckets) << shift;
+}
+
+int64_t LogHistogram::UpperBound(size_t index) const {
+  if (index + 1 == buckets_.size()) {
+    return max_;
+  }
+  return LowerBound(index + 1) - 1;
+}
+
+void LogHistogram::Record(int64_t value) {
+  value = std::max<int64_t>(value, 0);
+  buckets_[BucketIndex(value)]++;
+  min_ = count_ == 0 ? value : std::min(min_, value);
+  max_ = std::max(max_, value);
+  sum_ += value;
+  count_++;
+}
+
+void LogHistogram::Add(const LogHistogram& other) {
+  if (other.count_ == 0) {
+    return;
+  }
+  for (size_t i = 0; i < buckets_.size() && i < other.buckets_.size(); i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+  min_ = count_ == 0 ? other.min_ : std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  sum_ += other.sum_;
+  count_ += other.count_;
+}
+
+int64_t LogHistogram::ValueAtQuantile(double quantile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  const uint64_t rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(std::clamp(quantile, 0.0, 1.0) *
+                                         static_cast<double>(count_))));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      return std::min(UpperBound(i), max_);
+    }
+  }
+  return max_;
+}
+
+void LogHistogram::ForEachBucket(
+    const std::function<void(int64_t lower_bound, uint64_t count)>& callback)
+    const {
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    if (buckets_[i] != 0) {
+      callback(LowerBound(i), buckets_[i]);
+    }
+  }
+}
@@ -0,0 +1,81 @@
+#ifndef SCHEDVIZ_UTIL_LOG_HISTOGRAM_H_
+#define SCHEDVIZ_UTIL_LOG_HISTOGRAM_H_
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/**
+ * A log-linear histogram of non-negative integers, in the style of
+ * HdrHistogram: every power of two range is split into 2^sub_bucket_bits
+ * equal buckets, so any recorded value is known to within a relative error of
+ * 2^-sub_bucket_bits, and values below 2^(sub_bucket_bits + 1) exactly.
+ *
+ * The buckets are allocated up front, so memory use doesn't grow with the
+ * number of recorded values. Values too large for the histogram are counted
+ * in its last bucket.
+ */
+class LogHistogram {
+ public:
+  /**
+   * Constructs an empty histogram.
+   * @param sub_bucket_bits Log2 of the number of buckets per power of two.
+   * @param max_value_bits Values up to 2^max_value_bits - 1 are bucketed
+   *                       precisely. Must be at least sub_bucket_bits.
+   */
+  LogHistogram(int sub_bucket_bits, int max_value_bits);
+
+  /**
+   * Records a value.
+   * @param value The value. Negative values are recorded as 0.
+   */
+  void Record(int64_t value);
+
+  /**
+   * Adds the counts of another histogram with the same layout.
+   * @param other The histogram to add.
+   */
+  void Add(const LogHistogram& other);
+
+  /**
+   * @param quantile Between 0 and 1.
+   * @return The largest value of the bucket the quantile falls in, capped by
+   *         the largest recorded value, or 0 if nothing was recorded.
+   */
+  int64_t ValueAtQuantile(double quantile) const;
+
+  /**
+   * Calls callback with the smallest value and the count of each non-empty
+   * bucket, in increasing order.
+   */
+  void ForEachBucket(
+      const std::function<void(int64_t lower_bound, uint64_t count)>& callback)
+      const;
+
+  int sub_bucket_bits() const { return sub_bucket_bits_; }
+  uint64_t count() const { return count_; }
+  int64_t min() const { return count_ == 0 ? 0 : min_; }
+  int64_t max() const { return max_; }
+  int64_t sum() const { return sum_; }
+
+ private:
+  /**
+   * @return The index of the bucket value falls in.
+   */
+  size_t BucketIndex(uint64_t value) const;
+
+  /**
+   * @return The smallest and largest values of a bucket.
+   */
+  int64_t LowerBound(size_t index) const;
+  int64_t UpperBound(size_t index) const;
+
+  int sub_bucket_bits_;
+  std::vector<uint64_t> buckets_;
+  uint64_t count_ = 0;
+  int64_t min_ = 0;
+  int64_t max_ = 0;
+  int64_t sum_ = 0;
+};
+
+#endif  // SCHEDVIZ_UTIL_LOG_HISTOGRAM_H_
@@ -0,0 +1,124 @@
+#include "util/log_histogram.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+using Buckets = std::vector<std::pair<int64_t, uint64_t>>;
+
+Buckets BucketsOf(const LogHistogram& histogram) {
+  Buckets buckets;
+  histogram.ForEachBucket([&buckets](int64_t lower_bound, uint64_t count) {
+    buckets.emplace_back(lower_bound, count);
+  });
+  return buckets;
+}
+
+// 4 buckets per power of two, with values up to 31 bucketed precisely.
+LogHistogram SmallHistogram() { return LogHistogram(2, 5); }
+
+TEST(LogHistogramTest, RecordsSmallValuesExactly) {
+  LogHistogram histogram = SmallHistogram();
+  // Values below 2^(sub_bucket_bits + 1) get a bucket each.
+  for (int64_t value = 0; value < 8; value++) {
+    histogram.Record(value);
+  }
+  Buckets expected;
+  for (int64_t value = 0; value < 8; value++) {
+    expected.emplace_back(value, 1);
+  }
+  EXPECT_EQ(BucketsOf(histogram), expected);
+}
+
+TEST(LogHistogramTest, SplitsPowersOfTwoIntoSubBuckets) {
+  LogHistogram histogram = SmallHistogram();
+  for (int64_t value : {8, 9, 10, 11, 14, 15, 16, 19, 20, 28, 31}) {
+    histogram.Record(value);
+  }
+  EXPECT_EQ(BucketsOf(histogram),
+            (Buckets{{8, 2}, {10, 2}, {14, 2}, {16, 2}, {20, 1}, {28, 2}}));
+}
+
+TEST(LogHistogramTest, SaturatesIntoTheLastBucket) {
+  LogHistogram histogram = SmallHistogram();
+  histogram.Record(30);
+  histogram.Record(32);
+  histogram.Record(int64_t{1} << 40);
+  EXPECT_EQ(BucketsOf(histogram), (Buckets{{28, 3}}));
+  EXPECT_EQ(histogram.max(), int64_t{1} << 40);
+  // The last bucket reaches up to the largest value recorded, so every
+  // quantile in it is reported as that.
+  EXPECT_EQ(histogram.ValueAtQuantile(0), int64_t{1} << 40);
+  EXPECT_EQ(histogram.ValueAtQuantile(1), int64_t{1} << 40);
+}
+
+TEST(LogHistogramTest, RecordsNegativeValuesAsZero) {
+  LogHistogram histogram = SmallHistogram();
+  histogram.Record(-5);
+  EXPECT_EQ(BucketsOf(histogram), (Buckets{{0, 1}}));
+  EXPECT_EQ(histogram.min(), 0);
+  EXPECT_EQ(histogram.sum(), 0);
+}
+
+TEST(LogHistogramTest, KeepsSummaryStatistics) {
+  LogHistogram histogram = SmallHistogram();
+  EXPECT_EQ(histogram.count(), 0);
+  EXPECT_EQ(histogram.min(), 0);
+  EXPECT_EQ(histogram.max(), 0);
+  for (int64_t value : {12, 3, 40}) {
+    histogram.Record(value);
+  }
+  EXPECT_EQ(histogram.count(), 3);
+  EXPECT_EQ(histogram.min(), 3);
+  EXPECT_EQ(histogram.max(), 40);
+  EXPECT_EQ(histogram.sum(), 55);
+}
+
+TEST(LogHistogramTest, FindsQuantilesByRoundingTheRankUp) {
+  LogHistogram histogram = SmallHistogram();
+  EXPECT_EQ(histogram.ValueAtQuantile(0.5), 0);
+  for (int64_t value = 1; value <= 10; value++) {
+    histogram.Record(value);
+  }
+  // The rank is ceil(quantile * count), and at least 1.
+  EXPECT_EQ(histogram.ValueAtQuantile(0), 1);
+  EXPECT_EQ(histogram.ValueAtQuantile(0.5), 5);
+  EXPECT_EQ(histogram.ValueAtQuantile(0.51), 6);
+  // 8 and 9 share a bucket, so the 9th value is reported as its top.
+  EXPECT_EQ(histogram.ValueAtQuantile(0.8), 9);
+  EXPECT_EQ(histogram.ValueAtQuantile(0.9), 9);
+  // The bucket of 10 reaches 11, but nothing above 10 was recorded.
+  EXPECT_EQ(histogram.ValueAtQuantile(0.95), 10);
+  EXPECT_EQ(histogram.ValueAtQuantile(1), 10);
+  EXPECT_EQ(histogram.ValueAtQuantile(2), 10);
+  EXPECT_EQ(histogram.ValueAtQuantile(-1), 1);
+}
+
+TEST(LogHistogramTest, AddsHistograms) {
+  LogHistogram total = SmallHistogram();
+  LogHistogram empty = SmallHistogram();
+  LogHistogram first = SmallHistogram();
+  first.Record(5);
+  first.Record(17);
+  LogHistogram second = SmallHistogram();
+  second.Record(2);
+  second.Record(16);
+
+  total.Add(empty);
+  EXPECT_EQ(total.count(), 0);
+  total.Add(first);
+  EXPECT_EQ(total.min(), 5);
+  total.Add(second);
+  total.Add(empty);
+  EXPECT_EQ(BucketsOf(total), (Buckets{{2, 1}, {5, 1}, {16, 2}}));
+  EXPECT_EQ(total.count(), 4);
+  EXPECT_EQ(total.min(), 2);
+  EXPECT_EQ(total.max(), 17);
+  EXPECT_EQ(total.sum(), 40);
+}
+
+}  // namespace
@@ -0,0 +1,419 @@
+// Measures how much tracing slows down scheduling-heavy work. Two threads
+// bounce a byte back and forth over pipes, on one CPU so that every hop is
+// a context switch, and on two CPUs so that every hop wakes a thread on
+// another CPU. The ping-pong runs without tracing, under the trace collector
+// with each event enabled on its own, and under it with the whole event
+// set. The collector is run as it is in production, tracing the ping-pong
+// as its command, so that it configures FTrace through its own flags and
+// its draining competes for the CPUs too.
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "util/status.h"
+
+ABSL_FLAG(std::string, trace, "",
+          "Path to the trace collector. Defaults to the trace binary next to "
+          "this one");
+ABSL_FLAG(std::vector<std::string>, events,
+          std::vector<std::string>({
+              "sched:sched_switch",
+              "sched:sched_wakeup",
+              "sched:sched_wakeup_new",
+              "sched:sched_migrate_task",
+          }),
+          "The event set to measure, as the collector's --events. Each event "
+          "is also measured on its own");
+ABSL_FLAG(std::vector<std::string>, collector_flags, {},
+          "Flags to run the collector with, e.g. "
+          "--kernel_trace_root=/sys/kernel/tracing,--buffer_size=8192");
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(2),
+          "How long each ping-pong runs for");
+ABSL_FLAG(int, repeats, 3,
+          "How many times each ping-pong is run per configuration. The "
+          "median is reported");
+ABSL_FLAG(double, max_overhead_percent, 0,
+          "Exit with status 1 if the whole event set slows either ping-pong "
+          "down by more than this percentage. 0 disables the check");
+ABSL_FLAG(std::string, worker, "",
+          "Internal: run the 'switch' or 'wakeup' ping-pong and write its "
+          "result to --result_file, instead of benchmarking");
+ABSL_FLAG(std::string, result_file, "",
+          "Internal: where --worker writes its result");
+
+/**
+ * How many round trips the ping-pong makes between looks at the clock.
+ */
+static constexpr int64_t kClockCheckTrips = 256;
+
+/**
+ * Events per round trip below which an event is taken not to be part of the
+ * ping-pong, but of starting it, and gets no cost per event.
+ */
+static constexpr double kMinEventsPerTrip = 0.01;
+
+/**
+ * What one run of a ping-pong did.
+ */
+struct Result {
+  // Round trips, and how long they took.
+  int64_t trips = 0;
+  absl::Duration elapsed;
+  // Events the collector drained while tracing it, or 0 if untraced.
+  int64_t events = 0;
+};
+
+/**
+ * Pins the calling thread to a CPU.
+ * @return Whether it could be.
+ */
+static bool PinToCPU(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+/**
+ * Bounces a byte between this thread and another one for a while.
+ * @param cross_cpu Whether the threads run on different CPUs, or on the same
+ *                  one.
+ * @param duration How long to keep it up for.
+ * @param result Set to the round trips made.
+ * @return Status if successful or not.
+ */
+static Status RunPingPong(bool cross_cpu, absl::Duration duration,
+                          Result* result) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return Status::InternalError("Unable to read the CPU affinity");
+  }
+  const int ping_cpu = sched_getcpu();
+  int pong_cpu = ping_cpu;
+  for (int cpu = 0; cross_cpu && cpu < CPU_SETSIZE; cpu++) {
+    if (cpu != ping_cpu && CPU_ISSET(cpu, &allowed)) {
+      pong_cpu = cpu;
+      break;
+    }
+  }
+
+  int ping[2];
+  int pong[2];
+  if (pipe2(ping, O_CLOEXEC) != 0) {
+    return Status::InternalError("Unable to create pipe");
+  }
+  if (pipe2(pong, O_CLOEXEC) != 0) {
+    close(ping[0]);
+    close(ping[1]);
+    return Status::InternalError("Unable to create pipe");
+  }
+  if (!PinToCPU(ping_cpu)) {
+    std::cerr << "WARNING: Unable to pin to cpu" << ping_cpu << std::endl;
+  }
+  std::thread ponger([&] {
+    PinToCPU(pong_cpu);
+    char byte;
+    // Ends once the pinging end is closed.
+    while (read(ping[0], &byte, 1) == 1 && write(pong[1], &byte, 1) == 1) {
+    }
+  });
+
+  Status status;
+  const auto& start = absl::Now();
+  const auto& end = start + duration;
+  int64_t trips = 0;
+  char byte = 0;
+  while (status.ok()) {
+    for (int i = 0; i < kClockCheckTrips; i++) {
+      if (write(ping[1], &byte, 1) != 1 || read(pong[0], &byte, 1) != 1) {
+        status = Status::InternalError(
+            absl::StrCat("Unable to ping-pong: ", strerror(errno)));
+        break;
+      }
+    }
+    trips += kClockCheckTrips;
+    if (absl::Now() >= end) {
+      break;
+    }
+  }
+  result->trips = trips;
+  result->elapsed = absl::Now() - start;
+  close(ping[1]);
+  ponger.join();
+  close(ping[0]);
+  close(pong[0]);
+  close(pong[1]);
+  return status;
+}
+
+/**
+ * Runs a command and waits for it, with its stdout discarded.
+ * @return Status if successful or not. Fails if it didn't exit with 0.
+ */
+static Status RunCommand(const std::vector<std::string>& command) {
+  std::vector<char*> argv;
+  for (const auto& arg : command) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+  const pid_t pid = fork();
+  if (pid == -1) {
+    return Status::InternalError("Unable to fork");
+  }
+  if (pid == 0) {
+    const int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd != -1) {
+      dup2(null_fd, STDOUT_FILENO);
+    }
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  int wait_status;
+  if (waitpid(pid, &wait_status, 0) != pid) {
+    return Status::InternalError("Unable to wait for the benchmark");
+  }
+  if (!WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 0) {
+    return Status::InternalError(
+        absl::StrCat(absl::StrJoin(command, " "), " failed"));
+  }
+  return Status::OkStatus();
+}
+
+/**
+ * @param archive A trace archive.
+ * @return The events drained into it, from its metadata, or -1 if unknown.
+ */
+static int64_t ArchivedEvents(const std::filesystem::path& archive) {
+  const auto& command =
+      absl::StrCat("tar -xzOf ", archive.string(), " metadata.textproto");
+  FILE* metadata = popen(command.c_str(), "r");
+  if (metadata == nullptr) {
+    return -1;
+  }
+  int64_t events = -1;
+  char line[256];
+  while (fgets(line, sizeof(line), metadata) != nullptr) {
+    absl::string_view text(line);
+    if (absl::ConsumePrefix(&text, "events_drained: ")) {
+      (void)absl::SimpleAtoi(absl::StripTrailingAsciiWhitespace(text),
+                             &events);
+    }
+  }
+  pclose(metadata);
+  return events;
+}
+
+/**
+ * Runs a ping-pong in a process of its own, traced by the collector unless
+ * there are no events.
+ * @param benchmark 'switch' or 'wakeup'.
+ * @param events The events to trace, or empty to not trace.
+ * @param result Set to what the run did.
+ * @return Status if successful or not.
+ */
+static Status RunTraced(const std::string& benchmark,
+                        const std::vector<std::string>& events,
+                        Result* result) {
+  char dir_template[] = "/tmp/overhead_XXXXXX";
+  if (mkdtemp(dir_template) == nullptr) {
+    return Status::InternalError("Unable to create temporary directory.");
+  }
+  const std::filesystem::path dir(dir_template);
+  const auto& result_path = dir / "result";
+
+  std::vector<std::string> command;
+  if (!events.empty()) {
+    auto trace = std::filesystem::path(absl::GetFlag(FLAGS_trace));
+    if (trace.empty()) {
+      trace = std::filesystem::read_symlink("/proc/self/exe").parent_path() /
+              "trace";
+    }
+    command = {trace.string(), absl::StrCat("--out=", dir.string()),
+               absl::StrCat("--events=", absl::StrJoin(events, ","))};
+    for (const auto& flag : absl::GetFlag(FLAGS_collector_flags)) {
+      command.push_back(flag);
+    }
+    command.push_back("--");
+  }
+  command.push_back(std::filesystem::read_symlink("/proc/self/exe").string());
+  command.push_back(absl::StrCat("--worker=", benchmark));
+  command.push_back(absl::StrCat(
+      "--duration=", absl::FormatDuration(absl::GetFlag(FLAGS_duration))));
+  command.push_back(absl::StrCat("--result_file=", result_path.string()));
+
+  auto status = RunCommand(command);
+  if (status.ok()) {
+    std::ifstream file(result_path);
+    int64_t elapsed_ns;
+    if (file >> result->trips >> elapsed_ns) {
+      result->elapsed = absl::Nanoseconds(elapsed_ns);
+    } else {
+      status = Status::InternalError("The benchmark wrote no result");
+    }
+  }
+  if (status.ok() && !events.empty()) {
+    result->events = ArchivedEvents(dir / "trace.tar.gz");
+    if (result->events < 0) {
+      status = Status::InternalError("Unable to read the trace's metadata");
+    }
+  }
+  std::error_code error;
+  std::filesystem::remove_all(dir, error);
+  return status;
+}
+
+/**
+ * @return The time a round trip took.
+ */
+static double TripNanoseconds(const Result& result) {
+  return absl::ToDoubleNanoseconds(result.elapsed) /
+         std::max<int64_t>(result.trips, 1);
+}
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  const auto& worker = absl::GetFlag(FLAGS_worker);
+  if (!worker.empty()) {
+    if (worker != "switch" && worker != "wakeup") {
+      std::cerr << "--worker must be 'switch' or 'wakeup'" << std::endl;
+      return 1;
+    }
+    Result result;
+    const auto& status = RunPingPong(worker == "wakeup",
+                                     absl::GetFlag(FLAGS_duration), &result);
+    if (!status.ok()) {
+      std::cerr << status.message() << std::endl;
+      return 1;
+    }
+    std::ofstream file(absl::GetFlag(FLAGS_result_file));
+    file << result.trips << " " << absl::ToInt64Nanoseconds(result.elapsed)
+         << std::endl;
+    return file ? 0 : 1;
+  }
+
+  const auto& events = absl::GetFlag(FLAGS_events);
+  const int repeats = absl::GetFlag(FLAGS_repeats);
+  if (events.empty() || repeats <= 0 ||
+      absl::GetFlag(FLAGS_duration) < absl::Seconds(1) ||
+      absl::GetFlag(FLAGS_max_overhead_percent) < 0) {
+    std::cerr << "--events must not be empty, --repeats must be greater than "
+                 "zero, --duration at least 1s and --max_overhead_percent not "
+                 "negative"
+              << std::endl;
+    return 1;
+  }
+  if (geteuid() != 0) {
+    std::cerr << "The benchmark runs the trace collector, so it must be run "
+                 "as root"
+              << std::endl;
+    return 1;
+  }
+
+  if (cpu_set_t allowed; sched_getaffinity(0, sizeof(allowed), &allowed) ==
+                              0 &&
+                          CPU_COUNT(&allowed) < 2) {
+    std::cerr << "WARNING: Only one CPU is available; the wakeup ping-pong "
+                 "runs on one CPU"
+              << std::endl;
+  }
+
+  // Untraced first, as the baseline.
+  std::vector<std::vector<std::string>> configurations = {{}};
+  for (const auto& event : events) {
+    configurations.push_back({event});
+  }
+  if (events.size() > 1) {
+    configurations.push_back(events);
+  }
+
+  std::cout << std::left << std::setw(32) << "events" << std::setw(8)
+            << "bench" << std::right << std::setw(10) << "ns/trip"
+            << std::setw(12) << "trips/s" << std::setw(11) << "overhead%"
+            << std::setw(13) << "events/trip" << std::setw(11) << "ns/event"
+            << std::endl;
+  double worst_overhead = 0;
+  for (const std::string benchmark : {"switch", "wakeup"}) {
+    double baseline = 0;
+    for (const auto& configuration : configurations) {
+      std::vector<Result> results(repeats);
+      for (auto& result : results) {
+        const auto& status = RunTraced(benchmark, configuration, &result);
+        if (!status.ok()) {
+          std::cerr << status.message() << std::endl;
+          return 1;
+        }
+      }
+      std::sort(results.begin(), results.end(),
+                [](const Result& a, const Result& b) {
+                  return TripNanoseconds(a) < TripNanoseconds(b);
+                });
+      const Result& median = results[repeats / 2];
+      const double trip_ns = TripNanoseconds(median);
+      std::string name = "(untraced)";
+      if (configuration.size() == 1) {
+        name = configuration[0];
+      } else if (!configuration.empty()) {
+        name = absl::StrCat("(all ", configuration.size(), " events)");
+      }
+      std::cout << std::left << std::setw(32) << name << std::setw(8)
+                << benchmark << std::right << std::fixed
+                << std::setprecision(1) << std::setw(10) << trip_ns
+                << std::setprecision(0) << std::setw(12) << 1e9 / trip_ns;
+      if (configuration.empty()) {
+        baseline = trip_ns;
+        std::cout << std::endl;
+        continue;
+      }
+      // The traced events are those of the ping-pong, so the slowdown of a
+      // trip is spread over the events it recorded.
+      const double overhead = 100 * (trip_ns - baseline) / baseline;
+      const double events_per_trip =
+          static_cast<double>(median.events) / median.trips;
+      std::cout << std::setprecision(1) << std::setw(11) << overhead
+                << std::setprecision(2) << std::setw(13) << events_per_trip
+                << std::setprecision(1) << std::setw(11);
+      if (events_per_trip >= kMinEventsPerTrip) {
+        std::cout << (trip_ns - baseline) / events_per_trip;
+      } else {
+        std::cout << "-";
+      }
+      std::cout << std::endl;
+      if (configuration.size() == events.size()) {
+        worst_overhead = std::max(worst_overhead, overhead);
+      }
+    }
+  }
+
+  const double max_overhead = absl::GetFlag(FLAGS_max_overhead_percent);
+  if (max_overhead > 0 && worst_overhead > max_overhead) {
+    std::cerr << "Tracing slowed the ping-pong down by " << worst_overhead
+              << "%, more than --max_overhead_percent=" << max_overhead
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
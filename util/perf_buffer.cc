@@ -0,0 +1,238 @@
+#include "util/perf_buffer.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+
+namespace {
+
+int PerfEventOpen(perf_event_attr* attr, int cpu) {
+  return syscall(__NR_perf_event_open, attr, /*pid=*/-1, cpu,
+                 /*group_fd=*/-1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * The deepest kernel stack a sample records.
+ */
+constexpr uint16_t kMaxCallchainDepth = 64;
+
+/**
+ * Reads the next field of a sample.
+ * @return Whether the field fit in the sample.
+ */
+template <typename T>
+bool ReadSampleField(const char* record, size_t size, size_t* pos, T* value) {
+  if (size - *pos < sizeof(T)) {
+    return false;
+  }
+  memcpy(value, record + *pos, sizeof(T));
+  *pos += sizeof(T);
+  return true;
+}
+
+/**
+ * Layout of a PERF_RECORD_LOST, after its header: a u64 id and a u64 count.
+ */
+constexpr size_t kLostCountOffset =
+    sizeof(perf_event_header) + sizeof(uint64_t);
+
+}  // namespace
+
+Status PerfCPUBuffer::Open(int cpu, const std::vector<uint64_t>& tracepoint_ids,
+                           size_t buffer_bytes, int clockid,
+                           const std::vector<uint64_t>& callchain_tracepoint_ids,
+                           std::unique_ptr<PerfCPUBuffer>* buffer) {
+  if (tracepoint_ids.empty()) {
+    return Status::InternalError("No tracepoints to open");
+  }
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t data_pages = 1;
+  while (data_pages * 2 * page_size <= buffer_bytes) {
+    data_pages *= 2;
+  }
+
+  std::unique_ptr<PerfCPUBuffer> opened(new PerfCPUBuffer());
+  opened->data_size_ = data_pages * page_size;
+  opened->mapping_size_ = page_size + opened->data_size_;
+  opened->identified_ = !callchain_tracepoint_ids.empty();
+  for (const auto& id : tracepoint_ids) {
+    const bool callchain =
+        std::find(callchain_tracepoint_ids.begin(),
+                  callchain_tracepoint_ids.end(),
+                  id) != callchain_tracepoint_ids.end();
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.sample_period = 1;
+    attr.sample_type = PERF_SAMPLE_TIME | PERF_SAMPLE_RAW;
+    if (opened->identified_) {
+      attr.sample_type |= PERF_SAMPLE_IDENTIFIER;
+    }
+    if (callchain) {
+      attr.sample_type |= PERF_SAMPLE_CALLCHAIN;
+      attr.exclude_callchain_user = 1;
+      attr.sample_max_stack = kMaxCallchainDepth;
+    }
+    if (clockid != -1) {
+      attr.use_clockid = 1;
+      attr.clockid = clockid;
+    }
+    attr.disabled = 1;
+    // Only wake pollers once the buffer is half full.
+    attr.watermark = 1;
+    attr.wakeup_watermark = opened->data_size_ / 2;
+    const int fd = PerfEventOpen(&attr, cpu);
+    if (fd < 0) {
+      return Status::InternalError(absl::StrCat(
+          "perf_event_open failed for tracepoint ", id, " on cpu", cpu, ": ",
+          strerror(errno)));
+    }
+    opened->fds_.push_back(fd);
+    if (callchain) {
+      uint64_t event_id;
+      if (ioctl(fd, PERF_EVENT_IOC_ID, &event_id) != 0) {
+        return Status::InternalError(absl::StrCat(
+            "Unable to read the ID of tracepoint ", id, " on cpu", cpu, ": ",
+            strerror(errno)));
+      }
+      opened->callchain_event_ids_.insert(event_id);
+    }
+
+    // The first tracepoint owns the buffer; the rest are redirected to it,
+    // which requires it to be mapped already.
+    if (opened->fds_.size() == 1) {
+      void* mapping = mmap(nullptr, opened->mapping_size_,
+                           PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mapping == MAP_FAILED) {
+        return Status::InternalError(absl::StrCat(
+            "Unable to map perf buffer of cpu", cpu, ": ", strerror(errno)));
+      }
+      opened->mapping_ = mapping;
+    } else if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, opened->fds_.front()) !=
+               0) {
+      return Status::InternalError(absl::StrCat(
+          "Unable to redirect tracepoint ", id, " on cpu", cpu, ": ",
+          strerror(errno)));
+    }
+  }
+  *buffer = std::move(opened);
+  return Status::OkStatus();
+}
+
+PerfCPUBuffer::~PerfCPUBuffer() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+  for (const auto& fd : fds_) {
+    close(fd);
+  }
+}
+
+Status PerfCPUBuffer::SetEnabled(bool enable) {
+  for (const auto& fd : fds_) {
+    if (ioctl(fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE,
+              0) != 0) {
+      return Status::InternalError(
+          absl::StrCat("Unable to ", enable ? "enable" : "disable",
+                       " perf event: ", strerror(errno)));
+    }
+  }
+  return Status::OkStatus();
+}
+
+uint64_t PerfCPUBuffer::Drain(
+    const std::function<void(uint64_t timestamp, const char* data,
+                             uint32_t length, const uint64_t* callchain,
+                             size_t callchain_depth)>& callback) {
+  auto* metadata = static_cast<perf_event_mmap_page*>(mapping_);
+  const char* data =
+      static_cast<const char*>(mapping_) + (mapping_size_ - data_size_);
+  // Pairs with the kernel's release of data_head: records before it are
+  // fully written.
+  const uint64_t head =
+      __atomic_load_n(&metadata->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = metadata->data_tail;
+  uint64_t samples = 0;
+
+  while (tail < head) {
+    const size_t offset = tail % data_size_;
+    perf_event_header header;
+    if (offset + sizeof(header) <= data_size_) {
+      memcpy(&header, data + offset, sizeof(header));
+    } else {
+      const size_t first = data_size_ - offset;
+      memcpy(&header, data + offset, first);
+      memcpy(reinterpret_cast<char*>(&header) + first, data,
+             sizeof(header) - first);
+    }
+    if (header.size < sizeof(header) || tail + header.size > head) {
+      break;
+    }
+
+    // Records are contiguous unless they wrap around the end of the buffer.
+    const char* record = data + offset;
+    if (offset + header.size > data_size_) {
+      const size_t first = data_size_ - offset;
+      wrapped_.assign(data + offset, first);
+      wrapped_.append(data, header.size - first);
+      record = wrapped_.data();
+    }
+
+    if (header.type == PERF_RECORD_SAMPLE) {
+      // The fields follow in the order of their sample_type bits: identifier,
+      // time, callchain and raw data.
+      size_t pos = sizeof(header);
+      uint64_t event_id = 0;
+      uint64_t timestamp;
+      uint32_t raw_size;
+      bool valid =
+          (!identified_ ||
+           ReadSampleField(record, header.size, &pos, &event_id)) &&
+          ReadSampleField(record, header.size, &pos, &timestamp);
+      callchain_.clear();
+      if (valid && identified_ && callchain_event_ids_.count(event_id) > 0) {
+        uint64_t depth;
+        valid = ReadSampleField(record, header.size, &pos, &depth) &&
+                depth <= (header.size - pos) / sizeof(uint64_t);
+        for (uint64_t i = 0; valid && i < depth; i++) {
+          uint64_t ip;
+          ReadSampleField(record, header.size, &pos, &ip);
+          // Skip the markers of where the kernel and user stacks start.
+          if (ip < PERF_CONTEXT_MAX) {
+            callchain_.push_back(ip);
+          }
+        }
+      }
+      valid = valid && ReadSampleField(record, header.size, &pos, &raw_size) &&
+              raw_size <= header.size - pos;
+      if (valid) {
+        callback(timestamp, record + pos, raw_size, callchain_.data(),
+                 callchain_.size());
+        samples++;
+      }
+    } else if (header.type == PERF_RECORD_LOST &&
+               header.size >= kLostCountOffset + sizeof(uint64_t)) {
+      uint64_t lost;
+      memcpy(&lost, record + kLostCountOffset, sizeof(lost));
+      lost_ += lost;
+    }
+    tail += header.size;
+  }
+
+  // Hands the consumed space back to the kernel once we're done reading it.
+  __atomic_store_n(&metadata->data_tail, tail, __ATOMIC_RELEASE);
+  return samples;
+}
@@ -0,0 +1,104 @@
+#ifndef SCHEDVIZ_UTIL_PERF_BUFFER_H_
+#define SCHEDVIZ_UTIL_PERF_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "util/status.h"
+
+/**
+ * The perf_event_open ring buffer of a single CPU, receiving samples of a set
+ * of tracepoints.
+ *
+ * The buffer is mapped into our address space and read without copying
+ * syscalls: the kernel advances data_head as it writes, and we advance
+ * data_tail as we consume.
+ */
+class PerfCPUBuffer {
+ public:
+  /**
+   * Opens the tracepoints on a CPU and maps their shared ring buffer.
+   * @param cpu The CPU to sample.
+   * @param tracepoint_ids The IDs of the tracepoints, from their FTrace id
+   *                       files.
+   * @param buffer_bytes Size of the ring buffer. Rounded down to a power of
+   *                     two number of pages.
+   * @param clockid The clock to timestamp samples with, or -1 for perf's
+   *                default clock.
+   * @param callchain_tracepoint_ids The IDs of the tracepoints whose samples
+   *                                 also record the kernel stack.
+   * @param buffer Set to the opened buffer on success. Sampling starts
+   *               disabled.
+   * @return Status if successful or not.
+   */
+  static Status Open(int cpu, const std::vector<uint64_t>& tracepoint_ids,
+                     size_t buffer_bytes, int clockid,
+                     const std::vector<uint64_t>& callchain_tracepoint_ids,
+                     std::unique_ptr<PerfCPUBuffer>* buffer);
+
+  ~PerfCPUBuffer();
+
+  PerfCPUBuffer(const PerfCPUBuffer&) = delete;
+  PerfCPUBuffer& operator=(const PerfCPUBuffer&) = delete;
+
+  /**
+   * Starts or stops sampling the tracepoints.
+   * @param enable Whether to start or stop.
+   * @return Status if successful or not.
+   */
+  Status SetEnabled(bool enable);
+
+  /**
+   * Consumes every sample written since the last call.
+   * @param callback Called with the timestamp, raw tracepoint data and its
+   *                 length of each sample, in the order they were written.
+   *                 The raw data starts with the event's format ID, as in
+   *                 FTrace records. Samples of tracepoints that record the
+   *                 kernel stack come with its return addresses, innermost
+   *                 first; others with none.
+   * @return The number of samples consumed.
+   */
+  uint64_t Drain(const std::function<void(
+                     uint64_t timestamp, const char* data, uint32_t length,
+                     const uint64_t* callchain, size_t callchain_depth)>&
+                     callback);
+
+  /**
+   * @return A file descriptor that polls readable once the buffer is half
+   *         full.
+   */
+  int fd() const { return fds_.front(); }
+
+  /**
+   * @return The number of samples the kernel dropped because the buffer was
+   *         full.
+   */
+  uint64_t lost() const { return lost_; }
+
+ private:
+  PerfCPUBuffer() = default;
+
+  // One file descriptor per tracepoint. All of them write to the buffer
+  // mapped through the first one.
+  std::vector<int> fds_;
+  // The mapping: one metadata page followed by data_size_ bytes of data.
+  void* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  size_t data_size_ = 0;
+  uint64_t lost_ = 0;
+  // Whether samples start with the ID of their event, which tells the
+  // samples with a callchain apart. Only if some tracepoints record one.
+  bool identified_ = false;
+  std::unordered_set<uint64_t> callchain_event_ids_;
+  // The kernel stack of the sample being handed out.
+  std::vector<uint64_t> callchain_;
+  // Reassembles samples that wrap around the end of the buffer.
+  std::string wrapped_;
+};
+
+#endif  // SCHEDVIZ_UTIL_PERF_BUFFER_H_
@@ -0,0 +1,267 @@
+#include "util/ring_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "util/event_format.h"
+
+namespace {
+
+// Ring buffer record types. See include/linux/ring_buffer.h.
+constexpr uint32_t kTypeDataTypeLenMax = 28;
+constexpr uint32_t kTypePadding = 29;
+constexpr uint32_t kTypeTimeExtend = 30;
+constexpr uint32_t kTypeTimeStamp = 31;
+
+constexpr uint32_t kTypeLenBits = 5;
+constexpr uint32_t kTimeDeltaBits = 27;
+constexpr uint32_t kRecordHeaderSize = 4;
+// Time deltas that don't fit in a record header need a time extend record.
+constexpr uint64_t kMaxTimeDelta = (1 << kTimeDeltaBits) - 1;
+// The commit field also holds flags (e.g. missed events) in its upper bits.
+constexpr uint64_t kCommitSizeMask = 0xfffff;
+// Set when events were dropped before the page. See RB_MISSED_EVENTS.
+constexpr uint64_t kMissedEvents = uint64_t{1} << 31;
+
+uint32_t ReadU32(const char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint64_t ReadU64(const char* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+}  // namespace
+
+Status PageHeaderFormat::Parse(const std::string& header_page,
+                               PageHeaderFormat* format) {
+  PageHeaderFormat parsed;
+  bool found_commit = false;
+  bool found_data = false;
+  for (const auto& field : ParseFormatFields(header_page)) {
+    if (field.name == "timestamp") {
+      parsed.timestamp_offset = field.offset;
+    } else if (field.name == "commit") {
+      parsed.commit_offset = field.offset;
+      parsed.commit_size = field.size;
+      found_commit = true;
+    } else if (field.name == "data") {
+      parsed.data_offset = field.offset;
+      parsed.data_size = field.size;
+      found_data = true;
+    }
+  }
+  if (!found_commit || !found_data) {
+    return Status::InternalError(
+        "header_page is missing the commit or data field");
+  }
+  if (parsed.commit_size != 4 && parsed.commit_size != 8) {
+    return Status::InternalError(absl::StrCat(
+        "Unsupported header_page commit size: ", parsed.commit_size));
+  }
+  *format = parsed;
+  return Status::OkStatus();
+}
+
+uint64_t ForEachRecord(const PageHeaderFormat& format, const char* pages,
+                       size_t length,
+                       const std::function<bool(const RingBufferRecord&)>&
+                           callback) {
+  uint64_t count = 0;
+  const size_t page_size = format.page_size();
+  for (size_t page_start = 0; page_start + format.data_offset <= length;
+       page_start += page_size) {
+    const char* page = pages + page_start;
+    uint64_t timestamp = ReadU64(page + format.timestamp_offset);
+    uint64_t commit = format.commit_size == 8
+                          ? ReadU64(page + format.commit_offset)
+                          : ReadU32(page + format.commit_offset);
+    size_t data_size = commit & kCommitSizeMask;
+    // Never walk past the bytes we were actually given.
+    if (data_size > format.data_size) {
+      data_size = format.data_size;
+    }
+    if (page_start + format.data_offset + data_size > length) {
+      data_size = length - page_start - format.data_offset;
+    }
+
+    const char* data = page + format.data_offset;
+    size_t pos = 0;
+    while (pos + kRecordHeaderSize <= data_size) {
+      const uint32_t header = ReadU32(data + pos);
+      const uint32_t type_len = header & ((1 << kTypeLenBits) - 1);
+      const uint32_t time_delta = header >> kTypeLenBits;
+      const char* array = data + pos + kRecordHeaderSize;
+      const size_t remaining = data_size - pos - kRecordHeaderSize;
+
+      if (type_len == kTypeTimeExtend || type_len == kTypeTimeStamp) {
+        if (remaining < 4) {
+          break;
+        }
+        const uint64_t value =
+            (static_cast<uint64_t>(ReadU32(array)) << kTimeDeltaBits) +
+            time_delta;
+        timestamp = type_len == kTypeTimeExtend ? timestamp + value : value;
+        pos += kRecordHeaderSize + 4;
+        continue;
+      }
+      if (type_len == kTypePadding) {
+        // Padding without a time delta fills the rest of the page.
+        if (time_delta == 0 || remaining < 4) {
+          break;
+        }
+        pos += kRecordHeaderSize + ReadU32(array);
+        continue;
+      }
+
+      // Data record.
+      const char* payload;
+      uint32_t payload_length;
+      size_t record_length;
+      if (type_len == 0) {
+        if (remaining < 4) {
+          break;
+        }
+        // array[0] holds the length, including itself.
+        record_length = ReadU32(array);
+        if (record_length < 4) {
+          break;
+        }
+        payload = array + 4;
+        payload_length = record_length - 4;
+      } else if (type_len <= kTypeDataTypeLenMax) {
+        record_length = type_len << 2;
+        payload = array;
+        payload_length = record_length;
+      } else {
+        break;
+      }
+      if (record_length > remaining) {
+        break;
+      }
+      timestamp += time_delta;
+      count++;
+      if (!callback({timestamp, payload, payload_length})) {
+        return count;
+      }
+      pos += kRecordHeaderSize + record_length;
+    }
+  }
+  return count;
+}
+
+uint64_t CountRecords(const PageHeaderFormat& format, const char* pages,
+                      size_t length) {
+  return ForEachRecord(format, pages, length,
+                       [](const RingBufferRecord&) { return true; });
+}
+
+void RewritePages(
+    const PageHeaderFormat& format, const char* pages, size_t length,
+    const std::function<RingBufferRecord(const RingBufferRecord&)>& rewrite,
+    PageWriter* writer, std::string* out) {
+  const size_t page_size = format.page_size();
+  for (size_t page_start = 0; page_start + format.data_offset <= length;
+       page_start += page_size) {
+    const char* page = pages + page_start;
+    const uint64_t commit = format.commit_size == 8
+                                ? ReadU64(page + format.commit_offset)
+                                : ReadU32(page + format.commit_offset);
+    if (commit & kMissedEvents) {
+      writer->MarkMissedEvents(out);
+    }
+    ForEachRecord(format, page, std::min(page_size, length - page_start),
+                  [&](const RingBufferRecord& record) {
+                    const auto& rewritten = rewrite(record);
+                    if (rewritten.length > 0) {
+                      writer->Append(rewritten.timestamp, rewritten.data,
+                                     rewritten.length, out);
+                    }
+                    return true;
+                  });
+  }
+  writer->Flush(out);
+}
+
+PageWriter::PageWriter(const PageHeaderFormat& format)
+    : format_(format), page_(format.page_size(), '\0') {}
+
+bool PageWriter::Append(uint64_t timestamp, const char* data, uint32_t length,
+                        std::string* pages) {
+  // Payloads are padded to a multiple of four bytes. Large ones store their
+  // length in array[0] rather than in type_len.
+  const uint32_t padded_length = (length + 3) & ~3u;
+  const bool small = padded_length <= kTypeDataTypeLenMax << 2;
+  const size_t record_size =
+      kRecordHeaderSize + (small ? 0 : 4) + padded_length;
+  if (record_size > format_.data_size) {
+    return false;
+  }
+
+  timestamp = std::max(timestamp, last_timestamp_);
+  uint64_t delta = timestamp - last_timestamp_;
+  size_t extend_size = delta > kMaxTimeDelta ? 8 : 0;
+  if (used_ > 0 && used_ + extend_size + record_size > format_.data_size) {
+    Flush(pages);
+  }
+  if (used_ == 0) {
+    // A fresh page carries the record's timestamp in its header.
+    memcpy(&page_[format_.timestamp_offset], &timestamp, sizeof(timestamp));
+    delta = 0;
+    extend_size = 0;
+  }
+  if (extend_size > 0) {
+    WriteWord(kTypeTimeExtend | static_cast<uint32_t>(
+                                    (delta & kMaxTimeDelta) << kTypeLenBits));
+    WriteWord(static_cast<uint32_t>(delta >> kTimeDeltaBits));
+    delta = 0;
+  }
+  const uint32_t time_delta = static_cast<uint32_t>(delta) << kTypeLenBits;
+  if (small) {
+    WriteWord((padded_length >> 2) | time_delta);
+  } else {
+    WriteWord(time_delta);
+    // array[0] holds the length, including itself.
+    WriteWord(padded_length + 4);
+  }
+  memcpy(&page_[format_.data_offset + used_], data, length);
+  memset(&page_[format_.data_offset + used_ + length], 0,
+         padded_length - length);
+  used_ += padded_length;
+  last_timestamp_ = timestamp;
+  return true;
+}
+
+void PageWriter::Flush(std::string* pages) {
+  if (used_ == 0) {
+    return;
+  }
+  const uint64_t commit = used_ | (missed_events_ ? kMissedEvents : 0);
+  if (format_.commit_size == 8) {
+    memcpy(&page_[format_.commit_offset], &commit, 8);
+  } else {
+    const uint32_t commit32 = static_cast<uint32_t>(commit);
+    memcpy(&page_[format_.commit_offset], &commit32, 4);
+  }
+  // Leave no stale data from earlier pages behind the commit.
+  memset(&page_[format_.data_offset + used_], 0, format_.data_size - used_);
+  pages->append(page_);
+  used_ = 0;
+  missed_events_ = false;
+}
+
+void PageWriter::MarkMissedEvents(std::string* pages) {
+  Flush(pages);
+  missed_events_ = true;
+}
+
+void PageWriter::WriteWord(uint32_t word) {
+  memcpy(&page_[format_.data_offset + used_], &word, sizeof(word));
+  used_ += sizeof(word);
+}
@@ -0,0 +1,153 @@
+#ifndef SCHEDVIZ_UTIL_RING_BUFFER_H_
+#define SCHEDVIZ_UTIL_RING_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "util/status.h"
+
+/**
+ * Layout of a single FTrace ring buffer page, as described by the
+ * events/header_page file.
+ */
+struct PageHeaderFormat {
+  size_t timestamp_offset = 0;
+  size_t commit_offset = 8;
+  size_t commit_size = 8;
+  size_t data_offset = 16;
+  size_t data_size = 4080;
+
+  /**
+   * Parses the contents of an events/header_page file.
+   * @param header_page The contents of the header_page file.
+   * @param format The parsed format. Only written to on success.
+   * @return Status if successful or not.
+   */
+  static Status Parse(const std::string& header_page, PageHeaderFormat* format);
+
+  /**
+   * @return The total size in bytes of a page, including its header.
+   */
+  size_t page_size() const { return data_offset + data_size; }
+};
+
+/**
+ * A single data record read from a ring buffer page.
+ */
+struct RingBufferRecord {
+  // Absolute timestamp of the record in trace clock units.
+  uint64_t timestamp;
+  // Pointer to the record's payload. The first two bytes are the event's
+  // format ID.
+  const char* data;
+  // Length of the payload in bytes.
+  uint32_t length;
+};
+
+/**
+ * Walks the data records on the raw ring buffer pages read from a
+ * per_cpu/cpuN/trace_pipe_raw file. Non-data records (padding, time extends
+ * and absolute timestamps) are consumed internally to keep the timestamps of
+ * the returned records correct.
+ * @param format The layout of the pages.
+ * @param pages One or more whole pages, back to back.
+ * @param length The number of bytes in pages.
+ * @param callback Called once per data record in the order they appear. If
+ *                 the callback returns false, walking stops.
+ * @return The number of data records visited.
+ */
+uint64_t ForEachRecord(const PageHeaderFormat& format, const char* pages,
+                       size_t length,
+                       const std::function<bool(const RingBufferRecord&)>&
+                           callback);
+
+/**
+ * Counts the data records on the given pages.
+ * @param format The layout of the pages.
+ * @param pages One or more whole pages, back to back.
+ * @param length The number of bytes in pages.
+ * @return The number of data records found.
+ */
+uint64_t CountRecords(const PageHeaderFormat& format, const char* pages,
+                      size_t length);
+
+class PageWriter;
+
+/**
+ * Re-encodes the data records on raw ring buffer pages, letting each be
+ * replaced or dropped. The records are packed densely, so pages that were
+ * read before they were full come out full. A page after which the kernel
+ * dropped events starts a new page that keeps the missed events flag.
+ * @param format The layout of the pages.
+ * @param pages One or more whole pages, back to back.
+ * @param length The number of bytes in pages.
+ * @param rewrite Called once per data record in the order they appear, and
+ *                returns the record to write in its place. The returned data
+ *                must stay valid until the next call. A length of 0 drops
+ *                the record.
+ * @param writer Writes the records. Its partial page is completed at the
+ *               end.
+ * @param out Completed pages are appended to this.
+ */
+void RewritePages(
+    const PageHeaderFormat& format, const char* pages, size_t length,
+    const std::function<RingBufferRecord(const RingBufferRecord&)>& rewrite,
+    PageWriter* writer, std::string* out);
+
+/**
+ * Encodes records into FTrace ring buffer pages, so that events captured by
+ * other means can be archived in the same layout as trace_pipe_raw data.
+ */
+class PageWriter {
+ public:
+  /**
+   * Constructs a new PageWriter.
+   * @param format The layout of the pages to write.
+   */
+  explicit PageWriter(const PageHeaderFormat& format);
+
+  /**
+   * Appends a data record. Records must be appended in timestamp order;
+   * a timestamp older than the previous one is recorded as the previous one.
+   * @param timestamp Timestamp of the record in trace clock units.
+   * @param data The record's payload, starting with its format ID.
+   * @param length The number of bytes in data.
+   * @param pages Completed pages are appended to this.
+   * @return Whether the record fit on a page. Records larger than a page are
+   *         dropped.
+   */
+  bool Append(uint64_t timestamp, const char* data, uint32_t length,
+              std::string* pages);
+
+  /**
+   * Completes the current page, if it holds any records.
+   * @param pages The page is appended to this.
+   */
+  void Flush(std::string* pages);
+
+  /**
+   * Completes the current page, and flags the next one as following events
+   * the kernel dropped.
+   * @param pages The completed page is appended to this.
+   */
+  void MarkMissedEvents(std::string* pages);
+
+ private:
+  /**
+   * Appends a 32-bit word to the page's data.
+   */
+  void WriteWord(uint32_t word);
+
+  const PageHeaderFormat format_;
+  // The page being filled, and the number of data bytes used on it.
+  std::string page_;
+  size_t used_ = 0;
+  // Timestamp of the last record on the page.
+  uint64_t last_timestamp_ = 0;
+  // Whether the page follows dropped events.
+  bool missed_events_ = false;
+};
+
+#endif  // SCHEDVIZ_UTIL_RING_BUFFER_H_
@@ -0,0 +1,361 @@
+#include "util/ring_buffer.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// The header_page of a 64-bit kernel.
+constexpr char kHeaderPage[] =
+    "\tfield: u64 timestamp;\toffset:0;\tsize:8;\tsigned:0;\n"
+    "\tfield: local_t commit;\toffset:8;\tsize:8;\tsigned:1;\n"
+    "\tfield: int overwrite;\toffset:8;\tsize:1;\tsigned:1;\n"
+    "\tfield: char data;\toffset:16;\tsize:4080;\tsigned:0;\n";
+
+constexpr uint64_t kMissedEvents = uint64_t{1} << 31;
+
+/**
+ * Builds a ring buffer page of the default format record by record.
+ */
+class PageBuilder {
+ public:
+  explicit PageBuilder(uint64_t timestamp) : page_(format_.page_size(), '\0') {
+    memcpy(&page_[format_.timestamp_offset], &timestamp, sizeof(timestamp));
+  }
+
+  /**
+   * Adds a data record whose length fits in type_len.
+   */
+  PageBuilder& Small(uint32_t delta, const std::string& payload) {
+    Word(static_cast<uint32_t>(payload.size() / 4) | delta << 5);
+    Bytes(payload);
+    return *this;
+  }
+
+  /**
+   * Adds a data record whose length is in array[0].
+   */
+  PageBuilder& Large(uint32_t delta, const std::string& payload) {
+    Word(delta << 5);
+    Word(static_cast<uint32_t>(payload.size()) + 4);
+    Bytes(payload);
+    return *this;
+  }
+
+  PageBuilder& TimeExtend(uint64_t delta) {
+    Word(30 | static_cast<uint32_t>(delta & ((1 << 27) - 1)) << 5);
+    Word(static_cast<uint32_t>(delta >> 27));
+    return *this;
+  }
+
+  PageBuilder& TimeStamp(uint64_t timestamp) {
+    Word(31 | static_cast<uint32_t>(timestamp & ((1 << 27) - 1)) << 5);
+    Word(static_cast<uint32_t>(timestamp >> 27));
+    return *this;
+  }
+
+  /**
+   * Adds padding of length bytes after its header and array[0].
+   */
+  PageBuilder& Padding(uint32_t delta, uint32_t length) {
+    Word(29 | delta << 5);
+    Word(length);
+    Bytes(std::string(length - 4, '\xff'));
+    return *this;
+  }
+
+  /**
+   * Adds a raw word, e.g. a malformed header.
+   */
+  PageBuilder& Word(uint32_t word) {
+    memcpy(&page_[format_.data_offset + used_], &word, sizeof(word));
+    used_ += sizeof(word);
+    return *this;
+  }
+
+  /**
+   * @param flags Flags to set in the commit field, over the data size.
+   * @param commit The data size to claim, or the bytes used if negative.
+   * @return The page.
+   */
+  std::string Build(uint64_t flags = 0, int64_t commit = -1) {
+    const uint64_t value =
+        (commit < 0 ? used_ : static_cast<uint64_t>(commit)) | flags;
+    memcpy(&page_[format_.commit_offset], &value, sizeof(value));
+    return page_;
+  }
+
+ private:
+  void Bytes(const std::string& bytes) {
+    memcpy(&page_[format_.data_offset + used_], bytes.data(), bytes.size());
+    used_ += bytes.size();
+  }
+
+  const PageHeaderFormat format_;
+  std::string page_;
+  size_t used_ = 0;
+};
+
+struct Record {
+  uint64_t timestamp;
+  std::string payload;
+};
+
+std::vector<Record> Records(const std::string& pages,
+                            const PageHeaderFormat& format = {}) {
+  std::vector<Record> records;
+  ForEachRecord(format, pages.data(), pages.size(),
+                [&](const RingBufferRecord& record) {
+                  records.push_back(
+                      {record.timestamp,
+                       std::string(record.data, record.length)});
+                  return true;
+                });
+  return records;
+}
+
+TEST(PageHeaderFormatTest, ParsesHeaderPage) {
+  PageHeaderFormat format;
+  ASSERT_TRUE(PageHeaderFormat::Parse(kHeaderPage, &format).ok());
+  EXPECT_EQ(format.timestamp_offset, 0);
+  EXPECT_EQ(format.commit_offset, 8);
+  EXPECT_EQ(format.commit_size, 8);
+  EXPECT_EQ(format.data_offset, 16);
+  EXPECT_EQ(format.data_size, 4080);
+  EXPECT_EQ(format.page_size(), 4096);
+}
+
+TEST(PageHeaderFormatTest, ParsesFourByteCommit) {
+  PageHeaderFormat format;
+  ASSERT_TRUE(PageHeaderFormat::Parse(
+                  "\tfield: u64 timestamp;\toffset:0;\tsize:8;\tsigned:0;\n"
+                  "\tfield: local_t commit;\toffset:8;\tsize:4;\tsigned:1;\n"
+                  "\tfield: char data;\toffset:12;\tsize:4084;\tsigned:0;\n",
+                  &format)
+                  .ok());
+  EXPECT_EQ(format.commit_size, 4);
+  EXPECT_EQ(format.data_offset, 12);
+  EXPECT_EQ(format.page_size(), 4096);
+}
+
+TEST(PageHeaderFormatTest, RejectsMalformedHeaderPages) {
+  const PageHeaderFormat untouched{1, 2, 4, 3, 5};
+  for (const char* header_page : {
+           "",
+           // No data field.
+           "\tfield: u64 timestamp;\toffset:0;\tsize:8;\tsigned:0;\n"
+           "\tfield: local_t commit;\toffset:8;\tsize:8;\tsigned:1;\n",
+           // No commit field.
+           "\tfield: char data;\toffset:16;\tsize:4080;\tsigned:0;\n",
+           // An unsupported commit size.
+           "\tfield: local_t commit;\toffset:8;\tsize:2;\tsigned:1;\n"
+           "\tfield: char data;\toffset:16;\tsize:4080;\tsigned:0;\n",
+       }) {
+    PageHeaderFormat format = untouched;
+    EXPECT_FALSE(PageHeaderFormat::Parse(header_page, &format).ok())
+        << header_page;
+    EXPECT_EQ(format.data_offset, untouched.data_offset) << header_page;
+  }
+}
+
+TEST(ForEachRecordTest, AddsTimeDeltas) {
+  const auto& records =
+      Records(PageBuilder(1000).Small(0, "abcd").Small(5, "efghijkl").Build());
+  ASSERT_EQ(records.size(), 2);
+  EXPECT_EQ(records[0].timestamp, 1000);
+  EXPECT_EQ(records[0].payload, "abcd");
+  EXPECT_EQ(records[1].timestamp, 1005);
+  EXPECT_EQ(records[1].payload, "efghijkl");
+}
+
+TEST(ForEachRecordTest, ReadsLargeRecords) {
+  const std::string payload(200, 'x');
+  const auto& records = Records(PageBuilder(0).Large(7, payload).Build());
+  ASSERT_EQ(records.size(), 1);
+  EXPECT_EQ(records[0].timestamp, 7);
+  EXPECT_EQ(records[0].payload, payload);
+}
+
+TEST(ForEachRecordTest, AppliesTimeExtendsAndTimeStamps) {
+  const uint64_t extend = (uint64_t{3} << 27) + 12345;
+  const auto& records = Records(PageBuilder(100)
+                                    .TimeExtend(extend)
+                                    .Small(1, "abcd")
+                                    .TimeStamp(uint64_t{5} << 30)
+                                    .Small(2, "efgh")
+                                    .Build());
+  ASSERT_EQ(records.size(), 2);
+  EXPECT_EQ(records[0].timestamp, 100 + extend + 1);
+  EXPECT_EQ(records[1].timestamp, (uint64_t{5} << 30) + 2);
+}
+
+TEST(ForEachRecordTest, SkipsPadding) {
+  // Padding with a time delta is a discarded event, and is skipped; without
+  // one, it fills the rest of the page.
+  const auto& records = Records(PageBuilder(0)
+                                    .Small(1, "abcd")
+                                    .Padding(2, 12)
+                                    .Small(3, "efgh")
+                                    .Padding(0, 8)
+                                    .Small(4, "ijkl")
+                                    .Build());
+  ASSERT_EQ(records.size(), 2);
+  EXPECT_EQ(records[0].payload, "abcd");
+  EXPECT_EQ(records[1].payload, "efgh");
+  EXPECT_EQ(records[1].timestamp, 4);
+}
+
+TEST(ForEachRecordTest, IgnoresMissedEventsFlag) {
+  const auto& records =
+      Records(PageBuilder(0).Small(1, "abcd").Build(kMissedEvents));
+  ASSERT_EQ(records.size(), 1);
+  EXPECT_EQ(records[0].payload, "abcd");
+}
+
+TEST(ForEachRecordTest, WalksEachPageFromItsTimestamp) {
+  const auto& pages = PageBuilder(100).Small(1, "abcd").Build() +
+                      PageBuilder(50).Small(2, "efgh").Build();
+  const auto& records = Records(pages);
+  ASSERT_EQ(records.size(), 2);
+  EXPECT_EQ(records[0].timestamp, 101);
+  EXPECT_EQ(records[1].timestamp, 52);
+}
+
+TEST(ForEachRecordTest, StopsWhenCallbackReturnsFalse) {
+  const auto& page =
+      PageBuilder(0).Small(1, "abcd").Small(1, "efgh").Small(1, "ijkl").Build();
+  int seen = 0;
+  const uint64_t count =
+      ForEachRecord(PageHeaderFormat(), page.data(), page.size(),
+                    [&](const RingBufferRecord&) { return ++seen < 2; });
+  EXPECT_EQ(seen, 2);
+  EXPECT_EQ(count, 2);
+  EXPECT_EQ(CountRecords(PageHeaderFormat(), page.data(), page.size()), 3);
+}
+
+TEST(ForEachRecordTest, StaysWithinTheBytesGiven) {
+  // A commit past the end of the page, or of the bytes given, is clipped.
+  const auto& page = PageBuilder(0).Small(1, "abcd").Build(0, 1 << 19);
+  EXPECT_EQ(Records(page).size(), 1);
+  EXPECT_EQ(CountRecords(PageHeaderFormat(), page.data(), 16 + 4 + 2), 0);
+  EXPECT_EQ(CountRecords(PageHeaderFormat(), page.data(), 8), 0);
+}
+
+TEST(ForEachRecordTest, StopsAtMalformedRecords) {
+  // A large record claiming more than the page holds.
+  EXPECT_EQ(Records(PageBuilder(0).Small(1, "abcd").Word(0).Word(5000).Build())
+                .size(),
+            1);
+  // A large record whose length doesn't cover array[0] itself.
+  EXPECT_EQ(Records(PageBuilder(0).Word(0).Word(2).Build()).size(), 0);
+  // A small record longer than the commit.
+  EXPECT_EQ(Records(PageBuilder(0).Word(28).Build()).size(), 0);
+}
+
+/**
+ * @return The commit field of the page at index in pages.
+ */
+uint64_t Commit(const std::string& pages, size_t index) {
+  const PageHeaderFormat format;
+  uint64_t commit;
+  memcpy(&commit, &pages[index * format.page_size() + format.commit_offset],
+         sizeof(commit));
+  return commit;
+}
+
+std::string Rewrite(
+    const std::string& pages,
+    const std::function<RingBufferRecord(const RingBufferRecord&)>& rewrite) {
+  const PageHeaderFormat format;
+  PageWriter writer(format);
+  std::string out;
+  RewritePages(format, pages.data(), pages.size(), rewrite, &writer, &out);
+  return out;
+}
+
+RingBufferRecord Keep(const RingBufferRecord& record) { return record; }
+
+TEST(RewritePagesTest, ReplacesAndDropsRecords) {
+  const std::string replacement = "EFGHIJKL";
+  const auto& out =
+      Rewrite(PageBuilder(100)
+                  .Small(1, "abcd")
+                  .Small(2, "efgh")
+                  .Small(3, "ijkl")
+                  .Build(),
+              [&](const RingBufferRecord& record) {
+                RingBufferRecord rewritten = record;
+                if (std::string(record.data, record.length) == "efgh") {
+                  rewritten.data = replacement.data();
+                  rewritten.length = replacement.size();
+                } else if (std::string(record.data, record.length) == "ijkl") {
+                  rewritten.length = 0;
+                }
+                return rewritten;
+              });
+  const auto& records = Records(out);
+  ASSERT_EQ(records.size(), 2);
+  EXPECT_EQ(records[0].timestamp, 101);
+  EXPECT_EQ(records[0].payload, "abcd");
+  EXPECT_EQ(records[1].timestamp, 103);
+  EXPECT_EQ(records[1].payload, replacement);
+}
+
+TEST(RewritePagesTest, PacksPagesDensely) {
+  // Part full pages, as read from trace_pipe_raw before they filled, with
+  // a gap between them too long for a record's time delta.
+  const uint64_t later = uint64_t{1} << 40;
+  const auto& pages = PageBuilder(100).Small(1, "abcd").Build() +
+                      PageBuilder(200).Large(2, std::string(200, 'x')).Build() +
+                      PageBuilder(later).Small(3, "efgh").Build();
+  const auto& out = Rewrite(pages, Keep);
+  ASSERT_EQ(out.size(), PageHeaderFormat().page_size());
+  const auto& records = Records(out);
+  ASSERT_EQ(records.size(), 3);
+  EXPECT_EQ(records[0].timestamp, 101);
+  EXPECT_EQ(records[1].timestamp, 202);
+  EXPECT_EQ(records[1].payload, std::string(200, 'x'));
+  EXPECT_EQ(records[2].timestamp, later + 3);
+  EXPECT_EQ(records[2].payload, "efgh");
+}
+
+TEST(RewritePagesTest, StartsANewPageAfterMissedEvents) {
+  const auto& pages = PageBuilder(100).Small(1, "abcd").Build() +
+                      PageBuilder(200).Small(2, "efgh").Build(kMissedEvents) +
+                      PageBuilder(300).Small(3, "ijkl").Build();
+  const auto& out = Rewrite(pages, Keep);
+  ASSERT_EQ(out.size(), 2 * PageHeaderFormat().page_size());
+  EXPECT_EQ(Commit(out, 0) & kMissedEvents, 0);
+  EXPECT_EQ(Commit(out, 1) & kMissedEvents, kMissedEvents);
+  const auto& records = Records(out);
+  ASSERT_EQ(records.size(), 3);
+  EXPECT_EQ(records[1].timestamp, 202);
+  EXPECT_EQ(records[2].timestamp, 303);
+}
+
+TEST(RewritePagesTest, FillsPagesBeforeStartingAnother) {
+  // Records of 208 bytes with their headers, 19 of which fit on a page.
+  const std::string payload(200, 'x');
+  std::string pages;
+  for (int i = 0; i < 30; i++) {
+    pages += PageBuilder(i).Small(0, payload.substr(0, 100)).Build();
+  }
+  const auto& out = Rewrite(pages, [&](const RingBufferRecord& record) {
+    RingBufferRecord rewritten = record;
+    rewritten.data = payload.data();
+    rewritten.length = payload.size();
+    return rewritten;
+  });
+  ASSERT_EQ(out.size(), 2 * PageHeaderFormat().page_size());
+  EXPECT_EQ(CountRecords(PageHeaderFormat(), out.data(),
+                         PageHeaderFormat().page_size()),
+            19);
+  EXPECT_EQ(Records(out).size(), 30);
+}
+
+}  // namespace
@@ -0,0 +1,156 @@
+#include "util/sched_events.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "re2/re2.h"
+
+namespace {
+
+/**
+ * Regex for finding the preemption marker in sched_switch's print format,
+ * e.g. `REC->prev_state & 4096 ? "+" : ""`.
+ */
+constexpr const LazyRE2 kPreemptMarkerRegex = {
+    "REC->prev_state & (\\d+) \\? \"\\+\""};
+
+}  // namespace
+
+Status SchedEventDecoder::AddFormat(const EventFormat& format) {
+  Fields fields;
+  if (format.name == "sched_switch") {
+    fields.type = SchedEventType::kSwitch;
+  } else if (format.name == "sched_wakeup") {
+    fields.type = SchedEventType::kWakeup;
+  } else if (format.name == "sched_wakeup_new") {
+    fields.type = SchedEventType::kWakeupNew;
+  } else if (format.name == "sched_migrate_task") {
+    fields.type = SchedEventType::kMigrateTask;
+  } else {
+    return Status::OkStatus();
+  }
+
+  const auto& stored = formats_[format.id] = format;
+  const auto& require = [&stored](absl::string_view name,
+                                  const FormatField** field) {
+    *field = stored.FindField(name);
+    if (*field == nullptr) {
+      return Status::InternalError(
+          absl::StrCat(stored.name, " has no field named ", name));
+    }
+    return Status::OkStatus();
+  };
+
+  Status status;
+  switch (fields.type) {
+    case SchedEventType::kSwitch:
+      status = require("prev_pid", &fields.prev_pid);
+      if (status.ok()) status = require("prev_state", &fields.prev_state);
+      if (status.ok()) status = require("next_pid", &fields.pid);
+      if (status.ok()) status = require("next_comm", &fields.comm);
+      RE2::PartialMatch(stored.print_fmt, *kPreemptMarkerRegex,
+                        &task_report_max_);
+      break;
+    case SchedEventType::kWakeup:
+    case SchedEventType::kWakeupNew:
+      status = require("pid", &fields.pid);
+      if (status.ok()) status = require("comm", &fields.comm);
+      if (status.ok()) status = require("target_cpu", &fields.target_cpu);
+      break;
+    case SchedEventType::kMigrateTask:
+      status = require("pid", &fields.pid);
+      if (status.ok()) status = require("comm", &fields.comm);
+      if (status.ok()) status = require("orig_cpu", &fields.orig_cpu);
+      if (status.ok()) status = require("dest_cpu", &fields.target_cpu);
+      break;
+  }
+  if (!status.ok()) {
+    formats_.erase(format.id);
+    return status;
+  }
+  fields_[format.id] = fields;
+  return Status::OkStatus();
+}
+
+bool SchedEventDecoder::Decode(int cpu, const RingBufferRecord& record,
+                               SchedEvent* event) const {
+  if (record.length < sizeof(uint16_t)) {
+    return false;
+  }
+  uint16_t id;
+  memcpy(&id, record.data, sizeof(id));
+  const auto& it = fields_.find(id);
+  if (it == fields_.end()) {
+    return false;
+  }
+  const Fields& fields = it->second;
+  const auto& read = [&record](const FormatField* field) -> int64_t {
+    return field == nullptr
+               ? -1
+               : ReadNumberField(*field, record.data, record.length);
+  };
+
+  event->type = fields.type;
+  event->cpu = cpu;
+  event->timestamp = record.timestamp;
+  event->pid = read(fields.pid);
+  event->prev_pid = read(fields.prev_pid);
+  event->prev_state = read(fields.prev_state);
+  event->orig_cpu = read(fields.orig_cpu);
+  event->target_cpu = read(fields.target_cpu);
+  const auto& comm = ReadStringField(*fields.comm, record.data, record.length);
+  const size_t comm_length = std::min(comm.size(), event->comm.size() - 1);
+  memcpy(event->comm.data(), comm.data(), comm_length);
+  event->comm[comm_length] = '\0';
+  return true;
+}
+
+void WakeupTracker::OnWakeup(int32_t pid, uint64_t timestamp) {
+  wakeup_time_.emplace(pid, timestamp);
+}
+
+std::optional<int64_t> WakeupTracker::OnSwitch(int32_t prev_pid,
+                                               int32_t next_pid,
+                                               uint64_t timestamp) {
+  wakeup_time_.erase(prev_pid);
+  const auto& it = wakeup_time_.find(next_pid);
+  if (it == wakeup_time_.end()) {
+    return std::nullopt;
+  }
+  const int64_t latency = timestamp - it->second;
+  wakeup_time_.erase(it);
+  return latency;
+}
+
+void SchedEventMerger::Release(std::vector<SchedEvent>* events) {
+  uint64_t timestamp = kUntraced;
+  for (uint64_t watermark : watermarks_) {
+    timestamp = std::min(timestamp, watermark);
+  }
+  ReleaseUpTo(timestamp, events);
+}
+
+void SchedEventMerger::Flush(std::vector<SchedEvent>* events) {
+  ReleaseUpTo(kUntraced, events);
+}
+
+void SchedEventMerger::ReleaseUpTo(uint64_t timestamp,
+                                   std::vector<SchedEvent>* events) {
+  std::stable_sort(pending_.begin(), pending_.end(),
+                   [](const SchedEvent& a, const SchedEvent& b) {
+                     return a.timestamp < b.timestamp;
+                   });
+  const auto& end = std::upper_bound(
+      pending_.begin(), pending_.end(), timestamp,
+      [](uint64_t timestamp, const SchedEvent& event) {
+        return timestamp < event.timestamp;
+      });
+  events->insert(events->end(), std::make_move_iterator(pending_.begin()),
+                 std::make_move_iterator(end));
+  pending_.erase(pending_.begin(), end);
+}
@@ -0,0 +1,210 @@
+#ifndef SCHEDVIZ_UTIL_SCHED_EVENTS_H_
+#define SCHEDVIZ_UTIL_SCHED_EVENTS_H_
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "util/event_format.h"
+#include "util/ring_buffer.h"
+#include "util/status.h"
+
+/**
+ * The scheduling events the collector understands online.
+ */
+enum class SchedEventType {
+  kSwitch,
+  kWakeup,
+  kWakeupNew,
+  kMigrateTask,
+};
+
+/**
+ * A decoded scheduling event. Which fields are meaningful depends on type:
+ *   kSwitch: prev_pid, prev_state and pid (the next PID).
+ *   kWakeup, kWakeupNew: pid and target_cpu.
+ *   kMigrateTask: pid, orig_cpu and target_cpu (the destination CPU).
+ * comm is always the command of pid.
+ */
+struct SchedEvent {
+  SchedEventType type;
+  // The CPU whose buffer recorded the event.
+  int cpu;
+  // Timestamp in trace clock units.
+  uint64_t timestamp;
+  int32_t pid;
+  int32_t prev_pid;
+  int64_t prev_state;
+  int32_t orig_cpu;
+  int32_t target_cpu;
+  // NUL terminated.
+  std::array<char, 16> comm;
+};
+
+/**
+ * Decodes raw ring buffer records into SchedEvents.
+ */
+class SchedEventDecoder {
+ public:
+  /**
+   * Registers the format of an event. Formats of events other than the
+   * scheduling events are ignored.
+   * @param format The parsed format file.
+   * @return Status if successful or not.
+   */
+  Status AddFormat(const EventFormat& format);
+
+  /**
+   * Decodes a record, if it is a scheduling event.
+   * @param cpu The CPU whose buffer the record was read from.
+   * @param record The record to decode.
+   * @param event Where to store the decoded event.
+   * @return Whether or not the record was a scheduling event.
+   */
+  bool Decode(int cpu, const RingBufferRecord& record,
+              SchedEvent* event) const;
+
+  /**
+   * @param prev_state The prev_state of a sched_switch event.
+   * @return Whether the switched out thread is still runnable, i.e. it was
+   *         preempted rather than blocked.
+   */
+  bool IsRunnableState(int64_t prev_state) const {
+    return prev_state == 0 || prev_state == task_report_max_;
+  }
+
+  /**
+   * @return The prev_state value that marks a preempted thread.
+   */
+  int64_t task_report_max() const { return task_report_max_; }
+
+ private:
+  struct Fields {
+    SchedEventType type;
+    const FormatField* pid = nullptr;
+    const FormatField* prev_pid = nullptr;
+    const FormatField* prev_state = nullptr;
+    const FormatField* orig_cpu = nullptr;
+    const FormatField* target_cpu = nullptr;
+    const FormatField* comm = nullptr;
+  };
+
+  // Formats of the registered events. Indexed by event ID.
+  std::unordered_map<uint16_t, EventFormat> formats_;
+  // Field lookups into formats_. Indexed by event ID.
+  std::unordered_map<uint16_t, Fields> fields_;
+  // The prev_state value that marks a preempted thread. This is
+  // TASK_REPORT_MAX, whose value varies by kernel version.
+  int64_t task_report_max_ = 256;
+};
+
+/**
+ * Follows each thread from its wakeup to its switch-in, to measure how long
+ * it waited. Events must be fed in timestamp order.
+ */
+class WakeupTracker {
+ public:
+  /**
+   * Records a wakeup. Only a thread's first wakeup since it last switched
+   * out counts: later ones find it already runnable, and don't restart its
+   * wait.
+   * @param pid The woken thread.
+   * @param timestamp When it was woken.
+   */
+  void OnWakeup(int32_t pid, uint64_t timestamp);
+
+  /**
+   * Records a switch. The thread switching out is no longer waiting for any
+   * earlier wakeup, e.g. one that found it already running.
+   * @param prev_pid The thread switching out.
+   * @param next_pid The thread switching in.
+   * @param timestamp When the switch happened.
+   * @return How long next_pid waited since its wakeup, if the wakeup was
+   *         seen.
+   */
+  std::optional<int64_t> OnSwitch(int32_t prev_pid, int32_t next_pid,
+                                  uint64_t timestamp);
+
+ private:
+  // Time of the first wakeup of each thread since it last switched out,
+  // until it switches in.
+  std::unordered_map<int32_t, uint64_t> wakeup_time_;
+};
+
+/**
+ * Merges the events decoded from the CPUs' buffers into one timestamp
+ * ordered stream. A CPU's buffer isn't necessarily drained on every pass,
+ * so an event is only released once every traced CPU has been drained past
+ * its timestamp, and no event can follow it from another CPU.
+ */
+class SchedEventMerger {
+ public:
+  /**
+   * Constructs a new SchedEventMerger, with none of the CPUs traced.
+   * @param cpu_count Number of CPU IDs.
+   */
+  explicit SchedEventMerger(int cpu_count = 0)
+      : watermarks_(cpu_count, kUntraced) {}
+
+  /**
+   * Adds an event decoded from a CPU's buffer.
+   * @param event The event.
+   */
+  void Add(const SchedEvent& event) { pending_.push_back(event); }
+
+  /**
+   * Starts holding events back until the CPU is drained.
+   * @param cpu The CPU, which began tracing.
+   */
+  void AddCPU(int cpu) { watermarks_[cpu] = 0; }
+
+  /**
+   * Stops holding events back for the CPU.
+   * @param cpu The CPU, which was drained for the last time.
+   */
+  void RemoveCPU(int cpu) { watermarks_[cpu] = kUntraced; }
+
+  /**
+   * Records that the CPU's buffer was drained.
+   * @param cpu The CPU.
+   * @param timestamp A timestamp that no event still in the CPU's buffer
+   *                  precedes, e.g. the newest one drained from any CPU
+   *                  before and during its drain.
+   */
+  void MarkDrained(int cpu, uint64_t timestamp) {
+    watermarks_[cpu] = timestamp;
+  }
+
+  /**
+   * Moves the events every traced CPU has been drained past to events, in
+   * timestamp order. Events with the same timestamp keep the order they were
+   * added in.
+   * @param events The events to append to.
+   */
+  void Release(std::vector<SchedEvent>* events);
+
+  /**
+   * Moves all of the events to events, in timestamp order, once the CPUs
+   * were drained for the last time.
+   * @param events The events to append to.
+   */
+  void Flush(std::vector<SchedEvent>* events);
+
+ private:
+  // Watermark of the CPUs that aren't traced.
+  static constexpr uint64_t kUntraced = UINT64_MAX;
+
+  /**
+   * Moves the events up to and including timestamp to events.
+   */
+  void ReleaseUpTo(uint64_t timestamp, std::vector<SchedEvent>* events);
+
+  // For each CPU ID, the timestamp its buffer was last drained past.
+  std::vector<uint64_t> watermarks_;
+  // Events not yet released, in the order they were added.
+  std::vector<SchedEvent> pending_;
+};
+
+#endif  // SCHEDVIZ_UTIL_SCHED_EVENTS_H_
@@ -0,0 +1,164 @@
+#include "util/sched_events.h"
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+TEST(WakeupTrackerTest, MeasuresWakeupToSwitchIn) {
+  WakeupTracker tracker;
+  tracker.OnWakeup(10, 1000);
+  EXPECT_EQ(tracker.OnSwitch(0, 10, 1250), 250);
+  // The wakeup was serviced.
+  EXPECT_EQ(tracker.OnSwitch(10, 0, 1300), std::nullopt);
+  EXPECT_EQ(tracker.OnSwitch(0, 10, 1400), std::nullopt);
+}
+
+TEST(WakeupTrackerTest, IgnoresSwitchInsWithoutAWakeup) {
+  WakeupTracker tracker;
+  // A preempted thread switching back in was never woken.
+  EXPECT_EQ(tracker.OnSwitch(0, 10, 1000), std::nullopt);
+  tracker.OnWakeup(11, 1000);
+  EXPECT_EQ(tracker.OnSwitch(10, 12, 1100), std::nullopt);
+  EXPECT_EQ(tracker.OnSwitch(12, 11, 1200), 200);
+}
+
+TEST(WakeupTrackerTest, MeasuresFromTheFirstWakeup) {
+  WakeupTracker tracker;
+  tracker.OnWakeup(10, 1000);
+  tracker.OnWakeup(10, 1080);
+  tracker.OnWakeup(10, 1090);
+  EXPECT_EQ(tracker.OnSwitch(0, 10, 1150), 150);
+}
+
+TEST(WakeupTrackerTest, ForgetsWakeupsOfRunningThreads) {
+  WakeupTracker tracker;
+  // Woken while already running, then blocks: the wakeup is stale.
+  tracker.OnWakeup(10, 1000);
+  EXPECT_EQ(tracker.OnSwitch(10, 0, 5000), std::nullopt);
+  // A genuine wakeup is measured from when it happened.
+  tracker.OnWakeup(10, 9000);
+  EXPECT_EQ(tracker.OnSwitch(0, 10, 9050), 50);
+}
+
+TEST(WakeupTrackerTest, TracksThreadsIndependently) {
+  WakeupTracker tracker;
+  tracker.OnWakeup(10, 1000);
+  tracker.OnWakeup(11, 1100);
+  EXPECT_EQ(tracker.OnSwitch(0, 11, 1200), 100);
+  EXPECT_EQ(tracker.OnSwitch(11, 10, 1500), 500);
+}
+
+SchedEvent EventAt(uint64_t timestamp, int cpu, int32_t pid = 10) {
+  SchedEvent event{};
+  event.type = SchedEventType::kWakeup;
+  event.cpu = cpu;
+  event.timestamp = timestamp;
+  event.pid = pid;
+  return event;
+}
+
+std::vector<uint64_t> Timestamps(const std::vector<SchedEvent>& events) {
+  std::vector<uint64_t> timestamps;
+  for (const auto& event : events) {
+    timestamps.push_back(event.timestamp);
+  }
+  return timestamps;
+}
+
+TEST(SchedEventMergerTest, WaitsForCPUsThatWereNotDrained) {
+  // cpu0 and cpu64 are in different drain groups, and cpu64's is idle.
+  SchedEventMerger merger(65);
+  merger.AddCPU(0);
+  merger.AddCPU(64);
+  merger.Add(EventAt(50, 64));
+  merger.MarkDrained(64, 50);
+  merger.Add(EventAt(100, 0));
+  merger.MarkDrained(0, 100);
+  std::vector<SchedEvent> events;
+  merger.Release(&events);
+  EXPECT_EQ(Timestamps(events), (std::vector<uint64_t>{50}));
+
+  // A pass skips cpu64's group.
+  merger.Add(EventAt(300, 0));
+  merger.Add(EventAt(400, 0));
+  merger.MarkDrained(0, 400);
+  merger.Release(&events);
+  EXPECT_EQ(Timestamps(events), (std::vector<uint64_t>{50}));
+
+  // cpu64 had an event in between all along.
+  merger.Add(EventAt(200, 64));
+  merger.MarkDrained(64, 400);
+  merger.Release(&events);
+  EXPECT_EQ(Timestamps(events),
+            (std::vector<uint64_t>{50, 100, 200, 300, 400}));
+}
+
+TEST(SchedEventMergerTest, HoldsEventsUntilEveryCPUIsDrained) {
+  SchedEventMerger merger(2);
+  merger.AddCPU(0);
+  merger.AddCPU(1);
+  merger.Add(EventAt(100, 0));
+  merger.MarkDrained(0, 100);
+  std::vector<SchedEvent> events;
+  merger.Release(&events);
+  EXPECT_TRUE(events.empty());
+  merger.MarkDrained(1, 100);
+  merger.Release(&events);
+  EXPECT_EQ(Timestamps(events), (std::vector<uint64_t>{100}));
+}
+
+TEST(SchedEventMergerTest, IgnoresCPUsThatAreNotTraced) {
+  SchedEventMerger merger(3);
+  merger.AddCPU(0);
+  merger.AddCPU(2);
+  merger.Add(EventAt(100, 0));
+  merger.MarkDrained(0, 100);
+  merger.Add(EventAt(90, 2));
+  merger.MarkDrained(2, 90);
+  std::vector<SchedEvent> events;
+  merger.Release(&events);
+  EXPECT_EQ(Timestamps(events), (std::vector<uint64_t>{90}));
+  // cpu2 went offline after its last drain.
+  merger.RemoveCPU(2);
+  merger.Release(&events);
+  EXPECT_EQ(Timestamps(events), (std::vector<uint64_t>{90, 100}));
+}
+
+TEST(SchedEventMergerTest, KeepsTheOrderOfSimultaneousEvents) {
+  SchedEventMerger merger(2);
+  merger.AddCPU(0);
+  merger.AddCPU(1);
+  merger.Add(EventAt(100, 1, 11));
+  merger.Add(EventAt(100, 0, 10));
+  merger.Add(EventAt(100, 1, 12));
+  merger.MarkDrained(0, 100);
+  merger.MarkDrained(1, 100);
+  std::vector<SchedEvent> events;
+  merger.Release(&events);
+  ASSERT_EQ(events.size(), 3);
+  EXPECT_EQ(events[0].pid, 11);
+  EXPECT_EQ(events[1].pid, 10);
+  EXPECT_EQ(events[2].pid, 12);
+}
+
+TEST(SchedEventMergerTest, FlushesEverything) {
+  SchedEventMerger merger(2);
+  merger.AddCPU(0);
+  merger.AddCPU(1);
+  merger.Add(EventAt(300, 1));
+  merger.MarkDrained(1, 300);
+  merger.Add(EventAt(200, 0));
+  merger.Add(EventAt(400, 0));
+  merger.MarkDrained(0, 400);
+  std::vector<SchedEvent> events;
+  merger.Flush(&events);
+  EXPECT_EQ(Timestamps(events), (std::vector<uint64_t>{200, 300, 400}));
+  merger.Flush(&events);
+  EXPECT_EQ(events.size(), 3);
+}
+
+}  // namespace
@@ -0,0 +1,125 @@
+#include "util/sched_histograms.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace {
+
+/**
+ * Layout of the duration histograms: 16 buckets per power of two, i.e. a
+ * relative error of 1/16, up to 2^40ns (about 18 minutes).
+ */
+constexpr int kDurationSubBucketBits = 4;
+constexpr int kDurationMaxBits = 40;
+
+/**
+ * Layout of the migration distance histograms: every MigrationDistance gets
+ * its own bucket.
+ */
+constexpr int kDistanceBits = 3;
+
+}  // namespace
+
+SchedHistogramSet::SchedHistogramSet()
+    : wakeup_latency(kDurationSubBucketBits, kDurationMaxBits),
+      run_slice(kDurationSubBucketBits, kDurationMaxBits),
+      migration_distance(kDistanceBits, kDistanceBits) {}
+
+void SchedHistograms::OnEvent(const SchedEvent& event) {
+  switch (event.type) {
+    case SchedEventType::kSwitch: {
+      if (event.cpu < 0) {
+        return;
+      }
+      if (static_cast<size_t>(event.cpu) >= running_.size()) {
+        running_.resize(event.cpu + 1, {-1, 0});
+      }
+      // Only a slice whose switch-in was seen has a known length.
+      auto& running = running_[event.cpu];
+      if (event.prev_pid != 0 && running.first == event.prev_pid) {
+        const int64_t slice = event.timestamp - running.second;
+        ThreadHistograms(event.prev_pid, {})->run_slice.Record(slice);
+        CPUHistograms(event.cpu)->run_slice.Record(slice);
+      }
+      running = {event.pid, event.timestamp};
+      const auto& latency =
+          wakeups_.OnSwitch(event.prev_pid, event.pid, event.timestamp);
+      if (latency.has_value()) {
+        ThreadHistograms(event.pid, event.comm)
+            ->wakeup_latency.Record(*latency);
+        CPUHistograms(event.cpu)->wakeup_latency.Record(*latency);
+      }
+      return;
+    }
+    case SchedEventType::kWakeup:
+    case SchedEventType::kWakeupNew:
+      wakeups_.OnWakeup(event.pid, event.timestamp);
+      return;
+    case SchedEventType::kMigrateTask: {
+      const int distance = Distance(event.orig_cpu, event.target_cpu);
+      if (distance < 0) {
+        return;
+      }
+      ThreadHistograms(event.pid, event.comm)
+          ->migration_distance.Record(distance);
+      SchedHistogramSet* cpu = CPUHistograms(event.target_cpu);
+      if (cpu != nullptr) {
+        cpu->migration_distance.Record(distance);
+      }
+      return;
+    }
+  }
+}
+
+int SchedHistograms::Distance(int from_cpu, int to_cpu) const {
+  if (from_cpu < 0 || to_cpu < 0 ||
+      static_cast<size_t>(from_cpu) >= placements_.size() ||
+      static_cast<size_t>(to_cpu) >= placements_.size()) {
+    return -1;
+  }
+  const CPUPlacement& from = placements_[from_cpu];
+  const CPUPlacement& to = placements_[to_cpu];
+  if (from.node < 0 || to.node < 0) {
+    return -1;
+  }
+  MigrationDistance distance = MigrationDistance::kCrossNode;
+  if (from_cpu == to_cpu) {
+    distance = MigrationDistance::kSameCPU;
+  } else if (from.package >= 0 && from.package == to.package &&
+             from.core >= 0 && from.core == to.core) {
+    distance = MigrationDistance::kSameCore;
+  } else if (from.package >= 0 && from.package == to.package) {
+    distance = MigrationDistance::kSamePackage;
+  } else if (from.node == to.node) {
+    distance = MigrationDistance::kSameNode;
+  }
+  return static_cast<int>(distance);
+}
+
+SchedHistogramSet* SchedHistograms::ThreadHistograms(
+    int32_t pid, const std::array<char, 16>& comm) {
+  const auto& it = thread_index_.find(pid);
+  if (it != thread_index_.end()) {
+    Thread& thread = threads_[it->second];
+    if (comm[0] != '\0') {
+      thread.command = comm.data();
+    }
+    return &thread.histograms;
+  }
+  if (threads_.size() >= max_threads_) {
+    return &other_threads_;
+  }
+  thread_index_[pid] = threads_.size();
+  threads_.push_back({pid, comm.data(), SchedHistogramSet()});
+  return &threads_.back().histograms;
+}
+
+SchedHistogramSet* SchedHistograms::CPUHistograms(int cpu) {
+  if (cpu < 0) {
+    return nullptr;
+  }
+  if (static_cast<size_t>(cpu) >= cpus_.size()) {
+    cpus_.resize(cpu + 1);
+  }
+  return &cpus_[cpu];
+}
@@ -0,0 +1,137 @@
+#ifndef SCHEDVIZ_UTIL_SCHED_HISTOGRAMS_H_
+#define SCHEDVIZ_UTIL_SCHED_HISTOGRAMS_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "util/log_histogram.h"
+#include "util/sched_events.h"
+
+/**
+ * Where a CPU sits in the system topology. -1 marks unknown fields.
+ */
+struct CPUPlacement {
+  int node = -1;
+  int package = -1;
+  int core = -1;
+};
+
+/**
+ * How far apart two CPUs are in the topology. Recorded as the value of
+ * migration distance histograms.
+ */
+enum class MigrationDistance : int {
+  kSameCPU = 0,
+  kSameCore = 1,
+  kSamePackage = 2,
+  kSameNode = 3,
+  kCrossNode = 4,
+};
+
+/**
+ * The histograms kept for each thread and CPU.
+ */
+struct SchedHistogramSet {
+  SchedHistogramSet();
+
+  // Time from a thread's wakeup until it was switched in, in trace clock
+  // units.
+  LogHistogram wakeup_latency;
+  // Time from a thread's switch-in until its switch-out, in trace clock
+  // units.
+  LogHistogram run_slice;
+  // MigrationDistance of each migration.
+  LogHistogram migration_distance;
+};
+
+/**
+ * Maintains wakeup latency, run slice and migration distance histograms per
+ * thread and per CPU from a time ordered stream of scheduling events.
+ *
+ * Memory is bounded regardless of the capture's length: each histogram has a
+ * fixed number of buckets, and only the first max_threads threads seen get
+ * their own histograms. Later threads share a single set.
+ */
+class SchedHistograms {
+ public:
+  /**
+   * The histograms of a single thread.
+   */
+  struct Thread {
+    int32_t pid;
+    // The most recently seen command of the thread.
+    std::string command;
+    SchedHistogramSet histograms;
+  };
+
+  /**
+   * Constructs a new SchedHistograms.
+   * @param placements Where each CPU sits in the topology. Indexed by CPU ID.
+   *                   Migrations involving CPUs without a known placement
+   *                   are not recorded.
+   * @param max_threads How many threads get their own histograms.
+   */
+  SchedHistograms(std::vector<CPUPlacement> placements, size_t max_threads)
+      : placements_(std::move(placements)), max_threads_(max_threads) {}
+
+  /**
+   * Feeds the next event. Events must be fed in timestamp order.
+   * @param event The event.
+   */
+  void OnEvent(const SchedEvent& event);
+
+  /**
+   * @return The histograms of each thread that got its own, in the order
+   *         they were first seen.
+   */
+  const std::vector<Thread>& threads() const { return threads_; }
+
+  /**
+   * @return The histograms shared by threads seen after max_threads others.
+   */
+  const SchedHistogramSet& other_threads() const { return other_threads_; }
+
+  /**
+   * @return The histograms of each CPU, indexed by CPU ID.
+   */
+  const std::vector<SchedHistogramSet>& cpus() const { return cpus_; }
+
+  /**
+   * @return How far apart two CPUs are, or -1 if either's placement is
+   *         unknown.
+   */
+  int Distance(int from_cpu, int to_cpu) const;
+
+ private:
+  /**
+   * @return The histograms a thread's values are recorded in.
+   */
+  SchedHistogramSet* ThreadHistograms(int32_t pid,
+                                      const std::array<char, 16>& comm);
+
+  /**
+   * @return The histograms of a CPU, or nullptr for invalid CPU IDs.
+   */
+  SchedHistogramSet* CPUHistograms(int cpu);
+
+  const std::vector<CPUPlacement> placements_;
+  const size_t max_threads_;
+  std::vector<Thread> threads_;
+  // Indexes into threads_. Indexed by PID.
+  std::unordered_map<int32_t, size_t> thread_index_;
+  SchedHistogramSet other_threads_;
+  std::vector<SchedHistogramSet> cpus_;
+
+  // Measures wakeup latencies.
+  WakeupTracker wakeups_;
+  // The thread running on each CPU, and when it was switched in, or -1 if
+  // unknown. Indexed by CPU ID.
+  std::vector<std::pair<int32_t, uint64_t>> running_;
+};
+
+#endif  // SCHEDVIZ_UTIL_SCHED_HISTOGRAMS_H_
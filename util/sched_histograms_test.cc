@@ -0,0 +1,150 @@
+#include "util/sched_histograms.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+SchedEvent Wakeup(uint64_t timestamp, int32_t pid, int32_t target_cpu) {
+  SchedEvent event{};
+  event.type = SchedEventType::kWakeup;
+  event.timestamp = timestamp;
+  event.pid = pid;
+  event.target_cpu = target_cpu;
+  return event;
+}
+
+SchedEvent Switch(uint64_t timestamp, int cpu, int32_t prev_pid,
+                  int32_t next_pid, const char* next_comm = "") {
+  SchedEvent event{};
+  event.type = SchedEventType::kSwitch;
+  event.cpu = cpu;
+  event.timestamp = timestamp;
+  event.prev_pid = prev_pid;
+  event.pid = next_pid;
+  strncpy(event.comm.data(), next_comm, event.comm.size() - 1);
+  return event;
+}
+
+SchedEvent Migrate(uint64_t timestamp, int32_t pid, int32_t orig_cpu,
+                   int32_t dest_cpu) {
+  SchedEvent event{};
+  event.type = SchedEventType::kMigrateTask;
+  event.timestamp = timestamp;
+  event.pid = pid;
+  event.orig_cpu = orig_cpu;
+  event.target_cpu = dest_cpu;
+  return event;
+}
+
+/**
+ * Two nodes: node 0 has a package of two cores, the first with two
+ * hardware threads, and a second package; node 1 has one CPU. The
+ * placement of cpu5 is unknown.
+ */
+std::vector<CPUPlacement> Placements() {
+  return {
+      {0, 0, 0}, {0, 0, 0}, {0, 0, 1}, {0, 1, 2}, {1, 2, 3}, {},
+  };
+}
+
+TEST(SchedHistogramsTest, MeasuresMigrationDistances) {
+  const SchedHistograms histograms(Placements(), 10);
+  EXPECT_EQ(histograms.Distance(0, 0),
+            static_cast<int>(MigrationDistance::kSameCPU));
+  EXPECT_EQ(histograms.Distance(0, 1),
+            static_cast<int>(MigrationDistance::kSameCore));
+  EXPECT_EQ(histograms.Distance(1, 2),
+            static_cast<int>(MigrationDistance::kSamePackage));
+  EXPECT_EQ(histograms.Distance(2, 3),
+            static_cast<int>(MigrationDistance::kSameNode));
+  EXPECT_EQ(histograms.Distance(3, 4),
+            static_cast<int>(MigrationDistance::kCrossNode));
+  EXPECT_EQ(histograms.Distance(4, 0),
+            static_cast<int>(MigrationDistance::kCrossNode));
+  // Unknown placements and CPU IDs.
+  EXPECT_EQ(histograms.Distance(0, 5), -1);
+  EXPECT_EQ(histograms.Distance(5, 0), -1);
+  EXPECT_EQ(histograms.Distance(0, 6), -1);
+  EXPECT_EQ(histograms.Distance(-1, 0), -1);
+}
+
+TEST(SchedHistogramsTest, FallsBackToTheNodeWithoutPackages) {
+  const SchedHistograms histograms({{0, -1, -1}, {0, -1, -1}, {1, -1, -1}},
+                                   10);
+  EXPECT_EQ(histograms.Distance(0, 1),
+            static_cast<int>(MigrationDistance::kSameNode));
+  EXPECT_EQ(histograms.Distance(0, 2),
+            static_cast<int>(MigrationDistance::kCrossNode));
+}
+
+TEST(SchedHistogramsTest, RecordsLatenciesAndSlices) {
+  SchedHistograms histograms(Placements(), 10);
+  histograms.OnEvent(Wakeup(1000, 10, 1));
+  histograms.OnEvent(Switch(1300, 1, 0, 10, "worker"));
+  histograms.OnEvent(Switch(1800, 1, 10, 0));
+
+  ASSERT_EQ(histograms.threads().size(), 1);
+  const auto& thread = histograms.threads()[0];
+  EXPECT_EQ(thread.pid, 10);
+  EXPECT_EQ(thread.command, "worker");
+  EXPECT_EQ(thread.histograms.wakeup_latency.count(), 1);
+  EXPECT_EQ(thread.histograms.wakeup_latency.sum(), 300);
+  EXPECT_EQ(thread.histograms.run_slice.count(), 1);
+  EXPECT_EQ(thread.histograms.run_slice.sum(), 500);
+
+  ASSERT_GE(histograms.cpus().size(), 2);
+  EXPECT_EQ(histograms.cpus()[1].wakeup_latency.sum(), 300);
+  EXPECT_EQ(histograms.cpus()[1].run_slice.sum(), 500);
+  // The idle thread's slices aren't recorded.
+  EXPECT_EQ(histograms.cpus()[1].run_slice.count(), 1);
+}
+
+TEST(SchedHistogramsTest, SkipsSlicesWithoutASwitchIn) {
+  SchedHistograms histograms(Placements(), 10);
+  // The capture started while pid 10 ran.
+  histograms.OnEvent(Switch(1000, 0, 10, 11));
+  histograms.OnEvent(Switch(1500, 0, 11, 10));
+  ASSERT_EQ(histograms.threads().size(), 1);
+  EXPECT_EQ(histograms.threads()[0].pid, 11);
+  EXPECT_EQ(histograms.threads()[0].histograms.run_slice.sum(), 500);
+}
+
+TEST(SchedHistogramsTest, RecordsMigrations) {
+  SchedHistograms histograms(Placements(), 10);
+  histograms.OnEvent(Migrate(1000, 10, 0, 1));
+  histograms.OnEvent(Migrate(2000, 10, 1, 4));
+  // Unknown distances aren't recorded.
+  histograms.OnEvent(Migrate(3000, 10, 4, 5));
+
+  ASSERT_EQ(histograms.threads().size(), 1);
+  const auto& migrations = histograms.threads()[0].histograms.migration_distance;
+  EXPECT_EQ(migrations.count(), 2);
+  EXPECT_EQ(migrations.min(), static_cast<int>(MigrationDistance::kSameCore));
+  EXPECT_EQ(migrations.max(), static_cast<int>(MigrationDistance::kCrossNode));
+  // Recorded against the destination CPU.
+  ASSERT_GE(histograms.cpus().size(), 5);
+  EXPECT_EQ(histograms.cpus()[1].migration_distance.count(), 1);
+  EXPECT_EQ(histograms.cpus()[4].migration_distance.count(), 1);
+}
+
+TEST(SchedHistogramsTest, SharesHistogramsPastMaxThreads) {
+  SchedHistograms histograms(Placements(), 2);
+  for (int32_t pid = 10; pid < 15; pid++) {
+    histograms.OnEvent(Wakeup(pid * 1000, pid, 0));
+    histograms.OnEvent(Switch(pid * 1000 + 100, 0, 0, pid));
+    histograms.OnEvent(Switch(pid * 1000 + 200, 0, pid, 0));
+  }
+  ASSERT_EQ(histograms.threads().size(), 2);
+  EXPECT_EQ(histograms.threads()[0].pid, 10);
+  EXPECT_EQ(histograms.threads()[1].pid, 11);
+  EXPECT_EQ(histograms.other_threads().wakeup_latency.count(), 3);
+  EXPECT_EQ(histograms.other_threads().run_slice.count(), 3);
+  EXPECT_EQ(histograms.cpus()[0].wakeup_latency.count(), 5);
+}
+
+}  // namespace
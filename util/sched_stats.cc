@@ -0,0 +1,163 @@
+#include "util/sched_stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+void SchedStats::OnEvent(const SchedEvent& event) {
+  if (first_timestamp_ == 0) {
+    first_timestamp_ = event.timestamp;
+  }
+  last_timestamp_ = event.timestamp;
+
+  switch (event.type) {
+    case SchedEventType::kSwitch: {
+      CPU* cpu = GetCPU(event.cpu);
+      if (cpu != nullptr) {
+        if (cpu->current_pid > 0 && cpu->current_pid != event.prev_pid) {
+          // The previous thread's switch-out was missed, so when it stopped
+          // running is unknown.
+          const auto& it = threads_.find(cpu->current_pid);
+          if (it != threads_.end() &&
+              it->second.state == ThreadState::kRunning &&
+              it->second.cpu == event.cpu) {
+            it->second.state = ThreadState::kUnknown;
+          }
+        }
+        if (cpu->current_pid == 0) {
+          cpu->stats.idle_time += event.timestamp - cpu->since;
+        } else if (cpu->current_pid > 0) {
+          cpu->stats.busy_time += event.timestamp - cpu->since;
+        }
+        cpu->current_pid = event.pid;
+        cpu->since = event.timestamp;
+        cpu->stats.switches++;
+      }
+      // The idle thread never waits on a run queue.
+      if (event.prev_pid != 0) {
+        const bool runnable = decoder_->IsRunnableState(event.prev_state);
+        Thread* prev = GetThread(event.prev_pid, {});
+        Transition(prev,
+                   runnable ? ThreadState::kWaiting : ThreadState::kSleeping,
+                   event.timestamp);
+        if (runnable) {
+          prev->stats.preemptions++;
+        }
+      }
+      if (event.pid != 0) {
+        Thread* next = GetThread(event.pid, event.comm);
+        Transition(next, ThreadState::kRunning, event.timestamp);
+        next->cpu = event.cpu;
+        next->stats.switches++;
+      }
+      break;
+    }
+    case SchedEventType::kWakeup:
+    case SchedEventType::kWakeupNew: {
+      CPU* cpu = GetCPU(event.target_cpu);
+      if (cpu != nullptr) {
+        cpu->stats.wakeups++;
+      }
+      Thread* thread = GetThread(event.pid, event.comm);
+      thread->stats.wakeups++;
+      // Wakeups of threads that are already runnable don't change anything.
+      if (thread->state == ThreadState::kSleeping ||
+          thread->state == ThreadState::kUnknown) {
+        Transition(thread, ThreadState::kWaiting, event.timestamp);
+      }
+      break;
+    }
+    case SchedEventType::kMigrateTask: {
+      CPU* cpu = GetCPU(event.target_cpu);
+      if (cpu != nullptr) {
+        cpu->stats.migrations_in++;
+      }
+      GetThread(event.pid, event.comm)->stats.migrations++;
+      break;
+    }
+  }
+}
+
+std::vector<ThreadStats> SchedStats::Threads(uint64_t now) const {
+  std::vector<ThreadStats> threads;
+  threads.reserve(threads_.size());
+  for (const auto& entry : threads_) {
+    const Thread& thread = entry.second;
+    threads.push_back(thread.stats);
+    if (thread.state != ThreadState::kUnknown && now > thread.since) {
+      AddStateTime(thread.state, now - thread.since, &threads.back());
+    }
+  }
+  std::sort(threads.begin(), threads.end(),
+            [](const ThreadStats& a, const ThreadStats& b) {
+              return a.pid < b.pid;
+            });
+  return threads;
+}
+
+std::vector<CPUStats> SchedStats::CPUs(uint64_t now) const {
+  std::vector<CPUStats> cpus;
+  cpus.reserve(cpus_.size());
+  for (const auto& cpu : cpus_) {
+    cpus.push_back(cpu.stats);
+    if (cpu.current_pid < 0 || now <= cpu.since) {
+      continue;
+    }
+    if (cpu.current_pid == 0) {
+      cpus.back().idle_time += now - cpu.since;
+    } else {
+      cpus.back().busy_time += now - cpu.since;
+    }
+  }
+  return cpus;
+}
+
+SchedStats::Thread* SchedStats::GetThread(int32_t pid,
+                                          const std::array<char, 16>& comm) {
+  Thread& thread = threads_[pid];
+  thread.stats.pid = pid;
+  if (comm[0] != '\0') {
+    thread.stats.command = comm.data();
+  }
+  return &thread;
+}
+
+SchedStats::CPU* SchedStats::GetCPU(int cpu) {
+  if (cpu < 0) {
+    return nullptr;
+  }
+  if (static_cast<size_t>(cpu) >= cpus_.size()) {
+    const size_t first_new = cpus_.size();
+    cpus_.resize(cpu + 1);
+    for (size_t i = first_new; i < cpus_.size(); i++) {
+      cpus_[i].stats.cpu = i;
+    }
+  }
+  return &cpus_[cpu];
+}
+
+void SchedStats::Transition(Thread* thread, ThreadState state,
+                            uint64_t timestamp) {
+  if (thread->state != ThreadState::kUnknown && timestamp > thread->since) {
+    AddStateTime(thread->state, timestamp - thread->since, &thread->stats);
+  }
+  thread->state = state;
+  thread->since = timestamp;
+}
+
+void SchedStats::AddStateTime(ThreadState state, int64_t time,
+                              ThreadStats* stats) {
+  switch (state) {
+    case ThreadState::kRunning:
+      stats->run_time += time;
+      break;
+    case ThreadState::kWaiting:
+      stats->wait_time += time;
+      break;
+    case ThreadState::kSleeping:
+      stats->sleep_time += time;
+      break;
+    case ThreadState::kUnknown:
+      break;
+  }
+}
@@ -0,0 +1,147 @@
+#ifndef SCHEDVIZ_UTIL_SCHED_STATS_H_
+#define SCHEDVIZ_UTIL_SCHED_STATS_H_
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "util/sched_events.h"
+
+/**
+ * Scheduling totals of a single thread.
+ */
+struct ThreadStats {
+  int32_t pid = 0;
+  // The most recently seen command of the thread.
+  std::string command;
+  // Time spent running, runnable but waiting for a CPU, and blocked, in trace
+  // clock units.
+  int64_t run_time = 0;
+  int64_t wait_time = 0;
+  int64_t sleep_time = 0;
+  int64_t wakeups = 0;
+  int64_t migrations = 0;
+  // Number of times the thread was switched in, and switched out while still
+  // runnable.
+  int64_t switches = 0;
+  int64_t preemptions = 0;
+};
+
+/**
+ * Scheduling totals of a single CPU.
+ */
+struct CPUStats {
+  int cpu = 0;
+  // Time spent running threads other than the idle thread, and running the
+  // idle thread, in trace clock units.
+  int64_t busy_time = 0;
+  int64_t idle_time = 0;
+  int64_t switches = 0;
+  // Wakeups targeting this CPU, and migrations onto it.
+  int64_t wakeups = 0;
+  int64_t migrations_in = 0;
+};
+
+/**
+ * Accumulates per-thread and per-CPU scheduling totals from a time ordered
+ * stream of scheduling events, the same way the analysis library's thread
+ * summaries do, but in constant memory per thread.
+ *
+ * A thread's state is unknown until its first event, so time before that is
+ * not attributed to any state. Likewise, if a thread's switch-out was missed,
+ * e.g. because tracing was briefly off, its state is unknown until its next
+ * event.
+ */
+class SchedStats {
+ public:
+  /**
+   * Constructs a new SchedStats.
+   * @param decoder The decoder that produced the events. Used to interpret
+   *                sched_switch's prev_state. Must outlive this object.
+   */
+  explicit SchedStats(const SchedEventDecoder* decoder) : decoder_(decoder) {}
+
+  /**
+   * Feeds the next event. Events must be fed in timestamp order.
+   * @param event The event.
+   */
+  void OnEvent(const SchedEvent& event);
+
+  /**
+   * @param now Trace clock timestamp to close the threads' current states
+   *            at. Must not precede the last event fed.
+   * @return The totals of every thread seen so far, ordered by PID.
+   */
+  std::vector<ThreadStats> Threads(uint64_t now) const;
+
+  /**
+   * @param now Trace clock timestamp to close the CPUs' current intervals at.
+   *            Must not precede the last event fed.
+   * @return The totals of every CPU seen so far, ordered by CPU.
+   */
+  std::vector<CPUStats> CPUs(uint64_t now) const;
+
+  /**
+   * @return Timestamps of the first and last events fed, or 0 if none were.
+   */
+  uint64_t first_timestamp() const { return first_timestamp_; }
+  uint64_t last_timestamp() const { return last_timestamp_; }
+
+ private:
+  enum class ThreadState { kUnknown, kRunning, kWaiting, kSleeping };
+
+  struct Thread {
+    ThreadStats stats;
+    ThreadState state = ThreadState::kUnknown;
+    // When the thread entered its current state.
+    uint64_t since = 0;
+    // The CPU the thread last ran on.
+    int cpu = -1;
+  };
+
+  struct CPU {
+    CPUStats stats;
+    // The thread running on the CPU, or -1 until the CPU's first switch.
+    int32_t current_pid = -1;
+    // When current_pid was switched in.
+    uint64_t since = 0;
+  };
+
+  /**
+   * @param pid The thread's PID.
+   * @param comm The thread's command, or empty to leave it unchanged.
+   * @return The thread, created in the unknown state if it wasn't seen yet.
+   */
+  Thread* GetThread(int32_t pid, const std::array<char, 16>& comm);
+
+  /**
+   * @return The CPU, created if it wasn't seen yet. Never null for valid CPU
+   *         IDs.
+   */
+  CPU* GetCPU(int cpu);
+
+  /**
+   * Attributes the time since the thread's last transition to its current
+   * state, and moves it to state.
+   */
+  static void Transition(Thread* thread, ThreadState state,
+                         uint64_t timestamp);
+
+  /**
+   * Adds the time a thread has spent in state to its totals.
+   */
+  static void AddStateTime(ThreadState state, int64_t time,
+                           ThreadStats* stats);
+
+  const SchedEventDecoder* const decoder_;
+  // Indexed by PID. The idle threads (PID 0) are accounted per CPU instead.
+  std::unordered_map<int32_t, Thread> threads_;
+  // Indexed by CPU ID.
+  std::vector<CPU> cpus_;
+  uint64_t first_timestamp_ = 0;
+  uint64_t last_timestamp_ = 0;
+};
+
+#endif  // SCHEDVIZ_UTIL_SCHED_STATS_H_
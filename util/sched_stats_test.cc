@@ -0,0 +1,155 @@
+#include "util/sched_stats.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// prev_state of a thread that was preempted, and of one that blocked.
+constexpr int64_t kRunnable = 0;
+constexpr int64_t kSleeping = 1;
+
+SchedEvent Wakeup(uint64_t timestamp, int32_t pid, int32_t target_cpu) {
+  SchedEvent event{};
+  event.type = SchedEventType::kWakeup;
+  event.timestamp = timestamp;
+  event.pid = pid;
+  event.target_cpu = target_cpu;
+  return event;
+}
+
+SchedEvent Switch(uint64_t timestamp, int cpu, int32_t prev_pid,
+                  int64_t prev_state, int32_t next_pid,
+                  const char* next_comm = "") {
+  SchedEvent event{};
+  event.type = SchedEventType::kSwitch;
+  event.cpu = cpu;
+  event.timestamp = timestamp;
+  event.prev_pid = prev_pid;
+  event.prev_state = prev_state;
+  event.pid = next_pid;
+  strncpy(event.comm.data(), next_comm, event.comm.size() - 1);
+  return event;
+}
+
+SchedEvent Migrate(uint64_t timestamp, int32_t pid, int32_t orig_cpu,
+                   int32_t dest_cpu) {
+  SchedEvent event{};
+  event.type = SchedEventType::kMigrateTask;
+  event.timestamp = timestamp;
+  event.pid = pid;
+  event.orig_cpu = orig_cpu;
+  event.target_cpu = dest_cpu;
+  return event;
+}
+
+TEST(SchedStatsTest, TracksThreadStates) {
+  const SchedEventDecoder decoder;
+  SchedStats stats(&decoder);
+  stats.OnEvent(Wakeup(1000, 10, 0));
+  stats.OnEvent(Switch(1100, 0, 0, kRunnable, 10, "worker"));
+  stats.OnEvent(Switch(1400, 0, 10, kSleeping, 0));
+  stats.OnEvent(Wakeup(2400, 10, 0));
+  stats.OnEvent(Switch(2450, 0, 0, kRunnable, 10));
+  stats.OnEvent(Switch(2500, 0, 10, kRunnable, 11));
+
+  const std::vector<ThreadStats> threads = stats.Threads(3000);
+  ASSERT_EQ(threads.size(), 2);
+  const ThreadStats& worker = threads[0];
+  EXPECT_EQ(worker.pid, 10);
+  EXPECT_EQ(worker.command, "worker");
+  // Runs 1100-1400 and 2450-2500.
+  EXPECT_EQ(worker.run_time, 350);
+  // Waits 1000-1100 and 2400-2450, and after its preemption until now.
+  EXPECT_EQ(worker.wait_time, 100 + 50 + 500);
+  EXPECT_EQ(worker.sleep_time, 1000);
+  EXPECT_EQ(worker.wakeups, 2);
+  EXPECT_EQ(worker.switches, 2);
+  EXPECT_EQ(worker.preemptions, 1);
+
+  EXPECT_EQ(threads[1].pid, 11);
+  EXPECT_EQ(threads[1].run_time, 500);
+  EXPECT_EQ(threads[1].switches, 1);
+
+  EXPECT_EQ(stats.first_timestamp(), 1000);
+  EXPECT_EQ(stats.last_timestamp(), 2500);
+}
+
+TEST(SchedStatsTest, IgnoresTimeBeforeTheFirstEvent) {
+  const SchedEventDecoder decoder;
+  SchedStats stats(&decoder);
+  stats.OnEvent(Switch(1000, 0, 0, kRunnable, 20));
+  // Thread 10 was running before the capture started.
+  stats.OnEvent(Switch(1500, 1, 10, kSleeping, 0));
+
+  const std::vector<ThreadStats> threads = stats.Threads(2000);
+  ASSERT_EQ(threads.size(), 2);
+  EXPECT_EQ(threads[0].pid, 10);
+  EXPECT_EQ(threads[0].run_time, 0);
+  EXPECT_EQ(threads[0].sleep_time, 500);
+  EXPECT_EQ(threads[1].run_time, 1000);
+}
+
+TEST(SchedStatsTest, IgnoresWakeupsOfRunnableThreads) {
+  const SchedEventDecoder decoder;
+  SchedStats stats(&decoder);
+  stats.OnEvent(Wakeup(1000, 10, 0));
+  stats.OnEvent(Wakeup(1200, 10, 0));
+  stats.OnEvent(Switch(1300, 0, 0, kRunnable, 10));
+  stats.OnEvent(Wakeup(1400, 10, 0));
+
+  const std::vector<ThreadStats> threads = stats.Threads(1500);
+  ASSERT_EQ(threads.size(), 1);
+  EXPECT_EQ(threads[0].wakeups, 3);
+  EXPECT_EQ(threads[0].wait_time, 300);
+  EXPECT_EQ(threads[0].run_time, 200);
+}
+
+TEST(SchedStatsTest, ForgetsThreadsWhoseSwitchOutWasMissed) {
+  const SchedEventDecoder decoder;
+  SchedStats stats(&decoder);
+  stats.OnEvent(Switch(1000, 0, 0, kRunnable, 10));
+  // The switch from 10 to 11 was lost.
+  stats.OnEvent(Switch(2000, 0, 11, kSleeping, 0));
+
+  const std::vector<ThreadStats> threads = stats.Threads(3000);
+  ASSERT_EQ(threads.size(), 2);
+  EXPECT_EQ(threads[0].pid, 10);
+  EXPECT_EQ(threads[0].run_time, 0);
+  EXPECT_EQ(threads[0].wait_time, 0);
+  EXPECT_EQ(threads[0].sleep_time, 0);
+  EXPECT_EQ(threads[1].sleep_time, 1000);
+}
+
+TEST(SchedStatsTest, AccountsCPUBusyAndIdleTime) {
+  const SchedEventDecoder decoder;
+  SchedStats stats(&decoder);
+  stats.OnEvent(Switch(1000, 1, 0, kRunnable, 10));
+  stats.OnEvent(Switch(1300, 1, 10, kSleeping, 0));
+  stats.OnEvent(Wakeup(1500, 10, 1));
+  stats.OnEvent(Switch(1600, 1, 0, kRunnable, 10));
+  stats.OnEvent(Migrate(1700, 11, 0, 1));
+
+  const std::vector<CPUStats> cpus = stats.CPUs(2000);
+  ASSERT_EQ(cpus.size(), 2);
+  // cpu0 was only seen as a migration source.
+  EXPECT_EQ(cpus[0].cpu, 0);
+  EXPECT_EQ(cpus[0].busy_time, 0);
+  EXPECT_EQ(cpus[0].idle_time, 0);
+  EXPECT_EQ(cpus[0].switches, 0);
+  // Time before cpu1's first switch is unknown.
+  EXPECT_EQ(cpus[1].cpu, 1);
+  EXPECT_EQ(cpus[1].busy_time, 300 + 400);
+  EXPECT_EQ(cpus[1].idle_time, 300);
+  EXPECT_EQ(cpus[1].switches, 3);
+  EXPECT_EQ(cpus[1].wakeups, 1);
+  EXPECT_EQ(cpus[1].migrations_in, 1);
+
+  ASSERT_EQ(stats.Threads(2000).size(), 2);
+  EXPECT_EQ(stats.Threads(2000)[1].migrations, 1);
+}
+
+}  // namespace
@@ -0,0 +1,144 @@
+#include "util/sched_trigger.h"
+
+#include <cstdint>
+#include <string>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "absl/time/time.h"
+
+namespace {
+
+constexpr absl::string_view kWakeupLatency = "wakeup_latency";
+constexpr absl::string_view kRunqueueDepth = "runqueue_depth";
+
+}  // namespace
+
+Status TriggerCondition::Parse(absl::string_view spec,
+                               TriggerCondition* condition) {
+  const std::vector<absl::string_view> parts = absl::StrSplit(spec, '>');
+  if (parts.size() != 2) {
+    return Status::InternalError(absl::StrCat(
+        "Invalid trigger '", spec, "'. Expected <condition>><threshold>"));
+  }
+  const auto& name = absl::StripAsciiWhitespace(parts[0]);
+  const auto& value = absl::StripAsciiWhitespace(parts[1]);
+  TriggerCondition parsed;
+  if (name == kWakeupLatency) {
+    absl::Duration latency;
+    if (!absl::ParseDuration(value, &latency) ||
+        latency <= absl::ZeroDuration()) {
+      return Status::InternalError(absl::StrCat(
+          "Invalid wakeup latency '", value, "'. Expected e.g. 5ms"));
+    }
+    parsed.kind = Kind::kWakeupLatency;
+    parsed.threshold = absl::ToInt64Nanoseconds(latency);
+  } else if (name == kRunqueueDepth) {
+    if (!absl::SimpleAtoi(value, &parsed.threshold) || parsed.threshold < 0) {
+      return Status::InternalError(
+          absl::StrCat("Invalid run queue depth '", value, "'"));
+    }
+    parsed.kind = Kind::kRunqueueDepth;
+  } else {
+    return Status::InternalError(absl::StrCat(
+        "Unknown trigger condition '", name, "'. Expected ", kWakeupLatency,
+        " or ", kRunqueueDepth));
+  }
+  *condition = parsed;
+  return Status::OkStatus();
+}
+
+std::string TriggerCondition::ToString() const {
+  switch (kind) {
+    case Kind::kWakeupLatency:
+      return absl::StrCat(kWakeupLatency, ">",
+                          absl::FormatDuration(absl::Nanoseconds(threshold)));
+    case Kind::kRunqueueDepth:
+      return absl::StrCat(kRunqueueDepth, ">", threshold);
+  }
+  return "";
+}
+
+bool SchedTrigger::OnEvent(const SchedEvent& event, std::string* detail) {
+  switch (event.type) {
+    case SchedEventType::kWakeup:
+    case SchedEventType::kWakeupNew: {
+      wakeups_.OnWakeup(event.pid, event.timestamp);
+      const int64_t depth = Enqueue(event.pid, event.target_cpu);
+      if (condition_.kind == TriggerCondition::Kind::kRunqueueDepth &&
+          depth > condition_.threshold) {
+        *detail = absl::StrCat("cpu", event.target_cpu, " run queue depth ",
+                               depth, " after waking pid ", event.pid);
+        return true;
+      }
+      return false;
+    }
+    case SchedEventType::kMigrateTask: {
+      const auto& it = runqueue_cpu_.find(event.pid);
+      if (it == runqueue_cpu_.end()) {
+        return false;
+      }
+      const int64_t depth = Enqueue(event.pid, event.target_cpu);
+      if (condition_.kind == TriggerCondition::Kind::kRunqueueDepth &&
+          depth > condition_.threshold) {
+        *detail = absl::StrCat("cpu", event.target_cpu, " run queue depth ",
+                               depth, " after migrating pid ", event.pid);
+        return true;
+      }
+      return false;
+    }
+    case SchedEventType::kSwitch: {
+      const auto& latency =
+          wakeups_.OnSwitch(event.prev_pid, event.pid, event.timestamp);
+      Dequeue(event.pid);
+      int64_t depth = 0;
+      // The idle thread never waits on a run queue.
+      if (event.prev_pid != 0 && decoder_->IsRunnableState(event.prev_state)) {
+        depth = Enqueue(event.prev_pid, event.cpu);
+      }
+      if (condition_.kind == TriggerCondition::Kind::kRunqueueDepth &&
+          depth > condition_.threshold) {
+        *detail = absl::StrCat("cpu", event.cpu, " run queue depth ", depth,
+                               " after preempting pid ", event.prev_pid);
+        return true;
+      }
+
+      if (latency.has_value() &&
+          condition_.kind == TriggerCondition::Kind::kWakeupLatency &&
+          *latency > condition_.threshold) {
+        *detail = absl::StrCat(
+            "pid ", event.pid, " waited ",
+            absl::FormatDuration(absl::Nanoseconds(*latency)),
+            " between wakeup and switch-in on cpu", event.cpu);
+        return true;
+      }
+      return false;
+    }
+  }
+  return false;
+}
+
+int64_t SchedTrigger::Enqueue(int32_t pid, int cpu) {
+  if (cpu < 0) {
+    return 0;
+  }
+  Dequeue(pid);
+  if (static_cast<size_t>(cpu) >= runqueue_depth_.size()) {
+    runqueue_depth_.resize(cpu + 1, 0);
+  }
+  runqueue_cpu_[pid] = cpu;
+  return ++runqueue_depth_[cpu];
+}
+
+void SchedTrigger::Dequeue(int32_t pid) {
+  const auto& it = runqueue_cpu_.find(pid);
+  if (it == runqueue_cpu_.end()) {
+    return;
+  }
+  if (runqueue_depth_[it->second] > 0) {
+    runqueue_depth_[it->second]--;
+  }
+  runqueue_cpu_.erase(it);
+}
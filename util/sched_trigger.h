@@ -0,0 +1,92 @@
+#ifndef SCHEDVIZ_UTIL_SCHED_TRIGGER_H_
+#define SCHEDVIZ_UTIL_SCHED_TRIGGER_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "util/sched_events.h"
+#include "util/status.h"
+
+/**
+ * A scheduling condition evaluated online against the drained events.
+ */
+struct TriggerCondition {
+  enum class Kind {
+    // A thread waited longer than threshold nanoseconds between its wakeup
+    // and being switched in.
+    kWakeupLatency,
+    // More than threshold threads were waiting on a single CPU's run queue.
+    kRunqueueDepth,
+  };
+  Kind kind = Kind::kWakeupLatency;
+  int64_t threshold = 0;
+
+  /**
+   * Parses a condition of the form "wakeup_latency>5ms" or
+   * "runqueue_depth>4".
+   * @param spec The condition to parse.
+   * @param condition The parsed condition. Only written to on success.
+   * @return Status if successful or not.
+   */
+  static Status Parse(absl::string_view spec, TriggerCondition* condition);
+
+  /**
+   * @return The condition in the same form accepted by Parse.
+   */
+  std::string ToString() const;
+};
+
+/**
+ * Tracks run queue membership and pending wakeups from a time ordered stream
+ * of scheduling events, and reports when a TriggerCondition holds.
+ *
+ * Threads that were already waiting when the capture started are not known,
+ * so run queue depths are lower bounds.
+ */
+class SchedTrigger {
+ public:
+  /**
+   * Constructs a new SchedTrigger.
+   * @param condition The condition to evaluate.
+   * @param decoder The decoder that produced the events. Used to interpret
+   *                sched_switch's prev_state. Must outlive this object.
+   */
+  SchedTrigger(TriggerCondition condition, const SchedEventDecoder* decoder)
+      : condition_(condition), decoder_(decoder) {}
+
+  /**
+   * Feeds the next event. Events must be fed in timestamp order.
+   * @param event The event.
+   * @param detail Set to a human readable description of why the condition
+   *               holds, if it does.
+   * @return Whether or not the condition holds after this event.
+   */
+  bool OnEvent(const SchedEvent& event, std::string* detail);
+
+ private:
+  /**
+   * Marks a thread as waiting on a CPU's run queue.
+   * @return The new depth of that run queue.
+   */
+  int64_t Enqueue(int32_t pid, int cpu);
+
+  /**
+   * Removes a thread from whichever run queue it is waiting on, if any.
+   */
+  void Dequeue(int32_t pid);
+
+  const TriggerCondition condition_;
+  const SchedEventDecoder* const decoder_;
+
+  // Measures wakeup latencies.
+  WakeupTracker wakeups_;
+  // The CPU whose run queue each waiting thread is on.
+  std::unordered_map<int32_t, int> runqueue_cpu_;
+  // Number of waiting threads on each CPU's run queue. Indexed by CPU ID.
+  std::vector<int64_t> runqueue_depth_;
+};
+
+#endif  // SCHEDVIZ_UTIL_SCHED_TRIGGER_H_
@@ -0,0 +1,96 @@
+#include "util/sched_trigger.h"
+
+#include <cstdint>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// prev_state of a thread that blocked.
+constexpr int64_t kSleeping = 1;
+
+SchedEvent Wakeup(uint64_t timestamp, int32_t pid, int32_t target_cpu) {
+  SchedEvent event{};
+  event.type = SchedEventType::kWakeup;
+  event.timestamp = timestamp;
+  event.pid = pid;
+  event.target_cpu = target_cpu;
+  return event;
+}
+
+SchedEvent Switch(uint64_t timestamp, int cpu, int32_t prev_pid,
+                  int64_t prev_state, int32_t next_pid) {
+  SchedEvent event{};
+  event.type = SchedEventType::kSwitch;
+  event.cpu = cpu;
+  event.timestamp = timestamp;
+  event.prev_pid = prev_pid;
+  event.prev_state = prev_state;
+  event.pid = next_pid;
+  return event;
+}
+
+TEST(TriggerConditionTest, ParsesConditions) {
+  TriggerCondition condition;
+  ASSERT_TRUE(TriggerCondition::Parse("wakeup_latency>5ms", &condition).ok());
+  EXPECT_EQ(condition.kind, TriggerCondition::Kind::kWakeupLatency);
+  EXPECT_EQ(condition.threshold, 5000000);
+  EXPECT_EQ(condition.ToString(), "wakeup_latency>5ms");
+
+  ASSERT_TRUE(TriggerCondition::Parse(" runqueue_depth > 4 ", &condition).ok());
+  EXPECT_EQ(condition.kind, TriggerCondition::Kind::kRunqueueDepth);
+  EXPECT_EQ(condition.threshold, 4);
+  EXPECT_EQ(condition.ToString(), "runqueue_depth>4");
+}
+
+TEST(TriggerConditionTest, RejectsMalformedConditions) {
+  for (const char* spec : {
+           "",
+           "wakeup_latency",
+           "wakeup_latency>",
+           "wakeup_latency>5",
+           "wakeup_latency>0ms",
+           "wakeup_latency>-5ms",
+           "wakeup_latency>5ms>6ms",
+           "runqueue_depth>-1",
+           "runqueue_depth>4.5",
+           "runqueue_depth>x",
+           "load>4",
+       }) {
+    TriggerCondition condition;
+    condition.threshold = 42;
+    EXPECT_FALSE(TriggerCondition::Parse(spec, &condition).ok()) << spec;
+    EXPECT_EQ(condition.threshold, 42) << spec;
+  }
+}
+
+TEST(SchedTriggerTest, FiresOnWakeupLatency) {
+  const SchedEventDecoder decoder;
+  SchedTrigger trigger({TriggerCondition::Kind::kWakeupLatency, 100},
+                       &decoder);
+  std::string detail;
+  EXPECT_FALSE(trigger.OnEvent(Wakeup(1000, 10, 0), &detail));
+  EXPECT_FALSE(trigger.OnEvent(Switch(1050, 0, 0, 0, 10), &detail));
+  EXPECT_FALSE(trigger.OnEvent(Switch(1100, 0, 10, kSleeping, 0), &detail));
+  EXPECT_FALSE(trigger.OnEvent(Wakeup(2000, 10, 0), &detail));
+  EXPECT_TRUE(trigger.OnEvent(Switch(2101, 0, 0, 0, 10), &detail));
+  EXPECT_NE(detail.find("pid 10"), std::string::npos) << detail;
+}
+
+TEST(SchedTriggerTest, FiresOnRunqueueDepth) {
+  const SchedEventDecoder decoder;
+  SchedTrigger trigger({TriggerCondition::Kind::kRunqueueDepth, 2}, &decoder);
+  std::string detail;
+  EXPECT_FALSE(trigger.OnEvent(Wakeup(1, 10, 0), &detail));
+  EXPECT_FALSE(trigger.OnEvent(Wakeup(2, 11, 0), &detail));
+  // Switching one in leaves room for another.
+  EXPECT_FALSE(trigger.OnEvent(Switch(3, 0, 0, 0, 10), &detail));
+  EXPECT_FALSE(trigger.OnEvent(Wakeup(4, 12, 0), &detail));
+  // Preempting the running thread puts it back on the run queue.
+  EXPECT_FALSE(trigger.OnEvent(Switch(5, 0, 10, 0, 11), &detail));
+  EXPECT_TRUE(trigger.OnEvent(Wakeup(6, 13, 0), &detail));
+  EXPECT_NE(detail.find("run queue depth 3"), std::string::npos) << detail;
+}
+
+}  // namespace
@@ -0,0 +1,88 @@
+#ifndef SCHEDVIZ_UTIL_SPSC_QUEUE_H_
+#define SCHEDVIZ_UTIL_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * A bounded lock-free queue with a single producer thread and a single
+ * consumer thread.
+ *
+ * The producer only writes tail_ and the consumer only writes head_, so
+ * neither ever waits on the other; a full or empty queue is reported to the
+ * caller instead.
+ */
+template <typename T>
+class SPSCQueue {
+ public:
+  /**
+   * Constructs an empty queue.
+   * @param capacity How many values the queue holds. Rounded up to a power
+   *                 of two.
+   */
+  explicit SPSCQueue(size_t capacity) {
+    size_t slots = 1;
+    while (slots < capacity) {
+      slots *= 2;
+    }
+    slots_.resize(slots);
+    mask_ = slots - 1;
+  }
+
+  SPSCQueue(const SPSCQueue&) = delete;
+  SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+  /**
+   * Appends a value. Must only be called by the producer.
+   * @param value The value. Only moved from if there is room.
+   * @return Whether there was room for the value.
+   */
+  bool TryPush(T&& value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+      return false;
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Removes the oldest value. Must only be called by the consumer.
+   * @param value Set to the value, if there is one.
+   * @return Whether there was a value.
+   */
+  bool TryPop(T* value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @return How many values are queued. Exact when called by the producer
+   *         or the consumer while the other is idle, and a snapshot
+   *         otherwise.
+   */
+  size_t size() const {
+    // head_ never passes tail_, so reading it first never underflows.
+    const size_t head = head_.load(std::memory_order_acquire);
+    return tail_.load(std::memory_order_acquire) - head;
+  }
+
+ private:
+  std::vector<T> slots_;
+  size_t mask_;
+  // Count of values ever popped, written by the consumer. On its own cache
+  // line, so that the two threads don't contend on it.
+  alignas(64) std::atomic<size_t> head_{0};
+  // Count of values ever pushed, written by the producer.
+  alignas(64) std::atomic<size_t> tail_{0};
+};
+
+#endif  // SCHEDVIZ_UTIL_SPSC_QUEUE_H_
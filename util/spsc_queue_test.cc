@@ -0,0 +1,80 @@
+#include "util/spsc_queue.h"
+
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+TEST(SPSCQueueTest, RoundsCapacityUpToAPowerOfTwo) {
+  SPSCQueue<int> queue(5);
+  int pushed = 0;
+  for (int value = 0; value < 100; value++) {
+    if (!queue.TryPush(std::move(value))) {
+      break;
+    }
+    pushed++;
+  }
+  EXPECT_EQ(pushed, 8);
+  EXPECT_EQ(queue.size(), 8);
+}
+
+TEST(SPSCQueueTest, PopsInOrderAndReportsEmpty) {
+  SPSCQueue<int> queue(4);
+  int value;
+  EXPECT_FALSE(queue.TryPop(&value));
+  // Wrap around the slots several times.
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < 3; i++) {
+      ASSERT_TRUE(queue.TryPush(round * 3 + i));
+    }
+    for (int i = 0; i < 3; i++) {
+      ASSERT_TRUE(queue.TryPop(&value));
+      EXPECT_EQ(value, round * 3 + i);
+    }
+    EXPECT_EQ(queue.size(), 0);
+    EXPECT_FALSE(queue.TryPop(&value));
+  }
+}
+
+TEST(SPSCQueueTest, LeavesValueWhenFull) {
+  SPSCQueue<std::unique_ptr<int>> queue(1);
+  ASSERT_TRUE(queue.TryPush(std::make_unique<int>(1)));
+  auto second = std::make_unique<int>(2);
+  EXPECT_FALSE(queue.TryPush(std::move(second)));
+  ASSERT_NE(second, nullptr);
+  EXPECT_EQ(*second, 2);
+}
+
+TEST(SPSCQueueTest, PassesValuesBetweenThreads) {
+  constexpr uint64_t kValues = 1 << 20;
+  SPSCQueue<uint64_t> queue(64);
+  std::thread producer([&queue] {
+    for (uint64_t value = 0; value < kValues;) {
+      uint64_t pushed = value;
+      if (queue.TryPush(std::move(pushed))) {
+        value++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+  uint64_t expected = 0;
+  uint64_t out_of_order = 0;
+  while (expected < kValues) {
+    uint64_t value;
+    if (queue.TryPop(&value)) {
+      out_of_order += value != expected;
+      expected++;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  EXPECT_EQ(out_of_order, 0);
+  EXPECT_EQ(queue.size(), 0);
+}
+
+}  // namespace
@@ -0,0 +1,174 @@
+#include "util/thread_snapshot.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+
+namespace {
+
+// A reader is started for about this many processes, since starting one
+// costs more than reading a few processes.
+constexpr size_t kProcessesPerReader = 256;
+// Readers claim this many processes at a time.
+constexpr size_t kProcessBatch = 16;
+// Room for a stat line, which is about 300 bytes.
+constexpr size_t kStatBufferSize = 1024;
+// The difference between stat's priority field and the kernel's priority.
+constexpr int32_t kPriorityOffset = 100;
+
+/**
+ * @param dir_fd An open directory.
+ * @param ids Set to the entries that are numbers, like PIDs. Closes dir_fd.
+ */
+void ReadIDs(int dir_fd, std::vector<int32_t>* ids) {
+  DIR* dir = fdopendir(dir_fd);
+  if (dir == nullptr) {
+    close(dir_fd);
+    return;
+  }
+  while (const dirent* entry = readdir(dir)) {
+    int32_t id;
+    if (absl::SimpleAtoi(entry->d_name, &id)) {
+      ids->push_back(id);
+    }
+  }
+  closedir(dir);
+}
+
+/**
+ * Reads the threads of the processes that are claimed from pids, until
+ * they're all claimed.
+ */
+void ReadProcesses(int proc_fd, const std::vector<int32_t>& pids,
+                   std::atomic<size_t>* next, std::vector<ThreadState>* out) {
+  std::vector<int32_t> tids;
+  char buffer[kStatBufferSize];
+  for (;;) {
+    const size_t begin = next->fetch_add(kProcessBatch);
+    if (begin >= pids.size()) {
+      return;
+    }
+    const size_t end = std::min(pids.size(), begin + kProcessBatch);
+    for (size_t i = begin; i < end; i++) {
+      const int task_fd =
+          openat(proc_fd, absl::StrCat(pids[i], "/task").c_str(),
+                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (task_fd == -1) {
+        // The process exited.
+        continue;
+      }
+      // ReadIDs closes its descriptor, so it gets a copy to keep this one
+      // for the stat files.
+      tids.clear();
+      ReadIDs(dup(task_fd), &tids);
+      for (int32_t tid : tids) {
+        const int stat_fd = openat(task_fd, absl::StrCat(tid, "/stat").c_str(),
+                                   O_RDONLY | O_CLOEXEC);
+        if (stat_fd == -1) {
+          continue;
+        }
+        const ssize_t length = read(stat_fd, buffer, sizeof(buffer));
+        close(stat_fd);
+        ThreadState thread;
+        if (length > 0 &&
+            ParseThreadStat(absl::string_view(buffer, length), &thread)) {
+          thread.tgid = pids[i];
+          out->push_back(std::move(thread));
+        }
+      }
+      close(task_fd);
+    }
+  }
+}
+
+}  // namespace
+
+bool ParseThreadStat(absl::string_view stat, ThreadState* thread) {
+  // "PID (COMM) STATE PPID ...", where COMM may itself hold spaces and
+  // parentheses, so it ends at the last ')'.
+  const size_t comm_start = stat.find('(');
+  const size_t comm_end = stat.rfind(')');
+  if (comm_start == absl::string_view::npos ||
+      comm_end == absl::string_view::npos || comm_end < comm_start ||
+      !absl::SimpleAtoi(stat.substr(0, comm_start), &thread->pid)) {
+    return false;
+  }
+  thread->command =
+      std::string(stat.substr(comm_start + 1, comm_end - comm_start - 1));
+  // Fields from the state on, which is stat's third field.
+  const std::vector<absl::string_view> fields =
+      absl::StrSplit(stat.substr(comm_end + 1), ' ', absl::SkipEmpty());
+  constexpr size_t kState = 0;
+  constexpr size_t kPriority = 18 - 3;
+  constexpr size_t kProcessor = 39 - 3;
+  if (fields.size() <= kProcessor || fields[kState].empty() ||
+      !absl::SimpleAtoi(fields[kPriority], &thread->priority) ||
+      !absl::SimpleAtoi(fields[kProcessor], &thread->cpu)) {
+    return false;
+  }
+  thread->state = fields[kState][0];
+  thread->priority += kPriorityOffset;
+  return true;
+}
+
+Status ThreadSnapshot::Take(const std::filesystem::path& proc_root,
+                            int max_readers,
+                            std::unique_ptr<ThreadSnapshot>* snapshot) {
+  const auto& start = absl::Now();
+  const int proc_fd =
+      open(proc_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (proc_fd == -1) {
+    return Status::InternalError(absl::StrCat(
+        "Unable to open ", proc_root.string(), ": ", strerror(errno)));
+  }
+  std::vector<int32_t> pids;
+  ReadIDs(dup(proc_fd), &pids);
+
+  std::unique_ptr<ThreadSnapshot> taken(new ThreadSnapshot());
+  taken->readers_ = static_cast<int>(std::clamp<size_t>(
+      pids.size() / kProcessesPerReader, 1, std::max(max_readers, 1)));
+  std::vector<std::vector<ThreadState>> read(taken->readers_);
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> readers;
+  // This thread is a reader too.
+  for (int reader = 1; reader < taken->readers_; reader++) {
+    readers.emplace_back(ReadProcesses, proc_fd, std::cref(pids), &next,
+                         &read[reader]);
+  }
+  ReadProcesses(proc_fd, pids, &next, &read[0]);
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  close(proc_fd);
+
+  size_t count = 0;
+  for (const auto& threads : read) {
+    count += threads.size();
+  }
+  taken->threads_.reserve(count);
+  for (auto& threads : read) {
+    std::move(threads.begin(), threads.end(),
+              std::back_inserter(taken->threads_));
+  }
+  std::sort(taken->threads_.begin(), taken->threads_.end(),
+            [](const ThreadState& a, const ThreadState& b) {
+              return a.pid < b.pid;
+            });
+  taken->read_time_ = absl::Now() - start;
+  *snapshot = std::move(taken);
+  return Status::OkStatus();
+}
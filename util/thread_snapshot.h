@@ -0,0 +1,84 @@
+#ifndef SCHEDVIZ_UTIL_THREAD_SNAPSHOT_H_
+#define SCHEDVIZ_UTIL_THREAD_SNAPSHOT_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "util/status.h"
+
+/**
+ * A thread's scheduling state, as procfs reports it in
+ * /proc/PID/task/TID/stat.
+ */
+struct ThreadState {
+  int32_t pid = 0;
+  // The process the thread belongs to.
+  int32_t tgid = 0;
+  std::string command;
+  // The kernel's priority, as in sched_switch's prev_prio: 100 to 139 for
+  // normal threads, below 100 for real-time ones.
+  int32_t priority = 0;
+  // stat's one letter state, e.g. 'R' for running or runnable, 'S' for
+  // sleeping, 'D' for uninterruptible and 'I' for idle kernel threads.
+  char state = '?';
+  // The CPU the thread last ran on.
+  int32_t cpu = -1;
+};
+
+/**
+ * @param stat The contents of a thread's stat file.
+ * @param thread Set to the thread's state, except for its tgid.
+ * @return Whether the contents are well formed.
+ */
+bool ParseThreadStat(absl::string_view stat, ThreadState* thread);
+
+/**
+ * The state of every thread on the system, read from procfs.
+ *
+ * Processes are shared out among several reader threads, each of which reads
+ * the stat files of its processes' threads. A stat file is formatted by the
+ * kernel on read, so a system with many threads takes a while to read, and
+ * the threads' states are from slightly different times. Threads that exit
+ * while being read are left out.
+ */
+class ThreadSnapshot {
+ public:
+  /**
+   * Reads every thread's state.
+   * @param proc_root Where procfs is mounted, usually /proc.
+   * @param max_readers The most reader threads to read with.
+   * @param snapshot Set to the snapshot on success.
+   * @return Status if successful or not.
+   */
+  static Status Take(const std::filesystem::path& proc_root, int max_readers,
+                     std::unique_ptr<ThreadSnapshot>* snapshot);
+
+  /**
+   * @return The threads, by ascending PID.
+   */
+  const std::vector<ThreadState>& threads() const { return threads_; }
+
+  /**
+   * @return How many reader threads read the snapshot.
+   */
+  int readers() const { return readers_; }
+
+  /**
+   * @return How long reading took.
+   */
+  absl::Duration read_time() const { return read_time_; }
+
+ private:
+  ThreadSnapshot() = default;
+
+  std::vector<ThreadState> threads_;
+  int readers_ = 0;
+  absl::Duration read_time_;
+};
+
+#endif  // SCHEDVIZ_UTIL_THREAD_SNAPSHOT_H_
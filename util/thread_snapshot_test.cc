@@ -0,0 +1,149 @@
+#include "util/thread_snapshot.h"
+
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+/**
+ * @return A stat line as the kernel formats it, with the fields that
+ *         ParseThreadStat doesn't read set to placeholders.
+ */
+std::string Stat(int32_t pid, const std::string& command, char state,
+                 int32_t priority, int32_t cpu) {
+  std::string stat =
+      absl::StrCat(pid, " (", command, ") ", std::string(1, state));
+  // Fields 4 to 52, of which 18 is the priority and 39 the CPU.
+  for (int field = 4; field <= 52; field++) {
+    if (field == 18) {
+      absl::StrAppend(&stat, " ", priority);
+    } else if (field == 39) {
+      absl::StrAppend(&stat, " ", cpu);
+    } else {
+      absl::StrAppend(&stat, " ", field * 10);
+    }
+  }
+  return stat + "\n";
+}
+
+TEST(ParseThreadStatTest, ParsesStat) {
+  ThreadState thread;
+  ASSERT_TRUE(ParseThreadStat(Stat(1234, "bash", 'S', 20, 3), &thread));
+  EXPECT_EQ(thread.pid, 1234);
+  EXPECT_EQ(thread.command, "bash");
+  EXPECT_EQ(thread.state, 'S');
+  // stat's priority is offset from the kernel's by 100.
+  EXPECT_EQ(thread.priority, 120);
+  EXPECT_EQ(thread.cpu, 3);
+}
+
+TEST(ParseThreadStatTest, ParsesRealTimePriorities) {
+  ThreadState thread;
+  ASSERT_TRUE(ParseThreadStat(Stat(7, "migration/0", 'R', -100, 0), &thread));
+  EXPECT_EQ(thread.priority, 0);
+  EXPECT_EQ(thread.state, 'R');
+}
+
+TEST(ParseThreadStatTest, ParsesCommandsWithSpacesAndParentheses) {
+  ThreadState thread;
+  ASSERT_TRUE(ParseThreadStat(Stat(42, "a (b) c) d", 'D', 39, 1), &thread));
+  EXPECT_EQ(thread.command, "a (b) c) d");
+  EXPECT_EQ(thread.state, 'D');
+  EXPECT_EQ(thread.priority, 139);
+  EXPECT_EQ(thread.cpu, 1);
+
+  ASSERT_TRUE(ParseThreadStat(Stat(43, "", 'I', 20, 0), &thread));
+  EXPECT_EQ(thread.command, "");
+}
+
+TEST(ParseThreadStatTest, RejectsMalformedStats) {
+  const std::string stat = Stat(1234, "bash", 'S', 20, 3);
+  for (const std::string& malformed : {
+           std::string(),
+           std::string("garbage"),
+           std::string("1234 bash S 1 2 3"),
+           std::string("1234 (bash S 1 2 3"),
+           std::string("1234 bash) (S 1 2 3"),
+           std::string("x (bash) S 1 2 3"),
+           // Cut off before the CPU.
+           stat.substr(0, stat.find(" 380 ") + 4),
+           // A priority that isn't a number.
+           std::string(stat).replace(stat.find(" 20 "), 4, " x "),
+       }) {
+    ThreadState thread;
+    EXPECT_FALSE(ParseThreadStat(malformed, &thread)) << malformed;
+  }
+}
+
+class ThreadSnapshotTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    proc_root_ = std::filesystem::path(::testing::TempDir()) /
+                 ("thread_snapshot_test." + std::to_string(getpid()));
+    std::filesystem::create_directories(proc_root_);
+  }
+
+  void TearDown() override { std::filesystem::remove_all(proc_root_); }
+
+  void AddThread(int32_t tgid, int32_t pid, const std::string& stat) {
+    const auto& dir =
+        proc_root_ / absl::StrCat(tgid) / "task" / absl::StrCat(pid);
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir / "stat") << stat;
+  }
+
+  std::filesystem::path proc_root_;
+};
+
+TEST_F(ThreadSnapshotTest, ReadsEveryThread) {
+  AddThread(300, 300, Stat(300, "server", 'S', 20, 0));
+  AddThread(300, 301, Stat(301, "server worker", 'R', 10, 1));
+  AddThread(1, 1, Stat(1, "init", 'S', 20, 1));
+  // A thread whose stat is malformed, and entries that aren't processes.
+  AddThread(5, 5, "garbage");
+  std::filesystem::create_directories(proc_root_ / "self" / "task");
+  std::filesystem::create_directories(proc_root_ / "sys");
+
+  std::unique_ptr<ThreadSnapshot> snapshot;
+  ASSERT_TRUE(ThreadSnapshot::Take(proc_root_, 4, &snapshot).ok());
+  EXPECT_EQ(snapshot->readers(), 1);
+  const auto& threads = snapshot->threads();
+  ASSERT_EQ(threads.size(), 3);
+  EXPECT_EQ(threads[0].pid, 1);
+  EXPECT_EQ(threads[0].tgid, 1);
+  EXPECT_EQ(threads[1].pid, 300);
+  EXPECT_EQ(threads[1].tgid, 300);
+  EXPECT_EQ(threads[2].pid, 301);
+  EXPECT_EQ(threads[2].tgid, 300);
+  EXPECT_EQ(threads[2].command, "server worker");
+  EXPECT_EQ(threads[2].priority, 110);
+}
+
+TEST_F(ThreadSnapshotTest, SharesProcessesAmongReaders) {
+  for (int32_t pid = 1; pid <= 1000; pid++) {
+    AddThread(pid, pid, Stat(pid, "worker", 'S', 20, pid % 4));
+  }
+  std::unique_ptr<ThreadSnapshot> snapshot;
+  ASSERT_TRUE(ThreadSnapshot::Take(proc_root_, 2, &snapshot).ok());
+  EXPECT_EQ(snapshot->readers(), 2);
+  const auto& threads = snapshot->threads();
+  ASSERT_EQ(threads.size(), 1000);
+  for (int32_t pid = 1; pid <= 1000; pid++) {
+    EXPECT_EQ(threads[pid - 1].pid, pid);
+  }
+}
+
+TEST_F(ThreadSnapshotTest, FailsWithoutProcfs) {
+  std::unique_ptr<ThreadSnapshot> snapshot;
+  EXPECT_FALSE(
+      ThreadSnapshot::Take(proc_root_ / "missing", 4, &snapshot).ok());
+}
+
+}  // namespace
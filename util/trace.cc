@@ -2,30 +2,64 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "re2/re2.h"
+#include "util/event_format.h"
+#include "util/hist_triggers.h"
+#include "util/perf_buffer.h"
+#include "util/ring_buffer.h"
+#include "util/sched_events.h"
+#include "util/sched_trigger.h"
 #include "util/status.h"
+#include "util/trace_clock.h"
+#include "util/trace_stream.h"
+#include "util/uring_writer.h"
 
 // Command line flags
 ABSL_FLAG(std::string, out, "", "Path to directory to save trace in");
-ABSL_FLAG(int, capture_seconds, 0, "Number of seconds to record a trace");
+ABSL_FLAG(int, capture_seconds, 0,
+          "Number of seconds to record a trace. Optional when tracing a "
+          "command, in which case it bounds the capture");
 ABSL_FLAG(int, buffer_size, 4096,
           "Size of the trace buffer in KB. Default 4096");
 ABSL_FLAG(std::vector<std::string>, events,
@@ -41,14 +75,184 @@ ABSL_FLAG(std::string, kernel_trace_root, "/sys/kernel/debug/tracing",
           "Path to the root directory of the Ftrace filesystem");
 ABSL_FLAG(std::string, kernel_devices_root, "/sys/devices",
           "Path to the root directory of the devices filesystem");
+ABSL_FLAG(int64_t, max_events, 0,
+          "Stop the capture once this many events have been captured across "
+          "all CPUs, ending it with the page that reaches the limit. Pages "
+          "held until --trigger fires count once it fires. 0 means no "
+          "limit.");
+ABSL_FLAG(int64_t, max_bytes, 0,
+          "Stop the capture once this many bytes have been captured across "
+          "all CPUs, ending it with the page that reaches the limit. 0 means "
+          "no limit.");
+ABSL_FLAG(int64_t, max_cpu_events, 0,
+          "Stop the capture once this many events have been captured from "
+          "any single CPU, ending it with the page that reaches the limit. 0 "
+          "means no limit.");
+ABSL_FLAG(int64_t, max_cpu_bytes, 0,
+          "Stop the capture once this many bytes have been captured from any "
+          "single CPU, ending it with the page that reaches the limit. 0 "
+          "means no limit.");
+ABSL_FLAG(std::string, trigger, "",
+          "Scheduling condition that starts or stops the capture, e.g. "
+          "'wakeup_latency>5ms' or 'runqueue_depth>4'.");
+ABSL_FLAG(std::string, trigger_action, "start",
+          "What to do when --trigger holds: 'start' only keeps the "
+          "--pre_trigger window until then, 'stop' records from the start. "
+          "Both stop --post_trigger after the trigger.");
+ABSL_FLAG(absl::Duration, pre_trigger, absl::Seconds(1),
+          "How much data from before the trigger to keep with "
+          "--trigger_action=start.");
+ABSL_FLAG(absl::Duration, post_trigger, absl::Seconds(1),
+          "How long to keep recording after the trigger.");
+ABSL_FLAG(std::string, escalate_on, "",
+          "Scheduling condition that enables --escalation_events while it "
+          "persists, e.g. 'wakeup_latency>5ms'.");
+ABSL_FLAG(std::vector<std::string>, escalation_events, {},
+          "Comma separated list of FTrace events to enable while "
+          "--escalate_on holds.");
+ABSL_FLAG(absl::Duration, escalation_hold, absl::Seconds(1),
+          "How long --escalate_on must stop holding before "
+          "--escalation_events are disabled again.");
+ABSL_FLAG(std::string, backend, "trace_pipe_raw",
+          "How to drain events from the kernel: 'trace_pipe_raw' reads FTrace's "
+          "per-CPU pipes, 'perf' samples the tracepoints with perf_event_open "
+          "and consumes its per-CPU mmap'd ring buffers.");
+ABSL_FLAG(bool, summary, false,
+          "Compute per-thread and per-CPU scheduling totals while capturing, "
+          "and write them to summary.textproto in the archive.");
+ABSL_FLAG(absl::Duration, top, absl::ZeroDuration(),
+          "If positive, print the threads that ran the most this often while "
+          "capturing. Implies --summary.");
+ABSL_FLAG(bool, histograms, false,
+          "Maintain per-thread and per-CPU wakeup latency, run slice and "
+          "migration distance histograms while capturing, and write them to "
+          "histograms.textproto in the archive.");
+ABSL_FLAG(int, histogram_threads, 1024,
+          "How many threads get their own --histograms. Later threads share "
+          "one set of histograms, which bounds memory use.");
+ABSL_FLAG(bool, aggregate, false,
+          "Aggregate per-thread wakeup latency, run time and wait time "
+          "histograms in the kernel with hist triggers instead of recording "
+          "raw events. Requires Linux 4.17 or later.");
+ABSL_FLAG(absl::Duration, aggregate_interval, absl::ZeroDuration(),
+          "How often to snapshot the --aggregate tables. 0 only reads them at "
+          "the end of the capture.");
+ABSL_FLAG(std::vector<std::string>, stream, {},
+          "Comma separated list of sinks to stream the capture to while "
+          "tracing, as well as or instead of writing a tar.gz to --out: '-' "
+          "for stdout, 'unix:PATH' for a listening Unix domain socket, "
+          "'file:PATH' or 'pipe:COMMAND'. Each may be prefixed by 'block@' "
+          "(the default), 'drop@' or 'spill@' to choose what happens when "
+          "it can't keep up.");
+ABSL_FLAG(int, write_buffer_mb, 64,
+          "How many MB of drained pages may queue up in memory while the "
+          "output falls behind, before draining waits for it.");
+ABSL_FLAG(std::string, write_engine, "auto",
+          "How to write pages to the trace files: 'io_uring' batches the "
+          "writes of each pass into one system call, 'write' makes one "
+          "write() per buffer of pages, and 'auto' uses io_uring if the "
+          "kernel supports it.");
+ABSL_FLAG(bool, preallocate, true,
+          "Allocate disk space for the trace files ahead of each CPU's write "
+          "rate, so that they grow in large extents.");
+ABSL_FLAG(bool, direct_io, false,
+          "Write the trace files with O_DIRECT, bypassing the page cache. "
+          "Falls back to buffered writes if the filesystem doesn't support "
+          "it.");
+ABSL_FLAG(bool, drop_page_cache, true,
+          "Write the trace files back as they grow and drop them from the "
+          "page cache, so that tracing doesn't evict the workload's cache.");
+ABSL_FLAG(int64_t, memory_budget_mb, 0,
+          "How many MB the collector's resident set may grow to before "
+          "--budget_action is taken. 0 means no budget.");
+ABSL_FLAG(int64_t, disk_budget_mb, 0,
+          "How many MB of pages may be written to the trace files before "
+          "--budget_action is taken. 0 means no budget. The same action is "
+          "taken if the disk fills up.");
+ABSL_FLAG(std::string, budget_action, "drop",
+          "What to do when --memory_budget_mb or --disk_budget_mb is used "
+          "up: 'drop' whole pages, 'stop' the capture, or 'shrink' the event "
+          "set to the core scheduling events once 80% is used and drop pages "
+          "after that. Lost pages are recorded in the archive's metadata.");
+ABSL_FLAG(std::string, trace_clock, "local",
+          "The clock FTrace timestamps events with: 'local', 'global', "
+          "'mono', 'mono_raw', 'x86-tsc' or 'boot'. The archive records "
+          "readings of it alongside CLOCK_MONOTONIC and CLOCK_REALTIME at "
+          "the start and end of the capture, to convert its timestamps. "
+          "'x86-tsc' counts cycles, so it can't be combined with what "
+          "measures time in the collector: --trigger, --escalate_on, "
+          "--summary, --top, --histograms and --aggregate.");
+ABSL_FLAG(std::string, snapshot, "",
+          "Flight recorder mode, using FTrace's snapshot buffer: 'arm' "
+          "starts recording --events into the ring buffers, overwriting the "
+          "oldest, and leaves them recording after exiting; 'take' swaps the "
+          "buffers' contents out and archives them in an instant while "
+          "recording carries on; 'disarm' stops recording and frees the "
+          "snapshot buffer.");
+ABSL_FLAG(bool, stacks, false,
+          "Record the kernel stack of each thread that blocks, through the "
+          "stacktrace trigger or perf callchains. Each distinct stack is "
+          "stored once, symbolized in stacks.textproto, and sched_switch is "
+          "followed by a schedviz:stack_id event holding its ID.");
+ABSL_FLAG(std::string, kallsyms_cache, "/var/cache/schedviz/kallsyms",
+          "Where --stacks caches the index of the kernel's symbols between "
+          "captures. Empty to read /proc/kallsyms every time.");
+ABSL_FLAG(bool, thread_snapshots, true,
+          "Read every thread's command, priority, state and last CPU from "
+          "/proc as tracing starts and stops, to threads.textproto, so that "
+          "threads which never switch have a known state.");
+ABSL_FLAG(std::string, duty_cycle, "",
+          "Capture short windows on a fixed cadence instead of one long "
+          "capture, as ON/OFF durations, e.g. '2s/58s'. FTrace stays "
+          "configured between windows, and each window is archived to a "
+          "file of its own in --out, listed in duty_cycle.textproto.");
+ABSL_FLAG(int64_t, duty_windows, 0,
+          "How many --duty_cycle windows to capture. 0 keeps capturing until "
+          "SIGINT or SIGTERM, which stop after the current window.");
+ABSL_FLAG(int, duty_max_archives, 60,
+          "How many of the newest --duty_cycle window archives to keep.");
+ABSL_FLAG(absl::Duration, drain_interval, absl::Milliseconds(100),
+          "How long to sleep between drains of the CPU buffers. Each buffer "
+          "must hold what its CPU records in that time.");
+ABSL_FLAG(bool, estimate, false,
+          "Dry run: capture for --calibration only, and from that predict "
+          "the archive size, kernel buffer overruns and collector CPU time "
+          "of capturing for --capture_seconds, and recommend --buffer_size "
+          "and --drain_interval. Writes estimate.textproto to --out instead "
+          "of an archive.");
+ABSL_FLAG(absl::Duration, calibration, absl::Seconds(5),
+          "How long --estimate captures for.");
+ABSL_FLAG(std::string, collector_cpus, "",
+          "CPUs to run the collector's own threads on, e.g. housekeeping "
+          "CPUs '0-1'. A traced command still runs anywhere.");
+ABSL_FLAG(std::string, collector_cgroup, "",
+          "A cgroup directory, e.g. of a cpuset, to move the collector into. "
+          "A traced command is moved back to the collector's own cgroup.");
+ABSL_FLAG(std::string, compression_policy, "normal",
+          "Scheduling policy to compress the archive with: 'normal', "
+          "'batch' (SCHED_BATCH) or 'idle' (SCHED_IDLE).");
+ABSL_FLAG(int, drain_boost_priority, 0,
+          "SCHED_FIFO priority to raise draining to while a CPU buffer nears "
+          "overflow, for up to a second at a time. 0 never raises it.");
 
 static constexpr const auto kUSAGE =
     "Usage: trace --out OUT --capture_seconds CAPTURE_SECONDS [OPTIONS]\n"
+    "       trace --out OUT [OPTIONS] -- COMMAND [ARGS...]\n"
+    "       trace --stream SINKS --capture_seconds CAPTURE_SECONDS "
+    "[OPTIONS]\n"
     "This program collects an FTrace trace for a specified period of time"
     "and saves the results to a tar.gz file\n"
     "\n"
     "OUT is the path to directory to save trace in\n"
+    "SINKS is a comma separated list of where to stream the trace to while "
+    "capturing, as well as or instead of OUT: '-' for stdout, 'unix:PATH' "
+    "for a listening Unix domain socket, 'file:PATH', or 'pipe:COMMAND' for "
+    "a command's stdin. Prefix a sink with 'drop@' to drop pages it has no "
+    "room for, or 'spill@' to queue them on disk, instead of waiting for "
+    "it\n"
     "CAPTURE_SECONDS is the number of seconds to record a trace for\n"
+    "COMMAND is run once tracing has started; only it and its descendants "
+    "are traced, and tracing stops when it exits\n"
     "\n"
     "OPTIONS are"
     "\n"
@@ -58,8 +262,443 @@ static constexpr const auto kUSAGE =
     "--kernel_trace_root Path to the root directory of the Ftrace filesystem. "
     "Default '/sys/kernel/debug/tracing'\n"
     "--kernel_devices_root Path to the root directory of the devices "
-    "filesystem. Default '/sys/devices'"
-    "\n";
+    "filesystem. Default '/sys/devices'\n"
+    "--max_events Stop once this many events across all CPUs have been "
+    "captured, with the page that reaches the limit. Pages held until a "
+    "--trigger fires count once it fires. Default 0 (no limit)\n"
+    "--max_bytes Stop once this many bytes across all CPUs have been "
+    "captured, with the page that reaches the limit. Default 0 (no limit)\n"
+    "--max_cpu_events Stop once this many events from any single CPU have "
+    "been captured, with the page that reaches the limit. Default 0 (no "
+    "limit)\n"
+    "--max_cpu_bytes Stop once this many bytes from any single CPU have been "
+    "captured, with the page that reaches the limit. Default 0 (no limit)\n"
+    "--trigger Scheduling condition that starts or stops the capture, e.g. "
+    "'wakeup_latency>5ms' or 'runqueue_depth>4'\n"
+    "--trigger_action 'start' or 'stop'. Default 'start'\n"
+    "--pre_trigger How much data from before the trigger to keep. Default 1s\n"
+    "--post_trigger How long to keep recording after the trigger. Default 1s\n"
+    "--escalate_on Scheduling condition that enables --escalation_events "
+    "while it persists\n"
+    "--escalation_events Comma separated list of FTrace events to enable "
+    "while escalated\n"
+    "--escalation_hold How long the condition must be absent before "
+    "de-escalating. Default 1s\n"
+    "--backend 'trace_pipe_raw' or 'perf'. Default 'trace_pipe_raw'\n"
+    "--summary Write per-thread and per-CPU scheduling totals to "
+    "summary.textproto\n"
+    "--top How often to print the busiest threads. Implies --summary. "
+    "Default 0 (never)\n"
+    "--histograms Write per-thread and per-CPU scheduling histograms to "
+    "histograms.textproto\n"
+    "--histogram_threads How many threads get their own histograms. "
+    "Default 1024\n"
+    "--aggregate Archive in-kernel per-thread scheduling histograms instead "
+    "of raw events\n"
+    "--aggregate_interval How often to snapshot the --aggregate tables. "
+    "Default 0 (only at the end)\n"
+    "--write_buffer_mb How many MB of pages may queue up while the output "
+    "falls behind. Default 64\n"
+    "--write_engine 'auto', 'io_uring' or 'write': how to write the trace "
+    "files. Default 'auto'\n"
+    "--preallocate Allocate trace file space ahead of the write rate. "
+    "Default true\n"
+    "--direct_io Write the trace files with O_DIRECT. Default false\n"
+    "--drop_page_cache Drop written trace file pages from the page cache. "
+    "Default true\n"
+    "--memory_budget_mb Largest resident set the collector may grow to. "
+    "Default 0 (no budget)\n"
+    "--disk_budget_mb Most MB of pages to write to the trace files. Default "
+    "0 (no budget)\n"
+    "--budget_action 'drop', 'stop' or 'shrink': what to do when a budget is "
+    "used up or the disk fills up. Default 'drop'\n"
+    "--trace_clock 'local', 'global', 'mono', 'mono_raw', 'x86-tsc' or "
+    "'boot'. Default 'local'\n"
+    "--snapshot 'arm', 'take' or 'disarm': flight recorder mode. 'take' "
+    "archives what the armed ring buffers hold, without --capture_seconds"
+    "\n"
+    "--stacks Record deduplicated kernel stacks of blocking threads to "
+    "stacks.textproto\n"
+    "--kallsyms_cache Where --stacks caches the kernel's symbols. Default "
+    "'/var/cache/schedviz/kallsyms'\n"
+    "--nothread_snapshots Don't snapshot the threads in /proc to "
+    "threads.textproto as tracing starts and stops\n"
+    "--duty_cycle ON/OFF durations, e.g. '2s/58s': capture a window of ON "
+    "every ON+OFF, archiving each on its own, instead of --capture_seconds\n"
+    "--duty_windows How many --duty_cycle windows to capture. Default 0 "
+    "(until interrupted)\n"
+    "--duty_max_archives How many window archives to keep. Default 60\n"
+    "--drain_interval How long to sleep between drains of the CPU buffers. "
+    "Default 100ms\n"
+    "--estimate Predict the cost of capturing for --capture_seconds from a "
+    "short calibration capture, writing estimate.textproto to --out\n"
+    "--calibration How long --estimate captures for. Default 5s\n"
+    "--collector_cpus CPU list to run the collector on, e.g. '0-1'\n"
+    "--collector_cgroup cgroup directory to move the collector into\n"
+    "--compression_policy 'normal', 'batch' or 'idle': how the archive is "
+    "compressed. Default 'normal'\n"
+    "--drain_boost_priority SCHED_FIFO priority for draining while a buffer "
+    "nears overflow. Default 0 (never raised)\n";
+
+/**
+ * How many buffers of pages may queue up for the writer thread per CPU,
+ * regardless of their size.
+ */
+static constexpr size_t kWriteQueueCapacity = 1024;
+
+/**
+ * How many buffers for drained pages each writer thread allocates for each of
+ * its CPUs before the capture starts, so that the buffers draining reuses are
+ * in the memory of the CPU's NUMA node.
+ */
+static constexpr int kStagingBuffersPerCPU = 8;
+
+/**
+ * The size of the io_uring writer's buffers, and the most it may have. Each
+ * trace file gets two buffers while there are enough.
+ */
+static constexpr size_t kUringBufferBytes = 256 << 10;
+static constexpr size_t kUringMaxBuffers = 128;
+
+/**
+ * How much disk space is preallocated for a trace file at a time: enough
+ * for kPreallocationAhead of the CPU's writes, within these bounds.
+ */
+static constexpr int64_t kMinPreallocation = 4 << 20;
+static constexpr int64_t kMaxPreallocation = 256 << 20;
+static constexpr absl::Duration kPreallocationAhead = absl::Seconds(2);
+
+/**
+ * How many bytes of a trace file are written back and dropped from the page
+ * cache at a time. Much larger than an io_uring buffer, so that a range is
+ * written by the time its write back starts.
+ */
+static constexpr int64_t kWriteBackBytes = 4 << 20;
+
+/**
+ * How long the writer thread sleeps when there is nothing to write, and
+ * draining sleeps when the write budget is used up.
+ */
+static constexpr absl::Duration kWriterPollInterval = absl::Microseconds(200);
+
+/**
+ * The events that BudgetAction::kShrink keeps enabled: enough to tell what
+ * ran where, and why it was woken.
+ */
+static constexpr const char* kCoreEvents[] = {
+    "sched:sched_switch",
+    "sched:sched_wakeup",
+    "sched:sched_wakeup_new",
+};
+
+/**
+ * The event --stacks follows sched_switch with, holding the ID of the
+ * switched out thread's stack. Its ID is the largest a record's common_type
+ * can hold, which the kernel, handing IDs out from the bottom, never uses.
+ */
+static constexpr const char* kStackIDEvent = "schedviz:stack_id";
+static constexpr uint16_t kStackIDEventID = 65535;
+static constexpr const char* kStackIDFormat =
+    "name: stack_id\n"
+    "ID: 65535\n"
+    "format:\n"
+    "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+    "\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+    "\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;"
+    "\tsigned:0;\n"
+    "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+    "\n"
+    "\tfield:unsigned int stack_id;\toffset:8;\tsize:4;\tsigned:0;\n"
+    "\n"
+    "print fmt: \"stack_id=%u\", REC->stack_id\n";
+
+/**
+ * The common fields every event record starts with, which stack ID records
+ * copy from the record they follow.
+ */
+static constexpr size_t kCommonFieldsSize = 8;
+
+/**
+ * How often the pause between duty cycle windows checks for a stop request.
+ */
+static constexpr absl::Duration kDutyCycleStopCheckInterval =
+    absl::Milliseconds(100);
+
+/**
+ * Set by SIGINT and SIGTERM during a duty cycle.
+ */
+static volatile sig_atomic_t duty_cycle_stop_requested = 0;
+
+static void RequestDutyCycleStop(int) { duty_cycle_stop_requested = 1; }
+
+/**
+ * Size of the header of a ring buffer data record, which an estimate counts
+ * towards its event type.
+ */
+static constexpr int64_t kRecordHeaderSize = 4;
+
+/**
+ * How many times what a CPU buffer took in between two drains, at the
+ * fastest, an estimate recommends the buffer holds, to absorb bursts.
+ */
+static constexpr double kBufferHeadroom = 2;
+
+/**
+ * The smallest buffer size, in KB, and the range of drain intervals that an
+ * estimate recommends.
+ */
+static constexpr int64_t kMinRecommendedBufferKB = 64;
+static constexpr absl::Duration kMinDrainInterval = absl::Milliseconds(10);
+static constexpr absl::Duration kMaxDrainInterval = absl::Seconds(1);
+
+/**
+ * The fraction of a CPU buffer a drain pass must find filled up to raise
+ * draining's priority, and below which every buffer must be for it to be
+ * lowered again.
+ */
+static constexpr double kDrainBoostFill = 0.5;
+static constexpr double kDrainUnboostFill = 0.25;
+
+/**
+ * The longest draining's priority stays raised in one go, so that a
+ * sustained overload can't starve the workload, and how long it then waits
+ * to be raised again.
+ */
+static constexpr absl::Duration kMaxDrainBoost = absl::Seconds(1);
+
+/**
+ * How much disk space is set aside before capturing, and given back once
+ * the pages are written, so that the stats and metadata still fit when the
+ * pages fill up the disk.
+ */
+static constexpr off_t kDiskReserveBytes = 4 << 20;
+
+/**
+ * The fraction of a budget that BudgetAction::kShrink may use before
+ * shrinking the event set.
+ */
+static constexpr double kShrinkThreshold = 0.8;
+
+/**
+ * @return The name of a LossReason in ArchiveMetadataConfig.DataLoss.Reason.
+ */
+static const char* LossReasonName(LossReason reason) {
+  switch (reason) {
+    case LossReason::kDiskBudget:
+      return "DISK_BUDGET";
+    case LossReason::kDiskFull:
+      return "DISK_FULL";
+    case LossReason::kMemoryBudget:
+      return "MEMORY_BUDGET";
+  }
+  return "REASON_UNSPECIFIED";
+}
+
+/**
+ * @return The name of a CompressionPolicy in
+ *         ArchiveMetadataConfig.Collector.Policy.
+ */
+static const char* CompressionPolicyName(CompressionPolicy policy) {
+  switch (policy) {
+    case CompressionPolicy::kNormal:
+      return "NORMAL";
+    case CompressionPolicy::kBatch:
+      return "BATCH";
+    case CompressionPolicy::kIdle:
+      return "IDLE";
+  }
+  return "NORMAL";
+}
+
+/**
+ * @return The name of a TraceClock in ArchiveMetadataConfig.TraceClock.Clock.
+ */
+static const char* TraceClockEnumName(TraceClock clock) {
+  switch (clock) {
+    case TraceClock::kLocal:
+      return "LOCAL";
+    case TraceClock::kGlobal:
+      return "GLOBAL";
+    case TraceClock::kMono:
+      return "MONO";
+    case TraceClock::kMonoRaw:
+      return "MONO_RAW";
+    case TraceClock::kX86TSC:
+      return "X86_TSC";
+    case TraceClock::kBoot:
+      return "BOOT";
+  }
+  return "CLOCK_UNSPECIFIED";
+}
+
+/**
+ * @return The resident set size of this process in bytes, or 0 if unknown.
+ */
+static int64_t ResidentSetSize() {
+  std::ifstream statm("/proc/self/statm");
+  int64_t size_pages, resident_pages;
+  if (!(statm >> size_pages >> resident_pages)) {
+    return 0;
+  }
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @return The CPU time the calling thread has used.
+ */
+static absl::Duration ThreadCPUTime() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return absl::DurationFromTimespec(now);
+}
+
+/**
+ * @param cpus CPU IDs, each less than the set's size in CPUs.
+ * @param set_size The size of the set in bytes, from CPU_ALLOC_SIZE.
+ * @return The set of the CPUs, for sched_setaffinity.
+ */
+static std::vector<cpu_set_t> MakeCPUSet(const std::vector<int>& cpus,
+                                         size_t set_size) {
+  std::vector<cpu_set_t> set((set_size + sizeof(cpu_set_t) - 1) /
+                             sizeof(cpu_set_t));
+  CPU_ZERO_S(set_size, set.data());
+  for (int cpu : cpus) {
+    CPU_SET_S(cpu, set_size, set.data());
+  }
+  return set;
+}
+
+/**
+ * @param mounts The contents of /proc/self/mounts.
+ * @param cgroups The contents of /proc/self/cgroup.
+ * @param cgroup A cgroup directory, of cgroup v2 or of a v1 hierarchy.
+ * @return The cgroup.procs file of the cgroup this process is in, in the
+ *         same hierarchy, or empty if it can't be found.
+ */
+static std::string OwnCgroupProcs(const std::string& mounts,
+                                  const std::string& cgroups,
+                                  const std::filesystem::path& cgroup) {
+  // The hierarchy is the cgroup filesystem mounted deepest above the
+  // directory.
+  std::string mount_point;
+  std::vector<std::string> options;
+  bool v2 = false;
+  for (absl::string_view line : absl::StrSplit(mounts, '\n')) {
+    // "DEVICE MOUNT_POINT TYPE OPTIONS DUMP PASS"
+    const std::vector<std::string> fields =
+        absl::StrSplit(line, ' ', absl::SkipEmpty());
+    if (fields.size() < 4 || (fields[2] != "cgroup" && fields[2] != "cgroup2")) {
+      continue;
+    }
+    if (absl::StartsWith(cgroup.string(), fields[1] + "/") &&
+        fields[1].size() > mount_point.size()) {
+      mount_point = fields[1];
+      options = absl::StrSplit(fields[3], ',');
+      v2 = fields[2] == "cgroup2";
+    }
+  }
+  if (mount_point.empty()) {
+    return "";
+  }
+  // "ID:CONTROLLERS:PATH", where cgroup v2's line is "0::PATH", and a v1
+  // hierarchy's controllers are among its mount options.
+  for (absl::string_view line : absl::StrSplit(cgroups, '\n')) {
+    const std::vector<absl::string_view> fields =
+        absl::StrSplit(line, absl::MaxSplits(':', 2));
+    if (fields.size() != 3) {
+      continue;
+    }
+    bool matches = v2 ? fields[0] == "0" && fields[1].empty()
+                      : !fields[1].empty();
+    for (absl::string_view controller : absl::StrSplit(fields[1], ',')) {
+      if (!v2 && std::find(options.begin(), options.end(), controller) ==
+                     options.end()) {
+        matches = false;
+      }
+    }
+    if (matches) {
+      return absl::StrCat(mount_point, fields[2] == "/" ? "" : fields[2],
+                          "/cgroup.procs");
+    }
+  }
+  return "";
+}
+
+/**
+ * The most threads a snapshot of the threads is read with. Reading the start
+ * snapshot competes with draining for the collector's CPUs.
+ */
+static constexpr int kMaxThreadSnapshotReaders = 8;
+
+/**
+ * How many CPU IDs a draining group covers, one per bit of its queued mask.
+ */
+static constexpr int kDrainGroupCPUs = 64;
+
+/**
+ * Once this many drain passes in a row find a group's buffers empty, the
+ * group is only drained every this many passes, until it has pages again.
+ */
+static constexpr int kIdleGroupPasses = 4;
+
+/**
+ * How often the online CPUs are checked for hotplug during a capture.
+ */
+static constexpr absl::Duration kHotplugCheckInterval = absl::Seconds(1);
+
+/**
+ * Open files the collector needs besides two per CPU: formats, the stream,
+ * the io_uring and the like.
+ */
+static constexpr rlim_t kSpareFiles = 256;
+
+/**
+ * Parses a kernel CPU list, like "0-3,8,10-11".
+ * @param text The list.
+ * @param cpus Set to the CPUs, in order.
+ * @return Whether or not the list was valid.
+ */
+static bool ParseCPUList(absl::string_view text, std::vector<int>* cpus) {
+  cpus->clear();
+  text = absl::StripAsciiWhitespace(text);
+  if (text.empty()) {
+    return true;
+  }
+  for (absl::string_view range : absl::StrSplit(text, ',')) {
+    const std::vector<absl::string_view> bounds = absl::StrSplit(range, '-');
+    int first, last;
+    if (bounds.size() > 2 || !absl::SimpleAtoi(bounds.front(), &first) ||
+        !absl::SimpleAtoi(bounds.back(), &last) || first < 0 ||
+        last < first) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus->push_back(cpu);
+    }
+  }
+  return true;
+}
+
+/**
+ * Formats CPUs as a kernel CPU list.
+ * @param cpus The CPUs, in order.
+ * @return The list, like "0-3,8,10-11".
+ */
+static std::string CPUListText(const std::vector<int>& cpus) {
+  std::string text;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+      j++;
+    }
+    absl::StrAppend(&text, text.empty() ? "" : ",", cpus[i]);
+    if (j > i) {
+      absl::StrAppend(&text, "-", cpus[j]);
+    }
+    i = j + 1;
+  }
+  return text;
+}
 
 /**
  * Regex for matching a CPU name in a SysFS path.
@@ -72,7 +711,10 @@ static constexpr const LazyRE2 kCPURegex = {"(cpu\\d+$)"};
 static constexpr const LazyRE2 kNodeRegex = {"(node\\d+$)"};
 
 int main(int argc, char** argv) {
-  absl::ParseCommandLine(argc, argv);
+  const std::vector<char*> positional_args = absl::ParseCommandLine(argc, argv);
+  // The first positional argument is the program name.
+  const std::vector<std::string> command(positional_args.begin() + 1,
+                                         positional_args.end());
 
   if (geteuid() != 0) {
     std::cerr
@@ -89,20 +731,341 @@ int main(int argc, char** argv) {
   const auto& buffer_size = absl::GetFlag(FLAGS_buffer_size);
   const auto& events = absl::GetFlag(FLAGS_events);
   const auto& output_path = std::filesystem::path(absl::GetFlag(FLAGS_out));
+  CaptureLimits limits;
+  limits.max_events = absl::GetFlag(FLAGS_max_events);
+  limits.max_bytes = absl::GetFlag(FLAGS_max_bytes);
+  limits.max_cpu_events = absl::GetFlag(FLAGS_max_cpu_events);
+  limits.max_cpu_bytes = absl::GetFlag(FLAGS_max_cpu_bytes);
+
+  std::optional<SnapshotAction> snapshot;
+  if (const auto& action = absl::GetFlag(FLAGS_snapshot); action == "arm") {
+    snapshot = SnapshotAction::kArm;
+  } else if (action == "take") {
+    snapshot = SnapshotAction::kTake;
+  } else if (action == "disarm") {
+    snapshot = SnapshotAction::kDisarm;
+  } else if (!action.empty()) {
+    std::cerr << "--snapshot must be 'arm', 'take' or 'disarm'" << std::endl;
+    return 1;
+  }
+  // Arming and disarming write no archive.
+  const bool archive =
+      !snapshot.has_value() || *snapshot == SnapshotAction::kTake;
+
+  std::optional<DutyCycle> duty_cycle;
+  if (const auto& spec = absl::GetFlag(FLAGS_duty_cycle); !spec.empty()) {
+    duty_cycle.emplace();
+    const std::vector<std::string> parts = absl::StrSplit(spec, '/');
+    if (parts.size() != 2 || !absl::ParseDuration(parts[0], &duty_cycle->on) ||
+        !absl::ParseDuration(parts[1], &duty_cycle->off) ||
+        duty_cycle->on <= absl::ZeroDuration() ||
+        duty_cycle->off < absl::ZeroDuration()) {
+      std::cerr << "--duty_cycle must be ON/OFF durations, e.g. '2s/58s', "
+                   "with ON positive"
+                << std::endl;
+      return 1;
+    }
+    duty_cycle->windows = absl::GetFlag(FLAGS_duty_windows);
+    const int max_archives = absl::GetFlag(FLAGS_duty_max_archives);
+    if (duty_cycle->windows < 0 || max_archives <= 0) {
+      std::cerr << "--duty_windows must not be negative, and "
+                   "--duty_max_archives must be greater than zero"
+                << std::endl;
+      return 1;
+    }
+    duty_cycle->max_archives = max_archives;
+  }
+
+  const auto& drain_interval = absl::GetFlag(FLAGS_drain_interval);
+  if (drain_interval <= absl::ZeroDuration()) {
+    std::cerr << "--drain_interval must be greater than zero" << std::endl;
+    return 1;
+  }
+  const auto& estimate = absl::GetFlag(FLAGS_estimate);
+  const auto& calibration = absl::GetFlag(FLAGS_calibration);
+  if (estimate && calibration <= absl::ZeroDuration()) {
+    std::cerr << "--calibration must be greater than zero" << std::endl;
+    return 1;
+  }
 
-  if (output_path.string().empty()) {
+  CollectorPlacement placement;
+  if (const auto& cpus = absl::GetFlag(FLAGS_collector_cpus);
+      !cpus.empty() && !ParseCPUList(cpus, &placement.cpus)) {
+    std::cerr << "--collector_cpus must be a CPU list, e.g. '0-1,4'"
+              << std::endl;
+    return 1;
+  }
+  std::sort(placement.cpus.begin(), placement.cpus.end());
+  placement.cpus.erase(std::unique(placement.cpus.begin(), placement.cpus.end()),
+                       placement.cpus.end());
+  placement.cgroup = absl::GetFlag(FLAGS_collector_cgroup);
+  if (!placement.cgroup.empty() &&
+      !std::filesystem::exists(placement.cgroup / "cgroup.procs")) {
+    std::cerr << "--collector_cgroup must be a cgroup directory"
+              << std::endl;
+    return 1;
+  }
+  if (const auto& policy = absl::GetFlag(FLAGS_compression_policy);
+      policy == "batch") {
+    placement.compression_policy = CompressionPolicy::kBatch;
+  } else if (policy == "idle") {
+    placement.compression_policy = CompressionPolicy::kIdle;
+  } else if (policy != "normal") {
+    std::cerr << "--compression_policy must be 'normal', 'batch' or 'idle'"
+              << std::endl;
+    return 1;
+  }
+  placement.drain_boost_priority = absl::GetFlag(FLAGS_drain_boost_priority);
+  if (placement.drain_boost_priority < 0 ||
+      placement.drain_boost_priority > sched_get_priority_max(SCHED_FIFO)) {
+    std::cerr << "--drain_boost_priority must be from 0 to "
+              << sched_get_priority_max(SCHED_FIFO) << std::endl;
+    return 1;
+  }
+
+  const auto& stream = absl::GetFlag(FLAGS_stream);
+  if (archive && output_path.string().empty() && stream.empty()) {
     std::cerr << kUSAGE << std::endl;
-    std::cerr << "--out is required." << std::endl;
+    std::cerr << "--out or --stream is required." << std::endl;
     return 1;
   }
-  if (capture_seconds <= 0) {
+  if (!snapshot.has_value() && !duty_cycle.has_value() && command.empty() &&
+      capture_seconds <= 0) {
     std::cerr << "--capture_seconds must be greater than zero" << std::endl;
     return 1;
   }
+  if (capture_seconds < 0) {
+    std::cerr << "--capture_seconds must not be negative" << std::endl;
+    return 1;
+  }
   if (buffer_size <= 0) {
     std::cerr << "--buffer_size must be greater than zero" << std::endl;
     return 1;
   }
+  const auto& write_buffer_mb = absl::GetFlag(FLAGS_write_buffer_mb);
+  if (write_buffer_mb <= 0) {
+    std::cerr << "--write_buffer_mb must be greater than zero" << std::endl;
+    return 1;
+  }
+  ResourceBudgets budgets;
+  budgets.memory_bytes = absl::GetFlag(FLAGS_memory_budget_mb) << 20;
+  budgets.disk_bytes = absl::GetFlag(FLAGS_disk_budget_mb) << 20;
+  std::optional<WriteEngine> write_engine;
+  if (const auto& engine = absl::GetFlag(FLAGS_write_engine);
+      engine == "io_uring") {
+    write_engine = WriteEngine::kUring;
+  } else if (engine == "write") {
+    write_engine = WriteEngine::kWrite;
+  } else if (engine != "auto") {
+    std::cerr << "--write_engine must be 'auto', 'io_uring' or 'write'"
+              << std::endl;
+    return 1;
+  }
+  if (budgets.memory_bytes < 0 || budgets.disk_bytes < 0) {
+    std::cerr << "--memory_budget_mb and --disk_budget_mb must not be "
+                 "negative"
+              << std::endl;
+    return 1;
+  }
+  if (const auto& action = absl::GetFlag(FLAGS_budget_action);
+      action == "drop") {
+    budgets.action = BudgetAction::kDrop;
+  } else if (action == "stop") {
+    budgets.action = BudgetAction::kStop;
+  } else if (action == "shrink") {
+    budgets.action = BudgetAction::kShrink;
+  } else {
+    std::cerr << "--budget_action must be 'drop', 'stop' or 'shrink'"
+              << std::endl;
+    return 1;
+  }
+  if (limits.max_events < 0 || limits.max_bytes < 0 ||
+      limits.max_cpu_events < 0 || limits.max_cpu_bytes < 0) {
+    std::cerr << "--max_events, --max_bytes, --max_cpu_events and "
+                 "--max_cpu_bytes must not be negative"
+              << std::endl;
+    return 1;
+  }
+  std::optional<TriggerConfig> trigger;
+  if (const auto& trigger_spec = absl::GetFlag(FLAGS_trigger);
+      !trigger_spec.empty()) {
+    trigger.emplace();
+    const auto& status =
+        TriggerCondition::Parse(trigger_spec, &trigger->condition);
+    if (!status.ok()) {
+      std::cerr << status.message() << std::endl;
+      return 1;
+    }
+    const auto& action = absl::GetFlag(FLAGS_trigger_action);
+    if (action == "start") {
+      trigger->action = TriggerAction::kStart;
+    } else if (action == "stop") {
+      trigger->action = TriggerAction::kStop;
+    } else {
+      std::cerr << "--trigger_action must be 'start' or 'stop'" << std::endl;
+      return 1;
+    }
+    trigger->pre_trigger = absl::GetFlag(FLAGS_pre_trigger);
+    trigger->post_trigger = absl::GetFlag(FLAGS_post_trigger);
+    if (trigger->pre_trigger < absl::ZeroDuration() ||
+        trigger->post_trigger < absl::ZeroDuration()) {
+      std::cerr << "--pre_trigger and --post_trigger must not be negative"
+                << std::endl;
+      return 1;
+    }
+  }
+  std::optional<EscalationConfig> escalation;
+  if (const auto& escalate_on = absl::GetFlag(FLAGS_escalate_on);
+      !escalate_on.empty()) {
+    escalation.emplace();
+    const auto& status =
+        TriggerCondition::Parse(escalate_on, &escalation->condition);
+    if (!status.ok()) {
+      std::cerr << status.message() << std::endl;
+      return 1;
+    }
+    escalation->events = absl::GetFlag(FLAGS_escalation_events);
+    escalation->hold = absl::GetFlag(FLAGS_escalation_hold);
+    if (escalation->events.empty()) {
+      std::cerr << "--escalate_on requires --escalation_events" << std::endl;
+      return 1;
+    }
+    for (const auto& event : escalation->events) {
+      if (std::find(events.begin(), events.end(), event) != events.end()) {
+        std::cerr << "--escalation_events must not repeat --events, but both "
+                     "contain "
+                  << event << std::endl;
+        return 1;
+      }
+    }
+  }
+  const auto& aggregate = absl::GetFlag(FLAGS_aggregate);
+  const auto& aggregate_interval = absl::GetFlag(FLAGS_aggregate_interval);
+  if (aggregate) {
+    if (trigger.has_value() || escalation.has_value() || !command.empty() ||
+        limits.max_events > 0 || limits.max_bytes > 0 ||
+        limits.max_cpu_events > 0 || limits.max_cpu_bytes > 0 ||
+        budgets.memory_bytes > 0 || budgets.disk_bytes > 0) {
+      std::cerr << "--aggregate records no raw events, so it cannot be "
+                   "combined with --trigger, --escalate_on, --max_*, "
+                   "--*_budget_mb or a command"
+                << std::endl;
+      return 1;
+    }
+    if (aggregate_interval < absl::ZeroDuration()) {
+      std::cerr << "--aggregate_interval must not be negative" << std::endl;
+      return 1;
+    }
+  }
+  const auto& top = absl::GetFlag(FLAGS_top);
+  const bool summary =
+      absl::GetFlag(FLAGS_summary) || top > absl::ZeroDuration();
+  const auto& histograms = absl::GetFlag(FLAGS_histograms);
+  const auto& histogram_threads = absl::GetFlag(FLAGS_histogram_threads);
+  if ((summary || histograms) && aggregate) {
+    std::cerr << "--summary, --top and --histograms need raw events, so they "
+                 "cannot be combined with --aggregate"
+              << std::endl;
+    return 1;
+  }
+  if (histograms && histogram_threads < 0) {
+    std::cerr << "--histogram_threads must not be negative" << std::endl;
+    return 1;
+  }
+  DrainBackend backend;
+  if (const auto& backend_name = absl::GetFlag(FLAGS_backend);
+      backend_name == "trace_pipe_raw") {
+    backend = DrainBackend::kTracePipeRaw;
+  } else if (backend_name == "perf") {
+    backend = DrainBackend::kPerfEvent;
+    // These rely on FTrace recording the events.
+    if (escalation.has_value() || !command.empty() || aggregate) {
+      std::cerr << "--backend=perf cannot be combined with --escalate_on, "
+                   "--aggregate or a command"
+                << std::endl;
+      return 1;
+    }
+  } else {
+    std::cerr << "--backend must be 'trace_pipe_raw' or 'perf'" << std::endl;
+    return 1;
+  }
+  TraceClock trace_clock;
+  if (!ParseTraceClock(absl::GetFlag(FLAGS_trace_clock), &trace_clock)) {
+    std::cerr << "--trace_clock must be 'local', 'global', 'mono', "
+                 "'mono_raw', 'x86-tsc' or 'boot'"
+              << std::endl;
+    return 1;
+  }
+  if (int clockid; backend == DrainBackend::kPerfEvent &&
+                   !PerfClockID(trace_clock, &clockid)) {
+    std::cerr << "--backend=perf can only timestamp with --trace_clock "
+                 "'local', 'mono', 'mono_raw' or 'boot'"
+              << std::endl;
+    return 1;
+  }
+  // These compare, bucket and report timestamp differences as ns, which
+  // x86-tsc timestamps are not.
+  if (trace_clock == TraceClock::kX86TSC &&
+      (trigger.has_value() || escalation.has_value() || summary ||
+       histograms || aggregate)) {
+    std::cerr << "--trace_clock=x86-tsc timestamps in cycles, so it cannot be "
+                 "combined with --trigger, --escalate_on, --summary, --top, "
+                 "--histograms or --aggregate"
+              << std::endl;
+    return 1;
+  }
+  // Snapshots leave the flight recorder as armed, and hold whatever it
+  // recorded.
+  if (snapshot.has_value() &&
+      (!command.empty() || capture_seconds > 0 || trigger.has_value() ||
+       escalation.has_value() || aggregate ||
+       backend == DrainBackend::kPerfEvent)) {
+    std::cerr << "--snapshot cannot be combined with a command, "
+                 "--capture_seconds, --trigger, --escalate_on, --aggregate or "
+                 "--backend=perf"
+              << std::endl;
+    return 1;
+  }
+  // Each window is a capture of its own, archived to --out.
+  if (duty_cycle.has_value() &&
+      (output_path.empty() || !stream.empty() || !command.empty() ||
+       capture_seconds > 0 || trigger.has_value() || snapshot.has_value() ||
+       aggregate)) {
+    std::cerr << "--duty_cycle requires --out, and cannot be combined with "
+                 "--stream, a command, --capture_seconds, --trigger, "
+                 "--snapshot or --aggregate"
+              << std::endl;
+    return 1;
+  }
+  // The calibration capture predicts one of a duration, of the same events.
+  if (estimate &&
+      (output_path.empty() || !stream.empty() || !command.empty() ||
+       capture_seconds <= 0 || trigger.has_value() ||
+       escalation.has_value() || snapshot.has_value() ||
+       duty_cycle.has_value() || aggregate)) {
+    std::cerr << "--estimate requires --out and --capture_seconds, and cannot "
+                 "be combined with --stream, a command, --trigger, "
+                 "--escalate_on, --snapshot, --duty_cycle or --aggregate"
+              << std::endl;
+    return 1;
+  }
+  const auto& stacks = absl::GetFlag(FLAGS_stacks);
+  if (stacks) {
+    // The stacks are those of sched_switch's blocking threads, taken as the
+    // events are recorded.
+    if (std::find(events.begin(), events.end(), "sched:sched_switch") ==
+        events.end()) {
+      std::cerr << "--stacks requires sched:sched_switch in --events"
+                << std::endl;
+      return 1;
+    }
+    if (aggregate || snapshot.has_value()) {
+      std::cerr << "--stacks cannot be combined with --aggregate or "
+                   "--snapshot"
+                << std::endl;
+      return 1;
+    }
+  }
   if (!std::filesystem::exists(kernel_trace_root)) {
     std::cerr << "Path provided to --kernel_trace_root, " << kernel_trace_root
               << " does not exist" << std::endl;
@@ -117,6 +1080,55 @@ int main(int argc, char** argv) {
   FTraceTracer tracer(kernel_trace_root, kernel_devices_root, output_path,
                       buffer_size,
                       events);
+  tracer.SetCaptureLimits(limits);
+  tracer.SetBackend(backend);
+  tracer.SetWriteBudget(int64_t{write_buffer_mb} << 20);
+  tracer.SetResourceBudgets(budgets);
+  tracer.SetWriteEngine(write_engine);
+  tracer.SetTraceClock(trace_clock);
+  if (snapshot.has_value()) {
+    tracer.SetSnapshotAction(*snapshot);
+  }
+  if (stacks) {
+    tracer.SetKernelStacks(absl::GetFlag(FLAGS_kallsyms_cache));
+  }
+  if (duty_cycle.has_value()) {
+    tracer.SetDutyCycle(*duty_cycle);
+  }
+  tracer.SetThreadSnapshots(absl::GetFlag(FLAGS_thread_snapshots));
+  tracer.SetDrainInterval(drain_interval);
+  tracer.SetCollectorPlacement(placement);
+  if (estimate) {
+    tracer.SetEstimate(calibration);
+  }
+  OutputFileOptions file_options;
+  file_options.preallocate = absl::GetFlag(FLAGS_preallocate);
+  file_options.direct_io = absl::GetFlag(FLAGS_direct_io);
+  file_options.drop_page_cache = absl::GetFlag(FLAGS_drop_page_cache);
+  tracer.SetOutputFileOptions(file_options);
+  if (trigger.has_value()) {
+    tracer.SetTrigger(*trigger);
+  }
+  if (escalation.has_value()) {
+    tracer.SetEscalation(*escalation);
+  }
+  if (!command.empty()) {
+    tracer.SetCommand(command);
+  }
+  if (aggregate) {
+    tracer.SetAggregation(aggregate_interval);
+  }
+  if (summary) {
+    tracer.SetSummary(top > absl::ZeroDuration()
+                          ? std::optional<absl::Duration>(top)
+                          : std::nullopt);
+  }
+  if (histograms) {
+    tracer.SetHistograms(histogram_threads);
+  }
+  if (!stream.empty()) {
+    tracer.SetStream(stream);
+  }
 
   const auto& status = tracer.Trace(capture_seconds);
   if (!status.ok()) {
@@ -124,25 +1136,91 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  if (!command.empty()) {
+    // Behave like the command itself, so we can be dropped into scripts.
+    return tracer.WaitForCommand();
+  }
   return 0;
 }
 
 FTraceTracer::~FTraceTracer() {
   // Ignore error as we can't recover here.
   (void)StopTrace(/*final_copy=*/false);
+  AbortCommand();
 }
 
 Status FTraceTracer::Trace(int capture_seconds) {
   if (is_tracing_) {
     return Status::InternalError("Already Tracing");
   }
+  if (snapshot_ == SnapshotAction::kArm) {
+    return ArmSnapshots();
+  }
+  if (snapshot_ == SnapshotAction::kDisarm) {
+    return DisarmSnapshots();
+  }
+
+  // Before any thread is started, so that they all inherit the placement.
+  auto status = PlaceCollector();
+  if (!status.ok()) {
+    return status;
+  }
+  // Connect first, so that nothing is printed to a stdout being streamed to.
+  if (!stream_sinks_.empty()) {
+    status = TraceStream::Open(stream_sinks_, &stream_);
+    if (!status.ok()) {
+      return status;
+    }
+    streamed_files_.clear();
+  }
 
+  std::string plan;
+  if (snapshot_.has_value()) {
+    plan = "take a snapshot";
+  } else if (estimate_calibration_.has_value()) {
+    plan = absl::StrCat("estimate a ", capture_seconds,
+                        " second capture from ",
+                        absl::FormatDuration(*estimate_calibration_));
+  } else if (duty_cycle_.has_value()) {
+    plan = absl::StrCat("capture for ", absl::FormatDuration(duty_cycle_->on),
+                        " every ",
+                        absl::FormatDuration(duty_cycle_->on + duty_cycle_->off));
+  } else {
+    plan = absl::StrCat("capture for ", capture_seconds, " seconds");
+  }
   std::cout << "Trace date "
             << absl::FormatTime("%Y-%m-%d %H:%M:%S", absl::Now(),
                                 absl::LocalTimeZone())
-            << ": capture for " << capture_seconds
-            << " seconds, send output to " << output_path_ << std::endl;
+            << ": " << plan
+            << ", send output to "
+            << (output_path_.empty() ? absl::StrJoin(stream_sinks_, ", ")
+                                     : output_path_.string())
+            << std::endl;
+  if (!output_path_.empty() && stream_ != nullptr) {
+    std::cout << "Streaming to " << absl::StrJoin(stream_sinks_, ", ")
+              << std::endl;
+  }
+  if (!command_.empty()) {
+    std::cout << "Tracing command: " << absl::StrJoin(command_, " ")
+              << std::endl;
+  }
+
+  status = snapshot_.has_value() ? PrepareSnapshot() : ConfigureFTrace();
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (duty_cycle_.has_value()) {
+    return RunDutyCycle();
+  }
+  if (estimate_calibration_.has_value()) {
+    return Estimate(absl::Seconds(capture_seconds));
+  }
+  return CaptureArchive(absl::Seconds(capture_seconds), "trace.tar.gz");
+}
 
+Status FTraceTracer::CaptureArchive(absl::Duration capture_duration,
+                                    const std::string& archive) {
   // Create temp directory
   char temp_path_template[] = "/tmp/trace_XXXXXX";
   if (const auto temp_path = mkdtemp(temp_path_template);
@@ -152,20 +1230,7 @@ Status FTraceTracer::Trace(int capture_seconds) {
     return Status::InternalError("Unable to create temporary directory.");
   }
 
-  Status status;
-  // Write metadata file
-  status = WriteString(temp_path_ / "metadata.textproto",
-                       "trace_type: FTRACE\nrecorder: \"trace.cc\"\n");
-  if (!status.ok()) {
-    return status;
-  }
-
-  status = ConfigureFTrace();
-  if (!status.ok()) {
-    return status;
-  }
-
-  status = CopyOptions();
+  auto status = CopyOptions();
   if (!status.ok()) {
     return status;
   }
@@ -180,26 +1245,572 @@ Status FTraceTracer::Trace(int capture_seconds) {
     return status;
   }
 
-  status = CollectTrace(capture_seconds);
-  if (!status.ok()) {
-    return status;
+  // The consumer needs the headers to decode the pages that follow.
+  if (stream_ != nullptr) {
+    status = StreamNewFiles();
+    if (!status.ok()) {
+      return status;
+    }
   }
 
-  status = CopyCPUStats();
+  status = aggregation_interval_.has_value()
+               ? CollectAggregates(absl::ToInt64Seconds(capture_duration))
+               : CollectTrace(capture_duration);
   if (!status.ok()) {
     return status;
   }
 
-  status = CreateTar("trace.tar.gz");
+  status = CopyCPUStats();
   if (!status.ok()) {
     return status;
   }
 
-  std::cout << "Trace capture finished at "
-            << absl::FormatTime("%Y-%m-%d %H:%M:%S", absl::Now(),
-                                absl::LocalTimeZone())
+  if (sched_stats_ != nullptr) {
+    status = WriteSummary();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  if (sched_histograms_ != nullptr) {
+    status = WriteHistograms();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  if (stack_table_ != nullptr) {
+    status = WriteKernelStacks();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  if (start_threads_.snapshot != nullptr ||
+      end_threads_.snapshot != nullptr) {
+    status = WriteThreadSnapshots();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  status = WriteMetadata();
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (stream_ != nullptr) {
+    status = StreamNewFiles();
+    if (status.ok()) status = stream_->WriteEnd();
+    for (const auto& sink : stream_->Stats()) {
+      std::cout << "Streamed " << sink.bytes_sent << " bytes to "
+                << sink.destination;
+      if (sink.dropped_frames > 0) {
+        std::cout << ", dropping " << sink.dropped_bytes << " bytes of pages";
+      }
+      if (sink.spilled_bytes > 0) {
+        std::cout << ", spilling " << sink.spilled_bytes << " bytes to disk";
+      }
+      std::cout << std::endl;
+    }
+    stream_.reset();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  if (estimate_calibration_.has_value()) {
+    // Estimate measures the files, and removes them.
+    return Status::OkStatus();
+  }
+
+  if (output_path_.empty()) {
+    std::error_code error;
+    std::filesystem::remove_all(temp_path_, error);
+  } else {
+    status = CreateTar(archive);
+    if (!status.ok()) {
+      return status;
+    }
+    if (duty_cycle_.has_value()) {
+      // A window's files would pile up over a day of windows.
+      std::error_code error;
+      std::filesystem::remove_all(temp_path_, error);
+    }
+  }
+
+  if (!duty_cycle_.has_value()) {
+    std::cout << "Trace capture finished at "
+              << absl::FormatTime("%Y-%m-%d %H:%M:%S", absl::Now(),
+                                  absl::LocalTimeZone())
+              << std::endl;
+  }
+
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::RunDutyCycle() {
+  // Stopping mid-window would lose the window, so a stop request ends the
+  // cycle once the window is archived instead.
+  duty_cycle_stop_requested = 0;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = RequestDutyCycleStop;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  Status status;
+  archived_windows_.clear();
+  int64_t captured = 0;
+  for (window_ = 0;
+       duty_cycle_->windows == 0 || window_ < duty_cycle_->windows;
+       window_++) {
+    if (shrunk_) {
+      // The events a shrink disabled in tracefs would stay disabled, while
+      // the next window's archive claims the full set.
+      status = EnableEvents();
+      if (!status.ok()) {
+        break;
+      }
+    }
+    const auto& window_start = absl::Now();
+    // Named by start time, so that the archives of successive runs sort
+    // into one series.
+    const auto& archive = absl::StrCat(
+        "trace-",
+        absl::FormatTime("%Y%m%dT%H%M%SZ", window_start, absl::UTCTimeZone()),
+        "-", window_, ".tar.gz");
+    status = CaptureArchive(duty_cycle_->on, archive);
+    if (!status.ok()) {
+      break;
+    }
+    archived_windows_.push_back({archive, window_, clock_start_, clock_end_,
+                                 events_drained_, bytes_drained_});
+    captured++;
+    status = RollArchives();
+    if (!status.ok()) {
+      break;
+    }
+    std::cout << "Window " << window_ << ": " << events_drained_
+              << " events in " << archive << std::endl;
+
+    // Windows start on a fixed cadence, however long archiving took.
+    const auto& next_start = window_start + duty_cycle_->on + duty_cycle_->off;
+    while (!duty_cycle_stop_requested && absl::Now() < next_start) {
+      absl::SleepFor(
+          std::min(next_start - absl::Now(), kDutyCycleStopCheckInterval));
+    }
+    if (duty_cycle_stop_requested) {
+      break;
+    }
+  }
+
+  // FTrace stays configured until the last window is done.
+  if (free_fd_ != -1) {
+    close(free_fd_);
+    free_fd_ = -1;
+  }
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  std::cout << "Duty cycle finished at "
+            << absl::FormatTime("%Y-%m-%d %H:%M:%S", absl::Now(),
+                                absl::LocalTimeZone())
+            << " after " << captured << " windows"
             << std::endl;
+  return status;
+}
+
+Status FTraceTracer::RollArchives() {
+  while (archived_windows_.size() > duty_cycle_->max_archives) {
+    std::error_code error;
+    std::filesystem::remove(output_path_ / archived_windows_.front().archive,
+                            error);
+    archived_windows_.pop_front();
+  }
+  std::string text;
+  for (const auto& window : archived_windows_) {
+    absl::StrAppend(
+        &text, "window {\n  archive: \"", absl::CEscape(window.archive),
+        "\"\n  window: ", window.window,
+        "\n  start_realtime_ns: ", window.start.realtime_ns,
+        "\n  end_realtime_ns: ", window.end.realtime_ns,
+        "\n  start_trace_clock: ", window.start.trace_clock,
+        "\n  end_trace_clock: ", window.end.trace_clock,
+        "\n  events: ", window.events, "\n  bytes: ", window.bytes, "\n}\n");
+  }
+  // Replaced in one go, so that it never lists a half-written archive or
+  // misses a kept one.
+  const auto& path = output_path_ / "duty_cycle.textproto";
+  auto temp_path = path;
+  temp_path += ".tmp";
+  const auto& status = WriteString(temp_path, text);
+  if (!status.ok()) {
+    return status;
+  }
+  std::error_code error;
+  std::filesystem::rename(temp_path, path, error);
+  if (error) {
+    return Status::InternalError(
+        absl::StrCat("Unable to replace ", path.string(), ": ",
+                     error.message()));
+  }
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::Estimate(const absl::Duration capture_duration) {
+  auto status = CaptureArchive(*estimate_calibration_, "");
+  if (!status.ok()) {
+    return status;
+  }
+  // The trace files are measured apart from the rest of the archive, which
+  // doesn't grow with the duration.
+  int64_t trace_archive_bytes = 0;
+  int64_t other_archive_bytes = 0;
+  absl::Duration compression_cpu_time;
+  absl::Duration ignored;
+  status = CompressedSize("traces", &trace_archive_bytes,
+                          &compression_cpu_time);
+  if (status.ok()) {
+    status = CompressedSize("--exclude=traces *", &other_archive_bytes,
+                            &ignored);
+  }
+  // The kernel counts what it overwrote, or with nooverwrite what it
+  // dropped.
+  std::vector<int64_t> cpu_lost(cpu_count_, 0);
+  for (int cpu = 0; status.ok() && cpu < cpu_count_; cpu++) {
+    if (!cpu_traced_[cpu]) {
+      continue;
+    }
+    std::string stats;
+    status = ReadString(temp_path_ / "stats" / absl::StrCat("cpu", cpu),
+                        &stats);
+    for (absl::string_view line : absl::StrSplit(stats, '\n')) {
+      int64_t count;
+      if ((absl::ConsumePrefix(&line, "overrun:") ||
+           absl::ConsumePrefix(&line, "dropped events:")) &&
+          absl::SimpleAtoi(line, &count)) {
+        cpu_lost[cpu] += count;
+      }
+    }
+  }
+  std::error_code error;
+  std::filesystem::remove_all(temp_path_, error);
+  if (!status.ok()) {
+    return status;
+  }
+
+  const double calibration_seconds =
+      std::max<int64_t>(clock_end_.monotonic_ns - clock_start_.monotonic_ns,
+                        1) /
+      1e9;
+  const double scale =
+      absl::ToDoubleSeconds(capture_duration) / calibration_seconds;
+  const double buffer_bytes = buffer_size_ * 1024.0;
+  const auto& mean_drain_cpu_time =
+      drain_cpu_time_ / std::max<int64_t>(drain_passes_, 1);
+  // A buffer fills up for the interval and while the others are drained.
+  const double refill_seconds =
+      absl::ToDoubleSeconds(drain_interval_ + mean_drain_cpu_time);
+  const double event_bytes =
+      events_drained_ > 0 ? static_cast<double>(bytes_drained_) /
+                                events_drained_
+                          : 0;
+  // What a lost event would have taken up in the buffer.
+  int64_t record_events = 0;
+  int64_t record_bytes = 0;
+  for (const auto& [id, cost] : event_type_costs_) {
+    record_events += cost.events;
+    record_bytes += cost.bytes;
+  }
+  const double lost_event_bytes =
+      record_events > 0 ? static_cast<double>(record_bytes) / record_events
+                        : 0;
+
+  std::string text = absl::StrCat(
+      "calibration_ns: ", static_cast<int64_t>(calibration_seconds * 1e9),
+      "\nduration_ns: ", absl::ToInt64Nanoseconds(capture_duration),
+      "\nbuffer_size_kb: ", buffer_size_,
+      "\ndrain_interval_ns: ", absl::ToInt64Nanoseconds(drain_interval_),
+      "\ndrain_passes: ", drain_passes_, "\nmean_drain_cpu_time_ns: ",
+      absl::ToInt64Nanoseconds(mean_drain_cpu_time),
+      "\nmax_drain_cpu_time_ns: ",
+      absl::ToInt64Nanoseconds(max_drain_cpu_time_), "\n");
+  std::ostringstream report;
+  report << "Calibrated for " << std::fixed << std::setprecision(3)
+         << calibration_seconds << "s: " << events_drained_ << " events, "
+         << bytes_drained_ << " bytes in " << drain_passes_
+         << " drain passes of " << absl::FormatDuration(mean_drain_cpu_time)
+         << " CPU time on average, "
+         << absl::FormatDuration(max_drain_cpu_time_) << " at most\n\n";
+
+  std::vector<std::pair<uint16_t, EventTypeCost>> event_types(
+      event_type_costs_.begin(), event_type_costs_.end());
+  std::sort(event_types.begin(), event_types.end(),
+            [](const auto& a, const auto& b) {
+              return a.second.bytes > b.second.bytes;
+            });
+  report << std::left << std::setw(40) << "EVENT" << std::right
+         << std::setw(14) << "EVENTS/s" << std::setw(14) << "BYTES/s"
+         << "\n";
+  for (const auto& [id, cost] : event_types) {
+    const auto& it = event_names_.find(id);
+    const auto& name = it != event_names_.end() ? it->second
+                                                : absl::StrCat("id ", id);
+    const double events_per_second = cost.events / calibration_seconds;
+    const double bytes_per_second = cost.bytes / calibration_seconds;
+    report << std::left << std::setw(40) << name << std::right
+           << std::setprecision(1) << std::setw(14) << events_per_second
+           << std::setw(14) << bytes_per_second << "\n";
+    absl::StrAppend(&text, "event_type {\n  name: \"", absl::CEscape(name),
+                    "\"\n  events_per_second: ", events_per_second,
+                    "\n  bytes_per_second: ", bytes_per_second, "\n}\n");
+  }
+
+  report << "\n"
+         << std::setw(6) << "CPU" << std::setw(14) << "BYTES/s"
+         << std::setw(14) << "PEAK BYTES/s" << std::setw(10) << "HEADROOM"
+         << std::setw(10) << "LOST" << std::setw(16) << "PREDICTED LOST"
+         << std::setw(16) << "BUFFER_SIZE KB" << "\n";
+  double peak_fill_rate = 0;
+  int64_t predicted_lost = 0;
+  int64_t recommended_buffer_kb = kMinRecommendedBufferKB;
+  bool lost_any = false;
+  for (int cpu = 0; cpu < cpu_count_; cpu++) {
+    if (!cpu_traced_[cpu]) {
+      continue;
+    }
+    const double bytes_per_second =
+        cpu_bytes_drained_[cpu] / calibration_seconds;
+    // Lost events never reach the drained bytes, so a CPU that lost some
+    // filled its buffer at least as fast as it recorded on average.
+    const double peak = std::max(
+        peak_fill_rates_[cpu],
+        (cpu_bytes_drained_[cpu] + cpu_lost[cpu] * lost_event_bytes) /
+            calibration_seconds);
+    peak_fill_rate = std::max(peak_fill_rate, peak);
+    // Losses seen during calibration recur, and a buffer that can't hold
+    // what its CPU records on average between drains loses the rest.
+    const double overflow_bytes_per_second =
+        std::max(bytes_per_second - buffer_bytes / refill_seconds, 0.0);
+    const int64_t cpu_predicted_lost = static_cast<int64_t>(std::max(
+        cpu_lost[cpu] * scale,
+        event_bytes > 0 ? overflow_bytes_per_second *
+                              absl::ToDoubleSeconds(capture_duration) /
+                              event_bytes
+                        : 0));
+    predicted_lost += cpu_predicted_lost;
+    int64_t buffer_kb = kMinRecommendedBufferKB;
+    // Whatever the rates say, a buffer that lost events was too small.
+    while (buffer_kb * 1024 < kBufferHeadroom * peak * refill_seconds ||
+           (cpu_lost[cpu] > 0 && buffer_kb <= buffer_size_)) {
+      buffer_kb *= 2;
+    }
+    lost_any = lost_any || cpu_lost[cpu] > 0;
+    recommended_buffer_kb = std::max(recommended_buffer_kb, buffer_kb);
+    report << std::setw(6) << cpu << std::setprecision(1) << std::setw(14)
+           << bytes_per_second << std::setw(14) << peak << std::setw(10);
+    if (peak > 0) {
+      report << std::setprecision(2) << buffer_bytes / (peak * refill_seconds);
+    } else {
+      report << "-";
+    }
+    report << std::setw(10) << cpu_lost[cpu] << std::setw(16)
+           << cpu_predicted_lost << std::setw(16) << buffer_kb << "\n";
+    absl::StrAppend(&text, "cpu {\n  cpu: ", cpu,
+                    "\n  bytes_per_second: ", bytes_per_second,
+                    "\n  peak_bytes_per_second: ", peak,
+                    "\n  lost_events: ", cpu_lost[cpu],
+                    "\n  predicted_lost_events: ", cpu_predicted_lost,
+                    "\n  recommended_buffer_size_kb: ", buffer_kb, "\n}\n");
+  }
+
+  // The interval at which the current buffers hold what the busiest CPU
+  // took in at its fastest, with the same headroom.
+  absl::Duration recommended_interval = kMaxDrainInterval;
+  if (peak_fill_rate > 0) {
+    recommended_interval = std::clamp(
+        absl::Floor(absl::Seconds(buffer_bytes /
+                                  (kBufferHeadroom * peak_fill_rate)) -
+                        mean_drain_cpu_time,
+                    kMinDrainInterval),
+        kMinDrainInterval, kMaxDrainInterval);
+  }
+  if (lost_any) {
+    recommended_interval = std::max(
+        std::min(recommended_interval,
+                 absl::Floor(drain_interval_ / 2, kMinDrainInterval)),
+        kMinDrainInterval);
+  }
+  const auto predicted_events =
+      static_cast<int64_t>(events_drained_ * scale);
+  const auto predicted_bytes = static_cast<int64_t>(bytes_drained_ * scale);
+  const auto predicted_archive_bytes = static_cast<int64_t>(
+      other_archive_bytes + trace_archive_bytes * scale);
+  const auto& collector_cpu_time =
+      (drain_cpu_time_ + writer_cpu_time_) * scale;
+  const auto& predicted_compression_cpu_time = compression_cpu_time * scale;
+  absl::StrAppend(
+      &text, "events: ", predicted_events, "\nbytes: ", predicted_bytes,
+      "\narchive_bytes: ", predicted_archive_bytes,
+      "\nlost_events: ", predicted_lost, "\ncollector_cpu_time_ns: ",
+      absl::ToInt64Nanoseconds(collector_cpu_time),
+      "\ncompression_cpu_time_ns: ",
+      absl::ToInt64Nanoseconds(predicted_compression_cpu_time),
+      "\nrecommended_buffer_size_kb: ", recommended_buffer_kb,
+      "\nrecommended_drain_interval_ns: ",
+      absl::ToInt64Nanoseconds(recommended_interval), "\n");
+  report << "\nA " << absl::FormatDuration(capture_duration)
+         << " capture would drain " << predicted_events << " events, "
+         << predicted_bytes << " bytes, into a " << predicted_archive_bytes
+         << " byte archive, losing " << predicted_lost
+         << " events to overruns. Collecting would take "
+         << absl::FormatDuration(collector_cpu_time) << " of CPU time ("
+         << std::setprecision(2)
+         << 100 * absl::FDivDuration(collector_cpu_time, capture_duration)
+         << "% of a CPU), and archiving "
+         << absl::FormatDuration(predicted_compression_cpu_time) << ".\n"
+         << "Recommended: --buffer_size=" << recommended_buffer_kb
+         << " at --drain_interval=" << absl::FormatDuration(drain_interval_)
+         << ", or --drain_interval="
+         << absl::FormatDuration(recommended_interval)
+         << " at --buffer_size=" << buffer_size_ << "\n";
+  std::cout << report.str() << std::flush;
+  return WriteString(output_path_ / "estimate.textproto", text);
+}
+
+Status FTraceTracer::CompressedSize(const std::string& members,
+                                    int64_t* bytes,
+                                    absl::Duration* cpu_time) {
+  auto archive = temp_path_;
+  archive += ".tar.gz";
+  const auto& tar_cmd = absl::StrCat("cd ", temp_path_.string(),
+                                     " && tar -zcf ", archive.string(), " ",
+                                     members);
+  rusage before;
+  getrusage(RUSAGE_CHILDREN, &before);
+  const auto& status = RunArchiver(tar_cmd);
+  rusage after;
+  getrusage(RUSAGE_CHILDREN, &after);
+  *cpu_time = absl::DurationFromTimeval(after.ru_utime) +
+              absl::DurationFromTimeval(after.ru_stime) -
+              absl::DurationFromTimeval(before.ru_utime) -
+              absl::DurationFromTimeval(before.ru_stime);
+  std::error_code error;
+  const auto size = std::filesystem::file_size(archive, error);
+  *bytes = error ? 0 : size;
+  std::filesystem::remove(archive, error);
+  return status;
+}
+
+Status FTraceTracer::PlaceCollector() {
+  if (!placement_.cgroup.empty()) {
+    std::string mounts;
+    std::string cgroups;
+    auto status = ReadString("/proc/self/mounts", &mounts);
+    if (status.ok()) status = ReadString("/proc/self/cgroup", &cgroups);
+    if (!status.ok()) {
+      return status;
+    }
+    std::error_code error;
+    original_cgroup_procs_ = OwnCgroupProcs(
+        mounts, cgroups,
+        std::filesystem::weakly_canonical(placement_.cgroup, error));
+    if (original_cgroup_procs_.empty()) {
+      std::cerr << "WARNING: Unable to find the collector's own cgroup in "
+                   "the hierarchy of "
+                << placement_.cgroup
+                << "; a traced command will run in the collector's"
+                << std::endl;
+    }
+    status = WriteString(placement_.cgroup / "cgroup.procs",
+                         std::to_string(getpid()));
+    if (!status.ok()) {
+      return Status::InternalError(
+          absl::StrCat("Unable to move the collector into ",
+                       placement_.cgroup.string(), ": ", status.message()));
+    }
+  }
+  if (!placement_.cpus.empty()) {
+    const int max_cpu =
+        *std::max_element(placement_.cpus.begin(), placement_.cpus.end());
+    affinity_size_ = CPU_ALLOC_SIZE(std::max<long>(
+        max_cpu + 1, sysconf(_SC_NPROCESSORS_CONF)));
+    original_affinity_ = MakeCPUSet({}, affinity_size_);
+    if (sched_getaffinity(0, affinity_size_, original_affinity_.data()) !=
+        0) {
+      return Status::InternalError(absl::StrCat(
+          "Unable to read the collector's CPU affinity: ", strerror(errno)));
+    }
+    if (sched_setaffinity(0, affinity_size_,
+                          MakeCPUSet(placement_.cpus, affinity_size_).data()) !=
+        0) {
+      return Status::InternalError(
+          absl::StrCat("Unable to run the collector on CPUs ",
+                       CPUListText(placement_.cpus), ": ", strerror(errno)));
+    }
+  }
+  return Status::OkStatus();
+}
+
+void FTraceTracer::UpdateDrainBoost(double fill) {
+  const auto& now = absl::Now();
+  bool boost = drain_boosted_;
+  if (!drain_boosted_) {
+    boost = fill >= kDrainBoostFill && now >= drain_boost_allowed_ &&
+            placement_.drain_boost_priority > 0;
+  } else if (fill < kDrainUnboostFill) {
+    boost = false;
+  } else if (now - drain_boost_start_ >= kMaxDrainBoost) {
+    boost = false;
+    drain_boost_allowed_ = now + kMaxDrainBoost;
+  }
+  if (boost == drain_boosted_) {
+    return;
+  }
+  // Reset on fork, so that nothing draining starts inherits the priority.
+  sched_param param;
+  param.sched_priority = boost ? placement_.drain_boost_priority : 0;
+  if (sched_setscheduler(0, (boost ? SCHED_FIFO : SCHED_OTHER) |
+                                SCHED_RESET_ON_FORK,
+                         &param) != 0) {
+    if (boost) {
+      std::cerr << "WARNING: Unable to raise draining's priority: "
+                << strerror(errno) << std::endl;
+      // Not worth trying again every pass.
+      drain_boost_allowed_ = absl::InfiniteFuture();
+    }
+    return;
+  }
+  drain_boosted_ = boost;
+  if (boost) {
+    drain_boost_start_ = now;
+    drain_boosts_++;
+  } else {
+    drain_boost_time_ += now - drain_boost_start_;
+  }
+}
 
+Status FTraceTracer::RunArchiver(const std::string& command) {
+  const pid_t pid = fork();
+  if (pid == -1) {
+    return Status::InternalError("Unable to fork");
+  }
+  if (pid == 0) {
+    sched_param param;
+    param.sched_priority = 0;
+    if (placement_.compression_policy == CompressionPolicy::kBatch) {
+      sched_setscheduler(0, SCHED_BATCH, &param);
+    } else if (placement_.compression_policy == CompressionPolicy::kIdle) {
+      sched_setscheduler(0, SCHED_IDLE, &param);
+    }
+    execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+    _exit(127);
+  }
+  int wait_status;
+  if (waitpid(pid, &wait_status, 0) != pid || !WIFEXITED(wait_status) ||
+      WEXITSTATUS(wait_status) != 0) {
+    return Status::InternalError("Error running tar");
+  }
   return Status::OkStatus();
 }
 
@@ -216,7 +1827,8 @@ Status FTraceTracer::ConfigureFTrace() {
 
   // Hold a reference to the free_buffer file.
   // If this fd is closed, the buffer will be cleared.
-  free_fd_ = open((kernel_trace_root_ / "free_buffer").c_str(), O_RDONLY);
+  free_fd_ = open((kernel_trace_root_ / "free_buffer").c_str(),
+                  O_RDONLY | O_CLOEXEC);
   if (free_fd_ < 0) {
     return Status::InternalError("unable to open free_buffer file");
   }
@@ -238,6 +1850,11 @@ Status FTraceTracer::ConfigureFTrace() {
     return status;
   }
 
+  status = ConfigureTraceClock();
+  if (!status.ok()) {
+    return status;
+  }
+
   // Set buffer size.
   status = WriteString(kernel_trace_root_ / "buffer_size_kb",
                        std::to_string(buffer_size_));
@@ -271,6 +1888,14 @@ Status FTraceTracer::EnableEvents() {
     return Status::InternalError(
         absl::StrCat("Failed to disable all events in ", events_path.string()));
   }
+  // Hist triggers soft-enable the events they are attached to, which runs
+  // the triggers without recording the events to the ring buffer. The perf
+  // backend opens the tracepoints itself.
+  if (aggregation_interval_.has_value() ||
+      backend_ == DrainBackend::kPerfEvent) {
+    close(fd);
+    return Status::OkStatus();
+  }
   for (const auto& event : events_) {
     if ((unsigned)write(fd, event.c_str(), event.size()) != event.size()) {
       close(fd);
@@ -283,6 +1908,129 @@ Status FTraceTracer::EnableEvents() {
   return Status::OkStatus();
 }
 
+Status FTraceTracer::ConfigureTraceClock() {
+  const auto& clock_path = kernel_trace_root_ / "trace_clock";
+  const char* name = TraceClockName(trace_clock_);
+  // Lists the clocks the kernel offers, the current one in brackets.
+  std::string clocks;
+  auto status = ReadString(clock_path, &clocks);
+  if (!status.ok()) {
+    return status;
+  }
+  bool offered = false;
+  for (auto clock : absl::StrSplit(clocks, ' ', absl::SkipWhitespace())) {
+    clock = absl::StripAsciiWhitespace(clock);
+    absl::ConsumePrefix(&clock, "[");
+    absl::ConsumeSuffix(&clock, "]");
+    offered = offered || clock == name;
+  }
+  if (!offered) {
+    return Status::InternalError(
+        absl::StrCat("The kernel doesn't offer trace clock '", name,
+                     "'; it offers ", absl::StripAsciiWhitespace(clocks)));
+  }
+  status = WriteString(clock_path, name);
+  if (!status.ok()) {
+    return status;
+  }
+  // Without a stable TSC, e.g. in most VMs, local and global can't be read,
+  // and the archive only relates the capture's start and end to the system
+  // clocks.
+  return TraceClockSampler::Open(trace_clock_, &clock_sampler_);
+}
+
+Status FTraceTracer::ArmSnapshots() {
+  const auto& snapshot_path = kernel_trace_root_ / "snapshot";
+  if (!std::filesystem::exists(snapshot_path)) {
+    return Status::InternalError(
+        "Snapshots need a kernel built with CONFIG_TRACER_SNAPSHOT");
+  }
+  Status status = WriteString(kernel_trace_root_ / "tracing_on", "0");
+  if (status.ok()) {
+    status = WriteString(kernel_trace_root_ / "current_tracer", "nop");
+  }
+  // Unlike a capture, nothing drains the buffers, so they keep the newest
+  // events. They must also outlive us, so free_buffer isn't held.
+  if (status.ok()) {
+    status = WriteString(kernel_trace_root_ / "trace_options", "overwrite");
+  }
+  if (status.ok()) {
+    status = WriteString(kernel_trace_root_ / "buffer_size_kb",
+                         std::to_string(buffer_size_));
+  }
+  if (status.ok()) status = ConfigureTraceClock();
+  if (status.ok()) status = EnableEvents();
+  // Taking the first snapshot allocates the snapshot buffer, which is then
+  // cleared, so that later snapshots only swap.
+  if (status.ok()) status = WriteString(snapshot_path, "1");
+  if (status.ok()) status = WriteString(snapshot_path, "2");
+  if (status.ok()) {
+    status = WriteString(kernel_trace_root_ / "tracing_on", "1");
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  std::cout << "Recording " << absl::StrJoin(events_, ", ") << " into "
+            << buffer_size_ << "KB per CPU; archive them with --snapshot=take"
+            << std::endl;
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::DisarmSnapshots() {
+  Status status = WriteString(kernel_trace_root_ / "tracing_on", "0");
+  // Opening set_event for writing truncates it, which disables all events.
+  if (status.ok()) status = WriteString(kernel_trace_root_ / "set_event", "");
+  if (status.ok() &&
+      std::filesystem::exists(kernel_trace_root_ / "snapshot")) {
+    status = WriteString(kernel_trace_root_ / "snapshot", "0");
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  std::cout << "Stopped recording and freed the snapshot buffer" << std::endl;
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::PrepareSnapshot() {
+  if (!std::filesystem::exists(kernel_trace_root_ / "snapshot")) {
+    return Status::InternalError(
+        "Snapshots need a kernel built with CONFIG_TRACER_SNAPSHOT");
+  }
+  std::string value;
+  auto status = ReadString(kernel_trace_root_ / "tracing_on", &value);
+  if (!status.ok()) {
+    return status;
+  }
+  if (absl::StripAsciiWhitespace(value) != "1") {
+    return Status::InternalError(
+        "FTrace isn't recording; start it with --snapshot=arm first");
+  }
+  // The archive describes what was armed, not our flags.
+  status = ReadString(kernel_trace_root_ / "set_event", &value);
+  if (!status.ok()) {
+    return status;
+  }
+  events_.clear();
+  for (const auto& event : absl::StrSplit(value, '\n', absl::SkipWhitespace())) {
+    events_.push_back(std::string(absl::StripAsciiWhitespace(event)));
+  }
+  if (events_.empty()) {
+    return Status::InternalError("No events are enabled to take a snapshot of");
+  }
+  status = ReadString(kernel_trace_root_ / "trace_clock", &value);
+  if (!status.ok()) {
+    return status;
+  }
+  std::string clock;
+  if (!RE2::PartialMatch(value, "\\[([^\\]]+)\\]", &clock) ||
+      !ParseTraceClock(clock, &trace_clock_)) {
+    return Status::InternalError(
+        absl::StrCat("Snapshots of trace clock '", clock,
+                     "' can't be archived"));
+  }
+  return TraceClockSampler::Open(trace_clock_, &clock_sampler_);
+}
+
 Status FTraceTracer::CopyOptions() {
   if (is_tracing_) {
     return Status::InternalError("Already Tracing");
@@ -311,32 +2059,77 @@ Status FTraceTracer::CopyFormats() {
   }
   const auto& out = temp_path_ / "formats";
   const std::filesystem::path& formats_root = kernel_trace_root_ / "events";
-  for (const auto& event_type : events_) {
-    std::filesystem::path event_format_path;
-    const auto& event_type_parts = absl::StrSplit(event_type, ':');
-    for (const auto& part : event_type_parts) {
-      event_format_path /= std::string(part);
+  // Escalation events may be enabled mid-capture, so their formats are
+  // needed too.
+  std::vector<std::string> event_types = events_;
+  if (escalation_.has_value()) {
+    event_types.insert(event_types.end(), escalation_->events.begin(),
+                       escalation_->events.end());
+  }
+  // The aggregation's triggers are built from the scheduling event formats.
+  if (aggregation_interval_.has_value()) {
+    for (const auto& event : {"sched:sched_switch", "sched:sched_wakeup"}) {
+      if (std::find(event_types.begin(), event_types.end(), event) ==
+          event_types.end()) {
+        event_types.push_back(event);
+      }
     }
+  }
+  for (const auto& event_type : event_types) {
+    const auto& event_format_path = EventPath(event_type);
 
     const auto& out_path = out / event_format_path;
     if (!std::filesystem::create_directories(out_path)) {
       return Status::InternalError(absl::StrCat(
           "Unable to create directories for path: ", out_path.string()));
     }
-    const auto& status = CopyFakeFile(
-        formats_root / event_format_path / "format", out_path / "format");
+    auto status = CopyFakeFile(formats_root / event_format_path / "format",
+                               out_path / "format");
+    if (!status.ok()) {
+      return status;
+    }
+
+    // --stacks filters its trigger with, and decodes perf samples with,
+    // sched_switch's format. Estimates name the events they count by ID.
+    if (DecodingEnabled() || aggregation_interval_.has_value() ||
+        kernel_stacks_ || estimate_calibration_.has_value()) {
+      std::string format_text;
+      EventFormat format;
+      status = ReadString(out_path / "format", &format_text);
+      if (status.ok()) status = EventFormat::Parse(format_text, &format);
+      if (status.ok()) status = decoder_.AddFormat(format);
+      if (!status.ok()) {
+        return status;
+      }
+      event_names_[format.id] = event_type;
+    }
+  }
+
+  if (kernel_stacks_) {
+    const auto& out_path = out / EventPath(kStackIDEvent);
+    if (!std::filesystem::create_directories(out_path)) {
+      return Status::InternalError(absl::StrCat(
+          "Unable to create directories for path: ", out_path.string()));
+    }
+    const auto& status = WriteString(out_path / "format", kStackIDFormat);
     if (!status.ok()) {
       return status;
     }
+    event_names_[kStackIDEventID] = kStackIDEvent;
   }
 
-  const auto& status =
-      CopyFakeFile(formats_root / "header_page", out / "header_page");
+  auto status = CopyFakeFile(formats_root / "header_page", out / "header_page");
   if (!status.ok()) {
     return status;
   }
 
-  return Status::OkStatus();
+  // The page layout is needed to count the events in each drained page.
+  std::string header_page;
+  status = ReadString(out / "header_page", &header_page);
+  if (!status.ok()) {
+    return status;
+  }
+  return PageHeaderFormat::Parse(header_page, &page_format_);
 }
 
 Status FTraceTracer::CopySystemTopology() {
@@ -387,160 +2180,1945 @@ Status FTraceTracer::CopySystemTopology() {
   return Status::OkStatus();
 }
 
-Status FTraceTracer::CollectTrace(const int capture_seconds) {
+Status FTraceTracer::CollectTrace(const absl::Duration capture_duration) {
   if (is_tracing_) {
     return Status::InternalError("Already Tracing");
   }
   // Prepare
   const auto& out = temp_path_ / "traces";
-  // Create directories if they don't exist.
-  if (!std::filesystem::exists(out)) {
+  // Create directories if they don't exist. Pages that are only streamed
+  // skip the disk.
+  if (!output_path_.empty() && !std::filesystem::exists(out)) {
     if (!std::filesystem::create_directories(out)) {
       return Status::InternalError(absl::StrCat(
           "Unable to create directories for path: ", out.string()));
     }
   }
 
-  const auto& cpu_count = sysconf(_SC_NPROCESSORS_CONF);
   ClearCPUFDs();
-  fds_.reserve(cpu_count);
-  for (int i = 0; i < cpu_count; i++) {
-    const auto& cpuName = "cpu" + std::to_string(i);
-    const auto& cpuPath =
-        kernel_trace_root_ / "per_cpu" / cpuName / "trace_pipe_raw";
-    const auto& outPath = out / cpuName;
-
-    int in_fd = open(cpuPath.c_str(), O_RDONLY | O_NONBLOCK);
-    if (in_fd == -1) {
-      return Status::InternalError(
-          absl::StrCat("Unable to open ", cpuPath.string()));
-    }
-    int out_fd =
-        open(outPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
-    if (out_fd == -1) {
-      return Status::InternalError(
-          absl::StrCat("Unable to create ", outPath.string()));
+  std::vector<int> online;
+  auto cpu_status = ReadCPUs(&online);
+  if (cpu_status.ok()) cpu_status = RaiseFileLimit();
+  if (cpu_status.ok() && backend_ == DrainBackend::kPerfEvent) {
+    cpu_status = ReadTracepointIDs();
+  }
+  if (cpu_status.ok() && kernel_stacks_) cpu_status = PrepareKernelStacks();
+  if (!cpu_status.ok()) {
+    return cpu_status;
+  }
+  fds_.assign(cpu_count_, {-1, -1});
+  direct_io_ = file_options_.direct_io;
+  if (direct_io_ && !output_path_.empty()) {
+    // Every writer relies on this, so it's settled before any file is made.
+    const auto& probe_path = out / ".direct_io";
+    const int probe_fd =
+        open(probe_path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC | O_DIRECT,
+             0600);
+    if (probe_fd != -1) {
+      close(probe_fd);
+    } else if (errno == EINVAL) {
+      std::cerr << "WARNING: " << out
+                << " doesn't support O_DIRECT; writing through the page cache"
+                << std::endl;
+      direct_io_ = false;
     }
-    fds_.emplace_back(std::make_pair(in_fd, out_fd));
+    std::filesystem::remove(probe_path);
   }
-
-  // Start Trace.
-  Status status;
-  status = WriteString(kernel_trace_root_ / "tracing_on", "1");
-  if (!status.ok()) {
-    return status;
+  perf_buffers_.clear();
+  page_writers_.clear();
+  if (backend_ == DrainBackend::kPerfEvent) {
+    perf_buffers_.resize(cpu_count_);
   }
-  is_tracing_ = true;
-
-  std::cout << "Waiting " << capture_seconds << " seconds" << std::endl;
-
-  // Wait for trace to end.
-  const auto& start_time = absl::Now();
-  const auto& interval = absl::Milliseconds(100);
-  const auto& tracing_file_path = kernel_trace_root_ / "tracing_on";
-  absl::SleepFor(interval);
-  Status failedCopyStatus;
-  while (absl::Now() <= start_time + absl::Seconds(capture_seconds)) {
-    // Toggle tracing off before copy
-    status = WriteString(tracing_file_path, "0");
-    if (!status.ok()) {
-      failedCopyStatus = status;
-      break;
+  // Pages are re-encoded from perf samples, or to replace kernel stacks.
+  if (backend_ == DrainBackend::kPerfEvent || stack_table_ != nullptr) {
+    page_writers_.reserve(cpu_count_);
+    for (int cpu = 0; cpu < cpu_count_; cpu++) {
+      page_writers_.emplace_back(page_format_);
     }
-    // Perform Copy
-    status = CopyCPUBuffers();
-    if (!status.ok()) {
-      failedCopyStatus = status;
-      break;
+  }
+  perf_lost_.assign(cpu_count_, 0);
+  // Queues are only made for CPUs that come online.
+  write_queues_.clear();
+  write_queues_.resize(cpu_count_);
+  free_buffers_.clear();
+  free_buffers_.resize(cpu_count_);
+  event_merger_ = SchedEventMerger(cpu_count_);
+  for (int cpu : online) {
+    bool opened;
+    cpu_status = OpenCPU(cpu, &opened);
+    if (!cpu_status.ok()) {
+      ClearCPUFDs();
+      perf_buffers_.clear();
+      return cpu_status;
     }
-    // Toggle tracing on after copy
-    status = WriteString(tracing_file_path, "1");
-    if (!status.ok()) {
-      failedCopyStatus = status;
-      break;
+    if (!opened) {
+      std::cerr << "WARNING: cpu" << cpu
+                << " has no trace buffer; leaving it out of the capture"
+                << std::endl;
     }
-    absl::SleepFor(interval);
   }
-
-
-  status = StopTrace(/*final_copy=*/true);
-  if (!failedCopyStatus.ok()) {
+  for (int cpu = 0; cpu < cpu_count_; cpu++) {
+    // The pages are streamed as they are drained, not as a file.
+    streamed_files_.insert(std::filesystem::path("traces") /
+                           ("cpu" + std::to_string(cpu)));
+  }
+  drain_passes_ = 0;
+  next_hotplug_check_ = absl::Now() + kHotplugCheckInterval;
+  cpu_hotplugs_.clear();
+  drained_events_.clear();
+  newest_timestamp_ = 0;
+  escalated_ = false;
+  event_set_changes_.clear();
+  if (escalation_.has_value()) {
+    escalation_trigger_ =
+        std::make_unique<SchedTrigger>(escalation_->condition, &decoder_);
+  }
+  held_pages_.assign(cpu_count_, {});
+  trigger_fired_ = false;
+  trigger_timestamp_ = 0;
+  trigger_detail_.clear();
+  if (trigger_.has_value()) {
+    sched_trigger_ =
+        std::make_unique<SchedTrigger>(trigger_->condition, &decoder_);
+    std::cout << "Waiting for trigger " << trigger_->condition.ToString()
+              << std::endl;
+  }
+  if (summary_) {
+    sched_stats_ = std::make_unique<SchedStats>(&decoder_);
+  }
+  if (histogram_threads_.has_value()) {
+    std::vector<CPUPlacement> placements;
+    const auto& status = ReadCPUPlacements(&placements);
+    if (!status.ok()) {
+      return status;
+    }
+    sched_histograms_ = std::make_unique<SchedHistograms>(
+        std::move(placements), *histogram_threads_);
+  }
+  if (top_interval_.has_value()) {
+    next_top_time_ = absl::Now() + *top_interval_;
+  }
+  top_timestamp_ = 0;
+  top_run_time_.clear();
+  top_cpu_busy_time_.clear();
+  cpu_events_drained_.assign(cpu_count_, 0);
+  cpu_bytes_drained_.assign(cpu_count_, 0);
+  events_drained_ = 0;
+  bytes_drained_ = 0;
+  limit_counter_ = CaptureLimitCounter(limits_, cpu_count_);
+  stop_reason_ = StopReason::kCaptureDuration;
+  stop_detail_.clear();
+  max_queued_bytes_ = 0;
+  max_cpu_queue_depth_ = 0;
+  write_stalls_ = 0;
+  write_stall_time_ = absl::ZeroDuration();
+  disk_bytes_written_ = 0;
+  disk_full_ = false;
+  disk_full_noticed_ = false;
+  file_sizes_.assign(cpu_count_, 0);
+  writer_losses_.clear();
+  losses_.clear();
+  memory_full_ = false;
+  dropping_.assign(cpu_count_, false);
+  max_rss_bytes_ = 0;
+  shrunk_ = false;
+  drain_boost_allowed_ = absl::InfinitePast();
+  drain_boosts_ = 0;
+  drain_boost_time_ = absl::ZeroDuration();
+  start_threads_ = {};
+  end_threads_ = {};
+  if (estimate_calibration_.has_value()) {
+    event_type_costs_.clear();
+    peak_fill_rates_.assign(cpu_count_, 0);
+    drain_cpu_time_ = absl::ZeroDuration();
+    max_drain_cpu_time_ = absl::ZeroDuration();
+  }
+  const auto& reserve_path = temp_path_ / "disk_reserve";
+  if (!output_path_.empty()) {
+    const int reserve_fd =
+        open(reserve_path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+    if (reserve_fd == -1 ||
+        posix_fallocate(reserve_fd, 0, kDiskReserveBytes) != 0) {
+      std::cerr << "WARNING: Unable to reserve disk space for the metadata"
+                << std::endl;
+    }
+    if (reserve_fd != -1) {
+      close(reserve_fd);
+    }
+    // The reserve is never part of the capture.
+    streamed_files_.insert(reserve_path.filename());
+  }
+  preallocated_.assign(cpu_count_, 0);
+  written_back_.assign(cpu_count_, 0);
+  preallocated_bytes_ = 0;
+  dropped_cache_bytes_ = 0;
+  file_syscalls_ = 0;
+  writer_cpu_time_ = absl::ZeroDuration();
+  cpu_status = CreateWriters(online.size());
+  if (!cpu_status.ok()) {
+    return cpu_status;
+  }
+  if (budgets_.disk_bytes > 0 && !output_path_.empty()) {
+    struct statvfs disk;
+    if (statvfs(out.c_str(), &disk) == 0 &&
+        static_cast<int64_t>(disk.f_bavail * disk.f_frsize) <
+            budgets_.disk_bytes) {
+      std::cerr << "WARNING: Only " << disk.f_bavail * disk.f_frsize
+                << " bytes are free in " << out
+                << ", less than the disk budget" << std::endl;
+    }
+  }
+
+  // Start Trace.
+  Status status;
+  if (snapshot_.has_value()) {
+    // Swap in the empty snapshot buffer, to record into while the swapped
+    // out pages are drained. The trace clock is sampled around the swap.
+    if (thread_snapshots_) {
+      TakeThreadSnapshot(&end_threads_);
+    }
+    clock_start_ = clock_sampler_->Sample();
+    status = WriteString(kernel_trace_root_ / "snapshot", "1");
+    clock_end_ = clock_sampler_->Sample();
+    if (!status.ok()) {
+      return status;
+    }
+    stop_reason_ = StopReason::kSnapshot;
+  } else {
+    if (!command_.empty()) {
+      status = StartCommand();
+      if (!status.ok()) {
+        return status;
+      }
+    }
+    if (stack_table_ != nullptr && backend_ != DrainBackend::kPerfEvent) {
+      const auto& trigger =
+          MakeBlockedStackTrigger(decoder_.task_report_max());
+      status = AppendString(
+          kernel_trace_root_ / "events" / EventPath(trigger.event) / "trigger",
+          trigger.command);
+      if (status.ok()) installed_triggers_.push_back(trigger);
+    }
+    if (status.ok()) {
+      clock_start_ = clock_sampler_->Sample();
+      status = WriteString(kernel_trace_root_ / "tracing_on", "1");
+    }
+    if (!status.ok()) {
+      (void)RemoveHistTriggers();
+      AbortCommand();
+      return status;
+    }
+  }
+  is_tracing_ = true;
+  if (estimate_calibration_.has_value()) {
+    last_cpu_drain_.assign(cpu_count_, absl::Now());
+  }
+  if (thread_snapshots_ && !snapshot_.has_value()) {
+    // Read while the first pages are drained, so that a system with many
+    // threads doesn't hold up draining.
+    start_threads_reader_ =
+        std::thread(&FTraceTracer::TakeThreadSnapshot, this, &start_threads_);
+  }
+  StartWriter();
+  for (const auto& buffer : perf_buffers_) {
+    status = buffer != nullptr ? buffer->SetEnabled(true) : Status::OkStatus();
+    if (!status.ok()) {
+      (void)StopTrace(/*final_copy=*/false);
+      return status;
+    }
+  }
+  if (!command_.empty()) {
+    status = ReleaseCommand();
+    if (!status.ok()) {
+      (void)StopTrace(/*final_copy=*/false);
+      return status;
+    }
+  }
+
+  // Windows of a duty cycle would repeat this every time.
+  if (capture_duration > absl::ZeroDuration() && !duty_cycle_.has_value()) {
+    std::cout << "Waiting " << absl::ToInt64Seconds(capture_duration)
+              << " seconds" << std::endl;
+  }
+
+  // Wait for trace to end. A snapshot is drained in one go by StopTrace.
+  const auto& start_time = absl::Now();
+  auto end_time = capture_duration > absl::ZeroDuration()
+                      ? start_time + capture_duration
+                      : absl::InfiniteFuture();
+  const auto& interval = drain_interval_;
+  const auto& tracing_file_path = kernel_trace_root_ / "tracing_on";
+  if (snapshot_.has_value()) {
+    end_time = absl::InfinitePast();
+  } else {
+    WaitForData(interval);
+  }
+  Status failedCopyStatus;
+  while (absl::Now() <= end_time) {
+    // Toggle tracing off before copy
+    status = WriteString(tracing_file_path, "0");
+    if (!status.ok()) {
+      failedCopyStatus = status;
+      break;
+    }
+    // Perform Copy
+    status = CheckCPUHotplug();
+    if (status.ok()) status = CopyCPUBuffers(/*all=*/false);
+    if (!status.ok()) {
+      failedCopyStatus = status;
+      break;
+    }
+    status = ProcessDrainedEvents();
+    if (!status.ok()) {
+      failedCopyStatus = status;
+      break;
+    }
+    if (CaptureLimitReached()) {
+      std::cout << "Stopping early: " << stop_detail_ << std::endl;
+      break;
+    }
+    bool over_budget;
+    status = CheckResourceBudgets(&over_budget);
+    if (!status.ok()) {
+      failedCopyStatus = status;
+      break;
+    }
+    if (over_budget) {
+      std::cout << "Stopping early: " << stop_detail_ << std::endl;
+      break;
+    }
+    if (trigger_fired_ &&
+        absl::Now() >= trigger_time_ + trigger_->post_trigger) {
+      stop_reason_ = StopReason::kTrigger;
+      stop_detail_ = trigger_detail_;
+      break;
+    }
+    if (!command_.empty() && CommandExited()) {
+      stop_reason_ = StopReason::kCommandExited;
+      stop_detail_ = absl::StrCat("command exited with status ",
+                                  command_exit_status_);
+      std::cout << "Command exited with status " << command_exit_status_
+                << std::endl;
+      break;
+    }
+    // Toggle tracing on after copy
+    status = WriteString(tracing_file_path, "1");
+    if (!status.ok()) {
+      failedCopyStatus = status;
+      break;
+    }
+    WaitForData(interval);
+  }
+
+
+  status = StopTrace(/*final_copy=*/true);
+  std::error_code ignored;
+  std::filesystem::remove(reserve_path, ignored);
+  std::cout << "Write queue peaked at " << max_queued_bytes_
+            << " bytes (most buffers on one CPU: " << max_cpu_queue_depth_
+            << ")";
+  if (write_stalls_ > 0) {
+    std::cout << "; draining waited for the output " << write_stalls_
+              << " times for " << absl::FormatDuration(write_stall_time_);
+  }
+  std::cout << std::endl;
+  if (drain_boosts_ > 0) {
+    std::cout << "Raised draining's priority " << drain_boosts_
+              << " times for " << absl::FormatDuration(drain_boost_time_)
+              << std::endl;
+  }
+  if (!output_path_.empty()) {
+    const double megabytes =
+        std::max<double>(disk_bytes_written_.load(), 1) / (1 << 20);
+    std::cout << "Wrote " << disk_bytes_written_.load() << " bytes with "
+              << (engine_ == WriteEngine::kUring ? "io_uring" : "write()")
+              << ": " << file_syscalls_ / megabytes << " system calls and "
+              << absl::FormatDuration(writer_cpu_time_ / megabytes)
+              << " of writer CPU time per MB" << std::endl;
+  }
+  // The writer has been joined, so its losses can be merged in.
+  losses_.insert(losses_.end(), writer_losses_.begin(), writer_losses_.end());
+  writer_losses_.clear();
+  std::sort(losses_.begin(), losses_.end(),
+            [](const DataLoss& a, const DataLoss& b) {
+              return std::tie(a.cpu, a.first_timestamp) <
+                     std::tie(b.cpu, b.first_timestamp);
+            });
+  for (const auto& loss : losses_) {
+    std::cout << "Lost " << loss.pages << " pages (" << loss.events
+              << " events) of cpu" << loss.cpu << " from "
+              << loss.first_timestamp << " to " << loss.last_timestamp << ": "
+              << LossReasonName(loss.reason) << std::endl;
+  }
+  if (!failedCopyStatus.ok()) {
     // Merge the failure message from the failed copy and StopTrace,
     // if it failed.
     return Status::InternalError(
         absl::StrCat(failedCopyStatus.message(), "\n\n", status.message()));
   }
-  return status;
+  return status;
+}
+
+Status FTraceTracer::CollectAggregates(const int capture_seconds) {
+  if (is_tracing_) {
+    return Status::InternalError("Already Tracing");
+  }
+  aggregation_ = MakeSchedAggregation(decoder_.task_report_max());
+  events_drained_ = 0;
+  bytes_drained_ = 0;
+  stop_reason_ = StopReason::kCaptureDuration;
+  stop_detail_.clear();
+
+  Status status = InstallHistTriggers();
+  if (status.ok()) {
+    clock_start_ = clock_sampler_->Sample();
+    status = WriteString(kernel_trace_root_ / "tracing_on", "1");
+  }
+  if (!status.ok()) {
+    (void)RemoveHistTriggers();
+    return status;
+  }
+  is_tracing_ = true;
+  std::cout << "Aggregating for " << capture_seconds << " seconds"
+            << std::endl;
+
+  const auto& interval = *aggregation_interval_;
+  const auto& start_time = absl::Now();
+  const auto& end_time = start_time + absl::Seconds(capture_seconds);
+  auto next_snapshot = interval > absl::ZeroDuration()
+                           ? start_time + interval
+                           : absl::InfiniteFuture();
+  Status failedCopyStatus;
+  while (true) {
+    const auto& now = absl::Now();
+    const auto& wake_time = std::min(end_time, next_snapshot);
+    if (now < wake_time) {
+      absl::SleepFor(wake_time - now);
+      continue;
+    }
+    if (now >= end_time) {
+      break;
+    }
+    status = CopyHistTables(now - start_time);
+    if (status.ok() && stream_ != nullptr) status = StreamNewFiles();
+    if (!status.ok()) {
+      failedCopyStatus = status;
+      break;
+    }
+    next_snapshot += interval;
+  }
+
+  if (failedCopyStatus.ok()) {
+    // The final snapshot must be read before the triggers are removed, since
+    // removing them discards their tables.
+    status = WriteString(kernel_trace_root_ / "tracing_on", "0");
+    if (status.ok()) status = CopyHistTables(absl::Now() - start_time);
+    failedCopyStatus = status;
+  }
+
+  status = StopTrace(/*final_copy=*/false);
+  if (!failedCopyStatus.ok()) {
+    return Status::InternalError(
+        absl::StrCat(failedCopyStatus.message(), "\n\n", status.message()));
+  }
+  return status;
+}
+
+Status FTraceTracer::InstallHistTriggers() {
+  const auto& synthetic_events_path = kernel_trace_root_ / "synthetic_events";
+  if (!std::filesystem::exists(synthetic_events_path)) {
+    return Status::InternalError(absl::StrCat(
+        "--aggregate needs a kernel built with CONFIG_HIST_TRIGGERS and "
+        "CONFIG_SYNTH_EVENTS, but ",
+        synthetic_events_path.string(), " does not exist"));
+  }
+  for (const auto& definition : aggregation_.synthetic_events) {
+    const auto& status = AppendString(synthetic_events_path, definition);
+    if (!status.ok()) {
+      return status;
+    }
+    installed_synthetic_events_.push_back(definition);
+  }
+  const std::filesystem::path& events_root = kernel_trace_root_ / "events";
+  for (const auto& trigger : aggregation_.triggers) {
+    const auto& status = AppendString(
+        events_root / EventPath(trigger.event) / "trigger", trigger.command);
+    if (!status.ok()) {
+      return status;
+    }
+    installed_triggers_.push_back(trigger);
+  }
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::RemoveHistTriggers() {
+  // Keep going on failure, so that as much as possible is cleaned up.
+  Status status;
+  const std::filesystem::path& events_root = kernel_trace_root_ / "events";
+  for (auto it = installed_triggers_.rbegin(); it != installed_triggers_.rend();
+       ++it) {
+    const auto& remove_status =
+        AppendString(events_root / EventPath(it->event) / "trigger",
+                     absl::StrCat("!", it->command));
+    if (status.ok()) status = remove_status;
+  }
+  installed_triggers_.clear();
+  const auto& synthetic_events_path = kernel_trace_root_ / "synthetic_events";
+  for (auto it = installed_synthetic_events_.rbegin();
+       it != installed_synthetic_events_.rend(); ++it) {
+    const auto& remove_status = AppendString(
+        synthetic_events_path, absl::StrCat("!", SyntheticEventName(*it)));
+    if (status.ok()) status = remove_status;
+  }
+  installed_synthetic_events_.clear();
+  return status;
+}
+
+Status FTraceTracer::CopyHistTables(absl::Duration elapsed) {
+  const auto& snapshot = std::to_string(absl::ToInt64Milliseconds(elapsed));
+  const auto& out = temp_path_ / "hist" / snapshot;
+  if (!std::filesystem::create_directories(out)) {
+    return Status::InternalError(
+        absl::StrCat("Unable to create directories for path: ", out.string()));
+  }
+  const std::filesystem::path& events_root = kernel_trace_root_ / "events";
+  for (const auto& table : aggregation_.tables) {
+    const auto& status = CopyFakeFile(
+        events_root / EventPath(table.event) / "hist", out / table.name);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::CopyCPUBuffers(bool all) {
+  if (!is_tracing_) {
+    return Status::InternalError("Not currently in a trace");
+  }
+  drain_passes_++;
+  const bool estimating = estimate_calibration_.has_value();
+  const auto& cpu_start =
+      estimating ? ThreadCPUTime() : absl::ZeroDuration();
+  // The largest fraction of a CPU buffer drained.
+  double fill = 0;
+  for (auto& group : drain_groups_) {
+    if (group.cpus.empty() ||
+        (!all && group.idle_passes >= kIdleGroupPasses &&
+         drain_passes_ % kIdleGroupPasses != 0)) {
+      continue;
+    }
+    const int64_t bytes_before = bytes_drained_;
+    for (int cpu : group.cpus) {
+      const int64_t cpu_bytes_before = cpu_bytes_drained_[cpu];
+      const auto& status = backend_ == DrainBackend::kPerfEvent
+                               ? DrainPerfBuffer(cpu)
+                               : CopyCPUBuffer(cpu, fds_[cpu].first);
+      if (!status.ok()) {
+        return status;
+      }
+      // Whatever the CPU records next is newer than anything drained so far.
+      event_merger_.MarkDrained(cpu, newest_timestamp_);
+      fill = std::max(fill, (cpu_bytes_drained_[cpu] - cpu_bytes_before) /
+                                (buffer_size_ * 1024.0));
+      if (estimating) {
+        // What the buffer took in since it was last drained.
+        const auto& now = absl::Now();
+        const double seconds =
+            absl::ToDoubleSeconds(now - last_cpu_drain_[cpu]);
+        if (seconds > 0) {
+          peak_fill_rates_[cpu] =
+              std::max(peak_fill_rates_[cpu],
+                       (cpu_bytes_drained_[cpu] - cpu_bytes_before) / seconds);
+        }
+        last_cpu_drain_[cpu] = now;
+      }
+    }
+    group.idle_passes =
+        bytes_drained_ == bytes_before ? group.idle_passes + 1 : 0;
+  }
+  // The final drain, once tracing is off, is in no hurry.
+  if (!all && (placement_.drain_boost_priority > 0 || drain_boosted_)) {
+    UpdateDrainBoost(fill);
+  }
+  if (estimating) {
+    const auto& cpu_time = ThreadCPUTime() - cpu_start;
+    drain_cpu_time_ += cpu_time;
+    max_drain_cpu_time_ = std::max(max_drain_cpu_time_, cpu_time);
+  }
+
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::ReadCPUs(std::vector<int>* online) {
+  const auto& cpu_root = kernel_devices_root_ / "system" / "cpu";
+  std::string text;
+  std::vector<int> possible;
+  if (ReadString(cpu_root / "possible", &text).ok()) {
+    if (!ParseCPUList(text, &possible)) {
+      return Status::InternalError(
+          absl::StrCat("Invalid CPU list in ", (cpu_root / "possible").string()));
+    }
+    possible_cpus_ = std::string(absl::StripAsciiWhitespace(text));
+  }
+  if (possible.empty()) {
+    // Without the lists, every configured CPU is taken to be online.
+    for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_CONF); cpu++) {
+      possible.push_back(cpu);
+    }
+    possible_cpus_ = CPUListText(possible);
+  }
+  if (ReadOnlineCPUs(online).ok()) {
+    initial_online_cpus_ = CPUListText(*online);
+  } else {
+    *online = possible;
+    initial_online_cpus_ = possible_cpus_;
+  }
+  cpu_count_ = possible.back() + 1;
+  online->erase(std::remove_if(online->begin(), online->end(),
+                               [this](int cpu) { return cpu >= cpu_count_; }),
+                online->end());
+  cpu_online_.assign(cpu_count_, false);
+  cpu_traced_.assign(cpu_count_, false);
+  drain_groups_ =
+      std::vector<DrainGroup>((cpu_count_ + kDrainGroupCPUs - 1) /
+                              kDrainGroupCPUs);
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::ReadOnlineCPUs(std::vector<int>* online) {
+  const auto& online_path =
+      kernel_devices_root_ / "system" / "cpu" / "online";
+  // ReadString reads a missing file as empty, which would be no CPUs.
+  if (!std::filesystem::exists(online_path)) {
+    return Status::InternalError(
+        absl::StrCat(online_path.string(), " does not exist"));
+  }
+  std::string text;
+  const auto& status = ReadString(online_path, &text);
+  if (!status.ok()) {
+    return status;
+  }
+  if (!ParseCPUList(text, online) || online->empty()) {
+    return Status::InternalError(
+        absl::StrCat("Invalid CPU list in ", online_path.string()));
+  }
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::RaiseFileLimit() {
+  const rlim_t needed = 2 * static_cast<rlim_t>(cpu_count_) + kSpareFiles;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return Status::InternalError("Unable to read the open file limit");
+  }
+  if (limit.rlim_cur >= needed) {
+    return Status::OkStatus();
+  }
+  if (limit.rlim_max < needed) {
+    return Status::InternalError(absl::StrCat(
+        "Tracing ", cpu_count_, " CPUs needs ", needed,
+        " open files, but the hard limit is ", limit.rlim_max,
+        ". Raise it with ulimit -Hn"));
+  }
+  const rlim_t original = limit.rlim_cur;
+  limit.rlim_cur = needed;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return Status::InternalError(
+        absl::StrCat("Unable to raise the open file limit to ", needed));
+  }
+  original_file_limit_ = original;
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::OpenCPU(int cpu, bool* opened) {
+  *opened = false;
+  if (backend_ == DrainBackend::kPerfEvent) {
+    std::unique_ptr<PerfCPUBuffer> buffer;
+    int clockid = -1;
+    (void)PerfClockID(trace_clock_, &clockid);
+    auto status = PerfCPUBuffer::Open(
+        cpu, tracepoint_ids_, static_cast<size_t>(buffer_size_) * 1024,
+        clockid, callchain_tracepoint_ids_, &buffer);
+    // Buffers opened during the capture start sampling right away.
+    if (status.ok() && is_tracing_) status = buffer->SetEnabled(true);
+    if (!status.ok()) {
+      return status;
+    }
+    perf_buffers_[cpu] = std::move(buffer);
+  } else {
+    // A snapshot is read from the buffer the pages were swapped out to.
+    const auto& cpu_path =
+        kernel_trace_root_ / "per_cpu" / ("cpu" + std::to_string(cpu)) /
+        (snapshot_.has_value() ? "snapshot_raw" : "trace_pipe_raw");
+    const int in_fd = open(cpu_path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (in_fd == -1) {
+      if (errno == ENOENT) {
+        return Status::OkStatus();
+      }
+      return Status::InternalError(
+          absl::StrCat("Unable to open ", cpu_path.string()));
+    }
+    fds_[cpu].first = in_fd;
+  }
+  if (write_queues_[cpu] == nullptr) {
+    write_queues_[cpu] =
+        std::make_unique<SPSCQueue<DrainedPages>>(kWriteQueueCapacity);
+    free_buffers_[cpu] =
+        std::make_unique<SPSCQueue<std::string>>(kWriteQueueCapacity);
+  }
+  cpu_online_[cpu] = true;
+  cpu_traced_[cpu] = true;
+  auto& group = drain_groups_[cpu / kDrainGroupCPUs];
+  group.cpus.insert(
+      std::upper_bound(group.cpus.begin(), group.cpus.end(), cpu), cpu);
+  group.idle_passes = 0;
+  event_merger_.AddCPU(cpu);
+  *opened = true;
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::CloseCPU(int cpu) {
+  // The buffer of an offline CPU keeps what it had; drain it one last time.
+  Status status;
+  if (backend_ == DrainBackend::kPerfEvent) {
+    status = DrainPerfBuffer(cpu);
+    perf_buffers_[cpu].reset();
+  } else {
+    status = CopyCPUBuffer(cpu, fds_[cpu].first);
+    close(fds_[cpu].first);
+    fds_[cpu].first = -1;
+  }
+  cpu_online_[cpu] = false;
+  event_merger_.RemoveCPU(cpu);
+  auto& cpus = drain_groups_[cpu / kDrainGroupCPUs].cpus;
+  cpus.erase(std::find(cpus.begin(), cpus.end(), cpu));
+  return status;
+}
+
+Status FTraceTracer::CheckCPUHotplug() {
+  const auto& now = absl::Now();
+  if (now < next_hotplug_check_) {
+    return Status::OkStatus();
+  }
+  next_hotplug_check_ = now + kHotplugCheckInterval;
+  std::vector<int> online;
+  if (!ReadOnlineCPUs(&online).ok()) {
+    // Without the list, the CPUs online at the start are all there is.
+    return Status::OkStatus();
+  }
+  std::vector<bool> is_online(cpu_count_, false);
+  for (int cpu : online) {
+    if (cpu < cpu_count_) {
+      is_online[cpu] = true;
+    }
+  }
+  for (int cpu = 0; cpu < cpu_count_; cpu++) {
+    if (is_online[cpu] == cpu_online_[cpu]) {
+      continue;
+    }
+    if (!is_online[cpu]) {
+      const auto& status = CloseCPU(cpu);
+      if (!status.ok()) {
+        return status;
+      }
+      std::cout << "cpu" << cpu << " went offline" << std::endl;
+    } else {
+      bool opened;
+      const auto& status = OpenCPU(cpu, &opened);
+      if (!status.ok()) {
+        // It may have gone offline again already; try on the next check.
+        std::cerr << "WARNING: cpu" << cpu
+                  << " came online but can't be traced: " << status.message()
+                  << std::endl;
+        continue;
+      }
+      if (!opened) {
+        continue;
+      }
+      std::cout << "cpu" << cpu << " came online" << std::endl;
+    }
+    cpu_hotplugs_.push_back({cpu, is_online[cpu], newest_timestamp_, now});
+  }
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::ReadTracepointIDs() {
+  const std::filesystem::path& events_root = kernel_trace_root_ / "events";
+  std::vector<uint64_t> tracepoint_ids;
+  callchain_tracepoint_ids_.clear();
+  for (const auto& event : events_) {
+    std::string id_text;
+    uint64_t id;
+    const auto& id_path = events_root / EventPath(event) / "id";
+    const auto& status = ReadString(id_path, &id_text);
+    if (!status.ok()) {
+      return status;
+    }
+    if (!absl::SimpleAtoi(absl::StripAsciiWhitespace(id_text), &id)) {
+      return Status::InternalError(
+          absl::StrCat("Invalid tracepoint ID in ", id_path.string()));
+    }
+    tracepoint_ids.push_back(id);
+    if (kernel_stacks_ && event == "sched:sched_switch") {
+      callchain_tracepoint_ids_ = {id};
+    }
+  }
+  tracepoint_ids_ = std::move(tracepoint_ids);
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::DrainPerfBuffer(int cpu) {
+  if (!is_tracing_) {
+    return Status::InternalError("Not currently in a trace");
+  }
+  std::string pages;
+  PageWriter& writer = page_writers_[cpu];
+  SchedEvent event;
+  perf_buffers_[cpu]->Drain([&](uint64_t timestamp, const char* data,
+                                uint32_t length, const uint64_t* callchain,
+                                size_t callchain_depth) {
+    writer.Append(timestamp, data, length, &pages);
+    // Every switch records its stack; only those of blocking threads are
+    // kept, as the stacktrace trigger's filter would.
+    if (callchain_depth > 0 &&
+        decoder_.Decode(cpu, {timestamp, data, length}, &event) &&
+        event.type == SchedEventType::kSwitch &&
+        !decoder_.IsRunnableState(event.prev_state)) {
+      // What the stacktrace trigger would have recorded instead.
+      kernel_stack_bytes_ += (2 + callchain_depth) * sizeof(uint64_t);
+      const auto& record =
+          StackIDRecord(timestamp, data, callchain, callchain_depth);
+      writer.Append(record.timestamp, record.data, record.length, &pages);
+    }
+  });
+  // Complete the partial page, so that this pass's events are seen now.
+  writer.Flush(&pages);
+  perf_lost_[cpu] = perf_buffers_[cpu]->lost();
+  if (pages.empty()) {
+    return Status::OkStatus();
+  }
+  return ConsumePages(cpu, pages.data(), pages.size());
+}
+
+void FTraceTracer::WaitForData(absl::Duration interval) {
+  if (perf_buffers_.empty()) {
+    absl::SleepFor(interval);
+    return;
+  }
+  std::vector<pollfd> poll_fds;
+  for (const auto& buffer : perf_buffers_) {
+    if (buffer != nullptr) {
+      poll_fds.push_back({buffer->fd(), POLLIN, 0});
+    }
+  }
+  poll(poll_fds.data(), poll_fds.size(), absl::ToInt64Milliseconds(interval));
+}
+
+Status FTraceTracer::StopTrace(bool final_copy) {
+  if (!is_tracing_) {
+    return Status::InternalError("Not currently in a trace");
+  }
+
+  Status status;
+  if (drain_boosted_) {
+    UpdateDrainBoost(/*fill=*/0);
+  }
+  JoinThreadSnapshot();
+
+  const auto& tracing_file_path = kernel_trace_root_ / "tracing_on";
+  // A snapshot leaves the flight recorder recording.
+  if (!snapshot_.has_value()) {
+    if (final_copy && thread_snapshots_) {
+      // While still tracing, so that the trace covers the snapshot.
+      TakeThreadSnapshot(&end_threads_);
+    }
+    status = WriteString(tracing_file_path, "0");
+    clock_end_ = clock_sampler_->Sample();
+  }
+  if (!status.ok()) {
+    std::cerr << "WARNING: Failed to stop tracing. FTrace may still be "
+                 "running. Double check that "
+              << tracing_file_path << " is set to '0'" << std::endl;
+    (void)StopWriter();
+    close(free_fd_);
+    free_fd_ = -1;
+    is_tracing_ = false;
+    return status;
+  }
+
+  for (const auto& buffer : perf_buffers_) {
+    // Ignore errors; the buffer is drained and closed regardless.
+    if (buffer != nullptr) {
+      (void)buffer->SetEnabled(false);
+    }
+  }
+
+  if (final_copy) {
+    status = CopyCPUBuffers(/*all=*/true);
+    // Every buffer was drained for the last time.
+    event_merger_.Flush(&drained_events_);
+    if (status.ok()) status = ProcessDrainedEvents();
+    // If the trigger never fired, keep the last pre-trigger window.
+    if (status.ok() && HoldingPages()) status = FlushHeldPages();
+  }
+  // Nothing more will be queued; wait for the rest to be written.
+  const auto& writer_status = StopWriter();
+  if (status.ok()) status = writer_status;
+  if (final_copy && !status.ok()) {
+    close(free_fd_);
+    free_fd_ = -1;
+    is_tracing_ = false;
+    return status;
+  }
+
+  if (escalated_) {
+    // Don't leave the expensive events enabled after we're gone.
+    const auto& escalation_status =
+        SetEscalated(false, newest_timestamp_, "capture ended");
+    if (!escalation_status.ok()) {
+      std::cerr << "WARNING: " << escalation_status.message() << std::endl;
+    }
+  }
+
+  if (!installed_triggers_.empty() || !installed_synthetic_events_.empty()) {
+    const auto& hist_status = RemoveHistTriggers();
+    if (!hist_status.ok()) {
+      std::cerr << "WARNING: Failed to remove hist triggers: "
+                << hist_status.message() << std::endl;
+    }
+  }
+
+  if (command_pid_ != -1) {
+    const auto& filter_status = ClearEventPIDFilter();
+    if (!filter_status.ok()) {
+      std::cerr << "WARNING: " << filter_status.message() << std::endl;
+    }
+  }
+
+  ClearCPUFDs();
+  perf_buffers_.clear();
+  page_writers_.clear();
+  if (snapshot_.has_value()) {
+    // Whatever wasn't drained would turn up in the next snapshot.
+    const auto& clear_status =
+        WriteString(kernel_trace_root_ / "snapshot", "2");
+    if (!clear_status.ok()) {
+      std::cerr << "WARNING: Failed to clear the snapshot buffer: "
+                << clear_status.message() << std::endl;
+    }
+  }
+  if (original_file_limit_ != 0) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+      limit.rlim_cur = original_file_limit_;
+      (void)setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    original_file_limit_ = 0;
+  }
+
+  // A duty cycle keeps the buffers allocated between windows.
+  if (!duty_cycle_.has_value()) {
+    close(free_fd_);
+    free_fd_ = -1;
+  }
+  is_tracing_ = false;
+  return status;
+}
+
+Status FTraceTracer::StartCommand() {
+  // Build the arguments before forking; the child must not allocate.
+  std::vector<char*> argv;
+  for (const auto& arg : command_) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  int release_pipe[2];
+  if (pipe2(release_pipe, O_CLOEXEC) != 0) {
+    return Status::InternalError("Unable to create pipe for command");
+  }
+  const pid_t pid = fork();
+  if (pid == -1) {
+    close(release_pipe[0]);
+    close(release_pipe[1]);
+    return Status::InternalError("Unable to fork command");
+  }
+  if (pid == 0) {
+    close(release_pipe[1]);
+    // Wait until tracing is on. EOF means the collector gave up.
+    char go;
+    if (read(release_pipe[0], &go, 1) != 1) {
+      _exit(127);
+    }
+    // Streaming ignores SIGPIPE, but the command shouldn't inherit that, nor
+    // the open file limit raised for many CPUs.
+    signal(SIGPIPE, SIG_DFL);
+    if (original_file_limit_ != 0) {
+      struct rlimit limit;
+      if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = original_file_limit_;
+        setrlimit(RLIMIT_NOFILE, &limit);
+      }
+    }
+    // Nor the collector's placement; the command runs where it would have.
+    if (!original_affinity_.empty()) {
+      sched_setaffinity(0, affinity_size_, original_affinity_.data());
+    }
+    if (!original_cgroup_procs_.empty()) {
+      const int procs_fd =
+          open(original_cgroup_procs_.c_str(), O_WRONLY | O_CLOEXEC);
+      if (procs_fd != -1) {
+        // 0 is the writer itself.
+        (void)write(procs_fd, "0", 1);
+        close(procs_fd);
+      }
+    }
+    execvp(argv[0], argv.data());
+    _exit(127);
+  }
+  close(release_pipe[0]);
+  command_pid_ = pid;
+  command_release_fd_ = release_pipe[1];
+  command_exited_ = false;
+  command_exit_status_ = 0;
+
+  // Follow the command's descendants as well as the command itself.
+  auto status =
+      WriteString(kernel_trace_root_ / "options" / "event-fork", "1");
+  if (status.ok()) {
+    status = WriteString(kernel_trace_root_ / "set_event_pid",
+                         std::to_string(pid));
+  }
+  if (!status.ok()) {
+    AbortCommand();
+    (void)ClearEventPIDFilter();
+  }
+  return status;
+}
+
+Status FTraceTracer::ReleaseCommand() {
+  const char go = 1;
+  const bool released = write(command_release_fd_, &go, 1) == 1;
+  close(command_release_fd_);
+  command_release_fd_ = -1;
+  if (!released) {
+    return Status::InternalError("Unable to start command");
+  }
+  return Status::OkStatus();
+}
+
+bool FTraceTracer::CommandExited() {
+  if (command_exited_) {
+    return true;
+  }
+  int wait_status;
+  if (waitpid(command_pid_, &wait_status, WNOHANG) != command_pid_) {
+    return false;
+  }
+  command_exited_ = true;
+  command_exit_status_ = WIFSIGNALED(wait_status)
+                             ? 128 + WTERMSIG(wait_status)
+                             : WEXITSTATUS(wait_status);
+  return true;
+}
+
+void FTraceTracer::AbortCommand() {
+  if (command_release_fd_ == -1) {
+    return;
+  }
+  // Closing the pipe without writing makes the child exit.
+  close(command_release_fd_);
+  command_release_fd_ = -1;
+  int wait_status;
+  waitpid(command_pid_, &wait_status, 0);
+  command_exited_ = true;
+  command_exit_status_ = 127;
+}
+
+int FTraceTracer::WaitForCommand() {
+  if (command_pid_ == -1) {
+    return 0;
+  }
+  if (!command_exited_) {
+    std::cout << "Waiting for command to exit" << std::endl;
+    int wait_status;
+    if (waitpid(command_pid_, &wait_status, 0) == command_pid_) {
+      command_exited_ = true;
+      command_exit_status_ = WIFSIGNALED(wait_status)
+                                 ? 128 + WTERMSIG(wait_status)
+                                 : WEXITSTATUS(wait_status);
+    }
+  }
+  return command_exit_status_;
+}
+
+Status FTraceTracer::ClearEventPIDFilter() {
+  // Opening set_event_pid for writing truncates it, which removes the filter.
+  const auto& status = WriteString(kernel_trace_root_ / "set_event_pid", "");
+  if (!status.ok()) {
+    return status;
+  }
+  return WriteString(kernel_trace_root_ / "options" / "event-fork", "0");
+}
+
+Status FTraceTracer::CopyCPUBuffer(int cpu, int in_fd) {
+  if (!is_tracing_) {
+    return Status::InternalError("Not currently in a trace");
+  }
+  // Reused across CPUs and passes, so that idle CPUs cost a read each.
+  std::vector<char>& trace_data = read_buffer_;
+  trace_data.resize(buffer_size_);
+
+  // The capture ends with the page that reached a limit.
+  while (!limit_counter_.reached()) {
+    const auto bytes_read = read(in_fd, &trace_data.front(), trace_data.size());
+    if (bytes_read == -1 && errno != EAGAIN) {
+      return Status::InternalError(
+          absl::StrCat("Unable to read cpu file ", std::to_string(in_fd)));
+    }
+    if (bytes_read == -1 || bytes_read == 0) {
+      break;
+    }
+
+    Status status;
+    if (stack_table_ != nullptr) {
+      ReplaceKernelStacks(cpu, &trace_data.front(), bytes_read,
+                          &rewritten_pages_);
+      if (!rewritten_pages_.empty()) {
+        status = ConsumePages(cpu, rewritten_pages_.data(),
+                              rewritten_pages_.size());
+      }
+    } else {
+      status = ConsumePages(cpu, &trace_data.front(), bytes_read);
+    }
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::ConsumePages(int cpu, const char* pages,
+                                  size_t length) {
+  // The capture ends with the page that reached a limit.
+  if (limit_counter_.reached()) {
+    return Status::OkStatus();
+  }
+  DrainedPages drained;
+  // Reuse a buffer the writer thread is done with, if there is one.
+  free_buffers_[cpu]->TryPop(&drained.data);
+  drained.data.assign(pages, length);
+  // The timestamps are kept even when not decoding, so that any loss of the
+  // pages can be placed in time.
+  const bool decode = DecodingEnabled();
+  const bool estimating = estimate_calibration_.has_value();
+  SchedEvent event;
+  drained.events = ForEachRecord(
+      page_format_, pages, length, [&](const RingBufferRecord& record) {
+        if (decode && decoder_.Decode(cpu, record, &event)) {
+          event_merger_.Add(event);
+        }
+        if (estimating && record.length >= sizeof(uint16_t)) {
+          uint16_t id;
+          memcpy(&id, record.data, sizeof(id));
+          auto& cost = event_type_costs_[id];
+          cost.events++;
+          cost.bytes += kRecordHeaderSize + record.length;
+        }
+        if (drained.first_timestamp == 0) {
+          drained.first_timestamp = record.timestamp;
+        }
+        drained.last_timestamp = record.timestamp;
+        return true;
+      });
+
+  newest_timestamp_ = std::max(newest_timestamp_, drained.last_timestamp);
+  cpu_events_drained_[cpu] += drained.events;
+  cpu_bytes_drained_[cpu] += length;
+  events_drained_ += drained.events;
+  bytes_drained_ += length;
+
+  if (memory_full_) {
+    RecordLoss(&losses_, cpu, drained, LossReason::kMemoryBudget,
+               dropping_[cpu]);
+    dropping_[cpu] = true;
+    return Status::OkStatus();
+  }
+  dropping_[cpu] = false;
+  if (HoldingPages()) {
+    held_pages_[cpu].push_back(std::move(drained));
+    return Status::OkStatus();
+  }
+  return QueuePages(cpu, &drained);
+}
+
+Status FTraceTracer::PrepareKernelStacks() {
+  stack_table_ = std::make_unique<StackTable>();
+  kernel_stack_bytes_ = 0;
+  if (backend_ == DrainBackend::kPerfEvent) {
+    return Status::OkStatus();
+  }
+  // The records the stacktrace trigger writes are an FTrace internal event,
+  // with its format but no enable file.
+  const auto& format_path =
+      kernel_trace_root_ / "events" / "ftrace" / "kernel_stack" / "format";
+  std::string format_text;
+  auto status = ReadString(format_path, &format_text);
+  if (status.ok()) {
+    status = EventFormat::Parse(format_text, &kernel_stack_format_);
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  kernel_stack_size_ = kernel_stack_format_.FindField("size");
+  kernel_stack_caller_ = kernel_stack_format_.FindField("caller");
+  if (kernel_stack_size_ == nullptr || kernel_stack_caller_ == nullptr) {
+    return Status::InternalError(absl::StrCat(
+        format_path.string(), " is missing the size or caller field"));
+  }
+  return Status::OkStatus();
+}
+
+void FTraceTracer::ReplaceKernelStacks(int cpu, const char* pages,
+                                       size_t length, std::string* rewritten) {
+  rewritten->clear();
+  RewritePages(
+      page_format_, pages, length,
+      [&](const RingBufferRecord& record) {
+        uint16_t type;
+        if (record.length < sizeof(type)) {
+          return record;
+        }
+        memcpy(&type, record.data, sizeof(type));
+        if (type != kernel_stack_format_.id ||
+            record.length < kernel_stack_caller_->offset) {
+          return record;
+        }
+        // Older kernels fill a fixed size caller array, and end short stacks
+        // with ULONG_MAX.
+        const size_t depth = std::min<size_t>(
+            std::max<int64_t>(ReadNumberField(*kernel_stack_size_,
+                                              record.data, record.length),
+                              0),
+            (record.length - kernel_stack_caller_->offset) / sizeof(uint64_t));
+        stack_frames_.resize(depth);
+        memcpy(stack_frames_.data(),
+               record.data + kernel_stack_caller_->offset,
+               depth * sizeof(uint64_t));
+        const auto& end =
+            std::find(stack_frames_.begin(), stack_frames_.end(), ~uint64_t{0});
+        kernel_stack_bytes_ += record.length;
+        return StackIDRecord(record.timestamp, record.data,
+                             stack_frames_.data(), end - stack_frames_.begin());
+      },
+      &page_writers_[cpu], rewritten);
+}
+
+RingBufferRecord FTraceTracer::StackIDRecord(uint64_t timestamp,
+                                             const char* header,
+                                             const uint64_t* frames,
+                                             size_t depth) {
+  const uint32_t id = stack_table_->Intern(frames, depth);
+  stack_record_.assign(header, kCommonFieldsSize);
+  memcpy(&stack_record_[0], &kStackIDEventID, sizeof(kStackIDEventID));
+  stack_record_.append(reinterpret_cast<const char*>(&id), sizeof(id));
+  return {timestamp, stack_record_.data(),
+          static_cast<uint32_t>(stack_record_.size())};
+}
+
+void FTraceTracer::PreallocateFile(Writer* writer, int cpu, int fd,
+                                   int64_t length) {
+  const int64_t end = file_sizes_[cpu] + length;
+  if (!file_options_.preallocate || writer->preallocation_failed ||
+      end <= preallocated_[cpu]) {
+    return;
+  }
+  const double elapsed = std::max(
+      absl::ToDoubleSeconds(absl::Now() - writer_start_time_), 0.001);
+  int64_t ahead = file_sizes_[cpu] / elapsed *
+                  absl::ToDoubleSeconds(kPreallocationAhead);
+  ahead = std::clamp(ahead, kMinPreallocation, kMaxPreallocation);
+  if (budgets_.disk_bytes > 0) {
+    // Space the budget won't let us use would only be given back later.
+    ahead = std::min(ahead, budgets_.disk_bytes - disk_bytes_written_.load(
+                                                      std::memory_order_relaxed));
+  }
+  const int64_t allocate_end = std::max(end, file_sizes_[cpu] + ahead);
+  // The file's size only grows as pages are written.
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, preallocated_[cpu],
+                allocate_end - preallocated_[cpu]) != 0) {
+    // Not supported by the filesystem, or the disk is full; the writes will
+    // tell.
+    writer->preallocation_failed = true;
+    return;
+  }
+  writer->preallocated_bytes += allocate_end - preallocated_[cpu];
+  preallocated_[cpu] = allocate_end;
+}
+
+void FTraceTracer::DropWrittenPages(Writer* writer, int cpu, int fd) {
+  if (!file_options_.drop_page_cache || direct_io_) {
+    return;
+  }
+  // Lag a range behind the writes, so that its pages have left any io_uring
+  // buffer, and drop a range once it has had a range's worth of time to be
+  // written back.
+  while (file_sizes_[cpu] - written_back_[cpu] >= 2 * kWriteBackBytes) {
+    sync_file_range(fd, written_back_[cpu], kWriteBackBytes,
+                    SYNC_FILE_RANGE_WRITE);
+    if (written_back_[cpu] >= kWriteBackBytes) {
+      posix_fadvise(fd, written_back_[cpu] - kWriteBackBytes, kWriteBackBytes,
+                    POSIX_FADV_DONTNEED);
+      writer->dropped_cache_bytes += kWriteBackBytes;
+    }
+    written_back_[cpu] += kWriteBackBytes;
+  }
+}
+
+void FTraceTracer::FinishFiles(Writer* writer) {
+  for (int cpu : writer->cpus) {
+    const int fd = fds_[cpu].second;
+    if (fd == -1) {
+      continue;
+    }
+    if (preallocated_[cpu] > file_sizes_[cpu]) {
+      // Give back the space past the end of the file.
+      fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                file_sizes_[cpu], preallocated_[cpu] - file_sizes_[cpu]);
+    }
+    if (file_options_.drop_page_cache && !direct_io_) {
+      sync_file_range(fd, 0, 0,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      writer->dropped_cache_bytes +=
+          file_sizes_[cpu] - std::max<int64_t>(written_back_[cpu] -
+                                                   kWriteBackBytes,
+                                               0);
+    }
+  }
+}
+
+void FTraceTracer::FileWriteFailed(Writer* writer, int fd, off_t offset,
+                                   const char* data, size_t length,
+                                   int error) {
+  const auto& it =
+      std::find_if(writer->cpus.begin(), writer->cpus.end(),
+                   [&](int cpu) { return fds_[cpu].second == fd; });
+  if (it == writer->cpus.end()) {
+    return;
+  }
+  const int cpu = *it;
+  if (error != 0 && error != ENOSPC && error != EDQUOT) {
+    if (writer->uring_status.ok()) {
+      writer->uring_status = Status::InternalError(absl::StrCat(
+          "Unable to write pages for cpu", cpu, ": ", strerror(error)));
+    }
+    return;
+  }
+  // Cut off any partly written page, so that the file still holds whole
+  // pages only. Data that was never written starts past the end.
+  struct stat file;
+  if (fstat(fd, &file) != 0 ||
+      (file.st_size > offset && ftruncate(fd, offset) != 0)) {
+    if (writer->uring_status.ok()) {
+      writer->uring_status = Status::InternalError(absl::StrCat(
+          "Unable to truncate pages for cpu", cpu,
+          " after the disk filled up"));
+    }
+    return;
+  }
+  file_sizes_[cpu] = std::min<int64_t>(file_sizes_[cpu], offset);
+  disk_bytes_written_.fetch_sub(length, std::memory_order_relaxed);
+  writer->bytes_written -= length;
+  SetDiskFull(LossReason::kDiskFull,
+              absl::StrCat("the disk filled up after ", offset,
+                           " bytes of pages of cpu", cpu));
+  DrainedPages pages;
+  pages.data.assign(data, length);
+  pages.events = ForEachRecord(
+      page_format_, data, length, [&](const RingBufferRecord& record) {
+        if (pages.first_timestamp == 0) {
+          pages.first_timestamp = record.timestamp;
+        }
+        pages.last_timestamp = record.timestamp;
+        return true;
+      });
+  RecordLoss(&writer->losses, cpu, pages, LossReason::kDiskFull,
+             /*extend=*/true);
+}
+
+void FTraceTracer::RecordLoss(std::vector<DataLoss>* losses, int cpu,
+                              const DrainedPages& pages, LossReason reason,
+                              bool extend) {
+  const int64_t page_count = pages.data.size() / page_format_.page_size();
+  if (extend) {
+    for (auto it = losses->rbegin(); it != losses->rend(); ++it) {
+      if (it->cpu != cpu) {
+        continue;
+      }
+      if (it->reason == reason) {
+        // The io_uring writer may report pages out of order.
+        if (pages.events > 0) {
+          if (it->events == 0) {
+            it->first_timestamp = pages.first_timestamp;
+            it->last_timestamp = pages.last_timestamp;
+          }
+          it->first_timestamp =
+              std::min(it->first_timestamp, pages.first_timestamp);
+          it->last_timestamp =
+              std::max(it->last_timestamp, pages.last_timestamp);
+        }
+        it->pages += page_count;
+        it->bytes += pages.data.size();
+        it->events += pages.events;
+        return;
+      }
+      break;
+    }
+  }
+  losses->push_back({cpu, reason, pages.first_timestamp, pages.last_timestamp,
+                     page_count, static_cast<int64_t>(pages.data.size()),
+                     pages.events});
+}
+
+Status FTraceTracer::CreateWriters(size_t online_cpus) {
+  writers_.clear();
+  // CPUs of unknown nodes are written by the first writer.
+  std::vector<CPUPlacement> placements;
+  if (std::filesystem::exists(kernel_devices_root_ / "system" / "node")) {
+    (void)ReadCPUPlacements(&placements);
+  }
+  std::map<int, Writer*> node_writers;
+  for (int cpu = 0; cpu < cpu_count_; cpu++) {
+    const int node = static_cast<size_t>(cpu) < placements.size()
+                         ? placements[cpu].node
+                         : -1;
+    auto it = node_writers.find(node);
+    if (it == node_writers.end()) {
+      writers_.push_back(std::make_unique<Writer>());
+      writers_.back()->node = node;
+      writers_.back()->group_masks.assign(drain_groups_.size(), 0);
+      it = node_writers.emplace(node, writers_.back().get()).first;
+    }
+    Writer* writer = it->second;
+    writer->cpus.push_back(cpu);
+    writer->group_masks[cpu / kDrainGroupCPUs] |=
+        uint64_t{1} << (cpu % kDrainGroupCPUs);
+    if (write_queues_[cpu] != nullptr) {
+      writer->staged_cpus.push_back(cpu);
+    }
+  }
+  if (node_writers.size() > 1 && node_writers.count(-1) != 0) {
+    // Hand the CPUs of unknown nodes to a real node's writer.
+    Writer* unknown = node_writers[-1];
+    Writer* first = nullptr;
+    for (const auto& writer : writers_) {
+      if (writer.get() != unknown) {
+        first = writer.get();
+        break;
+      }
+    }
+    for (int cpu : unknown->cpus) {
+      first->cpus.push_back(cpu);
+      first->group_masks[cpu / kDrainGroupCPUs] |=
+          uint64_t{1} << (cpu % kDrainGroupCPUs);
+    }
+    first->staged_cpus.insert(first->staged_cpus.end(),
+                              unknown->staged_cpus.begin(),
+                              unknown->staged_cpus.end());
+    std::sort(first->cpus.begin(), first->cpus.end());
+    writers_.erase(std::find_if(
+        writers_.begin(), writers_.end(),
+        [unknown](const std::unique_ptr<Writer>& writer) {
+          return writer.get() == unknown;
+        }));
+  }
+  if (writers_.size() > 1) {
+    std::cout << "Writing with a thread on each of " << writers_.size()
+              << " NUMA nodes" << std::endl;
+  }
+
+  engine_ = WriteEngine::kWrite;
+  if (output_path_.empty() || write_engine_ == WriteEngine::kWrite) {
+    return Status::OkStatus();
+  }
+  for (const auto& writer : writers_) {
+    const size_t node_online = std::count_if(
+        writer->cpus.begin(), writer->cpus.end(),
+        [this](int cpu) { return cpu_online_[cpu]; });
+    // Only place the buffers when there is more than one node to choose
+    // from.
+    const auto& status = UringWriter::Open(
+        std::clamp<size_t>(2 * std::min(node_online, online_cpus), 2,
+                           kUringMaxBuffers),
+        kUringBufferBytes, page_format_.page_size(),
+        writers_.size() > 1 ? writer->node : -1,
+        [this, raw = writer.get()](int fd, off_t offset, const char* data,
+                                   size_t length, int error) {
+          FileWriteFailed(raw, fd, offset, data, length, error);
+        },
+        &writer->uring);
+    if (!status.ok()) {
+      for (const auto& opened : writers_) {
+        opened->uring.reset();
+      }
+      if (write_engine_.has_value()) {
+        return status;
+      }
+      std::cout << "Writing with write(): " << status.message() << std::endl;
+      return Status::OkStatus();
+    }
+  }
+  engine_ = WriteEngine::kUring;
+  return Status::OkStatus();
+}
+
+void FTraceTracer::StartWriter() {
+  queued_bytes_ = 0;
+  writer_failed_ = false;
+  writer_stopping_ = false;
+  writer_start_time_ = absl::Now();
+  for (const auto& writer : writers_) {
+    writer->thread = std::thread(&FTraceTracer::RunWriter, this, writer.get());
+  }
+}
+
+Status FTraceTracer::StopWriter() {
+  writer_stopping_.store(true, std::memory_order_release);
+  Status status;
+  for (const auto& writer : writers_) {
+    if (!writer->thread.joinable()) {
+      continue;
+    }
+    writer->thread.join();
+    writer->uring.reset();
+    if (status.ok()) status = writer->status;
+    preallocated_bytes_ += writer->preallocated_bytes;
+    dropped_cache_bytes_ += writer->dropped_cache_bytes;
+    file_syscalls_ += writer->file_syscalls;
+    writer_cpu_time_ += writer->cpu_time;
+    writer_losses_.insert(writer_losses_.end(), writer->losses.begin(),
+                          writer->losses.end());
+    writer->losses.clear();
+  }
+  return status;
+}
+
+Status FTraceTracer::WriterStatus() {
+  for (const auto& writer : writers_) {
+    if (writer->failed.load(std::memory_order_acquire)) {
+      return writer->status;
+    }
+  }
+  return Status::OkStatus();
+}
+
+LossReason FTraceTracer::SetDiskFull(LossReason reason,
+                                     const std::string& detail) {
+  std::lock_guard<std::mutex> lock(disk_full_mutex_);
+  if (!disk_full_.load(std::memory_order_relaxed)) {
+    disk_full_reason_ = reason;
+    disk_full_detail_ = detail;
+    disk_full_.store(true, std::memory_order_release);
+  }
+  return disk_full_reason_;
+}
+
+void FTraceTracer::RunWriter(Writer* writer) {
+  timespec cpu_start;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+  if (writers_.size() > 1) {
+    // Run on the node, so that the pages are written from its memory, but
+    // only on the collector's CPUs if it has some; if the node has none of
+    // them, the pages are written from afar.
+    std::vector<int> cpus;
+    for (int cpu : writer->cpus) {
+      if (placement_.cpus.empty() ||
+          std::find(placement_.cpus.begin(), placement_.cpus.end(), cpu) !=
+              placement_.cpus.end()) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (!cpus.empty()) {
+      const size_t set_size = CPU_ALLOC_SIZE(cpu_count_);
+      (void)sched_setaffinity(0, set_size, MakeCPUSet(cpus, set_size).data());
+    }
+  }
+  // Staging buffers first touched here are on the node too, and draining
+  // reuses them for the CPUs' pages.
+  const size_t staging_size =
+      std::max<size_t>(buffer_size_, page_format_.page_size());
+  for (int cpu : writer->staged_cpus) {
+    for (int i = 0; i < kStagingBuffersPerCPU; i++) {
+      std::string buffer(staging_size, '\0');
+      buffer.clear();
+      free_buffers_[cpu]->TryPush(std::move(buffer));
+    }
+  }
+  DrainedPages pages;
+  while (true) {
+    // Whatever was queued before stopping was requested is seen by this
+    // pass, so an idle pass after the request means there is nothing left.
+    const bool stopping = writer_stopping_.load(std::memory_order_acquire);
+    bool idle = true;
+    for (size_t group = 0; group < drain_groups_.size(); group++) {
+      // Only the queues of the writer's CPUs that had pages queued are
+      // looked at; the other bits belong to other writers.
+      const uint64_t mask = writer->group_masks[group];
+      auto& queued = drain_groups_[group].queued;
+      if ((queued.load(std::memory_order_relaxed) & mask) == 0) {
+        continue;
+      }
+      uint64_t cpus =
+          queued.fetch_and(~mask, std::memory_order_acquire) & mask;
+      for (; cpus != 0; cpus &= cpus - 1) {
+        const int cpu = group * kDrainGroupCPUs + __builtin_ctzll(cpus);
+        while (write_queues_[cpu]->TryPop(&pages)) {
+          idle = false;
+          // Keep emptying the queues after a failure, so that draining never
+          // waits on us forever.
+          if (writer->status.ok() && !output_path_.empty() &&
+              fds_[cpu].second == -1) {
+            writer->status = OpenOutputFile(cpu);
+          }
+          if (writer->status.ok()) {
+            writer->status = WritePages(writer, cpu, fds_[cpu].second, pages);
+          }
+          if (!writer->status.ok()) {
+            writer->failed.store(true, std::memory_order_release);
+            writer_failed_.store(true, std::memory_order_release);
+          }
+          queued_bytes_.fetch_sub(pages.data.size(),
+                                  std::memory_order_relaxed);
+          pages.data.clear();
+          // If draining has enough spare buffers, this one is freed instead.
+          free_buffers_[cpu]->TryPush(std::move(pages.data));
+          pages.data = std::string();
+        }
+      }
+    }
+    if (writer->uring != nullptr && writer->status.ok() &&
+        (!idle || stopping)) {
+      // Everything this pass filled is written with one system call, and
+      // the rest once nothing more is coming.
+      writer->status = idle ? writer->uring->Flush() : writer->uring->Submit();
+      if (writer->status.ok()) writer->status = writer->uring_status;
+      if (!writer->status.ok()) {
+        writer->failed.store(true, std::memory_order_release);
+        writer_failed_.store(true, std::memory_order_release);
+      }
+    }
+    if (idle) {
+      if (stopping) {
+        break;
+      }
+      absl::SleepFor(kWriterPollInterval);
+    }
+  }
+  if (writer->uring != nullptr) {
+    writer->file_syscalls = writer->uring->syscalls();
+  }
+  if (!output_path_.empty()) {
+    FinishFiles(writer);
+  }
+  timespec cpu_end;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+  writer->cpu_time = absl::DurationFromTimespec(cpu_end) -
+                     absl::DurationFromTimespec(cpu_start);
+}
+
+Status FTraceTracer::OpenOutputFile(int cpu) {
+  const auto& out_path =
+      temp_path_ / "traces" / ("cpu" + std::to_string(cpu));
+  const int out_fd =
+      open(out_path.c_str(),
+           O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC |
+               (direct_io_ ? O_DIRECT : 0),
+           0644);
+  if (out_fd == -1) {
+    return Status::InternalError(
+        absl::StrCat("Unable to create ", out_path.string()));
+  }
+  fds_[cpu].second = out_fd;
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::QueuePages(int cpu, DrainedPages* pages) {
+  if (limit_counter_.enabled()) {
+    // Count page by page, so that the capture ends with the page that
+    // reaches a limit rather than a whole buffer later.
+    const size_t page_size = page_format_.page_size();
+    size_t kept = 0;
+    size_t last_page = 0;
+    uint64_t kept_events = 0;
+    while (kept < pages->data.size() && !limit_counter_.reached()) {
+      const size_t size = std::min(page_size, pages->data.size() - kept);
+      const uint64_t events =
+          CountRecords(page_format_, pages->data.data() + kept, size);
+      limit_counter_.Count(cpu, events, size);
+      last_page = kept;
+      kept += size;
+      kept_events += events;
+    }
+    if (kept == 0) {
+      return Status::OkStatus();
+    }
+    if (kept < pages->data.size()) {
+      pages->data.resize(kept);
+      pages->events = kept_events;
+      ForEachRecord(page_format_, pages->data.data() + last_page,
+                    kept - last_page, [&](const RingBufferRecord& record) {
+                      pages->last_timestamp = record.timestamp;
+                      return true;
+                    });
+    }
+  }
+  const int64_t length = pages->data.size();
+  absl::Time stall_start;
+  bool stalled = false;
+  while (true) {
+    if (writer_failed_.load(std::memory_order_acquire)) {
+      return WriterStatus();
+    }
+    // Always let one buffer through, however big, so nothing waits forever.
+    const int64_t queued = queued_bytes_.load(std::memory_order_relaxed);
+    if (queued == 0 || queued + length <= write_budget_bytes_) {
+      queued_bytes_.fetch_add(length, std::memory_order_relaxed);
+      if (write_queues_[cpu]->TryPush(std::move(*pages))) {
+        drain_groups_[cpu / kDrainGroupCPUs].queued.fetch_or(
+            uint64_t{1} << (cpu % kDrainGroupCPUs), std::memory_order_release);
+        max_queued_bytes_ = std::max(max_queued_bytes_, queued + length);
+        max_cpu_queue_depth_ = std::max<int64_t>(
+            max_cpu_queue_depth_, write_queues_[cpu]->size());
+        break;
+      }
+      queued_bytes_.fetch_sub(length, std::memory_order_relaxed);
+    }
+    if (!stalled) {
+      stalled = true;
+      stall_start = absl::Now();
+      write_stalls_++;
+    }
+    absl::SleepFor(kWriterPollInterval);
+  }
+  if (stalled) {
+    write_stall_time_ += absl::Now() - stall_start;
+  }
+  return Status::OkStatus();
 }
 
-Status FTraceTracer::CopyCPUBuffers() {
-  if (!is_tracing_) {
-    return Status::InternalError("Not currently in a trace");
+Status FTraceTracer::WritePages(Writer* writer, int cpu, int out_fd,
+                                const DrainedPages& pages) {
+  const int64_t length = pages.data.size();
+  // Once pages stop fitting on disk, later ones are dropped too, so that the
+  // gap in the file is a single loss.
+  bool lost = out_fd != -1 && disk_full_.load(std::memory_order_acquire);
+  LossReason reason = lost ? disk_full_reason_ : LossReason::kDiskBudget;
+  if (out_fd != -1 && !lost) {
+    // Writers of other nodes may overshoot the budget by a buffer each.
+    const int64_t written =
+        disk_bytes_written_.load(std::memory_order_relaxed);
+    if (budgets_.disk_bytes > 0 && written + length > budgets_.disk_bytes) {
+      reason = SetDiskFull(
+          LossReason::kDiskBudget,
+          absl::StrCat("wrote ", written, " bytes of pages to disk, budget was ",
+                       budgets_.disk_bytes));
+      lost = true;
+    } else if (writer->uring != nullptr) {
+      PreallocateFile(writer, cpu, out_fd, length);
+      // Counted up front; FileWriteFailed takes back what doesn't make it.
+      file_sizes_[cpu] += length;
+      disk_bytes_written_.fetch_add(length, std::memory_order_relaxed);
+      writer->bytes_written += length;
+      auto status = writer->uring->Write(out_fd, pages.data.data(), length);
+      if (status.ok()) status = writer->uring_status;
+      if (!status.ok()) {
+        return status;
+      }
+      DropWrittenPages(writer, cpu, out_fd);
+    } else {
+      PreallocateFile(writer, cpu, out_fd, length);
+      const char* data = pages.data.data();
+      if (direct_io_) {
+        // O_DIRECT needs a page aligned buffer.
+        if (writer->direct_buffer_size < static_cast<size_t>(length)) {
+          void* buffer = nullptr;
+          if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), length) != 0) {
+            return Status::InternalError(
+                "Unable to allocate an O_DIRECT buffer");
+          }
+          writer->direct_buffer.reset(static_cast<char*>(buffer));
+          writer->direct_buffer_size = length;
+        }
+        memcpy(writer->direct_buffer.get(), data, length);
+        data = writer->direct_buffer.get();
+      }
+      writer->file_syscalls++;
+      const auto& result = write(out_fd, data, length);
+      if (result == length) {
+        file_sizes_[cpu] += length;
+        disk_bytes_written_.fetch_add(length, std::memory_order_relaxed);
+        writer->bytes_written += length;
+        DropWrittenPages(writer, cpu, out_fd);
+      } else if (result >= 0 || errno == ENOSPC || errno == EDQUOT) {
+        // Cut off any partly written page, so that the file still holds
+        // whole pages only.
+        if (ftruncate(out_fd, file_sizes_[cpu]) != 0 ||
+            lseek(out_fd, file_sizes_[cpu], SEEK_SET) == -1) {
+          return Status::InternalError(absl::StrCat(
+              "Unable to truncate pages for cpu", cpu,
+              " after the disk filled up"));
+        }
+        reason = SetDiskFull(LossReason::kDiskFull,
+                             absl::StrCat("the disk filled up after ",
+                                          written, " bytes of pages"));
+        lost = true;
+      } else {
+        return Status::InternalError(
+            absl::StrCat("Unable to write pages for cpu", cpu));
+      }
+    }
   }
-  const auto& cpu_count = sysconf(_SC_NPROCESSORS_CONF);
-  for (int i = 0; i < cpu_count; i++) {
-    const auto& cpu_fds = fds_[i];
-    const auto& status = CopyCPUBuffer(cpu_fds.first, cpu_fds.second);
+  if (lost) {
+    RecordLoss(&writer->losses, cpu, pages, reason, /*extend=*/true);
+  }
+  if (stream_ != nullptr) {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    return stream_->WritePages(cpu, pages.data.data(), length);
+  }
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::StreamNewFiles() {
+  for (const auto& entry :
+       std::filesystem::recursive_directory_iterator(temp_path_)) {
+    if (!entry.is_regular_file()) {
+      continue;
+    }
+    const auto& name = entry.path().lexically_relative(temp_path_).string();
+    if (streamed_files_.count(name) != 0) {
+      continue;
+    }
+    std::string contents;
+    auto status = ReadString(entry.path(), &contents);
+    if (status.ok()) status = stream_->WriteFile(name, contents);
     if (!status.ok()) {
       return status;
     }
+    streamed_files_.insert(name);
   }
-
   return Status::OkStatus();
 }
 
-Status FTraceTracer::StopTrace(bool final_copy) {
-  if (!is_tracing_) {
-    return Status::InternalError("Not currently in a trace");
+bool FTraceTracer::CaptureLimitReached() {
+  if (!limit_counter_.reached()) {
+    return false;
   }
+  stop_reason_ = limit_counter_.stop_reason();
+  stop_detail_ = limit_counter_.stop_detail();
+  return true;
+}
 
-  Status status;
-
-  const auto& tracing_file_path = kernel_trace_root_ / "tracing_on";
-  status = WriteString(tracing_file_path, "0");
-  if (!status.ok()) {
-    std::cerr << "WARNING: Failed to stop tracing. FTrace may still be "
-                 "running. Double check that "
-              << tracing_file_path << " is set to '0'" << std::endl;
-    close(free_fd_);
-    is_tracing_ = false;
-    return status;
+Status FTraceTracer::CheckResourceBudgets(bool* stop) {
+  *stop = false;
+  const bool shrink = budgets_.action == BudgetAction::kShrink && !shrunk_;
+  int64_t rss = ResidentSetSize();
+  if (budgets_.memory_bytes > 0 && rss > budgets_.memory_bytes &&
+      budgets_.action != BudgetAction::kStop) {
+    // Freed buffers may still count; give them back before judging.
+    malloc_trim(0);
+    rss = ResidentSetSize();
   }
-
-  if (final_copy) {
-    status = CopyCPUBuffers();
-    if (!status.ok()) {
-      close(free_fd_);
-      is_tracing_ = false;
-      return status;
+  max_rss_bytes_ = std::max(max_rss_bytes_, rss);
+  if (budgets_.memory_bytes > 0) {
+    if (rss > budgets_.memory_bytes) {
+      if (budgets_.action == BudgetAction::kStop) {
+        stop_reason_ = StopReason::kMemoryBudget;
+        stop_detail_ = absl::StrCat("resident set was ", rss,
+                                    " bytes, budget was ",
+                                    budgets_.memory_bytes);
+        *stop = true;
+        return Status::OkStatus();
+      }
+      if (!memory_full_) {
+        std::cout << "Over the memory budget, dropping pages: resident set is "
+                  << rss << " bytes" << std::endl;
+      }
+      memory_full_ = true;
+    } else {
+      if (memory_full_) {
+        std::cout << "Back within the memory budget: resident set is " << rss
+                  << " bytes" << std::endl;
+      }
+      memory_full_ = false;
+      if (shrink && rss > budgets_.memory_bytes * kShrinkThreshold) {
+        const auto& status = ShrinkEventSet(absl::StrCat(
+            "resident set reached ", rss, " bytes of the ",
+            budgets_.memory_bytes, " byte memory budget"));
+        if (!status.ok()) {
+          return status;
+        }
+      }
     }
   }
-
-  ClearCPUFDs();
-
-  close(free_fd_);
-  is_tracing_ = false;
-  return status;
+  if (disk_full_.load(std::memory_order_acquire)) {
+    if (budgets_.action == BudgetAction::kStop) {
+      stop_reason_ = StopReason::kDiskBudget;
+      stop_detail_ = disk_full_detail_;
+      *stop = true;
+      return Status::OkStatus();
+    }
+    if (!disk_full_noticed_) {
+      disk_full_noticed_ = true;
+      std::cout << "Dropping pages instead of writing them: "
+                << disk_full_detail_ << std::endl;
+    }
+  } else if (shrink && !shrunk_ && budgets_.disk_bytes > 0) {
+    const int64_t written = disk_bytes_written_.load(std::memory_order_relaxed);
+    if (written > budgets_.disk_bytes * kShrinkThreshold) {
+      return ShrinkEventSet(absl::StrCat("wrote ", written, " bytes of the ",
+                                         budgets_.disk_bytes,
+                                         " byte disk budget"));
+    }
+  }
+  return Status::OkStatus();
 }
 
-Status FTraceTracer::CopyCPUBuffer(int in_fd, int out_fd) {
-  if (!is_tracing_) {
-    return Status::InternalError("Not currently in a trace");
+Status FTraceTracer::ShrinkEventSet(const std::string& reason) {
+  shrunk_ = true;
+  // Perf samples tracepoints regardless of FTrace's enable files, so the
+  // perf backend only drops pages.
+  if (backend_ == DrainBackend::kPerfEvent) {
+    return Status::OkStatus();
   }
-  std::vector<char> trace_data(buffer_size_);
-
-  while (true) {
-    const auto bytes_read = read(in_fd, &trace_data.front(), trace_data.size());
-    if (bytes_read == -1 && errno != EAGAIN) {
-      return Status::InternalError(
-          absl::StrCat("Unable to read cpu file ", std::to_string(in_fd)));
+  std::vector<std::string> events;
+  for (const auto& event : events_) {
+    if (std::find(std::begin(kCoreEvents), std::end(kCoreEvents), event) ==
+        std::end(kCoreEvents)) {
+      events.push_back(event);
     }
-    if (bytes_read == -1 || bytes_read == 0) {
-      break;
+  }
+  if (escalated_) {
+    events.insert(events.end(), escalation_->events.begin(),
+                  escalation_->events.end());
+    escalated_ = false;
+  }
+  if (events.empty()) {
+    return Status::OkStatus();
+  }
+  const std::filesystem::path& events_root = kernel_trace_root_ / "events";
+  for (const auto& event : events) {
+    const auto& status =
+        WriteString(events_root / EventPath(event) / "enable", "0");
+    if (!status.ok()) {
+      return status;
     }
-
-    write(out_fd, &trace_data.front(), bytes_read);
   }
+  event_set_changes_.push_back(
+      {newest_timestamp_, absl::Now(), false, events, reason});
+  std::cout << "Shrinking the event set: " << reason << std::endl;
   return Status::OkStatus();
 }
 
@@ -559,12 +4137,24 @@ Status FTraceTracer::CopyCPUStats() {
     }
   }
 
-  const auto& cpu_count = sysconf(_SC_NPROCESSORS_CONF);
-  for (int i = 0; i < cpu_count; i++) {
+  for (int i = 0; i < cpu_count_; i++) {
+    if (!cpu_traced_[i]) {
+      continue;
+    }
     const auto& cpuName = "cpu" + std::to_string(i);
     const auto& cpuPath = kernel_trace_root_ / "per_cpu" / cpuName / "stats";
     const auto& outPath = out / cpuName;
 
+    if (backend_ == DrainBackend::kPerfEvent) {
+      // FTrace's stats don't cover perf buffers; write the same format.
+      const auto& status = WriteString(
+          outPath, absl::StrCat("entries: ", cpu_events_drained_[i],
+                                "\noverrun: ", perf_lost_[i], "\n"));
+      if (!status.ok()) {
+        return status;
+      }
+      continue;
+    }
     auto status = CopyFakeFile(cpuPath, outPath);
     if (!status.ok()) {
       return status;
@@ -573,6 +4163,667 @@ Status FTraceTracer::CopyCPUStats() {
   return Status::OkStatus();
 }
 
+Status FTraceTracer::ProcessDrainedEvents() {
+  event_merger_.Release(&drained_events_);
+  Status status;
+  for (const auto& event : drained_events_) {
+    newest_timestamp_ = std::max(newest_timestamp_, event.timestamp);
+    if (sched_stats_ != nullptr) {
+      sched_stats_->OnEvent(event);
+    }
+    if (sched_histograms_ != nullptr) {
+      sched_histograms_->OnEvent(event);
+    }
+    std::string escalation_detail;
+    if (escalation_trigger_ != nullptr &&
+        escalation_trigger_->OnEvent(event, &escalation_detail)) {
+      last_anomaly_time_ = absl::Now();
+      // Escalating again would undo shrinking the event set.
+      if (!escalated_ && !shrunk_) {
+        status = SetEscalated(true, event.timestamp, escalation_detail);
+        if (!status.ok()) {
+          break;
+        }
+      }
+    }
+    if (sched_trigger_ != nullptr && !trigger_fired_ &&
+        sched_trigger_->OnEvent(event, &trigger_detail_)) {
+      trigger_fired_ = true;
+      trigger_time_ = absl::Now();
+      trigger_timestamp_ = event.timestamp;
+      std::cout << "Trigger fired: " << trigger_detail_ << std::endl;
+      if (trigger_->action == TriggerAction::kStart) {
+        TrimHeldPages(event.timestamp);
+        status = FlushHeldPages();
+        if (!status.ok()) {
+          break;
+        }
+      }
+    }
+  }
+  drained_events_.clear();
+  if (top_interval_.has_value() && absl::Now() >= next_top_time_) {
+    PrintTop();
+    next_top_time_ = absl::Now() + *top_interval_;
+  }
+  if (status.ok() && escalated_ &&
+      absl::Now() >= last_anomaly_time_ + escalation_->hold) {
+    status = SetEscalated(
+        false, newest_timestamp_,
+        absl::StrCat(escalation_->condition.ToString(), " has not held for ",
+                     absl::FormatDuration(escalation_->hold)));
+  }
+  if (status.ok() && HoldingPages()) {
+    uint64_t newest = 0;
+    for (const auto& pages : held_pages_) {
+      if (!pages.empty()) {
+        newest = std::max(newest, pages.back().last_timestamp);
+      }
+    }
+    TrimHeldPages(newest);
+  }
+  return status;
+}
+
+Status FTraceTracer::SetEscalated(bool enable, uint64_t timestamp,
+                                  const std::string& reason) {
+  const std::filesystem::path& events_root = kernel_trace_root_ / "events";
+  for (const auto& event : escalation_->events) {
+    const auto& status =
+        WriteString(events_root / EventPath(event) / "enable",
+                    enable ? "1" : "0");
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  escalated_ = enable;
+  event_set_changes_.push_back(
+      {timestamp, absl::Now(), enable, escalation_->events, reason});
+  std::cout << (enable ? "Escalating: " : "De-escalating: ") << reason
+            << std::endl;
+  return Status::OkStatus();
+}
+
+void FTraceTracer::TrimHeldPages(uint64_t end_timestamp) {
+  const uint64_t window = absl::ToInt64Nanoseconds(trigger_->pre_trigger);
+  const uint64_t start_timestamp =
+      end_timestamp > window ? end_timestamp - window : 0;
+  for (auto& pages : held_pages_) {
+    while (!pages.empty() && pages.front().last_timestamp < start_timestamp) {
+      pages.pop_front();
+    }
+  }
+}
+
+Status FTraceTracer::FlushHeldPages() {
+  for (size_t cpu = 0; cpu < held_pages_.size(); cpu++) {
+    for (auto& page : held_pages_[cpu]) {
+      const auto& status = QueuePages(cpu, &page);
+      if (!status.ok()) {
+        return status;
+      }
+    }
+    held_pages_[cpu].clear();
+  }
+  return Status::OkStatus();
+}
+
+void FTraceTracer::PrintTop() {
+  // The number of threads to show.
+  constexpr size_t kTopRows = 20;
+  const uint64_t now = sched_stats_->last_timestamp();
+  if (now == 0) {
+    return;
+  }
+  const uint64_t since =
+      top_timestamp_ != 0 ? top_timestamp_ : sched_stats_->first_timestamp();
+  const double elapsed = std::max<uint64_t>(now - since, 1);
+  top_timestamp_ = now;
+
+  const auto& threads = sched_stats_->Threads(now);
+  std::vector<std::pair<int64_t, const ThreadStats*>> rows;
+  rows.reserve(threads.size());
+  for (const auto& thread : threads) {
+    int64_t& last_run_time = top_run_time_[thread.pid];
+    rows.emplace_back(thread.run_time - last_run_time, &thread);
+    last_run_time = thread.run_time;
+  }
+  const size_t shown = std::min(rows.size(), kTopRows);
+  std::partial_sort(rows.begin(), rows.begin() + shown, rows.end(),
+                    [](const auto& a, const auto& b) {
+                      return a.first > b.first;
+                    });
+
+  std::ostringstream top;
+  if (isatty(STDOUT_FILENO)) {
+    // Redraw in place, like top(1).
+    top << "\033[H\033[2J";
+  }
+  const auto& cpus = sched_stats_->CPUs(now);
+  top_cpu_busy_time_.resize(cpus.size(), 0);
+  top << "CPU busy %:";
+  for (const auto& cpu : cpus) {
+    top << " cpu" << cpu.cpu << "=" << std::fixed << std::setprecision(0)
+        << 100 * (cpu.busy_time - top_cpu_busy_time_[cpu.cpu]) / elapsed;
+    top_cpu_busy_time_[cpu.cpu] = cpu.busy_time;
+  }
+  top << "\nWrite queue: " << queued_bytes_.load() / 1024 << " KB queued, "
+      << max_queued_bytes_ / 1024 << " KB peak, " << write_stalls_
+      << " stalls";
+  top << "\n\n"
+      << std::setw(8) << "PID" << " " << std::left << std::setw(16)
+      << "COMMAND" << std::right << std::setw(7) << "%CPU" << std::setw(12)
+      << "RUN ms" << std::setw(12) << "WAIT ms" << std::setw(12) << "SLEEP ms"
+      << std::setw(9) << "WAKEUPS" << std::setw(9) << "MIGRATE" << "\n";
+  for (size_t i = 0; i < shown; i++) {
+    const ThreadStats& thread = *rows[i].second;
+    top << std::setw(8) << thread.pid << " " << std::left << std::setw(16)
+        << thread.command << std::right << std::setw(7) << std::fixed
+        << std::setprecision(1) << 100 * rows[i].first / elapsed
+        << std::setw(12) << thread.run_time / 1000000 << std::setw(12)
+        << thread.wait_time / 1000000 << std::setw(12)
+        << thread.sleep_time / 1000000 << std::setw(9) << thread.wakeups
+        << std::setw(9) << thread.migrations << "\n";
+  }
+  std::cout << top.str() << std::flush;
+}
+
+Status FTraceTracer::WriteSummary() {
+  const uint64_t now = sched_stats_->last_timestamp();
+  std::string summary = absl::StrCat(
+      "duration_ns: ", now - sched_stats_->first_timestamp(), "\n");
+  for (const auto& thread : sched_stats_->Threads(now)) {
+    absl::StrAppend(&summary, "thread {\n  pid: ", thread.pid,
+                    "\n  command: \"", absl::CEscape(thread.command),
+                    "\"\n  run_time_ns: ", thread.run_time,
+                    "\n  wait_time_ns: ", thread.wait_time,
+                    "\n  sleep_time_ns: ", thread.sleep_time,
+                    "\n  wakeups: ", thread.wakeups,
+                    "\n  migrations: ", thread.migrations,
+                    "\n  switches: ", thread.switches,
+                    "\n  preemptions: ", thread.preemptions, "\n}\n");
+  }
+  for (const auto& cpu : sched_stats_->CPUs(now)) {
+    absl::StrAppend(&summary, "cpu {\n  cpu: ", cpu.cpu,
+                    "\n  busy_time_ns: ", cpu.busy_time,
+                    "\n  idle_time_ns: ", cpu.idle_time,
+                    "\n  switches: ", cpu.switches,
+                    "\n  wakeups: ", cpu.wakeups,
+                    "\n  migrations_in: ", cpu.migrations_in, "\n}\n");
+  }
+  return WriteString(temp_path_ / "summary.textproto", summary);
+}
+
+Status FTraceTracer::ReadCPUPlacements(
+    std::vector<CPUPlacement>* placements) {
+  placements->clear();
+  const auto& node_root = kernel_devices_root_ / "system" / "node";
+  for (const auto& node_entry :
+       std::filesystem::directory_iterator(node_root)) {
+    int node;
+    if (!RE2::FullMatch(node_entry.path().filename().string(), "node(\\d+)",
+                        &node)) {
+      continue;
+    }
+    for (const auto& cpu_entry :
+         std::filesystem::directory_iterator(node_entry)) {
+      int cpu;
+      if (!RE2::FullMatch(cpu_entry.path().filename().string(), "cpu(\\d+)",
+                          &cpu)) {
+        continue;
+      }
+      if (static_cast<size_t>(cpu) >= placements->size()) {
+        placements->resize(cpu + 1);
+      }
+      CPUPlacement& placement = (*placements)[cpu];
+      placement.node = node;
+      // Without topology files, only the node is known.
+      std::string value;
+      const auto& topology_path = cpu_entry.path() / "topology";
+      if (ReadString(topology_path / "physical_package_id", &value).ok()) {
+        (void)absl::SimpleAtoi(absl::StripAsciiWhitespace(value),
+                               &placement.package);
+      }
+      if (ReadString(topology_path / "core_id", &value).ok()) {
+        (void)absl::SimpleAtoi(absl::StripAsciiWhitespace(value),
+                               &placement.core);
+      }
+    }
+  }
+  return Status::OkStatus();
+}
+
+/**
+ * Formats a histogram as the body of a LogHistogram text proto message,
+ * indented by indent.
+ */
+static std::string HistogramText(const LogHistogram& histogram,
+                                 const std::string& indent) {
+  std::string text = absl::StrCat(
+      indent, "sub_bucket_bits: ", histogram.sub_bucket_bits(), "\n", indent,
+      "count: ", histogram.count(), "\n", indent, "min: ", histogram.min(),
+      "\n", indent, "max: ", histogram.max(), "\n", indent,
+      "sum: ", histogram.sum(), "\n");
+  histogram.ForEachBucket([&](int64_t lower_bound, uint64_t count) {
+    absl::StrAppend(&text, indent, "bucket { lower_bound: ", lower_bound,
+                    " count: ", count, " }\n");
+  });
+  return text;
+}
+
+/**
+ * Formats a set of histograms as fields of a text proto message.
+ */
+static std::string HistogramSetText(const SchedHistogramSet& histograms) {
+  return absl::StrCat(
+      "  wakeup_latency_ns {\n",
+      HistogramText(histograms.wakeup_latency, "    "), "  }\n",
+      "  run_slice_ns {\n", HistogramText(histograms.run_slice, "    "),
+      "  }\n", "  migration_distance {\n",
+      HistogramText(histograms.migration_distance, "    "), "  }\n");
+}
+
+Status FTraceTracer::WriteHistograms() {
+  std::string text;
+  // Wakeup latency across all threads, for the printed percentiles.
+  LogHistogram wakeup_latency =
+      sched_histograms_->other_threads().wakeup_latency;
+  for (const auto& thread : sched_histograms_->threads()) {
+    absl::StrAppend(&text, "thread {\n  pid: ", thread.pid,
+                    "\n  command: \"", absl::CEscape(thread.command), "\"\n",
+                    HistogramSetText(thread.histograms), "}\n");
+    wakeup_latency.Add(thread.histograms.wakeup_latency);
+  }
+  absl::StrAppend(&text, "other_threads {\n",
+                  HistogramSetText(sched_histograms_->other_threads()), "}\n");
+  const auto& cpus = sched_histograms_->cpus();
+  for (size_t cpu = 0; cpu < cpus.size(); cpu++) {
+    absl::StrAppend(&text, "cpu {\n  cpu: ", cpu, "\n",
+                    HistogramSetText(cpus[cpu]), "}\n");
+  }
+
+  if (wakeup_latency.count() > 0) {
+    std::cout << "Wakeup latency over " << wakeup_latency.count()
+              << " wakeups: p50 "
+              << absl::FormatDuration(
+                     absl::Nanoseconds(wakeup_latency.ValueAtQuantile(0.5)))
+              << ", p99 "
+              << absl::FormatDuration(
+                     absl::Nanoseconds(wakeup_latency.ValueAtQuantile(0.99)))
+              << ", max "
+              << absl::FormatDuration(absl::Nanoseconds(wakeup_latency.max()))
+              << std::endl;
+  }
+  return WriteString(temp_path_ / "histograms.textproto", text);
+}
+
+Status FTraceTracer::WriteKernelStacks() {
+  const auto& start = absl::Now();
+  std::unique_ptr<KallsymsIndex> kallsyms;
+  auto status = KallsymsIndex::Load("/proc", kallsyms_cache_, &kallsyms);
+  if (!status.ok()) {
+    return status;
+  }
+  kallsyms_symbols_ = kallsyms->size();
+  kallsyms_cached_ = kallsyms->cached();
+  if (kallsyms_symbols_ == 0 && stack_table_->size() > 0) {
+    std::cerr << "WARNING: /proc/kallsyms hides the kernel's addresses; "
+                 "the stacks are left unsymbolized"
+              << std::endl;
+  }
+
+  std::string text;
+  for (uint32_t id = 0; id < stack_table_->size(); id++) {
+    size_t depth;
+    const uint64_t* frames = stack_table_->Frames(id, &depth);
+    absl::StrAppend(&text, "stack {\n  id: ", id, "\n");
+    for (size_t i = 0; i < depth; i++) {
+      absl::StrAppend(&text, "  frame { address: 0x", absl::Hex(frames[i]),
+                      " symbol: \"",
+                      absl::CEscape(kallsyms->Symbolize(frames[i])), "\" }\n");
+    }
+    absl::StrAppend(&text, "}\n");
+  }
+  symbolize_time_ = absl::Now() - start;
+  std::cout << "Recorded " << stack_table_->lookups() << " kernel stacks, "
+            << stack_table_->size() << " distinct, symbolized in "
+            << absl::FormatDuration(symbolize_time_)
+            << (kallsyms_cached_ ? " with the cached kallsyms index" : "")
+            << std::endl;
+  return WriteString(temp_path_ / "stacks.textproto", text);
+}
+
+void FTraceTracer::TakeThreadSnapshot(TimedThreadSnapshot* snapshot) {
+  int cpus = 1;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    cpus = CPU_COUNT(&allowed);
+  }
+  snapshot->before = clock_sampler_->Sample();
+  const auto& status = ThreadSnapshot::Take(
+      "/proc", std::min(cpus, kMaxThreadSnapshotReaders), &snapshot->snapshot);
+  snapshot->after = clock_sampler_->Sample();
+  if (!status.ok()) {
+    std::cerr << "WARNING: Unable to snapshot the threads: "
+              << status.message() << std::endl;
+    snapshot->snapshot.reset();
+  }
+}
+
+void FTraceTracer::JoinThreadSnapshot() {
+  if (start_threads_reader_.joinable()) {
+    start_threads_reader_.join();
+  }
+}
+
+Status FTraceTracer::WriteThreadSnapshots() {
+  std::string text;
+  int64_t threads = 0;
+  absl::Duration read_time;
+  for (const auto* snapshot : {&start_threads_, &end_threads_}) {
+    if (snapshot->snapshot == nullptr) {
+      continue;
+    }
+    absl::StrAppend(
+        &text, "snapshot {\n  time: ",
+        snapshot == &start_threads_ ? "START" : "END",
+        "\n  before { trace_clock: ", snapshot->before.trace_clock,
+        " monotonic_ns: ", snapshot->before.monotonic_ns,
+        " }\n  after { trace_clock: ", snapshot->after.trace_clock,
+        " monotonic_ns: ", snapshot->after.monotonic_ns, " }\n");
+    // One line per thread keeps the file small next to the trace.
+    for (const auto& thread : snapshot->snapshot->threads()) {
+      absl::StrAppend(&text, "  thread { pid: ", thread.pid,
+                      " tgid: ", thread.tgid, " command: \"",
+                      absl::CEscape(thread.command),
+                      "\" priority: ", thread.priority, " state: \"",
+                      absl::CEscape(absl::string_view(&thread.state, 1)),
+                      "\" cpu: ", thread.cpu, " }\n");
+    }
+    absl::StrAppend(&text, "}\n");
+    threads += snapshot->snapshot->threads().size();
+    read_time += snapshot->snapshot->read_time();
+  }
+  std::cout << "Snapshotted " << threads << " threads in "
+            << absl::FormatDuration(read_time) << std::endl;
+  return WriteString(temp_path_ / "threads.textproto", text);
+}
+
+Status FTraceTracer::WriteMetadata() {
+  const char* stop_reason = "STOP_REASON_UNSPECIFIED";
+  switch (stop_reason_) {
+    case StopReason::kUnspecified:
+      break;
+    case StopReason::kCaptureDuration:
+      stop_reason = "CAPTURE_DURATION";
+      break;
+    case StopReason::kEventLimit:
+      stop_reason = "EVENT_LIMIT";
+      break;
+    case StopReason::kByteLimit:
+      stop_reason = "BYTE_LIMIT";
+      break;
+    case StopReason::kCPUEventLimit:
+      stop_reason = "CPU_EVENT_LIMIT";
+      break;
+    case StopReason::kCPUByteLimit:
+      stop_reason = "CPU_BYTE_LIMIT";
+      break;
+    case StopReason::kTrigger:
+      stop_reason = "TRIGGER";
+      break;
+    case StopReason::kCommandExited:
+      stop_reason = "COMMAND_EXITED";
+      break;
+    case StopReason::kDiskBudget:
+      stop_reason = "DISK_BUDGET";
+      break;
+    case StopReason::kMemoryBudget:
+      stop_reason = "MEMORY_BUDGET";
+      break;
+    case StopReason::kSnapshot:
+      stop_reason = "SNAPSHOT";
+      break;
+  }
+  std::string metadata =
+      absl::StrCat("trace_type: ",
+                   aggregation_interval_.has_value() ? "FTRACE_HIST" : "FTRACE",
+                   "\nrecorder: \"trace.cc\"\n");
+  if (!aggregation_interval_.has_value()) {
+    absl::StrAppend(&metadata, "backend: ",
+                    backend_ == DrainBackend::kPerfEvent ? "PERF_EVENT"
+                                                         : "TRACE_PIPE_RAW",
+                    "\n");
+    // A snapshot is drained in one go.
+    if (!snapshot_.has_value()) {
+      absl::StrAppend(&metadata, "drain_interval_ns: ",
+                      absl::ToInt64Nanoseconds(drain_interval_), "\n");
+    }
+  }
+  absl::StrAppend(&metadata, "collector {\n");
+  if (!placement_.cpus.empty()) {
+    absl::StrAppend(&metadata, "  cpus: \"", CPUListText(placement_.cpus),
+                    "\"\n");
+  }
+  if (!placement_.cgroup.empty()) {
+    absl::StrAppend(&metadata, "  cgroup: \"",
+                    absl::CEscape(placement_.cgroup.string()), "\"\n");
+  }
+  absl::StrAppend(&metadata, "  compression_policy: ",
+                  CompressionPolicyName(placement_.compression_policy), "\n");
+  if (!aggregation_interval_.has_value()) {
+    absl::StrAppend(&metadata, "  drain_boost_priority: ",
+                    placement_.drain_boost_priority, "\n  drain_boosts: ",
+                    drain_boosts_, "\n  drain_boost_time_ns: ",
+                    absl::ToInt64Nanoseconds(drain_boost_time_), "\n");
+  }
+  absl::StrAppend(&metadata, "}\n");
+  absl::StrAppend(&metadata, "stop_reason: ", stop_reason, "\n");
+  absl::StrAppend(&metadata, "trace_clock {\n  clock: ",
+                  TraceClockEnumName(trace_clock_), "\n");
+  if (const auto& conversion = clock_sampler_->tsc_conversion();
+      conversion.has_value()) {
+    absl::StrAppend(&metadata, "  tsc_frequency_hz: ",
+                    clock_sampler_->tsc_frequency_hz(),
+                    "\n  tsc_conversion {\n    time_zero: ",
+                    conversion->time_zero, "\n    time_mult: ",
+                    conversion->time_mult, "\n    time_shift: ",
+                    conversion->time_shift, "\n  }\n");
+  } else if (trace_clock_ == TraceClock::kX86TSC &&
+             clock_end_.monotonic_ns > clock_start_.monotonic_ns) {
+    // Measured over the capture instead.
+    const long double cycles = clock_end_.trace_clock - clock_start_.trace_clock;
+    absl::StrAppend(
+        &metadata, "  tsc_frequency_hz: ",
+        static_cast<int64_t>(cycles * 1e9 /
+                                 (clock_end_.monotonic_ns -
+                                  clock_start_.monotonic_ns) +
+                             0.5),
+        "\n");
+  }
+  for (const auto& [name, sample] :
+       {std::make_pair("start", &clock_start_),
+        std::make_pair("end", &clock_end_)}) {
+    absl::StrAppend(&metadata, "  ", name, " {\n");
+    if (clock_sampler_->readable()) {
+      absl::StrAppend(&metadata, "    trace_clock: ", sample->trace_clock,
+                      "\n");
+    }
+    absl::StrAppend(&metadata, "    monotonic_ns: ", sample->monotonic_ns,
+                    "\n    realtime_ns: ", sample->realtime_ns,
+                    "\n    uncertainty_ns: ", sample->uncertainty_ns,
+                    "\n  }\n");
+  }
+  absl::StrAppend(&metadata, "}\n");
+  if (!stop_detail_.empty()) {
+    absl::StrAppend(&metadata, "stop_detail: \"",
+                    absl::CEscape(stop_detail_), "\"\n");
+  }
+  absl::StrAppend(&metadata, "events_drained: ", events_drained_, "\n");
+  absl::StrAppend(&metadata, "bytes_drained: ", bytes_drained_, "\n");
+  if (!aggregation_interval_.has_value()) {
+    absl::StrAppend(
+        &metadata, "write_queue {\n  budget_bytes: ", write_budget_bytes_,
+        "\n  max_queued_bytes: ", max_queued_bytes_,
+        "\n  max_cpu_queue_depth: ", max_cpu_queue_depth_,
+        "\n  stalls: ", write_stalls_, "\n  stall_time_ns: ",
+        absl::ToInt64Nanoseconds(write_stall_time_), "\n  engine: ",
+        engine_ == WriteEngine::kUring ? "IO_URING" : "WRITE",
+        "\n  file_write_syscalls: ", file_syscalls_,
+        "\n  writer_cpu_time_ns: ", absl::ToInt64Nanoseconds(writer_cpu_time_),
+        "\n  direct_io: ", direct_io_ ? "true" : "false",
+        "\n  preallocated_bytes: ", preallocated_bytes_,
+        "\n  dropped_cache_bytes: ", dropped_cache_bytes_, "\n");
+    // A single writer is the whole of the totals above.
+    if (writers_.size() > 1) {
+      for (const auto& writer : writers_) {
+        absl::StrAppend(&metadata, "  writer {\n    node: ", writer->node,
+                        "\n    cpus: \"", CPUListText(writer->cpus),
+                        "\"\n    bytes_written: ", writer->bytes_written,
+                        "\n    cpu_time_ns: ",
+                        absl::ToInt64Nanoseconds(writer->cpu_time),
+                        "\n  }\n");
+      }
+    }
+    absl::StrAppend(&metadata, "}\n");
+    const char* action = "DROP";
+    if (budgets_.action == BudgetAction::kStop) {
+      action = "STOP";
+    } else if (budgets_.action == BudgetAction::kShrink) {
+      action = "SHRINK";
+    }
+    absl::StrAppend(&metadata, "budget {\n  memory_bytes: ",
+                    budgets_.memory_bytes, "\n  disk_bytes: ",
+                    budgets_.disk_bytes, "\n  action: ", action,
+                    "\n  max_rss_bytes: ", max_rss_bytes_,
+                    "\n  disk_bytes_written: ", disk_bytes_written_.load(),
+                    "\n  shrunk: ", shrunk_ ? "true" : "false", "\n}\n");
+    absl::StrAppend(&metadata, "cpus {\n  possible: \"", possible_cpus_,
+                    "\"\n  online: \"", initial_online_cpus_, "\"\n");
+    for (const auto& hotplug : cpu_hotplugs_) {
+      absl::StrAppend(&metadata, "  hotplug {\n    cpu: ", hotplug.cpu,
+                      "\n    online: ", hotplug.online ? "true" : "false",
+                      "\n    timestamp: ", hotplug.timestamp,
+                      "\n    wall_time_ns: ",
+                      absl::ToUnixNanos(hotplug.wall_time), "\n  }\n");
+    }
+    absl::StrAppend(&metadata, "  drain_groups: ", drain_groups_.size(),
+                    "\n}\n");
+    for (const auto& loss : losses_) {
+      absl::StrAppend(&metadata, "data_loss {\n  cpu: ", loss.cpu,
+                      "\n  reason: ", LossReasonName(loss.reason),
+                      "\n  first_timestamp: ", loss.first_timestamp,
+                      "\n  last_timestamp: ", loss.last_timestamp,
+                      "\n  pages: ", loss.pages, "\n  bytes: ", loss.bytes,
+                      "\n  events: ", loss.events, "\n}\n");
+    }
+  }
+  if (!command_.empty()) {
+    absl::StrAppend(&metadata, "command {\n");
+    for (const auto& arg : command_) {
+      absl::StrAppend(&metadata, "  argv: \"", absl::CEscape(arg), "\"\n");
+    }
+    absl::StrAppend(&metadata, "  pid: ", command_pid_, "\n  exited: ",
+                    command_exited_ ? "true" : "false", "\n");
+    if (command_exited_) {
+      absl::StrAppend(&metadata, "  exit_status: ", command_exit_status_,
+                      "\n");
+    }
+    absl::StrAppend(&metadata, "}\n");
+  }
+  for (const auto& change : event_set_changes_) {
+    absl::StrAppend(&metadata, "event_set_change {\n  timestamp: ",
+                    change.timestamp, "\n  wall_time_ns: ",
+                    absl::ToUnixNanos(change.wall_time), "\n  enabled: ",
+                    change.enabled ? "true" : "false", "\n");
+    for (const auto& event : change.events) {
+      absl::StrAppend(&metadata, "  events: \"", event, "\"\n");
+    }
+    absl::StrAppend(&metadata, "  reason: \"", absl::CEscape(change.reason),
+                    "\"\n}\n");
+  }
+  if (trigger_.has_value()) {
+    absl::StrAppend(
+        &metadata, "trigger {\n  condition: \"",
+        trigger_->condition.ToString(), "\"\n  action: ",
+        trigger_->action == TriggerAction::kStart ? "START" : "STOP",
+        "\n  fired: ", trigger_fired_ ? "true" : "false",
+        "\n  timestamp: ", trigger_timestamp_, "\n  detail: \"",
+        absl::CEscape(trigger_detail_), "\"\n  pre_trigger_ns: ",
+        absl::ToInt64Nanoseconds(trigger_->pre_trigger),
+        "\n  post_trigger_ns: ",
+        absl::ToInt64Nanoseconds(trigger_->post_trigger), "\n}\n");
+  }
+  if (stream_ != nullptr) {
+    for (const auto& sink : stream_->Stats()) {
+      const char* policy = "BLOCK";
+      if (sink.policy == SinkPolicy::kDrop) {
+        policy = "DROP";
+      } else if (sink.policy == SinkPolicy::kSpill) {
+        policy = "SPILL";
+      }
+      absl::StrAppend(&metadata, "stream_sink {\n  destination: \"",
+                      absl::CEscape(sink.destination), "\"\n  policy: ",
+                      policy, "\n  bytes_sent: ", sink.bytes_sent,
+                      "\n  dropped_frames: ", sink.dropped_frames,
+                      "\n  dropped_bytes: ", sink.dropped_bytes,
+                      "\n  spilled_bytes: ", sink.spilled_bytes,
+                      "\n  zero_copy: ", sink.zero_copy ? "true" : "false",
+                      "\n}\n");
+    }
+  }
+  if (duty_cycle_.has_value()) {
+    absl::StrAppend(&metadata, "duty_cycle {\n  window: ", window_,
+                    "\n  on_ns: ", absl::ToInt64Nanoseconds(duty_cycle_->on),
+                    "\n  off_ns: ", absl::ToInt64Nanoseconds(duty_cycle_->off),
+                    "\n}\n");
+  }
+  if (stack_table_ != nullptr) {
+    // Each stack ID record is a record header and the ID after the common
+    // fields.
+    absl::StrAppend(
+        &metadata, "kernel_stacks {\n  stacks: ", stack_table_->lookups(),
+        "\n  distinct_stacks: ", stack_table_->size(),
+        "\n  kernel_stack_bytes: ", kernel_stack_bytes_,
+        "\n  stack_id_bytes: ",
+        stack_table_->lookups() * (4 + kCommonFieldsSize + sizeof(uint32_t)),
+        "\n  kallsyms_symbols: ", kallsyms_symbols_,
+        "\n  kallsyms_cached: ", kallsyms_cached_ ? "true" : "false",
+        "\n  symbolize_time_ns: ", absl::ToInt64Nanoseconds(symbolize_time_),
+        "\n}\n");
+  }
+  if (start_threads_.snapshot != nullptr ||
+      end_threads_.snapshot != nullptr) {
+    absl::StrAppend(&metadata, "thread_snapshots {\n");
+    if (const auto& start = start_threads_.snapshot; start != nullptr) {
+      absl::StrAppend(&metadata, "  start_threads: ", start->threads().size(),
+                      "\n  start_readers: ", start->readers(),
+                      "\n  start_read_time_ns: ",
+                      absl::ToInt64Nanoseconds(start->read_time()), "\n");
+    }
+    if (const auto& end = end_threads_.snapshot; end != nullptr) {
+      absl::StrAppend(&metadata, "  end_threads: ", end->threads().size(),
+                      "\n  end_readers: ", end->readers(),
+                      "\n  end_read_time_ns: ",
+                      absl::ToInt64Nanoseconds(end->read_time()), "\n");
+    }
+    absl::StrAppend(&metadata, "}\n");
+  }
+  if (aggregation_interval_.has_value()) {
+    absl::StrAppend(&metadata, "aggregation {\n  snapshot_interval_ns: ",
+                    absl::ToInt64Nanoseconds(*aggregation_interval_), "\n");
+    for (const auto& table : aggregation_.tables) {
+      absl::StrAppend(&metadata, "  table: \"", table.name, "\"\n");
+    }
+    for (const auto& trigger : aggregation_.triggers) {
+      absl::StrAppend(&metadata, "  trigger: \"", trigger.event, " ",
+                      absl::CEscape(trigger.command), "\"\n");
+    }
+    absl::StrAppend(&metadata, "}\n");
+  }
+  return WriteString(temp_path_ / "metadata.textproto", metadata);
+}
+
 Status FTraceTracer::CreateTar(const std::string& tar_name) {
   if (is_tracing_) {
     return Status::InternalError("Trace should be done before creating a tar");
@@ -585,16 +4836,29 @@ Status FTraceTracer::CreateTar(const std::string& tar_name) {
                    " && "
                    "tar -zcf ",
                    outStr, " *", " && ", "chmod a+rw ", outStr);
-  if (system(tar_cmd.c_str()) != 0) {
-    return Status::InternalError("Error running tar");
+  const auto& status = RunArchiver(tar_cmd);
+  if (!status.ok()) {
+    return status;
+  }
+  if (file_options_.drop_page_cache) {
+    const int fd = open(outStr.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+      fdatasync(fd);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
   }
   return Status::OkStatus();
 }
 
 void FTraceTracer::ClearCPUFDs() {
   for (const auto& cpu_fds : fds_) {
-    close(cpu_fds.first);
-    close(cpu_fds.second);
+    if (cpu_fds.first != -1) {
+      close(cpu_fds.first);
+    }
+    if (cpu_fds.second != -1) {
+      close(cpu_fds.second);
+    }
   }
   fds_.clear();
 }
@@ -604,6 +4868,7 @@ Status FTraceTracer::CopyFakeFile(const std::filesystem::path& src,
   std::ifstream in(src);
   std::ofstream out(dst);
   out << in.rdbuf();
+  out.flush();
   out.close();
   in.close();
   if (in.bad() || out.bad()) {
@@ -613,14 +4878,52 @@ Status FTraceTracer::CopyFakeFile(const std::filesystem::path& src,
   return Status::OkStatus();
 }
 
+std::filesystem::path FTraceTracer::EventPath(const std::string& event) {
+  std::filesystem::path event_path;
+  for (const auto& part : absl::StrSplit(event, ':')) {
+    event_path /= std::string(part);
+  }
+  return event_path;
+}
+
+Status FTraceTracer::ReadString(const std::filesystem::path& path,
+                                std::string* data) {
+  std::ifstream in(path);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  in.close();
+  if (in.bad()) {
+    return Status::InternalError(
+        absl::StrCat("Failed to read from ", path.string()));
+  }
+  *data = contents.str();
+  return Status::OkStatus();
+}
+
+Status FTraceTracer::AppendString(const std::filesystem::path& path,
+                                  const std::string& data) {
+  std::ofstream out(path, std::ios::app);
+  out << data;
+  out.close();
+  // Unlike bad(), this also catches files that could not be opened.
+  if (!out) {
+    return Status::InternalError(
+        absl::StrCat("Failed to append to ", path.string()));
+  }
+  return Status::OkStatus();
+}
+
 Status FTraceTracer::WriteString(const std::filesystem::path& path,
                                  const std::string& data) {
   std::ofstream out(path);
   out << data;
+  // Flushing first makes errors such as a full disk set badbit. Unlike
+  // bad(), this also catches files that could not be opened.
+  out.flush();
   out.close();
-  if (out.bad()) {
+  if (!out) {
     return Status::InternalError(
-        absl::StrCat("Failed to write to", path.string()));
+        absl::StrCat("Failed to write to ", path.string()));
   }
   return Status::OkStatus();
 }
@@ -1,14 +1,269 @@
 #ifndef SCHEDVIZ_UTIL_TRACE_H_
 #define SCHEDVIZ_UTIL_TRACE_H_
 
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/types.h>
 #include <unistd.h>
 
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
 #include <filesystem>
 #include <iostream>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "absl/time/time.h"
+#include "util/capture_limits.h"
+#include "util/hist_triggers.h"
+#include "util/kernel_stacks.h"
+#include "util/perf_buffer.h"
+#include "util/ring_buffer.h"
+#include "util/sched_events.h"
+#include "util/sched_histograms.h"
+#include "util/sched_stats.h"
+#include "util/sched_trigger.h"
+#include "util/spsc_queue.h"
 #include "util/status.h"
+#include "util/thread_snapshot.h"
+#include "util/trace_clock.h"
+#include "util/trace_stream.h"
+#include "util/uring_writer.h"
+
+/**
+ * How events are drained from the kernel. Mirrors
+ * ArchiveMetadataConfig.Backend.
+ */
+enum class DrainBackend {
+  // Copy pages out of per_cpu/cpuN/trace_pipe_raw with read().
+  kTracePipeRaw,
+  // Sample the tracepoints with perf_event_open and consume its per-CPU
+  // mmap'd ring buffers, re-encoding the samples as FTrace pages.
+  kPerfEvent,
+};
+
+/**
+ * What to do with FTrace's snapshot buffer, for flight recorder captures
+ * taken in an instant.
+ */
+enum class SnapshotAction {
+  // Record the events into the ring buffers, overwriting the oldest, and
+  // leave them recording after we exit.
+  kArm,
+  // Swap the ring buffers' contents out into the snapshot buffer and archive
+  // them, while recording carries on into the emptied buffers.
+  kTake,
+  // Stop recording and free the snapshot buffer.
+  kDisarm,
+};
+
+/**
+ * What to do when a trigger condition first holds.
+ */
+enum class TriggerAction {
+  // Only keep a rolling window of data until the condition holds, then
+  // record until post_trigger has elapsed.
+  kStart,
+  // Record from the start of the capture, and stop once post_trigger has
+  // elapsed after the condition holds.
+  kStop,
+};
+
+/**
+ * Configuration of a condition-triggered capture.
+ */
+struct TriggerConfig {
+  TriggerCondition condition;
+  TriggerAction action = TriggerAction::kStart;
+  // How much data to keep from before the trigger, in trace time.
+  absl::Duration pre_trigger = absl::Seconds(1);
+  // How long to keep recording after the trigger is noticed.
+  absl::Duration post_trigger = absl::Seconds(1);
+};
+
+/**
+ * Configuration of dynamic event escalation: extra events are enabled while
+ * an anomaly persists and disabled again once it has passed.
+ */
+struct EscalationConfig {
+  // The anomaly that enables the extra events.
+  TriggerCondition condition;
+  // FTrace event names to enable while escalated.
+  std::vector<std::string> events;
+  // How long the anomaly must be absent before the events are disabled.
+  absl::Duration hold = absl::Seconds(1);
+};
+
+/**
+ * A change to the set of enabled events made during a capture.
+ */
+struct EventSetChange {
+  // Trace clock timestamp of the event that caused the change, or of the last
+  // drained event if the change was not caused by an event.
+  uint64_t timestamp;
+  // Wall clock time of the change.
+  absl::Time wall_time;
+  // Whether the events were enabled or disabled.
+  bool enabled;
+  std::vector<std::string> events;
+  std::string reason;
+};
+
+/**
+ * A CPU that came online or went offline during a capture.
+ */
+struct CPUHotplug {
+  int cpu;
+  bool online;
+  // Trace clock timestamp of the last drained event when the change was
+  // noticed.
+  uint64_t timestamp;
+  // Wall clock time the change was noticed.
+  absl::Time wall_time;
+};
+
+/**
+ * How the writer thread writes pages to the trace files. Mirrors
+ * ArchiveMetadataConfig.WriteQueue.Engine.
+ */
+enum class WriteEngine {
+  // A write() per buffer of drained pages.
+  kWrite,
+  // Pages are gathered into buffers registered with an io_uring, and the
+  // writes of each writer pass are submitted with one system call.
+  kUring,
+};
+
+/**
+ * How the trace files are laid out on disk and kept out of the page cache.
+ */
+struct OutputFileOptions {
+  // Allocate disk space ahead of the writes, sized from each CPU's write
+  // rate, so that files grow in large extents.
+  bool preallocate = true;
+  // Bypass the page cache with O_DIRECT.
+  bool direct_io = false;
+  // Write pages back as they are written and drop them from the page cache,
+  // so that tracing doesn't evict the traced workload's cache.
+  bool drop_page_cache = true;
+};
+
+/**
+ * What to do when a memory or disk budget is used up. Mirrors
+ * ArchiveMetadataConfig.Budget.Action.
+ */
+enum class BudgetAction {
+  // Drop whole pages while over the budget, recording what was lost.
+  kDrop,
+  // Stop the capture.
+  kStop,
+  // Disable all but the core scheduling events once the budget is mostly
+  // used up, and drop pages once it is used up.
+  kShrink,
+};
+
+/**
+ * Budgets on the collector's own memory and disk use. A value of zero
+ * disables the corresponding budget.
+ */
+struct ResourceBudgets {
+  // Maximum resident set size of the collector.
+  int64_t memory_bytes = 0;
+  // Maximum number of bytes of pages written to the trace files.
+  int64_t disk_bytes = 0;
+  BudgetAction action = BudgetAction::kDrop;
+};
+
+/**
+ * Captures short windows on a fixed cadence instead of one long capture,
+ * with FTrace left configured but not recording in between. Each window is
+ * archived on its own.
+ */
+struct DutyCycle {
+  // How long each window records for, and how long recording then pauses.
+  absl::Duration on;
+  absl::Duration off;
+  // How many windows to capture, or 0 to keep going until interrupted.
+  int64_t windows = 0;
+  // How many of the newest window archives to keep. Older ones are deleted.
+  size_t max_archives = 60;
+};
+
+/**
+ * A window of a duty cycle whose archive is kept.
+ */
+struct ArchivedWindow {
+  // The archive's file name in the output directory.
+  std::string archive;
+  int64_t window;
+  // The clocks when recording started and stopped.
+  ClockSample start;
+  ClockSample end;
+  int64_t events;
+  int64_t bytes;
+};
+
+/**
+ * The scheduling policy the archive is compressed with. Mirrors
+ * ArchiveMetadataConfig.Collector.Policy.
+ */
+enum class CompressionPolicy {
+  kNormal,
+  // SCHED_BATCH: runs as normal, but never preempts the workload on waking.
+  kBatch,
+  // SCHED_IDLE: only runs on CPUs that have nothing else to run.
+  kIdle,
+};
+
+/**
+ * Where the collector's own threads run and how they are scheduled, to keep
+ * them out of the way, and out of the traces, of the workload.
+ */
+struct CollectorPlacement {
+  // CPUs to run the collector's threads on, e.g. housekeeping CPUs, or
+  // empty for any.
+  std::vector<int> cpus;
+  // A cgroup directory, e.g. a cpuset's, to move the collector into, or
+  // empty to stay in its own.
+  std::filesystem::path cgroup;
+  CompressionPolicy compression_policy = CompressionPolicy::kNormal;
+  // The SCHED_FIFO priority draining is raised to while a CPU buffer nears
+  // overflow, or 0 to never raise it.
+  int drain_boost_priority = 0;
+};
+
+/**
+ * Why drained pages are missing from the archive. Mirrors
+ * ArchiveMetadataConfig.DataLoss.Reason.
+ */
+enum class LossReason {
+  kDiskBudget,
+  kDiskFull,
+  kMemoryBudget,
+};
+
+/**
+ * Consecutive pages drained from a CPU buffer that are missing from the
+ * archive.
+ */
+struct DataLoss {
+  int cpu;
+  LossReason reason;
+  // Trace clock timestamps of the first and last lost events.
+  uint64_t first_timestamp;
+  uint64_t last_timestamp;
+  int64_t pages;
+  int64_t bytes;
+  int64_t events;
+};
 
 class FTraceTracer {
  public:
@@ -18,7 +273,8 @@ class FTraceTracer {
    * filesystem.
    * @param kernel_devices_root Path to the root directory of the devices
    * filesystem.
-   * @param output_path Path to directory to save trace in.
+   * @param output_path Path to directory to save trace in. May be empty if
+   * the trace is streamed instead.
    * @param buffer_size The number of kilobytes each CPU buffer will hold.
    * @param events A list of FTrace event names to record.
    */
@@ -34,6 +290,201 @@ class FTraceTracer {
 
   ~FTraceTracer();
 
+  /**
+   * Sets the budgets that stop a capture early.
+   * @param limits The budgets to enforce while collecting.
+   */
+  void SetCaptureLimits(const CaptureLimits& limits) { limits_ = limits; }
+
+  /**
+   * Makes the capture start or stop on a scheduling condition.
+   * @param trigger The condition and what to do when it holds.
+   */
+  void SetTrigger(const TriggerConfig& trigger) { trigger_ = trigger; }
+
+  /**
+   * Enables extra events mid-capture while a scheduling anomaly persists.
+   * @param escalation The anomaly and the events to enable.
+   */
+  void SetEscalation(const EscalationConfig& escalation) {
+    escalation_ = escalation;
+  }
+
+  /**
+   * Scopes the capture to a command: the command is started once tracing is
+   * on, only it and its descendants are traced, and the capture stops when it
+   * exits.
+   * @param command The command and its arguments.
+   */
+  void SetCommand(std::vector<std::string> command) {
+    command_ = std::move(command);
+  }
+
+  /**
+   * Chooses how events are drained from the kernel.
+   * @param backend The drain backend.
+   */
+  void SetBackend(DrainBackend backend) { backend_ = backend; }
+
+  /**
+   * Switches to aggregate mode: instead of streaming raw events, hist
+   * triggers and synthetic events aggregate per-thread scheduling
+   * distributions in the kernel, and only the aggregated tables are archived.
+   * @param snapshot_interval How often to read the tables while capturing.
+   *                          Zero reads them only at the end.
+   */
+  void SetAggregation(absl::Duration snapshot_interval) {
+    aggregation_interval_ = snapshot_interval;
+  }
+
+  /**
+   * Accumulates per-thread and per-CPU scheduling totals from the drained
+   * events, and writes them to summary.textproto in the archive.
+   * @param top_interval If set, how often to also print the busiest threads
+   *                     while capturing.
+   */
+  void SetSummary(std::optional<absl::Duration> top_interval) {
+    summary_ = true;
+    top_interval_ = top_interval;
+  }
+
+  /**
+   * Maintains wakeup latency, run slice and migration distance histograms
+   * per thread and per CPU from the drained events, and writes them to
+   * histograms.textproto in the archive.
+   * @param max_threads How many threads get their own histograms. Later
+   *                    threads share one set, which bounds memory use.
+   */
+  void SetHistograms(size_t max_threads) { histogram_threads_ = max_threads; }
+
+  /**
+   * Streams the capture to live consumers while tracing, as described in
+   * TraceStream. Trace pages are sent as they are drained, and are only
+   * written to disk if an output path is also set.
+   * @param sinks Where to stream to, and what to do when each sink can't
+   *              keep up, as taken by TraceStream::Open.
+   */
+  void SetStream(std::vector<std::string> sinks) {
+    stream_sinks_ = std::move(sinks);
+  }
+
+  /**
+   * Sets how many bytes of drained pages may queue up for the writer thread
+   * before draining waits for it.
+   * @param budget_bytes The budget.
+   */
+  void SetWriteBudget(int64_t budget_bytes) {
+    write_budget_bytes_ = budget_bytes;
+  }
+
+  /**
+   * Chooses how pages are written to the trace files.
+   * @param engine The engine, or nullopt to use io_uring if the kernel
+   *               supports it and write() otherwise.
+   */
+  void SetWriteEngine(std::optional<WriteEngine> engine) {
+    write_engine_ = engine;
+  }
+
+  /**
+   * Chooses how the trace files are laid out on disk and kept out of the
+   * page cache.
+   * @param options The options.
+   */
+  void SetOutputFileOptions(const OutputFileOptions& options) {
+    file_options_ = options;
+  }
+
+  /**
+   * Chooses the clock FTrace timestamps events with.
+   * @param clock The clock. Defaults to local, the kernel's default.
+   */
+  void SetTraceClock(TraceClock clock) { trace_clock_ = clock; }
+
+  /**
+   * Makes Trace work with FTrace's snapshot buffer instead of capturing over
+   * time. Arming and disarming write no archive.
+   * @param action What to do with the snapshot buffer.
+   */
+  void SetSnapshotAction(SnapshotAction action) { snapshot_ = action; }
+
+  /**
+   * Records the kernel stack of each thread that blocks, as the ID of the
+   * stack in an event following its sched_switch, and writes the distinct
+   * stacks, symbolized, to stacks.textproto.
+   * @param kallsyms_cache Where to cache the kernel's symbols between
+   *                       captures, or empty to read them every time.
+   */
+  void SetKernelStacks(const std::filesystem::path& kallsyms_cache) {
+    kernel_stacks_ = true;
+    kallsyms_cache_ = kallsyms_cache;
+  }
+
+  /**
+   * Makes Trace capture windows on a duty cycle, archiving each to a file
+   * of its own in the output directory and listing the kept ones in
+   * duty_cycle.textproto there. SIGINT and SIGTERM stop it after the
+   * current window.
+   * @param duty_cycle The duty cycle.
+   */
+  void SetDutyCycle(const DutyCycle& duty_cycle) { duty_cycle_ = duty_cycle; }
+
+  /**
+   * Sets whether the state of every thread is read from procfs as tracing
+   * starts and stops, and written to threads.textproto, so that threads
+   * that never switch during the capture have a known command and state.
+   * On by default; aggregations take no snapshots.
+   * @param enable Whether to take the snapshots.
+   */
+  void SetThreadSnapshots(bool enable) { thread_snapshots_ = enable; }
+
+  /**
+   * Sets how long draining sleeps between passes over the CPU buffers. Each
+   * buffer must hold what its CPU records in that time.
+   * @param interval The drain interval. Defaults to 100ms.
+   */
+  void SetDrainInterval(absl::Duration interval) { drain_interval_ = interval; }
+
+  /**
+   * Sets where the collector's threads run and how they are scheduled. A
+   * traced command is started with the CPUs and cgroup the collector was
+   * started with.
+   * @param placement The placement.
+   */
+  void SetCollectorPlacement(const CollectorPlacement& placement) {
+    placement_ = placement;
+  }
+
+  /**
+   * Makes Trace a dry run: it captures for a short calibration period
+   * instead, and from what that cost predicts what a capture of the
+   * requested duration would, recommending buffer sizes and a drain
+   * interval. The prediction is printed and written to estimate.textproto
+   * in the output directory, and no archive is kept.
+   * @param calibration How long to capture for to measure the costs.
+   */
+  void SetEstimate(absl::Duration calibration) {
+    estimate_calibration_ = calibration;
+  }
+
+  /**
+   * Bounds the collector's memory and the size of the trace files. Instead
+   * of failing when a budget is used up or the disk fills up, the capture
+   * degrades as chosen by the budget's action, and any pages that don't make
+   * it into the archive are recorded in its metadata.
+   * @param budgets The budgets, and what to do when one is used up.
+   */
+  void SetResourceBudgets(const ResourceBudgets& budgets) {
+    budgets_ = budgets;
+  }
+
+  /**
+   * Waits for the command set by SetCommand to exit, if it hasn't already.
+   * @return The command's exit status, or 128 plus the signal number if it
+   *         was killed by a signal.
+   */
+  int WaitForCommand();
+
   /**
    * Captures a new trace.
    * @param capture_seconds How long to capture a trace for.
@@ -42,6 +493,96 @@ class FTraceTracer {
   Status Trace(int capture_seconds);
 
  private:
+  /**
+   * Pages drained from a CPU buffer, and the events on them.
+   */
+  struct DrainedPages {
+    // One or more whole pages, back to back.
+    std::string data;
+    // Timestamps of the first and last events on the pages.
+    uint64_t first_timestamp = 0;
+    uint64_t last_timestamp = 0;
+    int64_t events = 0;
+  };
+
+  /**
+   * Online CPUs that are drained together. Group g holds the online CPUs
+   * among CPU IDs 64g to 64g+63, so that each of its CPUs is a bit of a
+   * mask, and a drain pass costs little for groups with nothing to drain.
+   */
+  struct DrainGroup {
+    // The group's online CPUs, in order. Only used by draining.
+    std::vector<int> cpus;
+    // Bits of the group's CPUs that have pages queued for the writer thread.
+    // Set by draining after queueing, and cleared by the writer before it
+    // empties the queues.
+    std::atomic<uint64_t> queued{0};
+    // How many drain passes in a row found the group's buffers empty.
+    int idle_passes = 0;
+  };
+
+  /**
+   * A thread that writes out the pages of the CPUs of one NUMA node, from
+   * staging buffers and io_uring buffers on that node.
+   */
+  struct Writer {
+    // The node, or -1 if the topology is unknown.
+    int node = -1;
+    // The node's CPUs, and for each drain group the bits of them in its
+    // queued mask.
+    std::vector<int> cpus;
+    std::vector<uint64_t> group_masks;
+    // The node's CPUs that had queues when the thread started, whose
+    // staging buffers it allocates.
+    std::vector<int> staged_cpus;
+    std::thread thread;
+    // The thread's first error. Only read by other threads once failed is
+    // set, or after the thread has been joined.
+    Status status;
+    std::atomic<bool> failed{false};
+    // The io_uring writer, if that is how the trace files are written, and
+    // the first error it reported through FileWriteFailed.
+    std::unique_ptr<UringWriter> uring;
+    Status uring_status;
+    // An aligned copy of the pages being written with O_DIRECT, and its
+    // size.
+    std::unique_ptr<char, decltype(&free)> direct_buffer{nullptr, &free};
+    size_t direct_buffer_size = 0;
+    // Whether the filesystem refused to preallocate.
+    bool preallocation_failed = false;
+    // What the thread did. Only read by other threads after it has been
+    // joined.
+    int64_t bytes_written = 0;
+    int64_t preallocated_bytes = 0;
+    int64_t dropped_cache_bytes = 0;
+    int64_t file_syscalls = 0;
+    absl::Duration cpu_time;
+    std::vector<DataLoss> losses;
+  };
+
+  /**
+   * Moves the collector into the placement's cgroup and pins it to its
+   * CPUs, remembering what to give a traced command back. Threads started
+   * afterwards inherit the placement.
+   * @return Status if successful or not.
+   */
+  Status PlaceCollector();
+
+  /**
+   * Raises draining's priority once a drain pass finds a CPU buffer nearly
+   * full, and lowers it again once the buffers are drained down, or after
+   * it has been raised for long enough.
+   * @param fill The largest fraction of a CPU buffer the pass drained.
+   */
+  void UpdateDrainBoost(double fill);
+
+  /**
+   * Runs a shell command with the compression policy, as archiving does.
+   * @param command The command.
+   * @return Status if successful or not. Fails if the command does.
+   */
+  Status RunArchiver(const std::string& command);
+
   /**
    * Prepare FTrace for a new trace.
    * @return Status if successful or not.
@@ -54,6 +595,35 @@ class FTraceTracer {
    */
   Status EnableEvents();
 
+  /**
+   * Sets FTrace's trace clock, and prepares to sample it at the start and
+   * end of the capture.
+   * @return Status if successful or not. Fails if the kernel doesn't offer
+   *         the clock.
+   */
+  Status ConfigureTraceClock();
+
+  /**
+   * Configures FTrace to record the events into its ring buffers as a flight
+   * recorder, allocates the snapshot buffer and starts recording.
+   * @return Status if successful or not.
+   */
+  Status ArmSnapshots();
+
+  /**
+   * Stops the flight recorder started by ArmSnapshots and frees the snapshot
+   * buffer.
+   * @return Status if successful or not.
+   */
+  Status DisarmSnapshots();
+
+  /**
+   * Checks that a flight recorder is running, and takes the events and trace
+   * clock it was armed with, in place of configuring FTrace.
+   * @return Status if successful or not.
+   */
+  Status PrepareSnapshot();
+
   /**
    * Stop tracing and drain what's left of the per cpu buffers.
    * @param final_copy Whether or not to perform a final copy of the
@@ -80,26 +650,510 @@ class FTraceTracer {
    */
   Status CopySystemTopology();
 
+  /**
+   * Captures a trace, or aggregates, into a new temp directory and archives
+   * it. FTrace must be configured.
+   * @param capture_duration How long to capture for.
+   * @param archive The file name of the archive in the output directory.
+   * @return Status if successful or not.
+   */
+  Status CaptureArchive(absl::Duration capture_duration,
+                        const std::string& archive);
+
+  /**
+   * Captures and archives windows on the duty cycle until enough windows
+   * are captured or a stop is requested, then frees the ring buffers.
+   * @return Status if successful or not.
+   */
+  Status RunDutyCycle();
+
+  /**
+   * Deletes the archives of the oldest windows past the duty cycle's limit,
+   * and rewrites duty_cycle.textproto to list the rest.
+   * @return Status if successful or not.
+   */
+  Status RollArchives();
+
+  /**
+   * Captures for the calibration period, then predicts and reports the cost
+   * of a capture of the requested duration.
+   * @param capture_duration The requested duration.
+   * @return Status if successful or not.
+   */
+  Status Estimate(absl::Duration capture_duration);
+
+  /**
+   * Archives some of the temp directory's files to a scratch archive next
+   * to it, to measure how well they compress, and deletes it again.
+   * @param members What to archive, as tar arguments relative to the temp
+   *                directory.
+   * @param bytes Set to the size of the archive.
+   * @param cpu_time Set to the CPU time tar and gzip took.
+   * @return Status if successful or not.
+   */
+  Status CompressedSize(const std::string& members, int64_t* bytes,
+                        absl::Duration* cpu_time);
+
   /**
    * Collects a trace and writes it to the temp directory.
-   * @param capture_seconds How long to collect the trace for.
+   * @param capture_duration How long to collect the trace for, or zero to
+   *                         collect until the command exits.
    * @return Status if successful or not.
    */
-  Status CollectTrace(int capture_seconds);
+  Status CollectTrace(absl::Duration capture_duration);
 
   /**
-   * Copies all CPU buffers to the temp directory.
+   * Collects aggregated tables and writes them to the temp directory.
+   * @param capture_seconds How long to aggregate for.
+   * @return Status if successful or not.
+   */
+  Status CollectAggregates(int capture_seconds);
+
+  /**
+   * Defines the synthetic events and installs the hist triggers of the
+   * aggregation. Anything installed is recorded so that it can be removed.
    * @return Status if successful or not.
    */
-  Status CopyCPUBuffers();
+  Status InstallHistTriggers();
 
   /**
-   * Copies a CPU buffer from FTrace to out_fd.
+   * Removes the hist triggers and synthetic events added by
+   * InstallHistTriggers, in reverse order.
+   * @return Status if successful or not.
+   */
+  Status RemoveHistTriggers();
+
+  /**
+   * Copies the current contents of every aggregated table to the temp
+   * directory.
+   * @param elapsed Time since aggregation started. Names the snapshot.
+   * @return Status if successful or not.
+   */
+  Status CopyHistTables(absl::Duration elapsed);
+
+  /**
+   * Copies the online CPUs' buffers to the writer thread.
+   * @param all Whether to drain every group, or to skip idle groups on most
+   *            passes.
+   * @return Status if successful or not.
+   */
+  Status CopyCPUBuffers(bool all);
+
+  /**
+   * Reads the CPUs that can ever come online and those that are online, and
+   * sets up a draining group for each 64 of them.
+   * @param online Set to the online CPUs.
+   * @return Status if successful or not.
+   */
+  Status ReadCPUs(std::vector<int>* online);
+
+  /**
+   * Reads the online CPUs from the devices filesystem.
+   * @param online Set to the online CPUs, in order.
+   * @return Status if successful or not. Fails if the kernel doesn't list
+   *         them.
+   */
+  Status ReadOnlineCPUs(std::vector<int>* online);
+
+  /**
+   * Raises the soft limit on open files to cover two files per CPU that can
+   * come online, if it doesn't already.
+   * @return Status if successful or not. Fails if the hard limit is too low.
+   */
+  Status RaiseFileLimit();
+
+  /**
+   * Opens the buffer of a CPU for draining and adds the CPU to its group.
+   * @param cpu The CPU.
+   * @param opened Set to whether or not the CPU's buffer exists. CPUs
+   *               without one are left out of the capture.
+   * @return Status if successful or not.
+   */
+  Status OpenCPU(int cpu, bool* opened);
+
+  /**
+   * Drains what's left of the buffer of a CPU that went offline, closes it,
+   * and removes the CPU from its group.
+   * @param cpu The CPU.
+   * @return Status if successful or not.
+   */
+  Status CloseCPU(int cpu);
+
+  /**
+   * Opens or closes the buffers of the CPUs that came online or went offline
+   * since the last check, and records the changes.
+   * @return Status if successful or not.
+   */
+  Status CheckCPUHotplug();
+
+  /**
+   * Creates a CPU's trace file, on its first pages. Only called by the
+   * CPU's writer thread.
+   * @param cpu The CPU.
+   * @return Status if successful or not.
+   */
+  Status OpenOutputFile(int cpu);
+
+  /**
+   * Copies a CPU buffer from FTrace to the writer thread.
+   * @param cpu The CPU whose buffer is being copied.
    * @param in_fd File Descriptor for the FTrace cpu buffer pipe.
-   * @param out_fd File descriptor to write to.
    * @return Status if successful or not.
    */
-  Status CopyCPUBuffer(int in_fd, int out_fd);
+  Status CopyCPUBuffer(int cpu, int in_fd);
+
+  /**
+   * Drains a CPU's perf buffer, re-encodes the samples as FTrace pages and
+   * passes them to the writer thread.
+   * @param cpu The CPU whose buffer is being drained.
+   * @return Status if successful or not.
+   */
+  Status DrainPerfBuffer(int cpu);
+
+  /**
+   * Accounts for, decodes and queues for writing (or holds back) pages
+   * drained from a CPU buffer.
+   * @param cpu The CPU whose buffer the pages came from.
+   * @param pages One or more whole pages, back to back.
+   * @param length The number of bytes in pages.
+   * @return Status if successful or not.
+   */
+  Status ConsumePages(int cpu, const char* pages, size_t length);
+
+  /**
+   * Reads the kernel_stack format, and installs the trigger that records the
+   * stack of each thread that blocks, unless the perf backend records them.
+   * @return Status if successful or not.
+   */
+  Status PrepareKernelStacks();
+
+  /**
+   * Re-encodes pages drained from a CPU buffer, replacing each kernel_stack
+   * record with a stack ID record.
+   * @param cpu The CPU whose buffer the pages came from.
+   * @param pages One or more whole pages, back to back.
+   * @param length The number of bytes in pages.
+   * @param rewritten Set to the re-encoded pages.
+   */
+  void ReplaceKernelStacks(int cpu, const char* pages, size_t length,
+                           std::string* rewritten);
+
+  /**
+   * Builds the record that stands in for a kernel stack.
+   * @param timestamp Timestamp of the stack.
+   * @param header The record the stack belongs to, whose common fields the
+   *               stack ID record takes.
+   * @param frames The stack's return addresses, innermost first.
+   * @param depth The number of frames.
+   * @return The record, valid until the next call.
+   */
+  RingBufferRecord StackIDRecord(uint64_t timestamp, const char* header,
+                                 const uint64_t* frames, size_t depth);
+
+  /**
+   * Symbolizes the recorded stacks and writes them to stacks.textproto in
+   * the temp directory.
+   * @return Status if successful or not.
+   */
+  Status WriteKernelStacks();
+
+  /**
+   * A snapshot of the threads, and the trace clock around it.
+   */
+  struct TimedThreadSnapshot {
+    std::unique_ptr<ThreadSnapshot> snapshot;
+    ClockSample before;
+    ClockSample after;
+  };
+
+  /**
+   * Reads the threads' state, with as many readers as the collector has
+   * CPUs to run on, up to a limit. Failing to is only warned about.
+   * @param snapshot Set to the snapshot, whose snapshot is null on failure.
+   */
+  void TakeThreadSnapshot(TimedThreadSnapshot* snapshot);
+
+  /**
+   * Waits for the start snapshot, if it's still being read.
+   */
+  void JoinThreadSnapshot();
+
+  /**
+   * Writes the snapshots that were taken to threads.textproto in the temp
+   * directory.
+   * @return Status if successful or not.
+   */
+  Status WriteThreadSnapshots();
+
+  /**
+   * Sets up a writer for each NUMA node with CPUs, with an io_uring whose
+   * buffers are on the node unless writing with write().
+   * @param online_cpus How many CPUs are online.
+   * @return Status if successful or not.
+   */
+  Status CreateWriters(size_t online_cpus);
+
+  /**
+   * Starts the writer threads, which write out the pages queued by
+   * QueuePages.
+   */
+  void StartWriter();
+
+  /**
+   * Waits for the writer threads to write out everything queued, stops
+   * them, and sums up what they did.
+   * @return The first error a writer thread hit, if any.
+   */
+  Status StopWriter();
+
+  /**
+   * A writer thread's main loop.
+   * @param writer The thread's writer.
+   */
+  void RunWriter(Writer* writer);
+
+  /**
+   * @return The error of the first writer thread that failed.
+   */
+  Status WriterStatus();
+
+  /**
+   * Records that pages no longer fit, unless that was recorded already.
+   * @param reason Why.
+   * @param detail A human readable explanation.
+   * @return The reason that was recorded first.
+   */
+  LossReason SetDiskFull(LossReason reason, const std::string& detail);
+
+  /**
+   * Queues pages for the writer thread, waiting while more than the write
+   * budget is queued already. The pages are counted against the capture
+   * limits, and those after the page that reaches a limit are left out.
+   * @param cpu The CPU whose buffer the pages came from.
+   * @param pages The pages. Moved from.
+   * @return The writer thread's error if it failed, or OK.
+   */
+  Status QueuePages(int cpu, DrainedPages* pages);
+
+  /**
+   * Writes pages drained from a CPU buffer to its output file, and sends
+   * them down the stream when streaming. Called on the CPU's writer thread.
+   * Pages that don't fit in the disk budget or on the disk are recorded as
+   * lost instead of being written to the file.
+   * @param writer The CPU's writer.
+   * @param cpu The CPU whose buffer the pages came from.
+   * @param out_fd File descriptor to write to, or -1 when only streaming.
+   * @param pages The pages.
+   * @return Status if successful or not.
+   */
+  Status WritePages(Writer* writer, int cpu, int out_fd,
+                    const DrainedPages& pages);
+
+  /**
+   * Makes sure there is disk space allocated for the next pages of a trace
+   * file, allocating ahead of the CPU's write rate if not. Called on the
+   * CPU's writer thread.
+   * @param writer The CPU's writer.
+   * @param cpu The CPU whose trace file is being written.
+   * @param fd The trace file.
+   * @param length How many bytes are about to be written.
+   */
+  void PreallocateFile(Writer* writer, int cpu, int fd, int64_t length);
+
+  /**
+   * Starts writing back the recently written pages of a trace file, and
+   * drops those written back earlier from the page cache. Called on the
+   * CPU's writer thread.
+   * @param writer The CPU's writer.
+   * @param cpu The CPU whose trace file was written.
+   * @param fd The trace file.
+   */
+  void DropWrittenPages(Writer* writer, int cpu, int fd);
+
+  /**
+   * Releases the unused preallocated space of a writer's trace files, and
+   * writes them back and drops them from the page cache. Called on the
+   * writer thread once every page has been written.
+   * @param writer The writer.
+   */
+  void FinishFiles(Writer* writer);
+
+  /**
+   * Handles pages a writer's io_uring could not write to a trace file.
+   * Called on the writer thread, with the writer and the arguments of
+   * UringWriter::UnwrittenCallback.
+   */
+  void FileWriteFailed(Writer* writer, int fd, off_t offset, const char* data,
+                       size_t length, int error);
+
+  /**
+   * Records that pages will be missing from the archive.
+   * @param losses The list to record the loss in.
+   * @param cpu The CPU whose buffer the pages came from.
+   * @param pages The lost pages.
+   * @param reason Why the pages are lost.
+   * @param extend Whether none of the CPU's pages were kept since its last
+   *               loss in the list, so that the pages extend that loss if it
+   *               has the same reason.
+   */
+  void RecordLoss(std::vector<DataLoss>* losses, int cpu,
+                  const DrainedPages& pages, LossReason reason, bool extend);
+
+  /**
+   * Checks the collector's memory and disk use against the resource
+   * budgets, shrinking the event set or starting to drop pages as the
+   * budget action says, and records the stop reason if the capture should
+   * stop.
+   * @param stop Set to whether or not the capture should stop.
+   * @return Status if successful or not.
+   */
+  Status CheckResourceBudgets(bool* stop);
+
+  /**
+   * Disables every event but the core scheduling ones for the rest of the
+   * capture, and records the change.
+   * @param reason Why the event set is being shrunk.
+   * @return Status if successful or not.
+   */
+  Status ShrinkEventSet(const std::string& reason);
+
+  /**
+   * Sends every file in the temp directory that hasn't been sent yet down
+   * the stream.
+   * @return Status if successful or not.
+   */
+  Status StreamNewFiles();
+
+  /**
+   * Looks up the IDs of the events provided to the constructor, for perf
+   * buffers to sample.
+   * @return Status if successful or not.
+   */
+  Status ReadTracepointIDs();
+
+  /**
+   * Waits until the next drain pass is due. With the perf backend, returns
+   * early once any CPU's buffer is half full.
+   * @param interval The longest time to wait.
+   */
+  void WaitForData(absl::Duration interval);
+
+  /**
+   * Records the stop reason if the pages kept reached a capture limit.
+   * @return Whether or not a limit was reached.
+   */
+  bool CaptureLimitReached();
+
+  /**
+   * @return Whether drained pages need to be decoded into SchedEvents.
+   */
+  bool DecodingEnabled() const {
+    return trigger_.has_value() || escalation_.has_value() || summary_ ||
+           histogram_threads_.has_value();
+  }
+
+  /**
+   * @return Whether drained pages are being held back until the trigger
+   *         fires instead of being written out.
+   */
+  bool HoldingPages() const {
+    return trigger_.has_value() && trigger_->action == TriggerAction::kStart &&
+           !trigger_fired_;
+  }
+
+  /**
+   * Feeds the SchedEvents that every CPU has been drained past, in
+   * timestamp order, to the online consumers, and fires the trigger if its
+   * condition holds.
+   * @return Status if successful or not.
+   */
+  Status ProcessDrainedEvents();
+
+  /**
+   * Forks the command, restricts event recording to it and its descendants,
+   * and leaves it blocked until ReleaseCommand is called.
+   * @return Status if successful or not.
+   */
+  Status StartCommand();
+
+  /**
+   * Lets the forked command exec.
+   * @return Status if successful or not.
+   */
+  Status ReleaseCommand();
+
+  /**
+   * Checks, without blocking, whether the command has exited.
+   * @return Whether or not the command has exited.
+   */
+  bool CommandExited();
+
+  /**
+   * Makes a command that was started but not released exit without
+   * running, and reaps it.
+   */
+  void AbortCommand();
+
+  /**
+   * Removes the event PID filter installed by StartCommand.
+   * @return Status if successful or not.
+   */
+  Status ClearEventPIDFilter();
+
+  /**
+   * Enables or disables events while tracing, and records the change.
+   * @param enable Whether to enable or disable the escalation events.
+   * @param timestamp Trace clock timestamp to record for the change.
+   * @param reason Why the change is being made.
+   * @return Status if successful or not.
+   */
+  Status SetEscalated(bool enable, uint64_t timestamp,
+                      const std::string& reason);
+
+  /**
+   * Drops held pages that are older than the pre-trigger window, which ends
+   * at end_timestamp.
+   * @param end_timestamp End of the pre-trigger window, in trace clock units.
+   */
+  void TrimHeldPages(uint64_t end_timestamp);
+
+  /**
+   * Writes all held pages to their CPU's output file and the stream.
+   * @return Status if successful or not.
+   */
+  Status FlushHeldPages();
+
+  /**
+   * Prints the threads that ran the most since the last call, and how busy
+   * each CPU was.
+   */
+  void PrintTop();
+
+  /**
+   * Writes the scheduling totals to summary.textproto in the temp directory.
+   * @return Status if successful or not.
+   */
+  Status WriteSummary();
+
+  /**
+   * Reads where each CPU sits in the topology from the devices filesystem.
+   * @param placements Set to the placements, indexed by CPU ID.
+   * @return Status if successful or not.
+   */
+  Status ReadCPUPlacements(std::vector<CPUPlacement>* placements);
+
+  /**
+   * Writes the scheduling histograms to histograms.textproto in the temp
+   * directory, and prints the overall wakeup latency percentiles.
+   * @return Status if successful or not.
+   */
+  Status WriteHistograms();
+
+  /**
+   * Writes the archive metadata file to the temp directory.
+   * @return Status if successful or not.
+   */
+  Status WriteMetadata();
 
   /**
    * Copies all CPU buffers to the temp directory.
@@ -140,6 +1194,34 @@ class FTraceTracer {
   static Status WriteString(const std::filesystem::path& path,
                             const std::string& data);
 
+  /**
+   * Append a string to a file, without truncating it first.
+   * Needed for control files where truncation has side effects, like
+   * synthetic_events.
+   * @param path Path to the file to append the string to.
+   * @param data The string to append.
+   * @return Status if successful or not.
+   */
+  static Status AppendString(const std::filesystem::path& path,
+                             const std::string& data);
+
+  /**
+   * Converts an FTrace event name such as "sched:sched_switch" to its
+   * relative path under the events directory, e.g. "sched/sched_switch".
+   * @param event The event name.
+   * @return The relative path of the event.
+   */
+  static std::filesystem::path EventPath(const std::string& event);
+
+  /**
+   * Read the contents of a file into a string.
+   * @param path Path to the file to read.
+   * @param data Where to store the file's contents.
+   * @return Status if successful or not.
+   */
+  static Status ReadString(const std::filesystem::path& path,
+                           std::string* data);
+
   // Path to the root directory of the Ftrace filesystem.
   const std::filesystem::path kernel_trace_root_;
   // Path to the root directory of the devices filesystem.
@@ -148,19 +1230,307 @@ class FTraceTracer {
   const std::filesystem::path output_path_;
   // Size of the trace buffer in KB.
   const int buffer_size_;
-  // List of Ftrace Events.
-  const std::vector<std::string> events_;
+  // List of Ftrace Events. Replaced by the armed events when taking a
+  // snapshot.
+  std::vector<std::string> events_;
+  // Budgets that stop the capture early.
+  CaptureLimits limits_;
+  // Counts the pages kept for output against limits_.
+  CaptureLimitCounter limit_counter_;
+  // Scheduling condition that starts or stops the capture, if any.
+  std::optional<TriggerConfig> trigger_;
+  // Events to enable while an anomaly persists, if any.
+  std::optional<EscalationConfig> escalation_;
+  // The command to scope the capture to, if any.
+  std::vector<std::string> command_;
+  // How events are drained from the kernel.
+  DrainBackend backend_ = DrainBackend::kTracePipeRaw;
+  // How often to read the aggregated tables, if in aggregate mode.
+  std::optional<absl::Duration> aggregation_interval_;
+  // Whether to write summary.textproto, and how often to print the busiest
+  // threads, if at all.
+  bool summary_ = false;
+  std::optional<absl::Duration> top_interval_;
+  // How many threads get their own histograms, if histograms are kept.
+  std::optional<size_t> histogram_threads_;
+  // Where to stream the capture to, if anywhere.
+  std::vector<std::string> stream_sinks_;
+  // How many bytes of pages may queue up for the writer thread.
+  int64_t write_budget_bytes_ = int64_t{64} << 20;
+  // Budgets on the collector's memory and disk use.
+  ResourceBudgets budgets_;
+  // How to write the trace files, if chosen.
+  std::optional<WriteEngine> write_engine_;
+  // How the trace files are laid out and cached.
+  OutputFileOptions file_options_;
+  // The clock events are timestamped with, and readings of it taken when
+  // tracing started and stopped.
+  TraceClock trace_clock_ = TraceClock::kLocal;
+  // What to do with the snapshot buffer, if anything.
+  std::optional<SnapshotAction> snapshot_;
+  std::unique_ptr<TraceClockSampler> clock_sampler_;
+  ClockSample clock_start_;
+  ClockSample clock_end_;
+  // The duty cycle, if capturing on one, the window being captured, and
+  // the windows whose archives are kept, oldest first.
+  std::optional<DutyCycle> duty_cycle_;
+  int64_t window_ = 0;
+  std::deque<ArchivedWindow> archived_windows_;
+  // Whether to record the kernel stacks of blocking threads, and where the
+  // kernel's symbols are cached.
+  bool kernel_stacks_ = false;
+  std::filesystem::path kallsyms_cache_;
+  // How long draining sleeps between passes.
+  absl::Duration drain_interval_ = absl::Milliseconds(100);
+  // Where the collector runs, and what a traced command is given back: the
+  // CPU affinity, and the cgroup.procs file of the cgroup, it was started
+  // with.
+  CollectorPlacement placement_;
+  std::vector<cpu_set_t> original_affinity_;
+  size_t affinity_size_ = 0;
+  std::string original_cgroup_procs_;
+  // Whether draining runs at the raised priority, since when, and until
+  // when it may not be raised again. How often it was raised, and for how
+  // long in all, during the capture.
+  bool drain_boosted_ = false;
+  absl::Time drain_boost_start_;
+  absl::Time drain_boost_allowed_;
+  int64_t drain_boosts_ = 0;
+  absl::Duration drain_boost_time_;
+  // The calibration period, when estimating the cost of a capture instead
+  // of taking it.
+  std::optional<absl::Duration> estimate_calibration_;
 
   // Path to temporary directory.
   std::filesystem::path temp_path_;
+  // The stream the capture is sent down. Only set if stream_sinks_ is.
+  std::unique_ptr<TraceStream> stream_;
+  // Files of the temp directory that have been sent down the stream,
+  // relative to it.
+  std::set<std::string> streamed_files_;
 
   // Are we currently running a trace or not?
   bool is_tracing_ = false;
   // File Descriptors for CPU buffers and output files. Indexed by CPU ID.
+  // CPU buffers are -1 for offline CPUs and with the perf backend. Output
+  // files are created by the writer thread, and are -1 until a CPU's first
+  // pages or when only streaming.
   std::vector<std::pair<int, int>> fds_;
+  // One past the highest ID of a CPU that can come online.
+  int cpu_count_ = 0;
+  // Whether each CPU is online and drained, and whether it ever was during
+  // the capture. Indexed by CPU ID.
+  std::vector<bool> cpu_online_;
+  std::vector<bool> cpu_traced_;
+  // The online CPUs, in groups of up to 64.
+  std::vector<DrainGroup> drain_groups_;
+  // How many drain passes there have been.
+  int64_t drain_passes_ = 0;
+  // The CPUs that could come online and that were online when the capture
+  // started, as kernel CPU lists.
+  std::string possible_cpus_;
+  std::string initial_online_cpus_;
+  // When CPU hotplug is next checked for, and the changes seen so far.
+  absl::Time next_hotplug_check_;
+  std::vector<CPUHotplug> cpu_hotplugs_;
+  // The buffer pages are read from trace_pipe_raw into.
+  std::vector<char> read_buffer_;
+  // The soft limit on open files before it was raised, or 0 if it wasn't.
+  rlim_t original_file_limit_ = 0;
   // File Descriptor for the free buffer file.
   // If closed, this will clear the kernel ring buffer.
-  int free_fd_;
+  int free_fd_ = -1;
+  // The writers, one per NUMA node with CPUs, whose threads write pages out
+  // so that slow output doesn't hold up draining.
+  std::vector<std::unique_ptr<Writer>> writers_;
+  // Drained pages waiting for the CPU's writer thread, and emptied buffers
+  // it hands back for reuse. Indexed by CPU ID, and only made once a CPU
+  // comes online. Draining produces into write_queues_ and consumes
+  // free_buffers_; the writer does the opposite.
+  std::vector<std::unique_ptr<SPSCQueue<DrainedPages>>> write_queues_;
+  std::vector<std::unique_ptr<SPSCQueue<std::string>>> free_buffers_;
+  // Set once everything that will be queued has been.
+  std::atomic<bool> writer_stopping_{false};
+  // Set once any writer thread has failed.
+  std::atomic<bool> writer_failed_{false};
+  // Serializes the writer threads' use of the stream.
+  std::mutex stream_mutex_;
+  // Bytes queued for the writer threads.
+  std::atomic<int64_t> queued_bytes_{0};
+  // The most bytes ever queued for the writer thread, and the most buffers
+  // queued for any single CPU.
+  int64_t max_queued_bytes_ = 0;
+  int64_t max_cpu_queue_depth_ = 0;
+  // How often, and for how long, draining waited for the writer thread.
+  int64_t write_stalls_ = 0;
+  absl::Duration write_stall_time_;
+  // How the trace files are being written.
+  WriteEngine engine_ = WriteEngine::kWrite;
+  // Whether the trace files are opened with O_DIRECT.
+  bool direct_io_ = false;
+  // When the writer threads started.
+  absl::Time writer_start_time_;
+  // How far each CPU's trace file has disk space allocated, and how far its
+  // write back has been started. Indexed by CPU ID. Only used by the CPU's
+  // writer thread.
+  std::vector<int64_t> preallocated_;
+  std::vector<int64_t> written_back_;
+  // Bytes of disk space preallocated for the trace files in all, bytes of
+  // them dropped from the page cache, and the system calls and CPU time
+  // the writer threads spent writing them. Summed up once the threads have
+  // been joined.
+  int64_t preallocated_bytes_ = 0;
+  int64_t dropped_cache_bytes_ = 0;
+  int64_t file_syscalls_ = 0;
+  absl::Duration writer_cpu_time_;
+
+  // Bytes of pages written to the trace files, by the writer threads.
+  std::atomic<int64_t> disk_bytes_written_{0};
+  // Set by a writer thread once pages no longer fit in the disk budget or
+  // on the disk, with why. The reason and detail are set under
+  // disk_full_mutex_ before disk_full_, and never change after.
+  std::mutex disk_full_mutex_;
+  std::atomic<bool> disk_full_{false};
+  LossReason disk_full_reason_ = LossReason::kDiskBudget;
+  std::string disk_full_detail_;
+  // Whether draining has noticed disk_full_.
+  bool disk_full_noticed_ = false;
+  // Bytes written to each CPU's trace file. Only used by the CPU's writer
+  // thread.
+  std::vector<int64_t> file_sizes_;
+  // Pages lost by the writer threads, gathered once they have been joined.
+  std::vector<DataLoss> writer_losses_;
+  // Pages lost by draining.
+  std::vector<DataLoss> losses_;
+  // Whether draining is over the memory budget, and so drops pages.
+  bool memory_full_ = false;
+  // Whether each CPU's last drained pages were dropped. Indexed by CPU ID.
+  std::vector<bool> dropping_;
+  // The collector's peak resident set size, as of the last budget check.
+  int64_t max_rss_bytes_ = 0;
+  // Whether the event set has been shrunk to stay within a budget.
+  bool shrunk_ = false;
+  // Layout of the ring buffer pages, read from events/header_page.
+  PageHeaderFormat page_format_;
+  // Perf buffers and the writers that re-encode their samples as pages, for
+  // the perf backend. Indexed by CPU ID; offline CPUs have no buffer.
+  std::vector<std::unique_ptr<PerfCPUBuffer>> perf_buffers_;
+  // The tracepoints the perf buffers sample.
+  std::vector<uint64_t> tracepoint_ids_;
+  // The ones whose samples record the kernel stack.
+  std::vector<uint64_t> callchain_tracepoint_ids_;
+  std::vector<PageWriter> page_writers_;
+
+  // The distinct kernel stacks recorded, when recording them.
+  std::unique_ptr<StackTable> stack_table_;
+  // The format of the records the stacktrace trigger writes, which the pipe
+  // backend replaces with stack ID records.
+  EventFormat kernel_stack_format_;
+  const FormatField* kernel_stack_size_ = nullptr;
+  const FormatField* kernel_stack_caller_ = nullptr;
+  // Bytes the stacks would have taken up in the trace files as
+  // kernel_stack records.
+  int64_t kernel_stack_bytes_ = 0;
+  // Scratch space for re-encoding pages.
+  std::vector<uint64_t> stack_frames_;
+  std::string stack_record_;
+  std::string rewritten_pages_;
+  // The index the stacks were symbolized with.
+  size_t kallsyms_symbols_ = 0;
+  bool kallsyms_cached_ = false;
+  absl::Duration symbolize_time_;
+  // Whether to snapshot the threads, the snapshots as tracing started and
+  // stopped, and the thread reading the start snapshot while draining goes
+  // on. A flight recorder's snapshot has only the end.
+  bool thread_snapshots_ = true;
+  TimedThreadSnapshot start_threads_;
+  TimedThreadSnapshot end_threads_;
+  std::thread start_threads_reader_;
+  // Samples the kernel dropped from each CPU's perf buffer.
+  std::vector<uint64_t> perf_lost_;
+
+  // What the calibration capture of an estimate drained of each event type,
+  // by format ID, and the event names of the IDs.
+  struct EventTypeCost {
+    int64_t events = 0;
+    // Including the records' headers.
+    int64_t bytes = 0;
+  };
+  std::unordered_map<uint16_t, EventTypeCost> event_type_costs_;
+  std::unordered_map<uint16_t, std::string> event_names_;
+  // For estimates, when each CPU was last drained, and the fastest its
+  // buffer filled up between two drains, in bytes per second. Indexed by
+  // CPU ID.
+  std::vector<absl::Time> last_cpu_drain_;
+  std::vector<double> peak_fill_rates_;
+  // For estimates, the CPU time the drain passes took, in all and at most.
+  absl::Duration drain_cpu_time_;
+  absl::Duration max_drain_cpu_time_;
+
+  // Number of events and bytes drained so far. Indexed by CPU ID.
+  std::vector<int64_t> cpu_events_drained_;
+  std::vector<int64_t> cpu_bytes_drained_;
+  // Number of events and bytes drained so far across all CPUs.
+  int64_t events_drained_ = 0;
+  int64_t bytes_drained_ = 0;
+  // Decoder for the scheduling events of the formats copied by CopyFormats.
+  SchedEventDecoder decoder_;
+  // Orders the scheduling events decoded from the CPUs' buffers.
+  SchedEventMerger event_merger_;
+  // Scheduling events released by event_merger_ for the online consumers.
+  std::vector<SchedEvent> drained_events_;
+
+  // Evaluates the trigger condition. Only set if trigger_ is.
+  std::unique_ptr<SchedTrigger> sched_trigger_;
+  // Pages held back until the trigger fires. Indexed by CPU ID.
+  std::vector<std::deque<DrainedPages>> held_pages_;
+  // Whether the trigger condition has held, and when it was noticed.
+  bool trigger_fired_ = false;
+  absl::Time trigger_time_;
+  // Timestamp of the event that fired the trigger, and why it fired.
+  uint64_t trigger_timestamp_ = 0;
+  std::string trigger_detail_;
+
+  // Timestamp of the newest drained event.
+  uint64_t newest_timestamp_ = 0;
+
+  // Evaluates the escalation condition. Only set if escalation_ is.
+  std::unique_ptr<SchedTrigger> escalation_trigger_;
+  // Whether the escalation events are currently enabled.
+  bool escalated_ = false;
+  // When the escalation condition last held.
+  absl::Time last_anomaly_time_;
+  // Every change made to the set of enabled events.
+  std::vector<EventSetChange> event_set_changes_;
+
+  // Scheduling totals for summary.textproto. Only set if summary_ is.
+  std::unique_ptr<SchedStats> sched_stats_;
+  // When the busiest threads are next printed, and the totals they were last
+  // printed with.
+  absl::Time next_top_time_;
+  uint64_t top_timestamp_ = 0;
+  std::unordered_map<int32_t, int64_t> top_run_time_;
+  std::vector<int64_t> top_cpu_busy_time_;
+  // Scheduling histograms. Only set if histogram_threads_ is.
+  std::unique_ptr<SchedHistograms> sched_histograms_;
+
+  // PID of the forked command, or -1 if there is none.
+  pid_t command_pid_ = -1;
+  // Write end of the pipe that the forked command waits on before exec'ing.
+  int command_release_fd_ = -1;
+  // Whether the command has exited, and its exit status if so.
+  bool command_exited_ = false;
+  int command_exit_status_ = 0;
+
+  // The synthetic events and triggers of aggregate mode.
+  SchedAggregation aggregation_;
+  // Synthetic events and triggers that are currently installed.
+  std::vector<std::string> installed_synthetic_events_;
+  std::vector<HistTrigger> installed_triggers_;
+
+  // Why the capture stopped, and a human readable explanation.
+  StopReason stop_reason_ = StopReason::kUnspecified;
+  std::string stop_detail_;
 };
 
 
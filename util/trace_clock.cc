@@ -0,0 +1,239 @@
+#include "util/trace_clock.h"
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SCHEDVIZ_HAVE_TSC 1
+#endif
+
+namespace {
+
+/**
+ * How many times Sample reads the clocks, keeping the tightest reading.
+ */
+constexpr int kSampleAttempts = 8;
+
+struct ClockName {
+  TraceClock clock;
+  const char* name;
+};
+
+constexpr ClockName kClockNames[] = {
+    {TraceClock::kLocal, "local"},     {TraceClock::kGlobal, "global"},
+    {TraceClock::kMono, "mono"},       {TraceClock::kMonoRaw, "mono_raw"},
+    {TraceClock::kX86TSC, "x86-tsc"}, {TraceClock::kBoot, "boot"},
+};
+
+int64_t ReadClock(clockid_t clock) {
+  timespec now;
+  clock_gettime(clock, &now);
+  return int64_t{now.tv_sec} * 1000000000 + now.tv_nsec;
+}
+
+uint64_t ReadTSC() {
+#ifdef SCHEDVIZ_HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+}  // namespace
+
+bool ParseTraceClock(const std::string& name, TraceClock* clock) {
+  for (const auto& clock_name : kClockNames) {
+    if (name == clock_name.name) {
+      *clock = clock_name.clock;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* TraceClockName(TraceClock clock) {
+  for (const auto& clock_name : kClockNames) {
+    if (clock == clock_name.clock) {
+      return clock_name.name;
+    }
+  }
+  return "local";
+}
+
+bool PerfClockID(TraceClock clock, int* clockid) {
+  switch (clock) {
+    case TraceClock::kLocal:
+      *clockid = -1;
+      return true;
+    case TraceClock::kMono:
+      *clockid = CLOCK_MONOTONIC;
+      return true;
+    case TraceClock::kMonoRaw:
+      *clockid = CLOCK_MONOTONIC_RAW;
+      return true;
+    case TraceClock::kBoot:
+      *clockid = CLOCK_BOOTTIME;
+      return true;
+    case TraceClock::kGlobal:
+    case TraceClock::kX86TSC:
+      break;
+  }
+  return false;
+}
+
+Status TraceClockSampler::Open(TraceClock clock,
+                               std::unique_ptr<TraceClockSampler>* sampler) {
+  std::unique_ptr<TraceClockSampler> opened(new TraceClockSampler());
+  opened->clock_ = clock;
+  switch (clock) {
+    case TraceClock::kMono:
+    case TraceClock::kMonoRaw:
+    case TraceClock::kBoot:
+      opened->readable_ = true;
+      break;
+    case TraceClock::kX86TSC:
+#ifdef SCHEDVIZ_HAVE_TSC
+      opened->readable_ = true;
+#endif
+      break;
+    case TraceClock::kLocal:
+    case TraceClock::kGlobal:
+      break;
+  }
+
+#ifdef SCHEDVIZ_HAVE_TSC
+  // A dummy event of our own records nothing, but its mmap page carries the
+  // TSC conversion.
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_SW_DUMMY;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  opened->perf_fd_ = syscall(__NR_perf_event_open, &attr, /*pid=*/0,
+                             /*cpu=*/-1, /*group_fd=*/-1, PERF_FLAG_FD_CLOEXEC);
+  if (opened->perf_fd_ != -1) {
+    opened->perf_page_size_ = sysconf(_SC_PAGESIZE);
+    void* page = mmap(nullptr, opened->perf_page_size_, PROT_READ,
+                      MAP_SHARED, opened->perf_fd_, 0);
+    if (page != MAP_FAILED) {
+      opened->perf_page_ = page;
+    }
+  }
+  if (opened->perf_page_ != nullptr) {
+    const auto* metadata =
+        static_cast<const volatile perf_event_mmap_page*>(opened->perf_page_);
+    TSCConversion conversion;
+    bool published;
+    uint32_t seq;
+    do {
+      seq = metadata->lock;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      published = metadata->cap_user_time_zero;
+      conversion.time_zero = metadata->time_zero;
+      conversion.time_mult = metadata->time_mult;
+      conversion.time_shift = metadata->time_shift;
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while (metadata->lock != seq);
+    if (published && conversion.time_mult != 0) {
+      opened->tsc_conversion_ = conversion;
+      if (clock == TraceClock::kLocal || clock == TraceClock::kGlobal) {
+        opened->readable_ = true;
+      }
+    }
+  }
+#endif
+
+  *sampler = std::move(opened);
+  return Status::OkStatus();
+}
+
+TraceClockSampler::~TraceClockSampler() {
+  if (perf_page_ != nullptr) {
+    munmap(perf_page_, perf_page_size_);
+  }
+  if (perf_fd_ != -1) {
+    close(perf_fd_);
+  }
+}
+
+uint64_t TraceClockSampler::tsc_frequency_hz() const {
+  if (!tsc_conversion_.has_value()) {
+    return 0;
+  }
+  // A cycle is time_mult / 2^time_shift ns.
+  return static_cast<uint64_t>(
+      static_cast<long double>(1000000000) *
+          static_cast<long double>(uint64_t{1} << tsc_conversion_->time_shift) /
+          tsc_conversion_->time_mult +
+      0.5);
+}
+
+uint64_t TraceClockSampler::ReadTraceClock() const {
+  switch (clock_) {
+    case TraceClock::kMono:
+      return ReadClock(CLOCK_MONOTONIC);
+    case TraceClock::kMonoRaw:
+      return ReadClock(CLOCK_MONOTONIC_RAW);
+    case TraceClock::kBoot:
+      return ReadClock(CLOCK_BOOTTIME);
+    case TraceClock::kX86TSC:
+      return ReadTSC();
+    case TraceClock::kLocal:
+    case TraceClock::kGlobal:
+      break;
+  }
+  // The conversion is updated, e.g. after a suspend, so it's read along with
+  // the TSC.
+  const auto* metadata =
+      static_cast<const volatile perf_event_mmap_page*>(perf_page_);
+  uint64_t ns;
+  uint32_t seq;
+  do {
+    seq = metadata->lock;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t cycles = ReadTSC();
+    const uint16_t shift = metadata->time_shift;
+    const uint64_t mult = metadata->time_mult;
+    const uint64_t quot = cycles >> shift;
+    const uint64_t rem = cycles & ((uint64_t{1} << shift) - 1);
+    ns = metadata->time_zero + quot * mult + ((rem * mult) >> shift);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while (metadata->lock != seq);
+  return ns;
+}
+
+ClockSample TraceClockSampler::Sample() const {
+  ClockSample best;
+  for (int i = 0; i < kSampleAttempts; i++) {
+    // Bracket the trace clock with the system clocks, and take the middle.
+    const int64_t realtime_before = ReadClock(CLOCK_REALTIME);
+    const int64_t monotonic_before = ReadClock(CLOCK_MONOTONIC);
+    const uint64_t trace_clock = readable_ ? ReadTraceClock() : 0;
+    const int64_t monotonic_after = ReadClock(CLOCK_MONOTONIC);
+    const int64_t realtime_after = ReadClock(CLOCK_REALTIME);
+    const int64_t uncertainty = (realtime_after - realtime_before) / 2;
+    if (i == 0 || uncertainty < best.uncertainty_ns) {
+      best.trace_clock = trace_clock;
+      best.monotonic_ns =
+          monotonic_before + (monotonic_after - monotonic_before) / 2;
+      best.realtime_ns =
+          realtime_before + (realtime_after - realtime_before) / 2;
+      best.uncertainty_ns = uncertainty;
+    }
+  }
+  return best;
+}
@@ -0,0 +1,142 @@
+#ifndef SCHEDVIZ_UTIL_TRACE_CLOCK_H_
+#define SCHEDVIZ_UTIL_TRACE_CLOCK_H_
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "util/status.h"
+
+/**
+ * The clock FTrace timestamps events with, set through the trace_clock file.
+ * Mirrors ArchiveMetadataConfig.TraceClock.Clock.
+ */
+enum class TraceClock {
+  // Per-CPU sched_clock, in ns. The kernel's default; fast, but not
+  // synchronized across CPUs.
+  kLocal,
+  // sched_clock kept monotonic across CPUs, in ns. Slower on many CPUs.
+  kGlobal,
+  // CLOCK_MONOTONIC.
+  kMono,
+  // CLOCK_MONOTONIC_RAW.
+  kMonoRaw,
+  // The raw time stamp counter, in cycles.
+  kX86TSC,
+  // CLOCK_BOOTTIME.
+  kBoot,
+};
+
+/**
+ * @param name A clock's name in trace_clock, e.g. "x86-tsc".
+ * @param clock Set to the clock, if the name is known.
+ * @return Whether the name is known.
+ */
+bool ParseTraceClock(const std::string& name, TraceClock* clock);
+
+/**
+ * @return The clock's name in trace_clock.
+ */
+const char* TraceClockName(TraceClock clock);
+
+/**
+ * @param clock A trace clock.
+ * @param clockid Set to the clock perf_event_open should timestamp samples
+ *                with, or -1 for perf's default clock, which is local.
+ * @return Whether perf can timestamp samples with the clock.
+ */
+bool PerfClockID(TraceClock clock, int* clockid);
+
+/**
+ * A reading of the trace clock, together with CLOCK_MONOTONIC and
+ * CLOCK_REALTIME.
+ */
+struct ClockSample {
+  // Trace clock reading, in the clock's units. 0 if the clock can't be read
+  // from user space.
+  uint64_t trace_clock = 0;
+  // The other clocks at the time of the trace clock reading.
+  int64_t monotonic_ns = 0;
+  int64_t realtime_ns = 0;
+  // How far the readings may be apart: half the time they took.
+  int64_t uncertainty_ns = 0;
+};
+
+/**
+ * The parameters the kernel converts TSC cycles to sched_clock ns with, as
+ * published to user space on perf_event mmap pages:
+ *   ns = time_zero + (cycles * time_mult) >> time_shift
+ */
+struct TSCConversion {
+  uint64_t time_zero = 0;
+  uint32_t time_mult = 0;
+  uint16_t time_shift = 0;
+};
+
+/**
+ * Reads a trace clock from user space, to relate its timestamps to the
+ * system clocks.
+ *
+ * The sched_clock based clocks, local and global, are computed from the TSC
+ * with the kernel's own conversion. Without a stable TSC they can't be read,
+ * and samples only have the system clocks.
+ */
+class TraceClockSampler {
+ public:
+  /**
+   * Prepares to sample a clock.
+   * @param clock The clock.
+   * @param sampler Set to the sampler on success.
+   * @return Status if successful or not.
+   */
+  static Status Open(TraceClock clock,
+                     std::unique_ptr<TraceClockSampler>* sampler);
+
+  ~TraceClockSampler();
+
+  TraceClockSampler(const TraceClockSampler&) = delete;
+  TraceClockSampler& operator=(const TraceClockSampler&) = delete;
+
+  /**
+   * Reads the clocks several times and keeps the tightest reading.
+   * @return The sample.
+   */
+  ClockSample Sample() const;
+
+  /**
+   * @return Whether the trace clock can be read, so that samples have it.
+   */
+  bool readable() const { return readable_; }
+
+  /**
+   * @return The kernel's TSC to ns conversion, if it publishes one.
+   */
+  const std::optional<TSCConversion>& tsc_conversion() const {
+    return tsc_conversion_;
+  }
+
+  /**
+   * @return The TSC frequency in Hz implied by the kernel's conversion, or 0
+   *         if there is none.
+   */
+  uint64_t tsc_frequency_hz() const;
+
+ private:
+  TraceClockSampler() = default;
+
+  /**
+   * @return The trace clock now. Only called if it's readable.
+   */
+  uint64_t ReadTraceClock() const;
+
+  TraceClock clock_ = TraceClock::kLocal;
+  bool readable_ = false;
+  std::optional<TSCConversion> tsc_conversion_;
+  // A perf event of our own, whose mmap page has the TSC conversion.
+  int perf_fd_ = -1;
+  void* perf_page_ = nullptr;
+  size_t perf_page_size_ = 0;
+};
+
+#endif  // SCHEDVIZ_UTIL_TRACE_CLOCK_H_
@@ -0,0 +1,675 @@
+#include "util/trace_stream.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+
+namespace {
+
+constexpr char kMagic[] = "SVSTRM01";
+
+/**
+ * Size of the type, CPU and length that start every frame.
+ */
+constexpr size_t kFrameHeaderSize = 3 * sizeof(uint32_t);
+
+/**
+ * How big to make the staging pipe. Linux's default limit for unprivileged
+ * processes, and far more than a drain pass usually produces per CPU.
+ */
+constexpr int kStagingPipeSize = 1 << 20;
+
+/**
+ * @return length bytes of data, starting offset bytes in.
+ */
+std::vector<iovec> Slice(const std::vector<iovec>& data, size_t offset,
+                         size_t length) {
+  std::vector<iovec> slice;
+  for (const auto& piece : data) {
+    if (length == 0) {
+      break;
+    }
+    if (offset >= piece.iov_len) {
+      offset -= piece.iov_len;
+      continue;
+    }
+    const size_t take = std::min(piece.iov_len - offset, length);
+    slice.push_back({static_cast<char*>(piece.iov_base) + offset, take});
+    offset = 0;
+    length -= take;
+  }
+  return slice;
+}
+
+/**
+ * Writes as much of data as fd takes without blocking.
+ * @return The number of bytes written, or -1 on errors.
+ */
+ssize_t TryWrite(int fd, const std::vector<iovec>& data) {
+  while (true) {
+    const ssize_t written = writev(fd, data.data(), data.size());
+    if (written >= 0) {
+      return written;
+    }
+    if (errno == EAGAIN) {
+      return 0;
+    }
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+/**
+ * Waits until fd has room for more data.
+ */
+void WaitWritable(int fd) {
+  pollfd poll_fd = {fd, POLLOUT, 0};
+  poll(&poll_fd, 1, -1);
+}
+
+/**
+ * Writes all of data to fd, waiting for room if fd is non-blocking.
+ * @param name Names fd in errors.
+ * @return Status if successful or not.
+ */
+Status WriteAll(int fd, const std::vector<iovec>& data, size_t length,
+                const std::string& name) {
+  size_t offset = 0;
+  while (offset < length) {
+    const ssize_t written = TryWrite(fd, Slice(data, offset, length - offset));
+    if (written < 0) {
+      return Status::InternalError(
+          absl::StrCat("Unable to write to ", name, ": ", strerror(errno)));
+    }
+    if (written == 0) {
+      WaitWritable(fd);
+    }
+    offset += written;
+  }
+  return Status::OkStatus();
+}
+
+/**
+ * Connects to a Unix domain socket.
+ * @return The connected socket, or -1 on failure.
+ */
+int ConnectUnixSocket(const std::string& path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(address.sun_path, path.data(), path.size());
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&address),
+              sizeof(address)) != 0) {
+    const int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Starts a shell command that reads from a new pipe.
+ * @param pid Set to the shell's PID.
+ * @return The write end of the pipe, or -1 on failure.
+ */
+int StartPipeCommand(const std::string& command, pid_t* pid) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    return -1;
+  }
+  *pid = fork();
+  if (*pid == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (*pid == 0) {
+    dup2(fds[0], STDIN_FILENO);
+    // We ignore SIGPIPE, but the command shouldn't inherit that.
+    signal(SIGPIPE, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+    _exit(127);
+  }
+  close(fds[0]);
+  return fds[1];
+}
+
+}  // namespace
+
+Status TraceStream::Open(const std::vector<std::string>& sinks,
+                         std::unique_ptr<TraceStream>* stream) {
+  if (sinks.empty()) {
+    return Status::InternalError("No sinks to stream to");
+  }
+  std::unique_ptr<TraceStream> opened(new TraceStream());
+  opened->sinks_.resize(sinks.size());
+  // Take over stdout before starting any commands, so that they can't write
+  // to it either.
+  for (const bool open_stdout : {true, false}) {
+    for (size_t i = 0; i < sinks.size(); i++) {
+      const bool is_stdout = SinkDestination(sinks[i], nullptr) == "-";
+      if (is_stdout != open_stdout) {
+        continue;
+      }
+      const auto& status = OpenSink(sinks[i], &opened->sinks_[i]);
+      if (!status.ok()) {
+        return status;
+      }
+    }
+  }
+  // A consumer that goes away should fail the capture, not kill us before
+  // FTrace is cleaned up.
+  signal(SIGPIPE, SIG_IGN);
+
+  // Sinks that wait on the capture can share one copy of each frame if at
+  // least one of them is a pipe: the pipes get it with tee(), and one more
+  // sink, preferably one that isn't a pipe, with splice().
+  std::vector<size_t> blocking;
+  std::vector<size_t> pipes;
+  for (size_t i = 0; i < opened->sinks_.size(); i++) {
+    const Sink& sink = opened->sinks_[i];
+    if (sink.stats.policy == SinkPolicy::kBlock) {
+      blocking.push_back(i);
+      if (sink.is_pipe) {
+        pipes.push_back(i);
+      }
+    }
+  }
+  if (blocking.size() >= 2 && !pipes.empty()) {
+    const auto& not_pipe =
+        std::find_if(blocking.begin(), blocking.end(), [&](size_t i) {
+          return !opened->sinks_[i].is_pipe;
+        });
+    opened->splice_sink_ = not_pipe != blocking.end() ? *not_pipe
+                                                      : pipes.back();
+    for (const auto& i : pipes) {
+      if (i != opened->splice_sink_) {
+        opened->tee_sinks_.push_back(i);
+      }
+    }
+    int staging[2];
+    if (!opened->tee_sinks_.empty() && pipe2(staging, O_CLOEXEC) == 0) {
+      opened->staging_read_fd_ = staging[0];
+      opened->staging_write_fd_ = staging[1];
+      // Keep the default size if we aren't allowed a bigger one.
+      fcntl(opened->staging_write_fd_, F_SETPIPE_SZ, kStagingPipeSize);
+      opened->staging_size_ = fcntl(opened->staging_write_fd_, F_GETPIPE_SZ);
+      opened->sinks_[opened->splice_sink_].stats.zero_copy = true;
+      for (const auto& i : opened->tee_sinks_) {
+        opened->sinks_[i].stats.zero_copy = true;
+      }
+    } else {
+      opened->tee_sinks_.clear();
+    }
+  }
+
+  std::vector<iovec> magic = {{const_cast<char*>(kMagic), strlen(kMagic)}};
+  const auto& status = opened->Send(magic, strlen(kMagic), /*cpu=*/-1);
+  if (!status.ok()) {
+    return status;
+  }
+  *stream = std::move(opened);
+  return Status::OkStatus();
+}
+
+std::string TraceStream::SinkDestination(const std::string& spec,
+                                         SinkPolicy* policy) {
+  SinkPolicy parsed = SinkPolicy::kBlock;
+  std::string destination = spec;
+  if (const auto& at = spec.find('@'); at != std::string::npos) {
+    const auto& prefix = spec.substr(0, at);
+    if (prefix == "block" || prefix == "drop" || prefix == "spill") {
+      parsed = prefix == "block"  ? SinkPolicy::kBlock
+               : prefix == "drop" ? SinkPolicy::kDrop
+                                  : SinkPolicy::kSpill;
+      destination = spec.substr(at + 1);
+    }
+  }
+  if (policy != nullptr) {
+    *policy = parsed;
+  }
+  return destination;
+}
+
+Status TraceStream::OpenSink(const std::string& spec, Sink* sink) {
+  const auto& destination = SinkDestination(spec, &sink->stats.policy);
+  sink->stats.destination = destination;
+
+  if (destination == "-") {
+    // Keep our own reference to stdout, and send everything else written
+    // there, like progress messages, to stderr instead.
+    std::cout.flush();
+    sink->fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (sink->fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+      return Status::InternalError("Unable to take over stdout for streaming");
+    }
+  } else if (absl::StartsWith(destination, "unix:")) {
+    const auto& path = destination.substr(strlen("unix:"));
+    sink->fd = ConnectUnixSocket(path);
+  } else if (absl::StartsWith(destination, "file:")) {
+    const auto& path = destination.substr(strlen("file:"));
+    sink->fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                    0644);
+  } else if (absl::StartsWith(destination, "pipe:")) {
+    sink->fd = StartPipeCommand(destination.substr(strlen("pipe:")),
+                                &sink->pid);
+  } else {
+    return Status::InternalError(absl::StrCat(
+        "Stream sinks must be '-', 'unix:PATH', 'file:PATH' or "
+        "'pipe:COMMAND', optionally prefixed by 'block@', 'drop@' or "
+        "'spill@', not '",
+        spec, "'"));
+  }
+  if (sink->fd == -1) {
+    return Status::InternalError(absl::StrCat("Unable to open ", destination,
+                                              ": ", strerror(errno)));
+  }
+  struct stat sink_stat;
+  sink->is_pipe = fstat(sink->fd, &sink_stat) == 0 && S_ISFIFO(sink_stat.st_mode);
+
+  if (sink->stats.policy == SinkPolicy::kBlock) {
+    return Status::OkStatus();
+  }
+  // Sinks that must not stall the capture are only written when they have
+  // room.
+  const int flags = fcntl(sink->fd, F_GETFL);
+  if (flags == -1 || fcntl(sink->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return Status::InternalError(
+        absl::StrCat("Unable to make ", destination, " non-blocking"));
+  }
+  if (sink->stats.policy == SinkPolicy::kSpill) {
+    char spill_path[] = "/tmp/trace_spill_XXXXXX";
+    sink->spill_fd = mkostemp(spill_path, O_CLOEXEC);
+    if (sink->spill_fd == -1) {
+      return Status::InternalError(
+          absl::StrCat("Unable to create a spill file for ", destination));
+    }
+    unlink(spill_path);
+  }
+  return Status::OkStatus();
+}
+
+int TraceStream::CloseSink(Sink* sink) {
+  if (sink->fd != -1) {
+    close(sink->fd);
+    sink->fd = -1;
+  }
+  if (sink->spill_fd != -1) {
+    close(sink->spill_fd);
+    sink->spill_fd = -1;
+  }
+  if (sink->pid == -1) {
+    return 0;
+  }
+  int wait_status;
+  const pid_t pid = sink->pid;
+  sink->pid = -1;
+  if (waitpid(pid, &wait_status, 0) != pid) {
+    return 127;
+  }
+  return WIFSIGNALED(wait_status) ? 128 + WTERMSIG(wait_status)
+                                  : WEXITSTATUS(wait_status);
+}
+
+TraceStream::~TraceStream() {
+  for (auto& sink : sinks_) {
+    CloseSink(&sink);
+  }
+  if (staging_read_fd_ != -1) {
+    close(staging_read_fd_);
+    close(staging_write_fd_);
+  }
+}
+
+Status TraceStream::WriteFile(const std::string& name,
+                              const std::string& contents) {
+  std::string prefix(sizeof(uint32_t), '\0');
+  const uint32_t name_length = name.size();
+  memcpy(&prefix[0], &name_length, sizeof(name_length));
+  prefix += name;
+  return WriteFrame(kFile, 0, prefix.data(), prefix.size(), contents.data(),
+                    contents.size());
+}
+
+Status TraceStream::WritePages(int cpu, const char* pages, size_t length) {
+  return WriteFrame(kPages, cpu, pages, length, nullptr, 0);
+}
+
+Status TraceStream::WriteEnd() {
+  auto status = WriteFrame(kEnd, 0, nullptr, 0, nullptr, 0);
+  for (auto& sink : sinks_) {
+    if (status.ok() && sink.stats.policy == SinkPolicy::kSpill) {
+      status = DrainSpill(&sink, /*wait=*/true);
+    }
+  }
+  for (auto& sink : sinks_) {
+    const int exit_status = CloseSink(&sink);
+    if (status.ok() && exit_status != 0) {
+      status = Status::InternalError(absl::StrCat(
+          sink.stats.destination, " exited with status ", exit_status));
+    }
+  }
+  return status;
+}
+
+std::vector<SinkStats> TraceStream::Stats() const {
+  std::vector<SinkStats> stats;
+  for (const auto& sink : sinks_) {
+    stats.push_back(sink.stats);
+  }
+  return stats;
+}
+
+Status TraceStream::WriteFrame(FrameType type, int cpu, const char* first,
+                               size_t first_length, const char* second,
+                               size_t second_length) {
+  uint32_t header[3] = {type, static_cast<uint32_t>(cpu),
+                        static_cast<uint32_t>(first_length + second_length)};
+  std::vector<iovec> data = {{header, sizeof(header)}};
+  if (first_length > 0) {
+    data.push_back({const_cast<char*>(first), first_length});
+  }
+  if (second_length > 0) {
+    data.push_back({const_cast<char*>(second), second_length});
+  }
+  return Send(data, kFrameHeaderSize + first_length + second_length,
+              type == kPages ? cpu : -1);
+}
+
+Status TraceStream::Send(const std::vector<iovec>& data, size_t length,
+                         int cpu) {
+  auto status = WriteBlocking(data, length);
+  for (auto& sink : sinks_) {
+    if (!status.ok()) {
+      break;
+    }
+    if (sink.stats.policy == SinkPolicy::kDrop) {
+      status = WriteOrDrop(&sink, cpu, data, length);
+    } else if (sink.stats.policy == SinkPolicy::kSpill) {
+      status = WriteOrSpill(&sink, data, length);
+    }
+  }
+  return status;
+}
+
+Status TraceStream::WriteBlocking(const std::vector<iovec>& data,
+                                  size_t length) {
+  for (size_t i = 0; i < sinks_.size(); i++) {
+    Sink& sink = sinks_[i];
+    if (sink.stats.policy != SinkPolicy::kBlock || sink.stats.zero_copy) {
+      continue;
+    }
+    const auto& status = WriteAll(sink.fd, data, length, sink.stats.destination);
+    if (!status.ok()) {
+      return status;
+    }
+    sink.stats.bytes_sent += length;
+  }
+  if (staging_read_fd_ == -1) {
+    return Status::OkStatus();
+  }
+
+  // The staging pipe is empty between chunks, so copying a chunk into it
+  // never blocks.
+  for (size_t offset = 0; offset < length;) {
+    const size_t chunk = std::min(length - offset, staging_size_);
+    auto status = WriteAll(staging_write_fd_, Slice(data, offset, chunk),
+                           chunk, "the staging pipe");
+    if (!status.ok()) {
+      return status;
+    }
+    for (const auto& i : tee_sinks_) {
+      Sink& sink = sinks_[i];
+      ssize_t teed;
+      do {
+        teed = tee(staging_read_fd_, sink.fd, chunk, 0);
+      } while (teed == -1 && errno == EINTR);
+      // tee() always starts at the front of the pipe, so whatever didn't fit
+      // is copied from our memory instead.
+      teed = std::max<ssize_t>(teed, 0);
+      status = WriteAll(sink.fd, Slice(data, offset + teed, chunk - teed),
+                        chunk - teed, sink.stats.destination);
+      if (!status.ok()) {
+        return status;
+      }
+      sink.stats.bytes_sent += chunk;
+    }
+    Sink& sink = sinks_[splice_sink_];
+    size_t left = chunk;
+    while (left > 0) {
+      const ssize_t spliced = splice(staging_read_fd_, nullptr, sink.fd,
+                                     nullptr, left, SPLICE_F_MOVE);
+      if (spliced > 0) {
+        left -= spliced;
+        continue;
+      }
+      if (spliced == -1 && errno == EINTR) {
+        continue;
+      }
+      if (spliced == 0 || errno != EINVAL) {
+        return Status::InternalError(
+            absl::StrCat("Unable to write to ", sink.stats.destination, ": ",
+                         strerror(errno)));
+      }
+      // The sink doesn't support splice(): empty the staging pipe and copy
+      // from our memory, now and from now on.
+      std::vector<char> discard(left);
+      for (size_t discarded = 0; discarded < left;) {
+        const ssize_t bytes_read =
+            read(staging_read_fd_, discard.data(), left - discarded);
+        if (bytes_read <= 0) {
+          return Status::InternalError("Unable to empty the staging pipe");
+        }
+        discarded += bytes_read;
+      }
+      status = WriteAll(sink.fd, Slice(data, offset + chunk - left, left),
+                        left, sink.stats.destination);
+      if (!status.ok()) {
+        return status;
+      }
+      sink.stats.zero_copy = false;
+      left = 0;
+    }
+    sink.stats.bytes_sent += chunk;
+    offset += chunk;
+  }
+  if (!sinks_[splice_sink_].stats.zero_copy) {
+    // The splice sink fell back to copying, which the loop above now does.
+    close(staging_read_fd_);
+    close(staging_write_fd_);
+    staging_read_fd_ = -1;
+    staging_write_fd_ = -1;
+    for (const auto& i : tee_sinks_) {
+      sinks_[i].stats.zero_copy = false;
+    }
+    tee_sinks_.clear();
+  }
+  return Status::OkStatus();
+}
+
+Status TraceStream::WriteOrDrop(Sink* sink, int cpu,
+                                const std::vector<iovec>& data,
+                                size_t length) {
+  const bool droppable = cpu >= 0;
+  const auto& drop = [&]() {
+    if (static_cast<size_t>(cpu) >= sink->dropped.size()) {
+      sink->dropped.resize(cpu + 1, 0);
+    }
+    sink->dropped[cpu] += length - kFrameHeaderSize;
+    sink->stats.dropped_frames++;
+    sink->stats.dropped_bytes += length - kFrameHeaderSize;
+    return Status::OkStatus();
+  };
+
+  // Frames can't be interleaved, so the rest of a partly sent frame goes
+  // first.
+  if (!sink->pending.empty()) {
+    std::vector<iovec> pending = {{sink->pending.data(), sink->pending.size()}};
+    if (droppable) {
+      const ssize_t written = TryWrite(sink->fd, pending);
+      if (written < 0) {
+        return Status::InternalError(
+            absl::StrCat("Unable to write to ", sink->stats.destination, ": ",
+                         strerror(errno)));
+      }
+      sink->stats.bytes_sent += written;
+      sink->pending.erase(0, written);
+      if (!sink->pending.empty()) {
+        return drop();
+      }
+    } else {
+      const auto& status = WriteAll(sink->fd, pending, sink->pending.size(),
+                                    sink->stats.destination);
+      if (!status.ok()) {
+        return status;
+      }
+      sink->stats.bytes_sent += sink->pending.size();
+      sink->pending.clear();
+    }
+  }
+
+  // Tell the sink what it missed before it gets anything else.
+  std::string notices;
+  for (size_t i = 0; i < sink->dropped.size(); i++) {
+    if (sink->dropped[i] == 0) {
+      continue;
+    }
+    const uint32_t header[3] = {kDropped, static_cast<uint32_t>(i),
+                                sizeof(uint64_t)};
+    notices.append(reinterpret_cast<const char*>(header), sizeof(header));
+    notices.append(reinterpret_cast<const char*>(&sink->dropped[i]),
+                   sizeof(uint64_t));
+  }
+  std::vector<iovec> pieces;
+  if (!notices.empty()) {
+    pieces.push_back({notices.data(), notices.size()});
+  }
+  pieces.insert(pieces.end(), data.begin(), data.end());
+  const size_t total = notices.size() + length;
+
+  if (!droppable) {
+    const auto& status = WriteAll(sink->fd, pieces, total,
+                                  sink->stats.destination);
+    if (!status.ok()) {
+      return status;
+    }
+    sink->stats.bytes_sent += total;
+    sink->dropped.clear();
+    return Status::OkStatus();
+  }
+  const ssize_t written = TryWrite(sink->fd, pieces);
+  if (written < 0) {
+    return Status::InternalError(absl::StrCat(
+        "Unable to write to ", sink->stats.destination, ": ", strerror(errno)));
+  }
+  if (written == 0) {
+    return drop();
+  }
+  sink->stats.bytes_sent += written;
+  sink->dropped.clear();
+  for (const auto& piece : Slice(pieces, written, total - written)) {
+    sink->pending.append(static_cast<const char*>(piece.iov_base),
+                         piece.iov_len);
+  }
+  return Status::OkStatus();
+}
+
+Status TraceStream::WriteOrSpill(Sink* sink, const std::vector<iovec>& data,
+                                 size_t length) {
+  auto status = DrainSpill(sink, /*wait=*/false);
+  if (!status.ok()) {
+    return status;
+  }
+  // Once anything is queued, everything after it must be queued too.
+  size_t offset = 0;
+  if (sink->spill_start == sink->spill_end) {
+    const ssize_t written = TryWrite(sink->fd, data);
+    if (written < 0) {
+      return Status::InternalError(
+          absl::StrCat("Unable to write to ", sink->stats.destination, ": ",
+                       strerror(errno)));
+    }
+    sink->stats.bytes_sent += written;
+    offset = written;
+  }
+  while (offset < length) {
+    const auto& rest = Slice(data, offset, length - offset);
+    const ssize_t written =
+        pwritev(sink->spill_fd, rest.data(), rest.size(), sink->spill_end);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return Status::InternalError(absl::StrCat(
+          "Unable to spill ", sink->stats.destination, " to disk: ",
+          strerror(errno)));
+    }
+    sink->spill_end += written;
+    sink->stats.spilled_bytes += written;
+    offset += written;
+  }
+  return Status::OkStatus();
+}
+
+Status TraceStream::DrainSpill(Sink* sink, bool wait) {
+  while (sink->spill_start < sink->spill_end) {
+    // sendfile() moves the queue to the sink without copying it through us.
+    const off_t before = sink->spill_start;
+    const ssize_t sent = sendfile(sink->fd, sink->spill_fd, &sink->spill_start,
+                                  sink->spill_end - sink->spill_start);
+    if (sent > 0) {
+      sink->stats.bytes_sent += sink->spill_start - before;
+      continue;
+    }
+    if (sent == -1 && errno == EINTR) {
+      continue;
+    }
+    if (sent == -1 && errno == EAGAIN) {
+      if (!wait) {
+        return Status::OkStatus();
+      }
+      WaitWritable(sink->fd);
+      continue;
+    }
+    return Status::InternalError(absl::StrCat(
+        "Unable to write to ", sink->stats.destination, ": ", strerror(errno)));
+  }
+  // Reuse the start of the file once the queue is empty.
+  if (sink->spill_end > 0) {
+    sink->spill_start = 0;
+    sink->spill_end = 0;
+    if (ftruncate(sink->spill_fd, 0) != 0) {
+      return Status::InternalError("Unable to truncate the spill file");
+    }
+  }
+  return Status::OkStatus();
+}
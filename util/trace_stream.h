@@ -0,0 +1,239 @@
+#ifndef SCHEDVIZ_UTIL_TRACE_STREAM_H_
+#define SCHEDVIZ_UTIL_TRACE_STREAM_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/status.h"
+
+/**
+ * What a sink does when it can't keep up with the capture.
+ */
+enum class SinkPolicy {
+  // Wait for the sink, which stalls draining and may make FTrace drop events.
+  kBlock,
+  // Drop pages the sink has no room for, and tell it how many bytes of each
+  // CPU's pages it missed with a kDropped frame once it catches up.
+  kDrop,
+  // Queue what the sink has no room for in an unlinked file on disk, and
+  // send it once the sink catches up.
+  kSpill,
+};
+
+/**
+ * How much of a stream a sink has taken.
+ */
+struct SinkStats {
+  // The sink's destination, without its policy.
+  std::string destination;
+  SinkPolicy policy = SinkPolicy::kBlock;
+  // Bytes delivered to the sink.
+  uint64_t bytes_sent = 0;
+  // Pages frames dropped by a kDrop sink, and their size.
+  uint64_t dropped_frames = 0;
+  uint64_t dropped_bytes = 0;
+  // Bytes queued on disk by a kSpill sink.
+  uint64_t spilled_bytes = 0;
+  // Whether the sink was fed from a kernel pipe with tee() or splice()
+  // instead of copying from our memory.
+  bool zero_copy = false;
+};
+
+/**
+ * Writes a capture as a stream of frames instead of a tar.gz, so that
+ * consumers can process it while tracing runs. The same stream is sent to
+ * every sink.
+ *
+ * The stream starts with the 8 byte magic "SVSTRM01". Every frame then starts
+ * with three uint32s in the traced machine's byte order, like the pages
+ * themselves: the frame type, a CPU ID (0 unless the type says otherwise) and
+ * the length of the payload that follows.
+ *
+ *   kFile:    a file of the archive. The payload is a uint32 name length, the
+ *             name relative to the archive root, e.g. "formats/header_page",
+ *             and the file's contents. The formats, options and topology
+ *             files come before any kPages frame.
+ *   kPages:   one or more whole ring buffer pages drained from the CPU, in
+ *             the layout of traces/cpuN in the archive.
+ *   kEnd:     the capture is complete. Has no payload, and is the last frame.
+ *   kDropped: the sink missed pages of the CPU. The payload is a uint64
+ *             count of the missed bytes.
+ *
+ * A stream that ends without a kEnd frame was cut short.
+ *
+ * When several sinks wait on the capture and some of them are pipes, frames
+ * are copied once into a kernel pipe, duplicated to the pipes with tee() and
+ * moved to one more sink with splice(), so those sinks cost no extra copy.
+ */
+class TraceStream {
+ public:
+  enum FrameType : uint32_t {
+    kFile = 1,
+    kPages = 2,
+    kEnd = 3,
+    kDropped = 4,
+  };
+
+  /**
+   * Connects to the consumers and writes the stream's magic to each.
+   * @param sinks Each is an optional policy followed by '@', one of "block"
+   *              (the default), "drop" or "spill", and a destination: "-"
+   *              for stdout, "unix:PATH" for a Unix domain socket that a
+   *              consumer is listening on, "file:PATH" for a file, or
+   *              "pipe:COMMAND" for the stdin of a shell command, such as a
+   *              compressor. When streaming to stdout, anything else the
+   *              process and the commands write to stdout is redirected to
+   *              stderr.
+   * @param stream Set to the opened stream on success.
+   * @return Status if successful or not.
+   */
+  static Status Open(const std::vector<std::string>& sinks,
+                     std::unique_ptr<TraceStream>* stream);
+
+  ~TraceStream();
+
+  TraceStream(const TraceStream&) = delete;
+  TraceStream& operator=(const TraceStream&) = delete;
+
+  /**
+   * Sends a file of the archive.
+   * @param name The file's path relative to the archive root.
+   * @param contents The file's contents.
+   * @return Status if successful or not.
+   */
+  Status WriteFile(const std::string& name, const std::string& contents);
+
+  /**
+   * Sends pages drained from a CPU buffer.
+   * @param cpu The CPU whose buffer the pages came from.
+   * @param pages One or more whole pages, back to back.
+   * @param length The number of bytes in pages.
+   * @return Status if successful or not.
+   */
+  Status WritePages(int cpu, const char* pages, size_t length);
+
+  /**
+   * Marks the capture as complete, waits for every sink to take everything
+   * queued for it, and closes the sinks. Nothing may be written afterwards.
+   * @return Status if successful or not.
+   */
+  Status WriteEnd();
+
+  /**
+   * @return How much of the stream each sink has taken, in the order they
+   *         were given to Open.
+   */
+  std::vector<SinkStats> Stats() const;
+
+ private:
+  struct Sink {
+    SinkStats stats;
+    int fd = -1;
+    // Whether fd is a pipe, which tee() can write to.
+    bool is_pipe = false;
+    // The shell running a "pipe:" sink's command, or -1.
+    pid_t pid = -1;
+    // The unsent rest of a frame that a kDrop sink only took part of.
+    std::string pending;
+    // Bytes of each CPU's pages a kDrop sink missed since its last kDropped
+    // frames. Indexed by CPU ID.
+    std::vector<uint64_t> dropped;
+    // An unlinked file holding what a kSpill sink has not taken yet, between
+    // spill_start and spill_end.
+    int spill_fd = -1;
+    off_t spill_start = 0;
+    off_t spill_end = 0;
+  };
+
+  TraceStream() = default;
+
+  /**
+   * Splits a sink's specification, as passed to Open, into its policy and
+   * destination.
+   * @param policy If not null, set to the policy.
+   * @return The destination.
+   */
+  static std::string SinkDestination(const std::string& spec,
+                                     SinkPolicy* policy);
+
+  /**
+   * Opens a sink's destination.
+   * @param spec The sink's specification, as passed to Open.
+   * @param sink Filled in on success.
+   * @return Status if successful or not.
+   */
+  static Status OpenSink(const std::string& spec, Sink* sink);
+
+  /**
+   * Closes a sink and reaps its command, if it has one.
+   * @return The command's exit status, or 0 if it has none.
+   */
+  static int CloseSink(Sink* sink);
+
+  /**
+   * Sends a frame whose payload is first followed by second to every sink.
+   * @return Status if successful or not.
+   */
+  Status WriteFrame(FrameType type, int cpu, const char* first,
+                    size_t first_length, const char* second,
+                    size_t second_length);
+
+  /**
+   * Sends data to every sink according to its policy.
+   * @param data The data, in pieces.
+   * @param length The number of bytes in data.
+   * @param cpu The CPU of a pages frame, or -1 for data that can't be
+   *            dropped.
+   * @return Status if successful or not.
+   */
+  Status Send(const std::vector<iovec>& data, size_t length, int cpu);
+
+  /**
+   * Sends data to the kBlock sinks, through the staging pipe if there is
+   * one.
+   * @return Status if successful or not.
+   */
+  Status WriteBlocking(const std::vector<iovec>& data, size_t length);
+
+  /**
+   * Sends data to a kDrop sink, or drops it if it is a pages frame and the
+   * sink has no room.
+   * @param cpu The CPU of a pages frame, or -1 for frames that can't be
+   *            dropped.
+   * @return Status if successful or not.
+   */
+  Status WriteOrDrop(Sink* sink, int cpu, const std::vector<iovec>& data,
+                     size_t length);
+
+  /**
+   * Sends data to a kSpill sink, queueing what it has no room for on disk.
+   * @return Status if successful or not.
+   */
+  Status WriteOrSpill(Sink* sink, const std::vector<iovec>& data,
+                      size_t length);
+
+  /**
+   * Sends as much of a kSpill sink's queue as it has room for.
+   * @param wait Whether to wait until the whole queue is sent.
+   * @return Status if successful or not.
+   */
+  Status DrainSpill(Sink* sink, bool wait);
+
+  std::vector<Sink> sinks_;
+  // A pipe that frames are copied into once, to be duplicated to the kBlock
+  // sinks in tee_sinks_ and moved to the one at splice_sink_. -1 unless at
+  // least one sink can be fed that way.
+  int staging_read_fd_ = -1;
+  int staging_write_fd_ = -1;
+  size_t staging_size_ = 0;
+  std::vector<size_t> tee_sinks_;
+  size_t splice_sink_ = 0;
+};
+
+#endif  // SCHEDVIZ_UTIL_TRACE_STREAM_H_
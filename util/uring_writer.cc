@@ -0,0 +1,369 @@
+#include "util/uring_writer.h"
+
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+
+namespace {
+
+int IoUringSetup(unsigned entries, io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int IoUringEnter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+}
+
+int IoUringRegister(int ring_fd, unsigned opcode, const void* arg,
+                    unsigned count) {
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, count);
+}
+
+int Mbind(void* address, size_t length, int mode,
+          const unsigned long* nodes, unsigned long max_node) {
+  return syscall(__NR_mbind, address, length, mode, nodes, max_node + 1, 0);
+}
+
+constexpr int kBitsPerLong = 8 * sizeof(unsigned long);
+
+/**
+ * @return The address at offset bytes into a mapping.
+ */
+template <typename T>
+T* At(void* mapping, size_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(mapping) + offset);
+}
+
+}  // namespace
+
+Status UringWriter::Open(size_t buffer_count, size_t buffer_size,
+                         size_t block_size, int numa_node,
+                         UnwrittenCallback unwritten,
+                         std::unique_ptr<UringWriter>* writer) {
+  buffer_size -= buffer_size % block_size;
+  if (buffer_count == 0 || buffer_size == 0) {
+    return Status::InternalError("io_uring writer needs at least one buffer");
+  }
+  std::unique_ptr<UringWriter> opened(new UringWriter());
+  opened->block_size_ = block_size;
+  opened->buffer_size_ = buffer_size;
+  opened->unwritten_ = std::move(unwritten);
+
+  // Each buffer has at most one write queued or in flight, so neither ring
+  // can overflow.
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  opened->ring_fd_ = IoUringSetup(buffer_count, &params);
+  if (opened->ring_fd_ < 0) {
+    return Status::InternalError(
+        absl::StrCat("io_uring_setup failed: ", strerror(errno)));
+  }
+  // IORING_OP_WRITE arrived with IORING_FEAT_RW_CUR_POS, in Linux 5.6.
+  if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+    return Status::InternalError("io_uring is too old to write files");
+  }
+
+  opened->sq_ring_size_ =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  opened->cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    opened->sq_ring_size_ =
+        std::max(opened->sq_ring_size_, opened->cq_ring_size_);
+  }
+  opened->sq_ring_ = mmap(nullptr, opened->sq_ring_size_,
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          opened->ring_fd_, IORING_OFF_SQ_RING);
+  if (opened->sq_ring_ == MAP_FAILED) {
+    opened->sq_ring_ = nullptr;
+    return Status::InternalError("Unable to map io_uring submission ring");
+  }
+  if (single_mmap) {
+    opened->cq_ring_ = opened->sq_ring_;
+  } else {
+    opened->cq_ring_ = mmap(nullptr, opened->cq_ring_size_,
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            opened->ring_fd_, IORING_OFF_CQ_RING);
+    if (opened->cq_ring_ == MAP_FAILED) {
+      opened->cq_ring_ = nullptr;
+      return Status::InternalError("Unable to map io_uring completion ring");
+    }
+  }
+  opened->sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  opened->sqes_ = mmap(nullptr, opened->sqes_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, opened->ring_fd_,
+                       IORING_OFF_SQES);
+  if (opened->sqes_ == MAP_FAILED) {
+    opened->sqes_ = nullptr;
+    return Status::InternalError("Unable to map io_uring submission entries");
+  }
+  opened->sq_head_ = At<unsigned>(opened->sq_ring_, params.sq_off.head);
+  opened->sq_tail_ = At<unsigned>(opened->sq_ring_, params.sq_off.tail);
+  opened->sq_mask_ = At<unsigned>(opened->sq_ring_, params.sq_off.ring_mask);
+  opened->sq_array_ = At<unsigned>(opened->sq_ring_, params.sq_off.array);
+  opened->cq_head_ = At<unsigned>(opened->cq_ring_, params.cq_off.head);
+  opened->cq_tail_ = At<unsigned>(opened->cq_ring_, params.cq_off.tail);
+  opened->cq_mask_ = At<unsigned>(opened->cq_ring_, params.cq_off.ring_mask);
+  opened->cqes_ = At<void>(opened->cq_ring_, params.cq_off.cqes);
+
+  opened->buffer_mapping_size_ = buffer_count * buffer_size;
+  opened->buffer_mapping_ =
+      mmap(nullptr, opened->buffer_mapping_size_, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (opened->buffer_mapping_ == MAP_FAILED) {
+    opened->buffer_mapping_ = nullptr;
+    return Status::InternalError("Unable to allocate io_uring buffers");
+  }
+  if (numa_node >= 0) {
+    // Before anything touches the buffers, so that they are faulted in on
+    // the node. Only a preference: a full node still gets its buffers.
+    std::vector<unsigned long> nodes(numa_node / kBitsPerLong + 1, 0);
+    nodes[numa_node / kBitsPerLong] = 1UL << (numa_node % kBitsPerLong);
+    (void)Mbind(opened->buffer_mapping_, opened->buffer_mapping_size_,
+                MPOL_PREFERRED, nodes.data(), nodes.size() * kBitsPerLong);
+  }
+  std::vector<iovec> iovecs;
+  for (size_t i = 0; i < buffer_count; i++) {
+    Buffer buffer;
+    buffer.data = At<char>(opened->buffer_mapping_, i * buffer_size);
+    opened->buffers_.push_back(buffer);
+    iovecs.push_back({buffer.data, buffer_size});
+  }
+  // Registering pins the buffers, which counts against RLIMIT_MEMLOCK on
+  // older kernels. Without it, each write maps its buffer instead.
+  opened->registered_ =
+      IoUringRegister(opened->ring_fd_, IORING_REGISTER_BUFFERS,
+                      iovecs.data(), iovecs.size()) == 0;
+  *writer = std::move(opened);
+  return Status::OkStatus();
+}
+
+UringWriter::~UringWriter() {
+  // The kernel may still be reading the buffers.
+  while (unsubmitted_ + in_flight_ > 0 && Enter(/*wait=*/true).ok()) {
+  }
+  if (buffer_mapping_ != nullptr) {
+    munmap(buffer_mapping_, buffer_mapping_size_);
+  }
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != nullptr) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  if (ring_fd_ != -1) {
+    close(ring_fd_);
+  }
+}
+
+Status UringWriter::Write(int fd, const char* data, size_t length) {
+  File& file = files_[fd];
+  while (length > 0) {
+    if (file.failed) {
+      unwritten_(fd, file.offset, data, length, file.error);
+      file.offset += length;
+      return Status::OkStatus();
+    }
+    if (file.filling == -1) {
+      const int index = FreeBuffer();
+      if (index == -1) {
+        return Status::InternalError(
+            absl::StrCat("io_uring_enter failed: ", strerror(errno)));
+      }
+      Buffer& buffer = buffers_[index];
+      buffer.fd = fd;
+      buffer.offset = file.offset;
+      buffer.start = 0;
+      buffer.length = 0;
+      file.filling = index;
+    }
+    const int index = file.filling;
+    Buffer& buffer = buffers_[index];
+    const size_t copied = std::min(length, buffer_size_ - buffer.length);
+    memcpy(buffer.data + buffer.length, data, copied);
+    buffer.length += copied;
+    file.offset += copied;
+    data += copied;
+    length -= copied;
+    if (buffer.length == buffer_size_) {
+      file.filling = -1;
+      const auto& status = QueueWrite(index);
+      if (!status.ok()) {
+        return status;
+      }
+    }
+  }
+  return Status::OkStatus();
+}
+
+Status UringWriter::Submit() {
+  if (unsubmitted_ == 0) {
+    Reap();
+    return Status::OkStatus();
+  }
+  return Enter(/*wait=*/false);
+}
+
+Status UringWriter::Flush() {
+  for (auto& entry : files_) {
+    const int index = entry.second.filling;
+    if (index == -1) {
+      continue;
+    }
+    entry.second.filling = -1;
+    const auto& status = QueueWrite(index);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  while (unsubmitted_ + in_flight_ > 0) {
+    const auto& status = Enter(/*wait=*/true);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return Status::OkStatus();
+}
+
+int UringWriter::FreeBuffer() {
+  while (true) {
+    for (size_t i = 0; i < buffers_.size(); i++) {
+      if (buffers_[i].fd == -1) {
+        return i;
+      }
+    }
+    if (unsubmitted_ + in_flight_ > 0) {
+      if (!Enter(/*wait=*/true).ok()) {
+        return -1;
+      }
+      continue;
+    }
+    // Every buffer is being filled; write out the fullest.
+    int fullest = 0;
+    for (size_t i = 1; i < buffers_.size(); i++) {
+      if (buffers_[i].length > buffers_[fullest].length) {
+        fullest = i;
+      }
+    }
+    files_[buffers_[fullest].fd].filling = -1;
+    if (!QueueWrite(fullest).ok()) {
+      return -1;
+    }
+  }
+}
+
+Status UringWriter::QueueWrite(int index) {
+  File& file = files_[buffers_[index].fd];
+  while (file.writing) {
+    const auto& status = Enter(/*wait=*/true);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  if (file.failed) {
+    GiveBack(index, file.error);
+    return Status::OkStatus();
+  }
+  PushWrite(index);
+  return Status::OkStatus();
+}
+
+void UringWriter::PushWrite(int index) {
+  Buffer& buffer = buffers_[index];
+  // Only we write the submission ring's tail.
+  const unsigned tail = *sq_tail_;
+  const unsigned slot = tail & *sq_mask_;
+  io_uring_sqe* sqe = At<io_uring_sqe>(sqes_, slot * sizeof(io_uring_sqe));
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = registered_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = buffer.fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buffer.data + buffer.start);
+  sqe->len = buffer.length - buffer.start;
+  sqe->off = buffer.offset + buffer.start;
+  sqe->buf_index = index;
+  sqe->user_data = index;
+  sq_array_[slot] = slot;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  unsubmitted_++;
+  buffer.writing = true;
+  files_[buffer.fd].writing = true;
+}
+
+Status UringWriter::Enter(bool wait) {
+  while (true) {
+    const int submitted =
+        IoUringEnter(ring_fd_, unsubmitted_, wait ? 1 : 0,
+                     wait ? IORING_ENTER_GETEVENTS : 0);
+    syscalls_++;
+    if (submitted >= 0) {
+      unsubmitted_ -= submitted;
+      in_flight_ += submitted;
+      break;
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      return Status::InternalError(
+          absl::StrCat("io_uring_enter failed: ", strerror(errno)));
+    }
+    // Completions may be what the kernel is waiting on.
+    Reap();
+  }
+  Reap();
+  return Status::OkStatus();
+}
+
+void UringWriter::Reap() {
+  // Only we write the completion ring's head.
+  unsigned head = *cq_head_;
+  while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    const io_uring_cqe* cqe =
+        At<io_uring_cqe>(cqes_, (head & *cq_mask_) * sizeof(io_uring_cqe));
+    const int index = cqe->user_data;
+    const int result = cqe->res;
+    __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+    in_flight_--;
+
+    Buffer& buffer = buffers_[index];
+    File& file = files_[buffer.fd];
+    buffer.writing = false;
+    file.writing = false;
+    if (result <= 0) {
+      file.failed = true;
+      file.error = -result;
+      GiveBack(index, file.error);
+    } else if (buffer.start + result < buffer.length) {
+      // Retry the rest once; a full disk fails the retry.
+      buffer.start += result;
+      PushWrite(index);
+    } else {
+      buffer.fd = -1;
+    }
+  }
+}
+
+void UringWriter::GiveBack(int index, int error) {
+  Buffer& buffer = buffers_[index];
+  // The buffer starts on a block boundary, so this gives back whole blocks.
+  const size_t written = buffer.start - buffer.start % block_size_;
+  unwritten_(buffer.fd, buffer.offset + written, buffer.data + written,
+             buffer.length - written, error);
+  buffer.fd = -1;
+  buffer.writing = false;
+}
@@ -0,0 +1,210 @@
+#ifndef SCHEDVIZ_UTIL_URING_WRITER_H_
+#define SCHEDVIZ_UTIL_URING_WRITER_H_
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "util/status.h"
+
+/**
+ * Appends to files through an io_uring, so that writing many small chunks to
+ * many files costs few system calls.
+ *
+ * Chunks are copied into per-file buffers registered with the kernel, and a
+ * buffer is only written out once it is full, with a single write of the
+ * whole buffer. The writes of all buffers filled since the last Submit are
+ * then handed to the kernel with a single io_uring_enter().
+ *
+ * At most one write per file is in flight at a time, so each file is written
+ * in order and a failed write is always the file's last. Once a write of a
+ * file fails, nothing more is written to it: the unwritten data, and
+ * everything appended to the file afterwards, is passed to the unwritten
+ * callback instead.
+ *
+ * Not thread-safe.
+ */
+class UringWriter {
+ public:
+  /**
+   * Called with data that could not be written.
+   * @param fd The file the data was meant for.
+   * @param offset Where in the file the data was meant to go. Everything
+   *               before it was written.
+   * @param data The data.
+   * @param length The number of bytes in data.
+   * @param error The errno of the failed write, or 0 if the write was short.
+   */
+  using UnwrittenCallback =
+      std::function<void(int fd, off_t offset, const char* data,
+                         size_t length, int error)>;
+
+  /**
+   * Sets up an io_uring and its buffers.
+   * @param buffer_count How many buffers to allocate. Writes stall when all
+   *                     of them are full, so two per file is best.
+   * @param buffer_size The size of each buffer. Rounded down to a multiple of
+   *                    block_size.
+   * @param block_size Every chunk appended is a whole number of blocks, and a
+   *                   failed write gives back whole blocks only: the file is
+   *                   written up to the start of the first block that didn't
+   *                   make it. FTrace page size for trace files.
+   * @param numa_node The NUMA node to allocate the buffers on, or -1 to
+   *                  leave it to the kernel.
+   * @param unwritten Called with data that could not be written.
+   * @param writer Set to the writer on success.
+   * @return Status if successful or not. Fails if the kernel doesn't support
+   *         io_uring or has it disabled.
+   */
+  static Status Open(size_t buffer_count, size_t buffer_size,
+                     size_t block_size, int numa_node,
+                     UnwrittenCallback unwritten,
+                     std::unique_ptr<UringWriter>* writer);
+
+  ~UringWriter();
+
+  UringWriter(const UringWriter&) = delete;
+  UringWriter& operator=(const UringWriter&) = delete;
+
+  /**
+   * Appends data to a file. The data is copied, so it may be reused as soon
+   * as this returns. Returns without waiting unless all buffers are full.
+   * @param fd The file, which must have been opened for writing at offset 0
+   *           and not be written any other way while the writer is in use.
+   * @param data The data, a whole number of blocks.
+   * @param length The number of bytes in data.
+   * @return Status if successful or not. Failed writes are not errors; they
+   *         are reported through the unwritten callback.
+   */
+  Status Write(int fd, const char* data, size_t length);
+
+  /**
+   * Hands the writes of the buffers filled since the last call to the
+   * kernel, and handles any completed writes, without waiting.
+   * @return Status if successful or not.
+   */
+  Status Submit();
+
+  /**
+   * Writes out every buffer, however full, and waits for all writes to
+   * complete.
+   * @return Status if successful or not.
+   */
+  Status Flush();
+
+  /**
+   * @return Whether the buffers are registered with the kernel, so that
+   *         writes don't need to map them.
+   */
+  bool registered() const { return registered_; }
+
+  /**
+   * @return How many io_uring_enter() calls have been made.
+   */
+  uint64_t syscalls() const { return syscalls_; }
+
+ private:
+  struct Buffer {
+    char* data;
+    // The file the buffer is filled for and where its data goes, or -1 if
+    // the buffer is free.
+    int fd = -1;
+    off_t offset = 0;
+    // The part of data still to be written, and how much of it is filled.
+    size_t start = 0;
+    size_t length = 0;
+    // Whether the buffer's write has been queued or is in flight.
+    bool writing = false;
+  };
+
+  struct File {
+    // Where the next chunk goes.
+    off_t offset = 0;
+    // The buffer being filled for the file, or -1.
+    int filling = -1;
+    // Whether one of the file's buffers is being written.
+    bool writing = false;
+    // Whether a write failed, so that nothing more is written, and its
+    // errno.
+    bool failed = false;
+    int error = 0;
+  };
+
+  UringWriter() = default;
+
+  /**
+   * @return A free buffer, waiting for one if needed, or -1 on error.
+   */
+  int FreeBuffer();
+
+  /**
+   * Queues the write of a filled buffer, first waiting for the write of its
+   * file's previous buffer, if there is one.
+   * @return Status if successful or not.
+   */
+  Status QueueWrite(int index);
+
+  /**
+   * Puts the write of a buffer's unwritten part in the submission ring.
+   */
+  void PushWrite(int index);
+
+  /**
+   * Calls io_uring_enter() to submit the queued writes and handles completed
+   * ones.
+   * @param wait Whether to wait for at least one write to complete.
+   * @return Status if successful or not.
+   */
+  Status Enter(bool wait);
+
+  /**
+   * Handles every completed write.
+   */
+  void Reap();
+
+  /**
+   * Passes a buffer's unwritten data to the unwritten callback, and frees
+   * it.
+   */
+  void GiveBack(int index, int error);
+
+  int ring_fd_ = -1;
+  size_t block_size_ = 0;
+  size_t buffer_size_ = 0;
+  UnwrittenCallback unwritten_;
+  bool registered_ = false;
+  uint64_t syscalls_ = 0;
+
+  // The rings, mapped from the kernel.
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  void* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  void* cqes_ = nullptr;
+  // Writes queued in the submission ring but not yet submitted.
+  unsigned unsubmitted_ = 0;
+  // Writes submitted but not yet completed.
+  unsigned in_flight_ = 0;
+
+  // The buffers, carved out of one mapping.
+  void* buffer_mapping_ = nullptr;
+  size_t buffer_mapping_size_ = 0;
+  std::vector<Buffer> buffers_;
+  std::unordered_map<int, File> files_;
+};
+
+#endif  // SCHEDVIZ_UTIL_URING_WRITER_H_
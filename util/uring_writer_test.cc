@@ -0,0 +1,153 @@
+#include "util/uring_writer.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+
+struct Unwritten {
+  int fd;
+  off_t offset;
+  std::string data;
+  int error;
+};
+
+/**
+ * A file in the test's temporary directory, removed when destroyed.
+ */
+class TempFile {
+ public:
+  TempFile() : path_(::testing::TempDir() + "/uring_writer_test.XXXXXX") {
+    const int fd = mkstemp(&path_[0]);
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  ~TempFile() { unlink(path_.c_str()); }
+
+  int Open(int flags) const { return open(path_.c_str(), flags | O_CLOEXEC); }
+
+  std::string Contents() const {
+    std::ifstream in(path_, std::ios::binary);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+  }
+
+ private:
+  std::string path_;
+};
+
+std::string Blocks(char fill, size_t count) {
+  return std::string(count * kBlockSize, fill);
+}
+
+class UringWriterTest : public ::testing::Test {
+ protected:
+  /**
+   * Opens writer_ with buffers of buffer_blocks blocks, skipping the test if
+   * the kernel can't do io_uring.
+   */
+  void OpenWriter(size_t buffer_count, size_t buffer_blocks) {
+    const auto& status = UringWriter::Open(
+        buffer_count, buffer_blocks * kBlockSize, kBlockSize,
+        /*numa_node=*/-1,
+        [this](int fd, off_t offset, const char* data, size_t length,
+               int error) {
+          unwritten_.push_back({fd, offset, std::string(data, length), error});
+        },
+        &writer_);
+    if (!status.ok()) {
+      GTEST_SKIP() << status.message();
+    }
+  }
+
+  std::unique_ptr<UringWriter> writer_;
+  std::vector<Unwritten> unwritten_;
+};
+
+TEST_F(UringWriterTest, RejectsBuffersSmallerThanABlock) {
+  std::unique_ptr<UringWriter> writer;
+  EXPECT_FALSE(UringWriter::Open(4, kBlockSize - 1, kBlockSize, -1,
+                                 UringWriter::UnwrittenCallback(), &writer)
+                   .ok());
+  EXPECT_FALSE(UringWriter::Open(0, kBlockSize, kBlockSize, -1,
+                                 UringWriter::UnwrittenCallback(), &writer)
+                   .ok());
+}
+
+TEST_F(UringWriterTest, WritesEachFileInOrder) {
+  OpenWriter(/*buffer_count=*/3, /*buffer_blocks=*/2);
+  TempFile first_file, second_file;
+  const int first = first_file.Open(O_WRONLY);
+  const int second = second_file.Open(O_WRONLY);
+  ASSERT_NE(first, -1);
+  ASSERT_NE(second, -1);
+
+  // Interleave the files, with chunks that straddle buffers, so that buffers
+  // are filled, written and reused out of step with each other.
+  std::string first_expected, second_expected;
+  for (char fill = 'a'; fill < 'h'; fill++) {
+    const auto& first_chunk = Blocks(fill, 1 + fill % 3);
+    const auto& second_chunk = Blocks(fill - 'a' + 'A', 1 + fill % 2);
+    ASSERT_TRUE(writer_->Write(first, first_chunk.data(), first_chunk.size())
+                    .ok());
+    ASSERT_TRUE(
+        writer_->Write(second, second_chunk.data(), second_chunk.size()).ok());
+    ASSERT_TRUE(writer_->Submit().ok());
+    first_expected += first_chunk;
+    second_expected += second_chunk;
+  }
+  // The last buffers are part full, and only written by Flush.
+  ASSERT_TRUE(writer_->Flush().ok());
+  close(first);
+  close(second);
+
+  EXPECT_TRUE(unwritten_.empty());
+  EXPECT_EQ(first_file.Contents(), first_expected);
+  EXPECT_EQ(second_file.Contents(), second_expected);
+  EXPECT_GT(writer_->syscalls(), 0);
+}
+
+TEST_F(UringWriterTest, GivesBackDataOfFailedWrites) {
+  OpenWriter(/*buffer_count=*/2, /*buffer_blocks=*/2);
+  TempFile file;
+  // Writes to a read-only descriptor fail with EBADF.
+  const int fd = file.Open(O_RDONLY);
+  ASSERT_NE(fd, -1);
+
+  const auto& data = Blocks('a', 2) + Blocks('b', 1);
+  ASSERT_TRUE(writer_->Write(fd, data.data(), data.size()).ok());
+  ASSERT_TRUE(writer_->Flush().ok());
+  // Once a write fails, later data goes straight to the callback.
+  const auto& later = Blocks('c', 1);
+  ASSERT_TRUE(writer_->Write(fd, later.data(), later.size()).ok());
+  ASSERT_TRUE(writer_->Flush().ok());
+  close(fd);
+
+  std::string given_back;
+  for (const auto& unwritten : unwritten_) {
+    EXPECT_EQ(unwritten.fd, fd);
+    EXPECT_EQ(unwritten.error, EBADF);
+    EXPECT_EQ(unwritten.offset, given_back.size());
+    given_back += unwritten.data;
+  }
+  EXPECT_EQ(given_back, data + later);
+  EXPECT_EQ(file.Contents(), "");
+}
+
+}  // namespace
@@ -0,0 +1,194 @@
+// Compares the system calls and CPU time per MB of the trace collector's
+// write engines: a write() per chunk, and batched io_uring writes from
+// registered buffers. Chunks are written round robin to several files, the
+// way the writer thread writes drained pages to one trace file per CPU.
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "util/status.h"
+#include "util/uring_writer.h"
+
+ABSL_FLAG(std::string, dir, "/tmp",
+          "Directory to write the benchmark's files in");
+ABSL_FLAG(int, megabytes, 256, "How many MB each engine writes");
+ABSL_FLAG(int, files, 4,
+          "How many files the writes are spread over, like one trace file "
+          "per CPU");
+ABSL_FLAG(int, chunk_kb, 4,
+          "Size of each write in KB, like a buffer of drained pages. Must be "
+          "a multiple of 4");
+ABSL_FLAG(int, chunks_per_pass, 32,
+          "How many chunks each file gets per writer pass. io_uring submits "
+          "once per pass");
+
+/**
+ * The block size the io_uring writer is told about, as FTrace's page size.
+ */
+static constexpr size_t kBlockSize = 4096;
+
+/**
+ * The io_uring writer's buffers, as the collector sizes them.
+ */
+static constexpr size_t kUringBufferBytes = 256 << 10;
+
+/**
+ * What writing cost one engine.
+ */
+struct Result {
+  uint64_t syscalls = 0;
+  absl::Duration cpu_time;
+  absl::Duration wall_time;
+};
+
+/**
+ * @return The CPU time used by the whole process so far. That includes the
+ *         kernel's io_uring worker threads, which run as part of it.
+ */
+static absl::Duration ProcessCPUTime() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return absl::DurationFromTimeval(usage.ru_utime) +
+         absl::DurationFromTimeval(usage.ru_stime);
+}
+
+/**
+ * Writes the benchmark's data to new files in dir.
+ * @param uring Whether to write with io_uring or write().
+ * @param result Set to what the writes cost.
+ * @return Status if successful or not.
+ */
+static Status Run(const std::filesystem::path& dir, bool uring,
+                  Result* result) {
+  const size_t chunk_size = absl::GetFlag(FLAGS_chunk_kb) << 10;
+  const int file_count = absl::GetFlag(FLAGS_files);
+  const int chunks_per_pass = absl::GetFlag(FLAGS_chunks_per_pass);
+  const uint64_t total = uint64_t{1} * absl::GetFlag(FLAGS_megabytes) << 20;
+  std::string chunk(chunk_size, '\0');
+  for (size_t i = 0; i < chunk.size(); i++) {
+    chunk[i] = static_cast<char>(i * 131);
+  }
+
+  std::vector<int> fds;
+  for (int i = 0; i < file_count; i++) {
+    const auto& path = dir / absl::StrCat(uring ? "io_uring" : "write", i);
+    const int fd =
+        open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      return Status::InternalError(
+          absl::StrCat("Unable to create ", path.string()));
+    }
+    fds.push_back(fd);
+  }
+
+  Status status;
+  // Write errors are reported from inside the writer's calls, whose own
+  // status would overwrite them, so they're kept apart and merged after.
+  Status write_status;
+  std::unique_ptr<UringWriter> writer;
+  if (uring) {
+    status = UringWriter::Open(
+        2 * file_count, kUringBufferBytes, kBlockSize, /*numa_node=*/-1,
+        [&write_status](int /*fd*/, off_t /*offset*/, const char* /*data*/,
+                        size_t /*length*/, int error) {
+          if (write_status.ok()) {
+            write_status = Status::InternalError(
+                absl::StrCat("Unable to write: ", strerror(error)));
+          }
+        },
+        &writer);
+  }
+
+  const auto& cpu_start = ProcessCPUTime();
+  const auto& wall_start = absl::Now();
+  uint64_t written = 0;
+  while (status.ok() && written < total) {
+    for (int fd : fds) {
+      for (int i = 0; i < chunks_per_pass && status.ok(); i++) {
+        if (uring) {
+          status = writer->Write(fd, chunk.data(), chunk.size());
+          if (status.ok()) status = write_status;
+        } else if (write(fd, chunk.data(), chunk.size()) !=
+                   static_cast<ssize_t>(chunk.size())) {
+          status = Status::InternalError(
+              absl::StrCat("Unable to write: ", strerror(errno)));
+        } else {
+          result->syscalls++;
+        }
+        written += chunk.size();
+      }
+    }
+    if (uring && status.ok()) {
+      status = writer->Submit();
+      if (status.ok()) status = write_status;
+    }
+  }
+  if (uring && status.ok()) {
+    status = writer->Flush();
+    if (status.ok()) status = write_status;
+  }
+  if (uring) {
+    result->syscalls = writer->syscalls();
+    writer.reset();
+  }
+  result->cpu_time = ProcessCPUTime() - cpu_start;
+  result->wall_time = absl::Now() - wall_start;
+
+  for (int i = 0; i < file_count; i++) {
+    close(fds[i]);
+    std::filesystem::remove(dir / absl::StrCat(uring ? "io_uring" : "write", i));
+  }
+  return status;
+}
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  if (absl::GetFlag(FLAGS_megabytes) <= 0 || absl::GetFlag(FLAGS_files) <= 0 ||
+      absl::GetFlag(FLAGS_chunks_per_pass) <= 0 ||
+      absl::GetFlag(FLAGS_chunk_kb) <= 0 ||
+      absl::GetFlag(FLAGS_chunk_kb) % 4 != 0) {
+    std::cerr << "--megabytes, --files and --chunks_per_pass must be greater "
+                 "than zero, and --chunk_kb a positive multiple of 4"
+              << std::endl;
+    return 1;
+  }
+  const auto& dir = std::filesystem::path(absl::GetFlag(FLAGS_dir));
+  const double megabytes = absl::GetFlag(FLAGS_megabytes);
+
+  std::cout << std::left << std::setw(10) << "engine" << std::right
+            << std::setw(14) << "syscalls/MB" << std::setw(14) << "CPU ms/MB"
+            << std::setw(10) << "MB/s" << std::endl;
+  for (bool uring : {false, true}) {
+    Result result;
+    const auto& status = Run(dir, uring, &result);
+    if (!status.ok()) {
+      std::cerr << (uring ? "io_uring: " : "write: ") << status.message()
+                << std::endl;
+      return 1;
+    }
+    std::cout << std::left << std::setw(10) << (uring ? "io_uring" : "write")
+              << std::right << std::fixed << std::setprecision(2)
+              << std::setw(14) << result.syscalls / megabytes << std::setw(14)
+              << absl::ToDoubleMilliseconds(result.cpu_time) / megabytes
+              << std::setw(10)
+              << megabytes / absl::ToDoubleSeconds(result.wall_time)
+              << std::endl;
+  }
+  return 0;
+}